@@ -12,6 +12,7 @@
 #include <math.h>
 
 #include <ocllib.h>
+#include <hostref.h>
 #include <clBLAS.h>
 
 static cl_platform_id platform;
@@ -36,29 +37,17 @@ void teardown(int exit_status)
   exit(exit_status);
 }
 
-void matrix_mul(const float *A, const float *B, float *C, cl_int M) {
-  for (int i=0; i<M; i++){
-    for (int j=0; j<M; j++){
-      for (int k=0; k<M; k++) {
-        C[i*M+j] += A[i*M+k] * B[k*M+j];
-      }
-    }
-  }
-}
 int main(int argc, char **argv) {
   cl_int status;
 
-  const char platform_name[] = "NVIDIA";
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
     print_platforms();
     teardown(-1);
   }
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
-
   context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
   checkError(status, "could not create context");
 
@@ -84,6 +73,7 @@ int main(int argc, char **argv) {
   }
 
   memset(C, 0, buf_size);
+  memset(Ref, 0, buf_size);
 
   for (int i = 0; i < M; ++i) {
     for (int j = 0; j < M; ++j) {
@@ -158,22 +148,10 @@ int main(int argc, char **argv) {
 
 #define CHECK
 #ifdef CHECK
-  matrix_mul(A,B,Ref,M);
-
-  int correct = 1;
-  for (int i = 0; i < M; ++i) {
-    for (int j = 0; j < M; ++j) {
-      if (abs(Ref[i*M+j]) - abs(C[i*M+j]) > 0.005) {
-        correct = 0;
-        printf("at %d,%d: %f != %f\n", i, j, Ref[i*M+j], C[i*M+j]);
-        goto endloop;
-      }
-    }
-  }
-endloop:
-
-  if (!correct)
-    fprintf(stderr, "Compare failed\n");
+  double check_start = get_time();
+  host_sgemm(A,B,Ref,M,M,M);
+  compare_products(Ref, C, (size_t) M*M, M);
+  printf("verification: %f s\n", get_time() - check_start);
 #endif
 
   free(A);
@@ -0,0 +1,136 @@
+# Run all examples over a sweep of problem sizes.
+#
+# Invoked by the ocl-bench target. Results are collected in
+# ${BENCH_DIR}/bench.csv and ${BENCH_DIR}/bench.json (one object per line).
+#
+# Optional variables:
+#   BENCH_REPS    - timed repetitions per run (default 10)
+#   BENCH_WARMUP  - warm-up runs (default 2)
+
+if (NOT BENCH_REPS)
+  set (BENCH_REPS 10)
+endif()
+if (NOT BENCH_WARMUP)
+  set (BENCH_WARMUP 2)
+endif()
+
+set (BENCH_CSV ${BENCH_DIR}/bench.csv)
+set (BENCH_JSON ${BENCH_DIR}/bench.json)
+file (REMOVE ${BENCH_CSV} ${BENCH_JSON})
+
+# bench_run(<subdir> <executable> <sizes> [args...])
+function (bench_run dir exe sizes)
+  set (path ${BENCH_DIR}/${dir}/${exe}${EXE_SUFFIX})
+  if (NOT EXISTS ${path})
+    message (STATUS "Skipping ${exe}: not built")
+    return()
+  endif()
+
+  foreach (size ${sizes})
+    # one run writes both files
+    execute_process (
+      COMMAND ${path} --size ${size} --reps ${BENCH_REPS} --warmup ${BENCH_WARMUP}
+        --results ${BENCH_DIR}/bench ${ARGN}
+      WORKING_DIRECTORY ${BENCH_DIR}/${dir}
+      RESULT_VARIABLE result
+      OUTPUT_QUIET
+      ERROR_QUIET)
+
+    if (NOT result EQUAL 0)
+      message (WARNING "${exe} ${ARGN} --size ${size} failed: ${result}")
+    endif()
+    message (STATUS "${exe} ${ARGN} size ${size} done")
+  endforeach()
+endfunction()
+
+foreach (kernel 1 2 3 4 5 6)
+  bench_run (matrix matrix "256;512;1024" ${kernel})
+endforeach()
+bench_run (matrix matrix "1000;2000" 6 1500 700)
+bench_run (reduce reduce "65536;1048576;16777216")
+bench_run (reduce reduce "1048576;16777216" argmax)
+bench_run (reduce reduce "16777216" sum all)
+# scaling across all devices of the platform
+bench_run (matrix matrix "2048" 6 --devices all)
+bench_run (reduce reduce "16777216" sum --devices all)
+bench_run (scan scan "1048576;16777216;268435456")
+bench_run (scan scan "16777216" exclusive uint)
+bench_run (sync sync "65536;1048576;16777216")
+bench_run (sync sync "16777216" double-float)
+bench_run (transpose comp "512;1024;2048;4096")
+foreach (elem float float2 float4)
+  bench_run (transpose comp "512;1024;2048;4096" tiled ${elem})
+endforeach()
+bench_run (transpose comp "1000;3000" tiled float 700)
+bench_run (transpose comp "1024;4096" inplace)
+bench_run (transpose comp "1000;3000" inplace float 700)
+# overlap of transfers and kernels versus queues and chunks
+foreach (queues 1 2 3)
+  bench_run (transpose comp "4096" pipeline float --queues ${queues} --chunks 8)
+endforeach()
+# load and upload latency of files from 1 MB to 4 GB
+foreach (mode read map zerocopy)
+  bench_run (memory load "1;16;256;4096" ${mode})
+endforeach()
+# allocation latency, raw clCreateBuffer versus the sub-buffer arena
+bench_run (memory alloc "1000" raw)
+bench_run (memory alloc "1000" arena)
+# round trip bandwidth from 4 KB to 1 GB per kind of host memory
+foreach (mode pageable pinned mapped usehostptr)
+  bench_run (memory transfer "4;64;1024;16384;262144;1048576" ${mode})
+endforeach()
+bench_run (gauss gauss "512;1024;2048;4096")
+# pixels per second versus radius, radius is 3 sigma
+foreach (sigma 1 2 5 10)
+  bench_run (gauss gauss "4096" mask image ${sigma})
+  bench_run (gauss gauss "4096" separable image ${sigma})
+  bench_run (gauss gauss "4096" separable buffer ${sigma})
+endforeach()
+# throughput per mask size, separable masks also as full 2D masks
+foreach (mask box3 box5 box9 box15 gauss5 gauss9)
+  foreach (values constant literal)
+    bench_run (gauss conv "4096" ${mask} ${values})
+    bench_run (gauss conv "4096" ${mask} ${values} 2d)
+  endforeach()
+endforeach()
+foreach (mask sobel-x laplacian sharpen)
+  bench_run (gauss conv "4096" ${mask} literal)
+endforeach()
+# direct versus FFT convolution around the crossover, and masks only the FFT runs
+foreach (mask box15 gauss15 box31 gauss31)
+  foreach (engine direct fft)
+    bench_run (gauss conv "4096" ${mask} constant 2d ${engine})
+  endforeach()
+endforeach()
+foreach (mask box65 gauss65 box127)
+  bench_run (gauss conv "4096" ${mask} constant auto fft)
+endforeach()
+bench_run (interpolation interpolation "512;1024;2048" 2)
+# native Stockham FFT versus clFFT, which fails to run if fft was built without it
+foreach (engine native clfft)
+  # latency per image, masking the resident spectrum versus a host round trip
+  # real-to-complex transforms versus complex ones of real data
+  foreach (layout complex real)
+    bench_run (fft fft "512" ${engine} image device ${layout})
+    bench_run (fft fft "512" ${engine} image host ${layout})
+    bench_run (fft fft "256;1024;4096;65536" ${engine} 1d ${layout})
+    bench_run (fft fft "1000" ${engine} 1d ${layout})
+    bench_run (fft fft "256;512;1024;2048" ${engine} 2d ${layout})
+    # time per call with a cold and a warm plan cache
+    bench_run (fft fft "256;1024;4096" ${engine} 1d latency ${layout})
+    bench_run (fft fft "32;64;128" ${engine} 2d latency ${layout})
+  endforeach()
+endforeach()
+# images per second of the batch pipeline versus batch size
+foreach (count 1 10 100 1000)
+  bench_run (gauss gauss "512" mask image --batch ${count})
+  bench_run (gauss gauss "512" separable image 2 --batch ${count})
+  bench_run (interpolation interpolation "512" 2 --batch ${count})
+endforeach()
+# streaming in bands versus the memory budget
+foreach (budget 0.25 1 256)
+  bench_run (gauss gauss "512" separable buffer 2 --stream lena.dat stream.pgm --budget ${budget})
+  bench_run (interpolation interpolation "512" 2 --stream lena.dat stream.pgm --budget ${budget})
+endforeach()
+
+message (STATUS "Results written to ${BENCH_CSV} and ${BENCH_JSON}")
@@ -0,0 +1,197 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <arena.h>
+
+#define MB (1024.0*1024.0)
+
+int arena_init(arena *a, cl_context context, cl_device_id device, cl_mem_flags flags, size_t chunk_size) {
+  memset(a, 0, sizeof(arena));
+  a->context = context;
+  a->flags = flags;
+
+  cl_uint align_bits = 0;
+  cl_ulong max_alloc = 0;
+  cl_int status = clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, NULL);
+  status |= clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not query the device for the arena\n");
+    return 0;
+  }
+  a->align = align_bits >= 8 ? align_bits / 8 : 1;
+
+  a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+  if (a->chunk_size > max_alloc)
+    a->chunk_size = (size_t) max_alloc;
+  return 1;
+}
+
+void arena_release(arena *a) {
+  for (int c = 0; c < ARENA_CLASSES; ++c) {
+    for (int i = 0; i < a->free[c].count; ++i)
+      clReleaseMemObject(a->free[c].mem[i]);
+    free(a->free[c].mem);
+  }
+  for (int i = 0; i < a->chunks; ++i)
+    clReleaseMemObject(a->chunk[i].mem);
+  memset(a, 0, sizeof(arena));
+}
+
+// Smallest size class of at least size bytes, the largest class if none is
+// large enough
+static int size_class(size_t size) {
+  int c = 0;
+  while (c < ARENA_CLASSES - 1 && ((size_t) ARENA_MIN_CLASS << c) < size)
+    ++c;
+  return c;
+}
+
+static void count_in_use(arena *a, size_t size) {
+  a->stats.in_use += size;
+  if (a->stats.in_use > a->stats.in_use_peak)
+    a->stats.in_use_peak = a->stats.in_use;
+}
+
+static void count_reserved(arena *a, size_t size) {
+  a->stats.reserved += size;
+  if (a->stats.reserved > a->stats.reserved_peak)
+    a->stats.reserved_peak = a->stats.reserved;
+}
+
+// Carve size bytes from the first backing buffer with room, adding one if needed
+static cl_mem carve(arena *a, size_t size, cl_int *status) {
+  int c;
+  for (c = 0; c < a->chunks; ++c) {
+    arena_chunk *chunk = &a->chunk[c];
+    size_t origin = (chunk->used + a->align - 1) / a->align * a->align;
+    if (origin + size <= chunk->size)
+      break;
+  }
+
+  if (c == a->chunks) {
+    if (a->chunks == ARENA_MAX_CHUNKS) {
+      *status = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+      return NULL;
+    }
+    cl_mem mem = clCreateBuffer(a->context, a->flags, a->chunk_size, NULL, status);
+    if (*status != CL_SUCCESS)
+      return NULL;
+    a->chunk[c].mem = mem;
+    a->chunk[c].size = a->chunk_size;
+    a->chunk[c].used = 0;
+    a->chunks++;
+    count_reserved(a, a->chunk_size);
+  }
+
+  arena_chunk *chunk = &a->chunk[c];
+  cl_buffer_region region;
+  region.origin = (chunk->used + a->align - 1) / a->align * a->align;
+  region.size = size;
+
+  cl_mem mem = clCreateSubBuffer(chunk->mem, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, status);
+  if (*status != CL_SUCCESS)
+    return NULL;
+  chunk->used = region.origin + size;
+  return mem;
+}
+
+cl_mem arena_alloc(arena *a, size_t size, cl_int *status) {
+  if (!size) {
+    *status = CL_INVALID_BUFFER_SIZE;
+    return NULL;
+  }
+
+  int c = size_class(size);
+  size_t class_size = (size_t) ARENA_MIN_CLASS << c;
+  cl_mem mem = NULL;
+
+  a->stats.allocs++;
+  a->stats.requested += size;
+
+  if (class_size >= size && a->free[c].count) {
+    mem = a->free[c].mem[--a->free[c].count];
+    a->stats.hits++;
+    a->stats.cached -= class_size;
+    a->stats.rounded += class_size;
+    count_in_use(a, class_size);
+    *status = CL_SUCCESS;
+    return mem;
+  }
+
+  a->stats.misses++;
+  if (class_size >= size && class_size <= a->chunk_size) {
+    mem = carve(a, class_size, status);
+    if (mem) {
+      a->stats.rounded += class_size;
+      count_in_use(a, class_size);
+      return mem;
+    }
+  }
+
+  // Too large for a chunk or the largest class, or out of chunks
+  mem = clCreateBuffer(a->context, a->flags, size, NULL, status);
+  if (*status != CL_SUCCESS)
+    return NULL;
+  a->stats.rounded += size;
+  count_in_use(a, size);
+  count_reserved(a, size);
+  return mem;
+}
+
+void arena_free(arena *a, cl_mem mem) {
+  if (!mem)
+    return;
+
+  size_t size = 0;
+  cl_mem parent = NULL;
+  clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+  clGetMemObjectInfo(mem, CL_MEM_ASSOCIATED_MEMOBJECT, sizeof(cl_mem), &parent, NULL);
+
+  a->stats.frees++;
+  a->stats.in_use -= size;
+
+  if (!parent) {
+    a->stats.reserved -= size;
+    clReleaseMemObject(mem);
+    return;
+  }
+
+  arena_list *l = &a->free[size_class(size)];
+  if (l->count == l->capacity) {
+    int capacity = l->capacity ? 2*l->capacity : 16;
+    cl_mem *list = (cl_mem *) realloc(l->mem, capacity * sizeof(cl_mem));
+    if (!list) {
+      // The memory stays carved, only the sub-buffer is lost
+      clReleaseMemObject(mem);
+      return;
+    }
+    l->mem = list;
+    l->capacity = capacity;
+  }
+  l->mem[l->count++] = mem;
+  a->stats.cached += size;
+}
+
+void arena_report(const arena *a) {
+  const arena_stats *s = &a->stats;
+
+  printf("arena: %d chunks of %.2f MB, alignment %lu bytes\n", a->chunks, a->chunk_size / MB,
+      (unsigned long) a->align);
+  printf("allocs %lu, frees %lu, hits %lu (%.1f%%), misses %lu\n", (unsigned long) s->allocs,
+      (unsigned long) s->frees, (unsigned long) s->hits, s->allocs ? 100.0 * s->hits / s->allocs : 0.0,
+      (unsigned long) s->misses);
+  printf("memory [MB]: in use %.2f (peak %.2f), cached %.2f, reserved %.2f (peak %.2f)\n",
+      s->in_use / MB, s->in_use_peak / MB, s->cached / MB, s->reserved / MB, s->reserved_peak / MB);
+
+  // Reserved memory that is not in use: free lists and uncarved chunk ends
+  printf("fragmentation: %.1f%% of reserved memory unused, %.1f%% of allocated memory lost to size classes\n",
+      s->reserved ? 100.0 * (1.0 - (double) s->in_use / s->reserved) : 0.0,
+      s->rounded ? 100.0 * (1.0 - (double) s->requested / s->rounded) : 0.0);
+}
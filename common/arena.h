@@ -0,0 +1,70 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <CL/cl.h>
+
+// Size classes are powers of two from ARENA_MIN_CLASS bytes up to 2 GB, the
+// largest that a 32-bit size_t holds. Larger buffers are dedicated.
+#define ARENA_MIN_CLASS 256
+#define ARENA_CLASSES 24
+
+// Default size of the backing buffers
+#define ARENA_CHUNK_SIZE (64 << 20)
+
+#define ARENA_MAX_CHUNKS 64
+
+typedef struct {
+  size_t allocs, frees;
+  size_t hits;                    // served from a free list
+  size_t misses;                  // new sub-buffer or dedicated buffer
+  size_t requested, rounded;      // bytes over all allocations, before and after rounding to the class
+  size_t in_use, in_use_peak;     // bytes handed out, rounded to the class
+  size_t reserved, reserved_peak; // bytes of backing and dedicated buffers
+  size_t cached;                  // bytes in free lists
+} arena_stats;
+
+typedef struct {
+  cl_mem mem;
+  size_t size, used;
+} arena_chunk;
+
+typedef struct {
+  cl_mem *mem;
+  int count, capacity;
+} arena_list;
+
+typedef struct {
+  cl_context context;
+  cl_mem_flags flags;
+  size_t align;                   // CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes
+  size_t chunk_size;
+
+  int chunks;
+  arena_chunk chunk[ARENA_MAX_CHUNKS];
+  arena_list free[ARENA_CLASSES];
+
+  arena_stats stats;
+} arena;
+
+// Backing buffers of chunk_size bytes (0 for ARENA_CHUNK_SIZE, limited to
+// the largest buffer of device) are created with flags as needed.
+int arena_init(arena *a, cl_context context, cl_device_id device, cl_mem_flags flags, size_t chunk_size);
+
+// Release the free lists and backing buffers. Allocated buffers are returned
+// with arena_free first.
+void arena_release(arena *a);
+
+// A buffer of at least size bytes: a sub-buffer of a backing buffer, whose
+// origin satisfies the base address alignment of the device, or a dedicated
+// buffer if size exceeds the chunk size. Freed sub-buffers of the same size
+// class are reused without calling into the runtime.
+cl_mem arena_alloc(arena *a, size_t size, cl_int *status);
+
+// Return a buffer of arena_alloc to its free list. Dedicated buffers are
+// released.
+void arena_free(arena *a, cl_mem mem);
+
+// Hits, misses, memory and fragmentation.
+void arena_report(const arena *a);
+
+#endif /* ARENA_H */
@@ -0,0 +1,341 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#else
+#include <dirent.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <utils.h>
+#include <bench.h>
+#include <batch.h>
+
+void batch_parse_args(int *argc, char **argv, batch_options *opts) {
+  opts->count  = 0;
+  opts->input  = NULL;
+  opts->queues = 3;
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--batch") && val) {
+      opts->count = atoi(val);
+    } else if (!strcmp(arg, "--input") && val) {
+      opts->input = val;
+    } else if (!strcmp(arg, "--queues") && val) {
+      opts->queues = atoi(val);
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+
+  if (opts->count < 0) opts->count = 0;
+  if (opts->input && !opts->count) opts->count = BATCH_ALL;
+  if (opts->queues < 1) opts->queues = 1;
+  if (opts->queues > BATCH_MAX_QUEUES) opts->queues = BATCH_MAX_QUEUES;
+}
+
+//
+// Inputs
+//
+
+typedef struct {
+  char **paths;
+  int count, capacity;
+} path_list;
+
+static int add_path(path_list *l, const char *dir, const char *name) {
+  if (l->count == l->capacity) {
+    int capacity = l->capacity ? 2*l->capacity : 64;
+    char **paths = (char **) realloc(l->paths, capacity * sizeof(char *));
+    if (!paths)
+      return 0;
+    l->paths = paths;
+    l->capacity = capacity;
+  }
+
+  size_t size = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+  char *path = (char *) malloc(size);
+  if (!path)
+    return 0;
+  if (dir)
+    snprintf(path, size, "%s/%s", dir, name);
+  else
+    snprintf(path, size, "%s", name);
+
+  l->paths[l->count++] = path;
+  return 1;
+}
+
+static int is_image(const char *name) {
+  const char *ext = strrchr(name, '.');
+  return ext && (!strcmp(ext, ".pgm") || !strcmp(ext, ".dat"));
+}
+
+static int compare_path(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Images of a directory in name order
+static int list_directory(const char *dir, path_list *l) {
+#ifdef _WIN32
+  char pattern[MAX_PATH];
+  snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+
+  WIN32_FIND_DATAA entry;
+  HANDLE h = FindFirstFileA(pattern, &entry);
+  if (h == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Error: could not read directory %s\n", dir);
+    return 0;
+  }
+  do {
+    if (is_image(entry.cFileName) && !add_path(l, dir, entry.cFileName)) {
+      FindClose(h);
+      return 0;
+    }
+  } while (FindNextFileA(h, &entry));
+  FindClose(h);
+#else
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "Error: could not read directory %s\n", dir);
+    return 0;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d))) {
+    if (is_image(entry->d_name) && !add_path(l, dir, entry->d_name)) {
+      closedir(d);
+      return 0;
+    }
+  }
+  closedir(d);
+#endif
+
+  if (l->count)
+    qsort(l->paths, l->count, sizeof(char *), compare_path);
+  return 1;
+}
+
+// One path per line, empty lines and lines starting with # are ignored
+static int list_file(const char *name, path_list *l) {
+  FILE *f = fopen(name, "r");
+  if (!f) {
+    fprintf(stderr, "Error: could not open %s\n", name);
+    return 0;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    size_t n = strlen(line);
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r' || line[n-1] == ' '))
+      line[--n] = 0;
+    if (n == 0 || line[0] == '#')
+      continue;
+    if (!add_path(l, NULL, line)) {
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+int batch_load(batch_options *opts, const char *fallback, batch_image **images, int *count) {
+  const char *input = opts->input ? opts->input : fallback;
+  *images = NULL;
+  *count = 0;
+
+  path_list l = {NULL, 0, 0};
+  struct stat st;
+  int ok;
+  if (!stat(input, &st) && S_ISDIR(st.st_mode))
+    ok = list_directory(input, &l);
+  else if (is_image(input))
+    ok = add_path(&l, NULL, input);
+  else
+    ok = list_file(input, &l);
+
+  if (ok && !l.count) {
+    fprintf(stderr, "Error: no images in %s\n", input);
+    ok = 0;
+  }
+
+  batch_image *list = ok ? (batch_image *) calloc(l.count, sizeof(batch_image)) : NULL;
+  if (ok && !list) {
+    fprintf(stderr, "Error: malloc failed\n");
+    ok = 0;
+  }
+
+  int n = 0;
+  for (int i = 0; ok && i < l.count; ++i) {
+    batch_image *img = &list[n];
+    if (!read_image(l.paths[i], &img->data, &img->width, &img->height)) {
+      ok = 0;
+      break;
+    }
+    if (n > 0 && (img->width != list[0].width || img->height != list[0].height)) {
+      fprintf(stderr, "Warning: skipping %s, %lux%lu instead of %lux%lu\n", l.paths[i],
+          (unsigned long) img->width, (unsigned long) img->height,
+          (unsigned long) list[0].width, (unsigned long) list[0].height);
+      free(img->data);
+      img->data = NULL;
+      continue;
+    }
+    img->name = l.paths[i];
+    l.paths[i] = NULL;
+    n++;
+  }
+
+  for (int i = 0; i < l.count; ++i)
+    free(l.paths[i]);
+  free(l.paths);
+
+  if (!ok) {
+    batch_free_images(list, n);
+    return 0;
+  }
+
+  *images = list;
+  *count = n;
+  if (opts->count == BATCH_ALL)
+    opts->count = n;
+  return 1;
+}
+
+void batch_free_images(batch_image *images, int count) {
+  if (!images)
+    return;
+  for (int i = 0; i < count; ++i) {
+    free(images[i].name);
+    free(images[i].data);
+  }
+  free(images);
+}
+
+int batch_tile(batch_image *images, int count, size_t width, size_t height) {
+  for (int i = 0; i < count; ++i) {
+    unsigned char *tiled = tile_image(images[i].data, images[i].width, images[i].height, width, height);
+    if (!tiled)
+      return 0;
+    free(images[i].data);
+    images[i].data = tiled;
+    images[i].width = width;
+    images[i].height = height;
+  }
+  return 1;
+}
+
+//
+// Pipeline
+//
+
+int batch_init(batch *p, cl_context context, cl_device_id device, int queues, size_t out_size) {
+  cl_int status;
+
+  memset(p, 0, sizeof(batch));
+  p->slots = queues < 1 ? 1 : (queues > BATCH_MAX_QUEUES ? BATCH_MAX_QUEUES : queues);
+
+  for (int i = 0; i < p->slots; ++i) {
+    batch_slot *s = &p->slot[i];
+    s->index = i;
+
+    s->queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not create command queue %d\n", i);
+      print_error(status);
+      batch_release(p);
+      return 0;
+    }
+
+    s->out = malloc(out_size);
+    if (!s->out) {
+      fprintf(stderr, "Error: malloc failed\n");
+      batch_release(p);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Wait for the image in flight on slot
+static int retire(batch *p, batch_slot *s) {
+  int ok = 1;
+  for (int e = 0; e < s->events; ++e) {
+    if (p->b) {
+      bench_event(p->b, s->phase[e], s->event[e]);
+      continue;
+    }
+    if (clWaitForEvents(1, &s->event[e]) != CL_SUCCESS)
+      ok = 0;
+    clReleaseEvent(s->event[e]);
+  }
+  s->events = 0;
+  return ok;
+}
+
+void batch_release(batch *p) {
+  for (int i = 0; i < p->slots; ++i) {
+    batch_slot *s = &p->slot[i];
+    if (s->queue) {
+      clFinish(s->queue);
+      clReleaseCommandQueue(s->queue);
+    }
+    for (int e = 0; e < s->events; ++e)
+      clReleaseEvent(s->event[e]);
+    free(s->out);
+  }
+  memset(p, 0, sizeof(batch));
+}
+
+void batch_event(batch_slot *slot, int phase, cl_event event) {
+  // No room left, wait for the command here so that it has finished by the
+  // time the slot is reused
+  if (slot->events == BATCH_MAX_EVENTS) {
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+    return;
+  }
+  slot->phase[slot->events] = phase;
+  slot->event[slot->events++] = event;
+}
+
+int batch_run(batch *p, int count, const batch_image *images, int nimages,
+    batch_enqueue enqueue, void *user) {
+  double start = get_time();
+  int ok = 1;
+
+  for (int i = 0; ok && i < count; ++i) {
+    batch_slot *s = &p->slot[i % p->slots];
+    const batch_image *image = &images[i % nimages];
+
+    ok = retire(p, s);
+    if (ok && !enqueue(s, image, user)) {
+      fprintf(stderr, "Error: could not enqueue %s\n", image->name);
+      ok = 0;
+    }
+    // Start the commands while the other queues are filled
+    if (ok && clFlush(s->queue) != CL_SUCCESS)
+      ok = 0;
+    p->last = s->index;
+  }
+
+  for (int i = 0; i < p->slots; ++i)
+    ok &= retire(p, &p->slot[i]);
+
+  if (p->b)
+    bench_wall(p->b, get_time() - start);
+  return ok;
+}
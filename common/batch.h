@@ -0,0 +1,77 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Command queues, each with its own slot of device memory
+#define BATCH_MAX_QUEUES 8
+
+// Commands per image whose events are kept until the slot is reused
+#define BATCH_MAX_EVENTS 8
+
+#define BATCH_USAGE "[--batch N] [--input DIR|LIST|FILE] [--queues N]"
+
+// --input without --batch: every input once
+#define BATCH_ALL -1
+
+typedef struct {
+  int count;          // images per batch, 0 processes a single image
+  const char *input;  // directory, list file or image, NULL for the default
+  int queues;
+} batch_options;
+
+// Remove --batch, --input and --queues from argv.
+void batch_parse_args(int *argc, char **argv, batch_options *opts);
+
+typedef struct {
+  char *name;
+  unsigned char *data; // 8-bit grayscale
+  size_t width, height;
+} batch_image;
+
+// Read the .pgm and .dat images of opts->input, or of fallback if not given:
+// a directory, a text file with one path per line or a single image. Images
+// that differ in size from the first one are skipped. Resolves BATCH_ALL.
+int batch_load(batch_options *opts, const char *fallback, batch_image **images, int *count);
+void batch_free_images(batch_image *images, int count);
+
+// Repeat every image to fill width x height, like tile_image.
+int batch_tile(batch_image *images, int count, size_t width, size_t height);
+
+typedef struct {
+  int index;
+  cl_command_queue queue;
+  void *out;                  // host result of the image in flight
+
+  int events;
+  cl_event event[BATCH_MAX_EVENTS];
+  int phase[BATCH_MAX_EVENTS];
+} batch_slot;
+
+// Enqueue the upload, kernels and download of image on slot->queue using the
+// device memory of slot->index, without waiting. Events are handed over with
+// batch_event. Returns 0 on failure.
+typedef int (*batch_enqueue)(batch_slot *slot, const batch_image *image, void *user);
+
+typedef struct {
+  int slots;
+  batch_slot slot[BATCH_MAX_QUEUES];
+  int last;                   // slot of the last image of the batch
+  bench *b;                   // if set, events and the batch time are recorded here
+} batch;
+
+int batch_init(batch *p, cl_context context, cl_device_id device, int queues, size_t out_size);
+void batch_release(batch *p);
+
+// Keep event of a command of slot, released when the slot is reused.
+void batch_event(batch_slot *slot, int phase, cl_event event);
+
+// Process count images, cycling through images. Images are assigned to the
+// slots round-robin: while one queue uploads, others run kernels or download.
+// A slot is only reused after its previous image is complete.
+int batch_run(batch *p, int count, const batch_image *images, int nimages,
+    batch_enqueue enqueue, void *user);
+
+#endif /* BATCH_H */
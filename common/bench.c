@@ -0,0 +1,279 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+static const char *phase_names[BENCH_PHASES] = {"h2d", "kernel", "d2h"};
+
+static const char *phase_name(int p) {
+  return p < BENCH_PHASES ? phase_names[p] : (p == BENCH_PHASES ? "total" : "wall");
+}
+
+typedef struct {
+  double min, median, mean, p95, p99;
+} bench_stats;
+
+void bench_parse_args(int *argc, char **argv, bench_options *opts) {
+  opts->warmup = 2;
+  opts->reps   = 10;
+  opts->format = BENCH_TEXT;
+  opts->size   = 0;
+  opts->output = NULL;
+  opts->results = NULL;
+  opts->tune   = 0;
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--tune")) {
+      opts->tune = 1;
+      continue;
+    }
+
+    if (!strcmp(arg, "--warmup") && val) {
+      opts->warmup = atoi(val);
+    } else if (!strcmp(arg, "--reps") && val) {
+      opts->reps = atoi(val);
+    } else if (!strcmp(arg, "--size") && val) {
+      opts->size = (size_t) strtoull(val, NULL, 0);
+    } else if (!strcmp(arg, "--output") && val) {
+      opts->output = val;
+    } else if (!strcmp(arg, "--results") && val) {
+      opts->results = val;
+    } else if (!strcmp(arg, "--format") && val) {
+      if (!strcmp(val, "csv"))
+        opts->format = BENCH_CSV;
+      else if (!strcmp(val, "json"))
+        opts->format = BENCH_JSON;
+      else
+        opts->format = BENCH_TEXT;
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+
+  if (opts->warmup < 0) opts->warmup = 0;
+  if (opts->reps < 1) opts->reps = 1;
+}
+
+int bench_init(bench *b, const bench_options *opts, const char *name, const char *variant, size_t size) {
+  memset(b, 0, sizeof(bench));
+  b->opts    = opts;
+  b->name    = name;
+  b->variant = variant ? variant : "";
+  b->size    = size;
+  b->rep     = -opts->warmup - 1;
+
+  for (int p = 0; p < BENCH_PHASES; ++p) {
+    b->samples[p] = (double *) calloc(opts->reps, sizeof(double));
+    if (!b->samples[p]) {
+      fprintf(stderr, "Error: could not allocate benchmark samples\n");
+      bench_free(b);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void bench_wall(bench *b, double seconds) {
+  if (!b->wall) {
+    b->wall = (double *) calloc(b->opts->reps, sizeof(double));
+    if (!b->wall) {
+      fprintf(stderr, "Error: could not allocate benchmark samples\n");
+      return;
+    }
+  }
+  if (b->rep >= 0 && b->rep < b->opts->reps)
+    b->wall[b->rep] = seconds;
+}
+
+void bench_set_rate(bench *b, double work, const char *unit) {
+  b->work = work;
+  b->unit = unit;
+}
+
+int bench_next(bench *b) {
+  b->rep++;
+  return b->rep < b->opts->reps;
+}
+
+void bench_event(bench *b, int phase, cl_event event) {
+  cl_int status;
+  cl_ulong start, end;
+
+  status = clWaitForEvents(1, &event);
+  checkError(status, "Error: could not wait for event");
+
+  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+  checkError(status, "Error: could not get start profile information");
+
+  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+  checkError(status, "Error: could not get end profile information");
+
+  status = clReleaseEvent(event);
+  checkError(status, "Error: could not release event");
+
+  bench_time(b, phase, (end - start) * 1e-9);
+}
+
+void bench_time(bench *b, int phase, double seconds) {
+  if (b->rep >= 0 && b->rep < b->opts->reps)
+    b->samples[phase][b->rep] += seconds;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int n, int pct) {
+  int rank = (pct * n + 99) / 100;
+  if (rank < 1) rank = 1;
+  return sorted[rank-1];
+}
+
+static void compute_stats(const double *samples, int n, bench_stats *s) {
+  double *sorted = (double *) malloc(n * sizeof(double));
+  if (!sorted) {
+    memset(s, 0, sizeof(bench_stats));
+    return;
+  }
+  memcpy(sorted, samples, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_double);
+
+  double sum = 0;
+  for (int i = 0; i < n; ++i) sum += sorted[i];
+
+  s->min    = sorted[0];
+  s->median = (n % 2) ? sorted[n/2] : 0.5 * (sorted[n/2-1] + sorted[n/2]);
+  s->mean   = sum / n;
+  s->p95    = percentile(sorted, n, 95);
+  s->p99    = percentile(sorted, n, 99);
+
+  free(sorted);
+}
+
+double bench_rate(const bench *b) {
+  bench_stats s;
+  compute_stats(b->wall ? b->wall : b->samples[BENCH_KERNEL], b->opts->reps, &s);
+  return (b->unit && s.median > 0) ? b->work / s.median : 0;
+}
+
+// Append the statistics of all rows in format to path, or print them if path is NULL
+static void write_report(const bench *b, const char *path, int format, const bench_stats *stats, int rows,
+    double rate, const char *unit) {
+  int n = b->opts->reps;
+  FILE *fp = stdout;
+  int new_file = 1;
+  if (path) {
+    fp = fopen(path, "a");
+    if (!fp) {
+      fprintf(stderr, "Error: could not open %s\n", path);
+      return;
+    }
+    fseek(fp, 0, SEEK_END);
+    new_file = (ftell(fp) == 0);
+  }
+
+  switch (format) {
+    case BENCH_CSV:
+      if (new_file)
+        fprintf(fp, "name,variant,size,phase,reps,min,median,mean,p95,p99,rate,unit\n");
+      for (int p = 0; p <= rows; ++p) {
+        const bench_stats *s = &stats[p];
+        fprintf(fp, "%s,%s,%lu,%s,%d,%e,%e,%e,%e,%e,%f,%s\n",
+            b->name, b->variant, (unsigned long) b->size,
+            phase_name(p), n,
+            s->min, s->median, s->mean, s->p95, s->p99, rate, unit);
+      }
+      break;
+    case BENCH_JSON:
+      fprintf(fp, "{\"name\": \"%s\", \"variant\": \"%s\", \"size\": %lu, \"reps\": %d, "
+          "\"rate\": %f, \"unit\": \"%s\"",
+          b->name, b->variant, (unsigned long) b->size, n, rate, unit);
+      for (int p = 0; p <= rows; ++p) {
+        const bench_stats *s = &stats[p];
+        fprintf(fp, ", \"%s\": {\"min\": %e, \"median\": %e, \"mean\": %e, \"p95\": %e, \"p99\": %e}",
+            phase_name(p),
+            s->min, s->median, s->mean, s->p95, s->p99);
+      }
+      fprintf(fp, "}\n");
+      break;
+    default:
+      fprintf(fp, "%s %s size: %lu, reps: %d, warmup: %d\n", b->name, b->variant,
+          (unsigned long) b->size, n, b->opts->warmup);
+      fprintf(fp, "%-8s %12s %12s %12s %12s %12s\n", "[s]", "min", "median", "mean", "p95", "p99");
+      for (int p = 0; p <= rows; ++p) {
+        const bench_stats *s = &stats[p];
+        fprintf(fp, "%-8s %12f %12f %12f %12f %12f\n",
+            phase_name(p),
+            s->min, s->median, s->mean, s->p95, s->p99);
+      }
+      if (b->unit)
+        fprintf(fp, "rate: %f %s\n", rate, unit);
+  }
+
+  if (fp != stdout)
+    fclose(fp);
+}
+
+void bench_report(const bench *b) {
+  int n = b->opts->reps;
+  bench_stats stats[BENCH_PHASES+2];
+
+  double *total = (double *) calloc(n, sizeof(double));
+  if (!total) {
+    fprintf(stderr, "Error: could not allocate benchmark samples\n");
+    return;
+  }
+
+  for (int p = 0; p < BENCH_PHASES; ++p) {
+    compute_stats(b->samples[p], n, &stats[p]);
+    for (int i = 0; i < n; ++i) total[i] += b->samples[p][i];
+  }
+  compute_stats(total, n, &stats[BENCH_PHASES]);
+  free(total);
+
+  // Overlapping phases add a row with the host time, which the rate is based on
+  int rows = BENCH_PHASES;
+  if (b->wall)
+    compute_stats(b->wall, n, &stats[++rows]);
+
+  double seconds = b->wall ? stats[rows].median : stats[BENCH_KERNEL].median;
+  double rate = (b->unit && seconds > 0) ? b->work / seconds : 0;
+  const char *unit = b->unit ? b->unit : "";
+
+  if (b->opts->results) {
+    // Both formats of the same run
+    char path[1024];
+    for (int format = BENCH_CSV; format <= BENCH_JSON; ++format) {
+      snprintf(path, sizeof(path), "%s.%s", b->opts->results, format == BENCH_CSV ? "csv" : "json");
+      write_report(b, path, format, stats, rows, rate, unit);
+    }
+    return;
+  }
+  write_report(b, b->opts->output, b->opts->format, stats, rows, rate, unit);
+}
+
+void bench_free(bench *b) {
+  for (int p = 0; p < BENCH_PHASES; ++p) {
+    free(b->samples[p]);
+    b->samples[p] = NULL;
+  }
+  free(b->wall);
+  b->wall = NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+#include <CL/cl.h>
+
+enum {
+  BENCH_H2D=0,
+  BENCH_KERNEL=1,
+  BENCH_D2H=2,
+  BENCH_PHASES=3
+};
+
+enum {
+  BENCH_TEXT=0,
+  BENCH_CSV=1,
+  BENCH_JSON=2
+};
+
+#define BENCH_USAGE "[--size N] [--reps N] [--warmup N] [--format text|csv|json] [--output FILE] [--results PREFIX] [--tune]"
+
+typedef struct {
+  int warmup;
+  int reps;
+  int format;
+  size_t size;        // problem size, 0 selects the example default
+  const char *output; // append results to this file instead of stdout
+  const char *results; // append results to PREFIX.csv and PREFIX.json of the same run instead
+  int tune;           // run the auto-tuner instead of using the tuning database
+} bench_options;
+
+typedef struct {
+  const bench_options *opts;
+  const char *name;
+  const char *variant;
+  size_t size;
+
+  int rep;            // current repetition, negative during warm-up
+  double *samples[BENCH_PHASES];
+  double *wall;       // host time per repetition, if set with bench_wall
+
+  double work;        // work per repetition, e.g. GFLOP or GB
+  const char *unit;   // unit of work/kernel time, e.g. "GFLOP/s"
+} bench;
+
+// Remove --warmup, --reps, --format, --size, --output, --results and --tune from argv.
+void bench_parse_args(int *argc, char **argv, bench_options *opts);
+
+int bench_init(bench *b, const bench_options *opts, const char *name, const char *variant, size_t size);
+void bench_set_rate(bench *b, double work, const char *unit);
+
+// Advance to the next repetition, returns 0 after the last one.
+int bench_next(bench *b);
+
+// Wait for event, add its duration to the current repetition and release it.
+void bench_event(bench *b, int phase, cl_event event);
+
+// Add a duration measured otherwise, e.g. of several commands, to the current
+// repetition.
+void bench_time(bench *b, int phase, double seconds);
+
+// Set the host time of the current repetition, for phases that overlap.
+// Once set, the rate is the work per median host time.
+void bench_wall(bench *b, double seconds);
+
+// Work per median kernel or host time, 0 if no rate is set.
+double bench_rate(const bench *b);
+
+void bench_report(const bench *b);
+void bench_free(bench *b);
+
+#endif /* BENCH_H */
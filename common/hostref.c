@@ -0,0 +1,389 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#include <process.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+
+#include <hostref.h>
+
+// Block sizes of the host GEMM: a KB x NB block of B (128 KB) stays in L2
+// while MB rows of A stream through it.
+#define MB 32
+#define KB 128
+#define NB 256
+
+#define MAX_THREADS 256
+#define MAX_MISMATCHES 10
+
+int host_threads(void) {
+  const char *env = getenv("OCL_HOST_THREADS");
+  int n = (env && *env) ? atoi(env) : 0;
+
+  if (n <= 0) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    n = (int) info.dwNumberOfProcessors;
+#else
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+
+  if (n < 1) n = 1;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  return n;
+}
+
+typedef struct {
+  const float *A, *B;
+  float *C;
+  int M, N, K;
+  int first, stride; // row blocks first, first+stride, ...
+} gemm_task;
+
+// The innermost loop runs over contiguous rows of B and C without aliasing,
+// so that it is vectorized by the compiler.
+static void gemm_block(const float *restrict A, const float *restrict B, float *restrict C,
+    int rows, int cols, int depth, int lda, int ldb, int ldc) {
+  for (int i = 0; i < rows; ++i) {
+    float *restrict c = C + (size_t) i*ldc;
+    for (int k = 0; k < depth; ++k) {
+      const float a = A[(size_t) i*lda + k];
+      const float *restrict b = B + (size_t) k*ldb;
+      for (int j = 0; j < cols; ++j)
+        c[j] += a * b[j];
+    }
+  }
+}
+
+static void gemm_rows(const gemm_task *t) {
+  int blocks = (t->M + MB - 1) / MB;
+
+  for (int ib = t->first; ib < blocks; ib += t->stride) {
+    int i0 = ib * MB;
+    int rows = (t->M - i0 < MB) ? t->M - i0 : MB;
+
+    for (int k0 = 0; k0 < t->K; k0 += KB) {
+      int depth = (t->K - k0 < KB) ? t->K - k0 : KB;
+
+      for (int j0 = 0; j0 < t->N; j0 += NB) {
+        int cols = (t->N - j0 < NB) ? t->N - j0 : NB;
+
+        gemm_block(t->A + (size_t) i0*t->K + k0, t->B + (size_t) k0*t->N + j0,
+            t->C + (size_t) i0*t->N + j0, rows, cols, depth, t->K, t->N, t->N);
+      }
+    }
+  }
+}
+
+typedef void (*host_task)(void *task);
+
+typedef struct {
+  host_task fn;
+  void *task;
+} thread_arg;
+
+#ifdef _WIN32
+static unsigned __stdcall host_thread(void *arg) {
+  thread_arg *t = (thread_arg *) arg;
+  t->fn(t->task);
+  return 0;
+}
+#else
+static void *host_thread(void *arg) {
+  thread_arg *t = (thread_arg *) arg;
+  t->fn(t->task);
+  return NULL;
+}
+#endif
+
+// Run fn on the n tasks of task_size bytes each, one thread per task.
+// Task 0 runs on the calling thread. If a thread cannot be started, its task
+// runs on the calling thread as well.
+static void run_parallel(host_task fn, void *tasks, size_t task_size, int n) {
+  thread_arg args[MAX_THREADS];
+#ifdef _WIN32
+  HANDLE threads[MAX_THREADS];
+#else
+  pthread_t threads[MAX_THREADS];
+#endif
+  int started[MAX_THREADS];
+
+  for (int t = 0; t < n; ++t) {
+    args[t].fn = fn;
+    args[t].task = (char *) tasks + t * task_size;
+  }
+
+  for (int t = 1; t < n; ++t) {
+#ifdef _WIN32
+    threads[t] = (HANDLE) _beginthreadex(NULL, 0, host_thread, &args[t], 0, NULL);
+    started[t] = threads[t] != 0;
+#else
+    started[t] = !pthread_create(&threads[t], NULL, host_thread, &args[t]);
+#endif
+  }
+
+  fn(tasks);
+
+  for (int t = 1; t < n; ++t) {
+    if (!started[t]) {
+      fn(args[t].task);
+      continue;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(threads[t], INFINITE);
+    CloseHandle(threads[t]);
+#else
+    pthread_join(threads[t], NULL);
+#endif
+  }
+}
+
+static void gemm_thread(void *task) {
+  gemm_rows((const gemm_task *) task);
+}
+
+void host_sgemm(const float *A, const float *B, float *C, int M, int N, int K) {
+  gemm_task tasks[MAX_THREADS];
+
+  int blocks = (M + MB - 1) / MB;
+  int n = host_threads();
+  if (n > blocks) n = blocks;
+  if (n < 1) return;
+
+  for (int t = 0; t < n; ++t) {
+    gemm_task task = {A, B, C, M, N, K, t, n};
+    tasks[t] = task;
+  }
+
+  run_parallel(gemm_thread, tasks, sizeof(gemm_task), n);
+}
+
+// Ranges smaller than this are not worth a thread
+#define SCAN_MIN_RANGE 65536
+
+typedef struct {
+  const void *in;
+  void *out;
+  int is_float;
+  int exclusive;
+  size_t first, last;  // range of elements
+  double sum;          // total of the range, then the prefix of all ranges before
+  unsigned int usum;
+} scan_task;
+
+static void scan_sum_thread(void *arg) {
+  scan_task *t = (scan_task *) arg;
+
+  if (t->is_float) {
+    const float *in = (const float *) t->in;
+    double sum = 0;
+    for (size_t i = t->first; i < t->last; ++i)
+      sum += in[i];
+    t->sum = sum;
+  } else {
+    const unsigned int *in = (const unsigned int *) t->in;
+    unsigned int sum = 0;
+    for (size_t i = t->first; i < t->last; ++i)
+      sum += in[i];
+    t->usum = sum;
+  }
+}
+
+static void scan_range_thread(void *arg) {
+  scan_task *t = (scan_task *) arg;
+
+  if (t->is_float) {
+    const float *in = (const float *) t->in;
+    float *out = (float *) t->out;
+    double sum = t->sum;
+    for (size_t i = t->first; i < t->last; ++i) {
+      double x = in[i];
+      out[i] = (float) (t->exclusive ? sum : sum + x);
+      sum += x;
+    }
+  } else {
+    const unsigned int *in = (const unsigned int *) t->in;
+    unsigned int *out = (unsigned int *) t->out;
+    unsigned int sum = t->usum;
+    for (size_t i = t->first; i < t->last; ++i) {
+      unsigned int x = in[i];
+      out[i] = t->exclusive ? sum : sum + x;
+      sum += x;
+    }
+  }
+}
+
+// Sum the ranges in parallel, scan the range sums, then scan the ranges in
+// parallel starting from the prefix of their range.
+static void host_scan(const void *in, void *out, size_t n, int is_float, int exclusive) {
+  scan_task tasks[MAX_THREADS];
+
+  int threads = host_threads();
+  if ((size_t) threads > n / SCAN_MIN_RANGE) threads = (int) (n / SCAN_MIN_RANGE);
+  if (threads < 1) threads = 1;
+
+  for (int t = 0; t < threads; ++t) {
+    scan_task task = {in, out, is_float, exclusive, n * t / threads, n * (t + 1) / threads, 0, 0};
+    tasks[t] = task;
+  }
+
+  if (threads > 1)
+    run_parallel(scan_sum_thread, tasks, sizeof(scan_task), threads);
+
+  double sum = 0;
+  unsigned int usum = 0;
+  for (int t = 0; t < threads; ++t) {
+    double range_sum = tasks[t].sum;
+    unsigned int range_usum = tasks[t].usum;
+    tasks[t].sum = sum;
+    tasks[t].usum = usum;
+    sum += range_sum;
+    usum += range_usum;
+  }
+
+  run_parallel(scan_range_thread, tasks, sizeof(scan_task), threads);
+}
+
+void host_scan_float(const float *in, float *out, size_t n, int exclusive) {
+  host_scan(in, out, n, 1, exclusive);
+}
+
+void host_scan_uint(const unsigned int *in, unsigned int *out, size_t n, int exclusive) {
+  host_scan(in, out, n, 0, exclusive);
+}
+
+typedef struct {
+  float *data;
+  size_t n, stride, dist;
+  size_t first, last;       // transforms
+  const double *twiddles;   // exp(sign 2 pi i k / n), interleaved
+  int ok;
+} fft_task;
+
+static size_t smallest_factor(size_t n) {
+  for (size_t f = 2; f * f <= n; ++f)
+    if (n % f == 0)
+      return f;
+  return n;
+}
+
+// Stockham passes of the smallest remaining factor, each a naive DFT of the
+// factor's length over twiddled inputs
+static void fft_thread(void *arg) {
+  fft_task *t = (fft_task *) arg;
+  size_t n = t->n;
+  const double *w = t->twiddles;
+
+  double *a = (double *) malloc(4 * n * sizeof(double));
+  if (!a) {
+    t->ok = 0;
+    return;
+  }
+  double *b = a + 2 * n;
+
+  for (size_t tr = t->first; tr < t->last; ++tr) {
+    float *x = t->data + 2 * tr * t->dist;
+    for (size_t k = 0; k < n; ++k) {
+      a[2*k]   = x[2 * k * t->stride];
+      a[2*k+1] = x[2 * k * t->stride + 1];
+    }
+
+    double *src = a, *dst = b;
+    for (size_t ns = 1; ns < n; ) {
+      size_t r = smallest_factor(n / ns), m = n / r;
+      for (size_t j = 0; j < m; ++j) {
+        size_t k = j % ns, d = (j / ns) * ns * r + k;
+        for (size_t q = 0; q < r; ++q) {
+          double re = 0, im = 0;
+          for (size_t s = 0; s < r; ++s) {
+            size_t e = (s * (k * (n / (ns * r)) + q * (n / r))) % n;
+            const double *v = src + 2 * (j + s * m);
+            re += v[0] * w[2*e] - v[1] * w[2*e+1];
+            im += v[0] * w[2*e+1] + v[1] * w[2*e];
+          }
+          dst[2 * (d + q * ns)]     = re;
+          dst[2 * (d + q * ns) + 1] = im;
+        }
+      }
+      double *swap = src;
+      src = dst;
+      dst = swap;
+      ns *= r;
+    }
+
+    for (size_t k = 0; k < n; ++k) {
+      x[2 * k * t->stride]     = (float) src[2*k];
+      x[2 * k * t->stride + 1] = (float) src[2*k+1];
+    }
+  }
+  free(a);
+}
+
+int host_fft(float *data, size_t n, size_t count, size_t stride, size_t dist, int sign) {
+  fft_task tasks[MAX_THREADS];
+
+  if (n < 2 || !count)
+    return 1;
+
+  double *twiddles = (double *) malloc(2 * n * sizeof(double));
+  if (!twiddles) {
+    fprintf(stderr, "Error: malloc failed\n");
+    return 0;
+  }
+  const double pi = 3.14159265358979323846;
+  for (size_t k = 0; k < n; ++k) {
+    twiddles[2*k]   = cos(2 * pi * k / n);
+    twiddles[2*k+1] = sign * sin(2 * pi * k / n);
+  }
+
+  int threads = host_threads();
+  if ((size_t) threads > count) threads = (int) count;
+
+  for (int t = 0; t < threads; ++t) {
+    fft_task task = {data, n, stride, dist, count * t / threads, count * (t + 1) / threads, twiddles, 1};
+    tasks[t] = task;
+  }
+  run_parallel(fft_thread, tasks, sizeof(fft_task), threads);
+  free(twiddles);
+
+  for (int t = 0; t < threads; ++t) {
+    if (!tasks[t].ok) {
+      fprintf(stderr, "Error: malloc failed\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+size_t compare_float(const float *ref, const float *out, size_t n, float rtol, float atol) {
+  size_t mismatches = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    float diff = fabsf(ref[i] - out[i]);
+    // also catches NaN in out
+    if (!(diff <= atol + rtol * fabsf(ref[i]))) {
+      if (mismatches < MAX_MISMATCHES)
+        fprintf(stderr, "at %lu: %f != %f\n", (unsigned long) i, ref[i], out[i]);
+      ++mismatches;
+    }
+  }
+
+  if (mismatches)
+    fprintf(stderr, "Compare failed: %lu of %lu elements differ\n",
+        (unsigned long) mismatches, (unsigned long) n);
+  return mismatches;
+}
+
+size_t compare_products(const float *ref, const float *out, size_t n, int k) {
+  return compare_float(ref, out, n, k * FLT_EPSILON, 1e-6f);
+}
@@ -0,0 +1,34 @@
+#ifndef HOSTREF_H
+#define HOSTREF_H
+
+#include <stddef.h>
+
+// Number of worker threads for host reference computations: OCL_HOST_THREADS
+// if set, otherwise the number of online processors.
+int host_threads(void);
+
+// Row-major C += A * B with A: M x K, B: K x N, C: M x N. Cache-blocked and
+// parallelized over blocks of rows of C.
+void host_sgemm(const float *A, const float *B, float *C, int M, int N, int K);
+
+// Inclusive or exclusive prefix sum of n elements, parallelized over ranges of
+// the input. Float sums are accumulated in double. in and out may be the same.
+void host_scan_float(const float *in, float *out, size_t n, int exclusive);
+void host_scan_uint(const unsigned int *in, unsigned int *out, size_t n, int exclusive);
+
+// Complex DFT in double precision of count transforms of n interleaved
+// complex floats, in place: element k of transform t is at
+// data[2*(t*dist + k*stride)]. sign is -1 for the forward and +1 for the
+// (unscaled) inverse transform. Mixed radix over the prime factors of n,
+// parallelized over transforms. Returns 0 if out of memory.
+int host_fft(float *data, size_t n, size_t count, size_t stride, size_t dist, int sign);
+
+// Compare out against ref element-wise with |ref - out| <= atol + rtol * |ref|.
+// Prints the first mismatches and returns the number of mismatching elements.
+size_t compare_float(const float *ref, const float *out, size_t n, float rtol, float atol);
+
+// compare_float of n products of length k: the summation order differs
+// between host and device, so up to k roundings are allowed.
+size_t compare_products(const float *ref, const float *out, size_t n, int k);
+
+#endif /* HOSTREF_H */
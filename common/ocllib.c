@@ -1,12 +1,21 @@
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#include <psapi.h>
 #include <io.h>
+#include <direct.h>
 #define alloca _alloca
 #define access _access
+#define mkdir(path, mode) _mkdir(path)
 #define R_OK 4
 #else
+#define _POSIX_C_SOURCE 200809L
 #include <unistd.h>
 #include <alloca.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #endif
 
 #include <stdarg.h>
@@ -276,6 +285,53 @@ void print_device_info(cl_device_id device, int printShort) {
   fprintf(stderr,"===============================================\n");
 }
 
+//
+// Device queries
+//
+
+double device_bandwidth(cl_context context, cl_command_queue queue, size_t size) {
+  cl_int status;
+  cl_mem src, dst;
+  double best = 0;
+
+  src = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+  if (status != CL_SUCCESS)
+    return 0;
+  dst = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+  if (status != CL_SUCCESS) {
+    clReleaseMemObject(src);
+    return 0;
+  }
+
+  // one warm-up copy, then the fastest of 5
+  for (int rep = 0; rep <= 5; ++rep) {
+    cl_event event;
+    cl_ulong start, end;
+
+    status = clEnqueueCopyBuffer(queue, src, dst, 0, 0, size, 0, NULL, &event);
+    if (status != CL_SUCCESS)
+      break;
+
+    status = clWaitForEvents(1, &event);
+    if (status == CL_SUCCESS)
+      status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    if (status == CL_SUCCESS)
+      status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+    if (status != CL_SUCCESS)
+      break;
+
+    // a copy reads and writes size bytes
+    double bandwidth = 2.0 * size / ((end - start) * 1e-9) * 1e-9;
+    if (rep > 0 && end > start && bandwidth > best)
+      best = bandwidth;
+  }
+
+  clReleaseMemObject(src);
+  clReleaseMemObject(dst);
+  return best;
+}
+
 
 int find_platform(const char *platform_name_search, cl_platform_id *platform) {
   cl_int status;
@@ -341,6 +397,188 @@ cl_platform_id select_platform(const unsigned int id) {
   return NULL;
 }
 
+void device_parse_args(int *argc, char **argv, device_options *opts) {
+  opts->platform = getenv("OCL_PLATFORM");
+  opts->device   = getenv("OCL_DEVICE");
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--platform") && val) {
+      opts->platform = val;
+    } else if (!strcmp(arg, "--device") && val) {
+      opts->device = val;
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+
+  if (opts->platform && !*opts->platform)
+    opts->platform = NULL;
+  if (opts->device && !*opts->device)
+    opts->device = NULL;
+}
+
+double device_score(cl_device_id device) {
+  cl_uint units = 0, clock = 0;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock, NULL);
+  return (double) units * clock;
+}
+
+static int is_index(const char *s) {
+  if (!*s)
+    return 0;
+  for (; *s; ++s)
+    if (*s < '0' || *s > '9')
+      return 0;
+  return 1;
+}
+
+static int platform_name_contains(cl_platform_id platform, const char *search) {
+  size_t sz;
+  if (clGetPlatformInfo(platform, CL_PLATFORM_NAME, 0, NULL, &sz) != CL_SUCCESS)
+    return 0;
+  char *name = (char *) alloca(sz);
+  if (clGetPlatformInfo(platform, CL_PLATFORM_NAME, sz, name, NULL) != CL_SUCCESS)
+    return 0;
+  return strstr(name, search) != NULL;
+}
+
+static int device_name_contains(cl_device_id device, const char *search) {
+  size_t sz;
+  if (clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &sz) != CL_SUCCESS)
+    return 0;
+  char *name = (char *) alloca(sz);
+  if (clGetDeviceInfo(device, CL_DEVICE_NAME, sz, name, NULL) != CL_SUCCESS)
+    return 0;
+  return strstr(name, search) != NULL;
+}
+
+// Devices of platform matching spec, best-ranked first. Returns their number,
+// of which at most max are stored.
+static cl_uint match_devices(cl_platform_id platform, const char *spec, cl_device_id *devices, cl_uint max) {
+  cl_device_type type = CL_DEVICE_TYPE_ALL;
+  const char *name = NULL;
+  long index = -1;
+
+  if (!spec || !strcmp(spec, "all"))
+    ;
+  else if (!strcmp(spec, "cpu"))
+    type = CL_DEVICE_TYPE_CPU;
+  else if (!strcmp(spec, "gpu"))
+    type = CL_DEVICE_TYPE_GPU;
+  else if (!strcmp(spec, "accelerator"))
+    type = CL_DEVICE_TYPE_ACCELERATOR;
+  else if (is_index(spec))
+    index = atol(spec);
+  else
+    name = spec;
+
+  // Indices count all devices, as printed by print_platforms
+  cl_uint num_devices = 0;
+  if (clGetDeviceIDs(platform, type, 0, NULL, &num_devices) != CL_SUCCESS || !num_devices)
+    return 0;
+
+  cl_device_id *dids = (cl_device_id *) alloca(sizeof(cl_device_id)*num_devices);
+  double *scores = (double *) alloca(sizeof(double)*num_devices);
+  if (clGetDeviceIDs(platform, type, num_devices, dids, NULL) != CL_SUCCESS)
+    return 0;
+
+  // Insertion sort by score, equal scores keep their order
+  cl_uint count = 0;
+  for (cl_uint i = 0; i < num_devices; ++i) {
+    if ((index >= 0 && (cl_uint) index != i) || (name && !device_name_contains(dids[i], name)))
+      continue;
+
+    double score = device_score(dids[i]);
+    cl_uint j = count++;
+    for (; j > 0 && scores[j-1] < score; --j) {
+      dids[j] = dids[j-1];
+      scores[j] = scores[j-1];
+    }
+    dids[j] = dids[i];
+    scores[j] = score;
+  }
+
+  for (cl_uint i = 0; i < count && i < max; ++i)
+    devices[i] = dids[i];
+  return count;
+}
+
+int select_devices(const device_options *opts, const char *default_platform,
+    cl_platform_id *platform, cl_device_id *devices, cl_uint max, cl_uint *count) {
+  cl_int status;
+
+  cl_uint num_platforms;
+  status = clGetPlatformIDs(0, NULL, &num_platforms);
+  if (status != CL_SUCCESS || !num_platforms) {
+    fprintf(stderr, "Error: no OpenCL platform found\n");
+    return 0;
+  }
+
+  cl_platform_id *pids = (cl_platform_id *) alloca(sizeof(cl_platform_id)*num_platforms);
+  status = clGetPlatformIDs(num_platforms, pids, NULL);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: query for all platform ids failed\n");
+    return 0;
+  }
+
+  const char *search = opts->platform ? opts->platform : default_platform;
+  if (opts->platform && is_index(opts->platform)) {
+    unsigned long id = strtoul(opts->platform, NULL, 10);
+    if (id >= num_platforms) {
+      fprintf(stderr, "Error: platform %lu not found, %u platforms\n", id, num_platforms);
+      return 0;
+    }
+    pids[0] = pids[id];
+    num_platforms = 1;
+    search = NULL;
+  }
+
+  // The named platform only, the default one before all others
+  cl_device_id best;
+  *platform = NULL;
+  for (int pass = 0; pass < 2 && !*platform; ++pass) {
+    double best_score = -1;
+    for (cl_uint i = 0; i < num_platforms; ++i) {
+      if (pass == 0 && search && !platform_name_contains(pids[i], search))
+        continue;
+      if (match_devices(pids[i], opts->device, &best, 1) && device_score(best) > best_score) {
+        best_score = device_score(best);
+        *platform = pids[i];
+      }
+    }
+    if (opts->platform || !search)
+      break;
+  }
+
+  if (!*platform) {
+    if (opts->platform)
+      fprintf(stderr, "Error: no device \"%s\" on platform \"%s\"\n",
+          opts->device ? opts->device : "all", opts->platform);
+    else
+      fprintf(stderr, "Error: no device \"%s\" found\n", opts->device ? opts->device : "all");
+    return 0;
+  }
+
+  *count = match_devices(*platform, opts->device, devices, max);
+  if (*count > max)
+    *count = max;
+  return 1;
+}
+
+int select_device(const device_options *opts, const char *default_platform,
+    cl_platform_id *platform, cl_device_id *device) {
+  cl_uint count;
+  return select_devices(opts, default_platform, platform, device, 1, &count);
+}
+
 void print_platforms(void) {
 
   // Get number of platforms.
@@ -411,7 +649,7 @@ int load_file(const char *name, unsigned char **binary, size_t *size) {
   ptr = (unsigned char *) malloc(s);
   if (!ptr) {
     fprintf(stderr, "Error: malloc %s failed: %s\n", name, strerror(errno));
-    goto error_ret;
+    goto error_close;
   }
 
   // Go back to the file start
@@ -423,6 +661,8 @@ int load_file(const char *name, unsigned char **binary, size_t *size) {
     goto error_free;
   }
 
+  fclose(fp);
+
   *size = s;
   *binary = ptr;
 
@@ -438,16 +678,296 @@ error_ret:
   return 0;
 }
 
+int map_file(const char *name, mapped_file *file) {
+  memset(file, 0, sizeof(mapped_file));
+
+#ifdef _WIN32
+  HANDLE f = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (f == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Error: failed to open %s\n", name);
+    return 0;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(f, &size)) {
+    fprintf(stderr, "Error: failed to get the size of %s\n", name);
+    CloseHandle(f);
+    return 0;
+  }
+  file->size = (size_t) size.QuadPart;
+  file->file = f;
+
+  // Empty files cannot be mapped
+  if (!file->size)
+    return 1;
+
+  file->mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (file->mapping)
+    file->data = (const unsigned char *) MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!file->data) {
+    fprintf(stderr, "Error: failed to map %s\n", name);
+    unmap_file(file);
+    return 0;
+  }
+#else
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: failed to open %s: %s\n", name, strerror(errno));
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "Error: fstat %s failed: %s\n", name, strerror(errno));
+    close(fd);
+    return 0;
+  }
+  file->size = (size_t) st.st_size;
+
+  // Empty files cannot be mapped
+  if (file->size) {
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Error: mmap %s failed: %s\n", name, strerror(errno));
+      close(fd);
+      return 0;
+    }
+    file->data = (const unsigned char *) data;
+  }
+  // The mapping keeps the file open
+  close(fd);
+#endif
+  return 1;
+}
+
+void unmap_file(mapped_file *file) {
+#ifdef _WIN32
+  if (file->data) UnmapViewOfFile(file->data);
+  if (file->mapping) CloseHandle(file->mapping);
+  if (file->file) CloseHandle(file->file);
+#else
+  if (file->data) munmap((void *) file->data, file->size);
+#endif
+  memset(file, 0, sizeof(mapped_file));
+}
+
+cl_mem map_file_buffer(cl_context context, const mapped_file *file, int zero_copy, cl_int *status) {
+  if (!file->data) {
+    *status = CL_INVALID_BUFFER_SIZE;
+    return NULL;
+  }
+
+  // Mappings start at a page, which satisfies CL_DEVICE_MEM_BASE_ADDR_ALIGN
+  // of all devices; the runtime never writes to a read-only buffer
+  cl_mem_flags flags = CL_MEM_READ_ONLY;
+  if (zero_copy && (size_t) file->data % MAP_FILE_ALIGNMENT == 0)
+    flags |= CL_MEM_USE_HOST_PTR;
+  else
+    flags |= CL_MEM_COPY_HOST_PTR;
+
+  return clCreateBuffer(context, flags, file->size, (void *) file->data, status);
+}
+
+double get_time(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double) now.QuadPart / (double) freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+size_t peak_rss(void) {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+#ifdef __APPLE__
+  return (size_t) usage.ru_maxrss;
+#else
+  return (size_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+//
+// Program binary cache
+//
+// Built programs are stored in OCL_CACHE_DIR (default: .oclcache in the
+// working directory), keyed by a hash over kernel source, build options,
+// device name and driver version. Setting OCL_NO_CACHE disables the cache.
+//
+
+cl_ulong fnv1a(cl_ulong hash, const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *) data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static cl_ulong fnv1a_device_string(cl_ulong hash, cl_device_id device, cl_device_info param) {
+  size_t sz;
+  if (clGetDeviceInfo(device, param, 0, NULL, &sz) != CL_SUCCESS)
+    return hash;
+
+  char *a = (char *) alloca(sz);
+  clGetDeviceInfo(device, param, sz, a, NULL);
+  return fnv1a(hash, a, sz);
+}
+
+cl_ulong device_hash(cl_device_id device) {
+  cl_ulong hash = FNV1A_INIT;
+  hash = fnv1a_device_string(hash, device, CL_DEVICE_NAME);
+  hash = fnv1a_device_string(hash, device, CL_DRIVER_VERSION);
+  return hash;
+}
+
+const char *program_cache_dir(void) {
+  if (getenv("OCL_NO_CACHE"))
+    return NULL;
+
+  const char *dir = getenv("OCL_CACHE_DIR");
+  if (!dir || !*dir)
+    dir = ".oclcache";
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Warning: could not create cache directory %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+  return dir;
+}
+
+static int program_cache_path(const char *name, const unsigned char *source, size_t size,
+    cl_device_id device, const char *compiler_opts, char *path, size_t path_size) {
+  const char *dir = program_cache_dir();
+  if (!dir)
+    return 0;
+
+  const char *opts = compiler_opts ? compiler_opts : "";
+  cl_ulong dev = device_hash(device);
+  cl_ulong hash = FNV1A_INIT;
+  hash = fnv1a(hash, source, size);
+  hash = fnv1a(hash, opts, strlen(opts) + 1);
+  hash = fnv1a(hash, &dev, sizeof(dev));
+
+  // Use the kernel file name without directory to make entries recognizable
+  const char *base = name;
+  for (const char *p = name; *p; ++p)
+    if (*p == '/' || *p == '\\') base = p + 1;
+
+  snprintf(path, path_size, "%s/%s-%016llx.bin", dir, base, (unsigned long long) hash);
+  return 1;
+}
+
+static int load_cached_program(const char *path, cl_program *program, cl_context context,
+    cl_device_id device, const char *compiler_opts) {
+  cl_int status, binary_status;
+  mapped_file binary;
+
+  if (access(path, R_OK))
+    return 0;
+
+  if (!map_file(path, &binary) || !binary.data) {
+    unmap_file(&binary);
+    return 0;
+  }
+
+  *program = clCreateProgramWithBinary(context, 1, &device, &binary.size,
+      &binary.data, &binary_status, &status);
+  unmap_file(&binary);
+
+  if (status != CL_SUCCESS || binary_status != CL_SUCCESS)
+    goto error_ret;
+
+  status = clBuildProgram(*program, 1, &device, compiler_opts, NULL, NULL);
+  if (status != CL_SUCCESS)
+    goto error_ret;
+
+  return 1;
+
+error_ret:
+  fprintf(stderr, "Warning: cached binary %s rejected, rebuilding from source\n", path);
+  if (*program) clReleaseProgram(*program);
+  *program = NULL;
+  return 0;
+}
+
+static void store_cached_program(const char *path, cl_program program) {
+  cl_int status;
+  size_t size;
+
+  status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL);
+  if (status != CL_SUCCESS || size == 0)
+    return;
+
+  unsigned char *binary = (unsigned char *) malloc(size);
+  if (!binary)
+    return;
+
+  status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL);
+  if (status != CL_SUCCESS)
+    goto error_free;
+
+  // Write to a temporary file first, so concurrent runs never see a partial binary
+  char *tmp = (char *) alloca(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+
+  FILE *fp = fopen(tmp, "wb");
+  if (!fp) {
+    fprintf(stderr, "Warning: could not write %s: %s\n", tmp, strerror(errno));
+    goto error_free;
+  }
+
+  size_t written = fwrite(binary, 1, size, fp);
+  fclose(fp);
+
+  if (written != size) {
+    remove(tmp);
+    goto error_free;
+  }
+
+  remove(path);
+  if (rename(tmp, path))
+    remove(tmp);
+
+error_free:
+  free(binary);
+}
+
 int create_program(const char *name, cl_program *program, cl_context context,
     cl_device_id device, const char *compiler_opts){
   cl_int status;
+  double start = get_time();
 
-  unsigned char *binary;
-  size_t size;
-  if (!load_file(name, &binary, &size)) goto error_ret;
-  if (!binary) goto error_ret;
+  *program = NULL;
+
+  // The source is hashed and compiled straight from the mapped file
+  mapped_file source;
+  if (!map_file(name, &source)) goto error_ret;
+  if (!source.data) goto error_free;
+
+  char path[1024];
+  int use_cache = program_cache_path(name, source.data, source.size, device, compiler_opts, path, sizeof(path));
 
-  *program = clCreateProgramWithSource(context, 1, (const char **) &binary, &size, &status);
+  if (use_cache && load_cached_program(path, program, context, device, compiler_opts)) {
+    fprintf(stderr, "Program %s: loaded from cache in %f s\n", name, get_time() - start);
+    unmap_file(&source);
+    return 1;
+  }
+
+  *program = clCreateProgramWithSource(context, 1, (const char **) &source.data, &source.size, &status);
 
   if (status != CL_SUCCESS) {
     fprintf(stderr, "Error: failed to create program %s:", name);
@@ -470,11 +990,16 @@ int create_program(const char *name, cl_program *program, cl_context context,
     goto error_free;
   }
 
-  free(binary);
+  if (use_cache)
+    store_cached_program(path, *program);
+
+  fprintf(stderr, "Program %s: compiled in %f s\n", name, get_time() - start);
+
+  unmap_file(&source);
   return 1;
 
 error_free:
-  free(binary);
+  unmap_file(&source);
 error_ret:
   return 0;
 }
@@ -17,12 +17,86 @@ void device_info_string( cl_device_id device, cl_device_info param, const char*
 void print_error(cl_int error);
 void print_device_info( cl_device_id device, int printShort );
 
+// Device memory bandwidth in GB/s, measured by copying size bytes between two
+// buffers. queue needs profiling enabled, returns 0 on failure.
+double device_bandwidth(cl_context context, cl_command_queue queue, size_t size);
+
 void print_platforms(void);
 int find_platform(const char *name, cl_platform_id *platform);
 cl_platform_id select_platform(const unsigned int index);
 
+#define DEVICE_USAGE "[--platform NAME|INDEX] [--device NAME|INDEX|cpu|gpu|accelerator]"
+
+// Platform and device to run on, from --platform and --device or else the
+// OCL_PLATFORM and OCL_DEVICE environment variables. Names match substrings,
+// indices count in the order of print_platforms.
+typedef struct {
+  const char *platform;   // NULL for the default platform of the example
+  const char *device;     // NULL for all devices of the platform
+} device_options;
+
+// Remove --platform and --device from argv.
+void device_parse_args(int *argc, char **argv, device_options *opts);
+
+// Compute units times maximum clock in MHz, to rank devices.
+double device_score(cl_device_id device);
+
+// The devices of opts on one platform, best-ranked first, e.g. for a context
+// spanning all of them; at most max are stored. Without a platform in opts,
+// default_platform is searched first and then all platforms, and the
+// platform with the best-ranked device is taken. Returns 0 if none matches.
+int select_devices(const device_options *opts, const char *default_platform,
+    cl_platform_id *platform, cl_device_id *devices, cl_uint max, cl_uint *count);
+
+// The best-ranked device of select_devices.
+int select_device(const device_options *opts, const char *default_platform,
+    cl_platform_id *platform, cl_device_id *device);
+
 int load_file(const char *name, unsigned char **binary, size_t *size);
 
+// Alignment of mapped files, a page
+#define MAP_FILE_ALIGNMENT 4096
+
+// Read-only mapping of a whole file, data is NULL for an empty file
+typedef struct {
+  const unsigned char *data;
+  size_t size;
+#ifdef _WIN32
+  void *file, *mapping;
+#endif
+} mapped_file;
+
+// Map name read-only instead of reading it like load_file: pages are read on
+// first access and nothing is copied. Returns 0 on failure.
+int map_file(const char *name, mapped_file *file);
+void unmap_file(mapped_file *file);
+
+// Read-only buffer of a mapped file. With zero_copy the buffer uses the
+// mapped pages (CL_MEM_USE_HOST_PTR), which CPU devices read in place, GPUs
+// copy them when the buffer is first used; otherwise the contents are copied
+// at creation (CL_MEM_COPY_HOST_PTR).
+cl_mem map_file_buffer(cl_context context, const mapped_file *file, int zero_copy, cl_int *status);
+
+double get_time(void);
+
+// Largest resident set of the process so far in bytes, 0 if unknown.
+size_t peak_rss(void);
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+cl_ulong fnv1a(cl_ulong hash, const void *data, size_t size);
+
+// Identifies a device and driver, e.g. for caches and tuning databases.
+cl_ulong device_hash(cl_device_id device);
+
+// Directory of the program cache, created if needed. NULL if the cache is
+// disabled or the directory cannot be created.
+const char *program_cache_dir(void);
+
+// Build a program from source, reusing a cached binary when possible.
+// On build failure *program is kept, so the caller can print the build log.
+int create_program(const char *name, cl_program *program, cl_context context,
+    cl_device_id device, const char *compiler_opts);
+
 void print_build_log(cl_program, cl_device_id);
 
 void teardown(int);
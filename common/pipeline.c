@@ -0,0 +1,265 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <pipeline.h>
+
+static const char *stage_names[PIPELINE_STAGES] = {"h2d", "kernel", "d2h"};
+
+// Queue of every stage: with two queues the transfers share one
+static const int stage_queue[PIPELINE_STAGES][PIPELINE_STAGES] = {
+  {0, 0, 0},
+  {0, 1, 0},
+  {0, 1, 2}
+};
+
+void pipeline_default_options(pipeline_options *opts) {
+  opts->queues   = 3;
+  opts->buffers  = 2;
+  opts->chunks   = 4;
+  opts->timeline = 0;
+}
+
+void pipeline_parse_args(int *argc, char **argv, pipeline_options *opts) {
+  pipeline_default_options(opts);
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--timeline")) {
+      opts->timeline = 1;
+      continue;
+    }
+
+    if (!strcmp(arg, "--queues") && val) {
+      opts->queues = atoi(val);
+    } else if (!strcmp(arg, "--buffers") && val) {
+      opts->buffers = atoi(val);
+    } else if (!strcmp(arg, "--chunks") && val) {
+      opts->chunks = atoi(val);
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+
+  if (opts->queues < 1) opts->queues = 1;
+  if (opts->queues > PIPELINE_STAGES) opts->queues = PIPELINE_STAGES;
+  if (opts->buffers < 1) opts->buffers = 1;
+  if (opts->buffers > PIPELINE_MAX_BUFFERS) opts->buffers = PIPELINE_MAX_BUFFERS;
+  if (opts->chunks < 1) opts->chunks = 1;
+}
+
+int pipeline_init(pipeline *p, cl_context context, cl_device_id device, const pipeline_options *opts,
+    size_t in_size, size_t out_size) {
+  cl_int status;
+
+  memset(p, 0, sizeof(pipeline));
+  p->queues = opts->queues < 1 ? 1 : (opts->queues > PIPELINE_STAGES ? PIPELINE_STAGES : opts->queues);
+  p->buffers = opts->buffers < 1 ? 1 : (opts->buffers > PIPELINE_MAX_BUFFERS ? PIPELINE_MAX_BUFFERS : opts->buffers);
+  p->in_size = in_size;
+  p->out_size = out_size;
+
+  for (int i = 0; i < p->queues; ++i) {
+    p->queue[i] = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not create pipeline queue %d\n", i);
+      goto error_ret;
+    }
+  }
+
+  for (int i = 0; i < p->buffers; ++i) {
+    if (in_size) {
+      p->in[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, in_size, NULL, &status);
+      if (status != CL_SUCCESS) {
+        fprintf(stderr, "Error: could not create pipeline input buffer of %lu bytes\n", (unsigned long) in_size);
+        goto error_ret;
+      }
+    }
+    if (out_size) {
+      p->out[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, out_size, NULL, &status);
+      if (status != CL_SUCCESS) {
+        fprintf(stderr, "Error: could not create pipeline output buffer of %lu bytes\n", (unsigned long) out_size);
+        goto error_ret;
+      }
+    }
+  }
+  return 1;
+
+error_ret:
+  print_error(status);
+  pipeline_release(p);
+  return 0;
+}
+
+void pipeline_release(pipeline *p) {
+  for (int i = 0; i < PIPELINE_STAGES; ++i) {
+    if (p->queue[i]) {
+      clFinish(p->queue[i]);
+      clReleaseCommandQueue(p->queue[i]);
+    }
+  }
+  for (int i = 0; i < PIPELINE_MAX_BUFFERS; ++i) {
+    if (p->in[i]) clReleaseMemObject(p->in[i]);
+    if (p->out[i]) clReleaseMemObject(p->out[i]);
+  }
+  free(p->timeline);
+  memset(p, 0, sizeof(pipeline));
+}
+
+// Device time of a stage: from its barrier, i.e. when the chunks it depends on
+// are complete and its queue is free, to the end of its last command
+static void stage_time(cl_event barrier, cl_event last, cl_ulong *start, cl_ulong *end) {
+  *start = *end = 0;
+  if (!last || clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), end, NULL) != CL_SUCCESS)
+    return;
+  if (!barrier || clGetEventProfilingInfo(barrier, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), start, NULL) != CL_SUCCESS)
+    clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), start, NULL);
+  if (*start > *end)
+    *start = *end;
+}
+
+int pipeline_run(pipeline *p, size_t length, size_t chunk,
+    pipeline_stage upload, pipeline_stage kernel, pipeline_stage download, void *user) {
+  pipeline_stage stages[PIPELINE_STAGES] = {upload, kernel, download};
+  cl_int status;
+
+  if (chunk == 0)
+    chunk = length ? length : 1;
+  size_t chunks = (length + chunk - 1) / chunk;
+
+  p->chunks = 0;
+  if (chunks > p->capacity) {
+    free(p->timeline);
+    p->timeline = malloc(chunks * sizeof(*p->timeline));
+    p->capacity = p->timeline ? chunks : 0;
+  }
+
+  // Barrier and last event of every stage of every chunk
+  cl_event (*events)[PIPELINE_STAGES][2] = calloc(chunks ? chunks : 1, sizeof(*events));
+  if (!events || (chunks && !p->timeline)) {
+    fprintf(stderr, "Error: malloc failed\n");
+    free(events);
+    return 0;
+  }
+
+  int ok = 1;
+  for (size_t c = 0; ok && c < chunks; ++c) {
+    pipeline_chunk ch;
+    ch.index = c;
+    ch.offset = c * chunk;
+    ch.count = (length - ch.offset < chunk) ? length - ch.offset : chunk;
+    ch.in = p->in[c % p->buffers];
+    ch.out = p->out[c % p->buffers];
+
+    for (int s = 0; ok && s < PIPELINE_STAGES; ++s) {
+      cl_event wait[2];
+      cl_uint n = 0;
+      if (s > 0)
+        wait[n++] = events[c][s-1][1];
+
+      // The buffers were last used by chunk c - buffers: its kernel read the
+      // input and its download read the output
+      if (c >= (size_t) p->buffers) {
+        if (s == BENCH_H2D)
+          wait[n++] = events[c - p->buffers][BENCH_KERNEL][1];
+        if (s == BENCH_KERNEL)
+          wait[n++] = events[c - p->buffers][BENCH_D2H][1];
+      }
+
+      cl_command_queue queue = p->queue[stage_queue[p->queues-1][s]];
+      status = clEnqueueBarrierWithWaitList(queue, n, n ? wait : NULL, &events[c][s][0]);
+      if (status != CL_SUCCESS) {
+        fprintf(stderr, "Error: could not enqueue pipeline barrier\n");
+        print_error(status);
+        events[c][s][0] = NULL;
+        ok = 0;
+      } else if (!stages[s](queue, &ch, &events[c][s][1], user)) {
+        fprintf(stderr, "Error: could not enqueue %s of chunk %lu\n", stage_names[s], (unsigned long) c);
+        events[c][s][1] = NULL;
+        ok = 0;
+      }
+    }
+
+    // Start the chunk while the next one is enqueued
+    for (int i = 0; i < p->queues; ++i)
+      clFlush(p->queue[i]);
+  }
+
+  for (int i = 0; i < p->queues; ++i) {
+    status = clFinish(p->queue[i]);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not finish pipeline\n");
+      print_error(status);
+      ok = 0;
+    }
+  }
+
+  for (size_t c = 0; c < chunks; ++c) {
+    for (int s = 0; s < PIPELINE_STAGES; ++s) {
+      cl_ulong *t = p->timeline[c][s];
+      stage_time(events[c][s][0], events[c][s][1], &t[0], &t[1]);
+      if (ok && p->b)
+        bench_time(p->b, s, (t[1] - t[0]) * 1e-9);
+
+      if (events[c][s][0]) clReleaseEvent(events[c][s][0]);
+      if (events[c][s][1]) clReleaseEvent(events[c][s][1]);
+    }
+  }
+  free(events);
+
+  p->chunks = ok ? chunks : 0;
+  return ok;
+}
+
+void pipeline_report(const pipeline *p, int verbose) {
+  if (!p->chunks)
+    return;
+
+  cl_ulong first = p->timeline[0][0][0], last = 0;
+  for (size_t c = 0; c < p->chunks; ++c) {
+    for (int s = 0; s < PIPELINE_STAGES; ++s) {
+      if (p->timeline[c][s][0] < first) first = p->timeline[c][s][0];
+      if (p->timeline[c][s][1] > last) last = p->timeline[c][s][1];
+    }
+  }
+
+  double busy[PIPELINE_STAGES] = {0, 0, 0};
+  double serial = 0;
+
+  if (verbose)
+    printf("%-6s %25s %25s %25s\n", "chunk", "h2d [ms]", "kernel [ms]", "d2h [ms]");
+  for (size_t c = 0; c < p->chunks; ++c) {
+    if (verbose)
+      printf("%-6lu", (unsigned long) c);
+    for (int s = 0; s < PIPELINE_STAGES; ++s) {
+      const cl_ulong *t = p->timeline[c][s];
+      busy[s] += (t[1] - t[0]) * 1e-6;
+      if (verbose)
+        printf(" %11.3f - %11.3f", (t[0] - first) * 1e-6, (t[1] - first) * 1e-6);
+    }
+    if (verbose)
+      printf("\n");
+  }
+  for (int s = 0; s < PIPELINE_STAGES; ++s)
+    serial += busy[s];
+
+  // Without overlap the elapsed time is the sum of the stages
+  double elapsed = (last - first) * 1e-6;
+  printf("pipeline: %lu chunks, %d queues, %d buffers\n", (unsigned long) p->chunks, p->queues, p->buffers);
+  printf("busy [ms]: h2d %.3f, kernel %.3f, d2h %.3f; elapsed %.3f, serial %.3f\n",
+      busy[BENCH_H2D], busy[BENCH_KERNEL], busy[BENCH_D2H], elapsed, serial);
+  if (elapsed > 0 && serial > 0)
+    printf("overlap: %.1f%% (%.2fx)\n", 100 * (1 - elapsed / serial), serial / elapsed);
+}
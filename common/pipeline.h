@@ -0,0 +1,68 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Upload, kernel and download, in the order of the bench phases
+#define PIPELINE_STAGES 3
+
+// Deepest ping-pong buffering
+#define PIPELINE_MAX_BUFFERS 3
+
+#define PIPELINE_USAGE "[--queues 1-3] [--buffers 1-3] [--chunks N] [--timeline]"
+
+typedef struct {
+  int queues;     // 1 serializes all stages, 2 overlaps transfers with kernels, 3 also uploads with downloads
+  int buffers;    // chunks in flight, each with its own device buffers
+  int chunks;     // chunks the input is split into
+  int timeline;   // print the stages of every chunk
+} pipeline_options;
+
+// Remove --queues, --buffers, --chunks and --timeline from argv.
+void pipeline_parse_args(int *argc, char **argv, pipeline_options *opts);
+void pipeline_default_options(pipeline_options *opts);
+
+typedef struct {
+  size_t index;           // chunk number
+  size_t offset, count;   // first unit and number of units of the chunk
+  cl_mem in, out;         // device buffers of the chunk
+} pipeline_chunk;
+
+// Enqueue the commands of one stage of chunk on queue, without wait lists,
+// and return the event of the last one. The queue already waits for the
+// stages the chunk depends on. Returns 0 on failure.
+typedef int (*pipeline_stage)(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user);
+
+typedef struct {
+  int queues, buffers;
+  cl_command_queue queue[PIPELINE_STAGES];
+  cl_mem in[PIPELINE_MAX_BUFFERS], out[PIPELINE_MAX_BUFFERS];
+  size_t in_size, out_size;
+
+  bench *b;               // if set, the busy time of the stages is recorded here
+
+  // Device time of every stage of the chunks of the last run, ns
+  size_t chunks, capacity;
+  cl_ulong (*timeline)[PIPELINE_STAGES][2];
+} pipeline;
+
+// Create the queues and buffers of in_size and out_size bytes per chunk.
+int pipeline_init(pipeline *p, cl_context context, cl_device_id device, const pipeline_options *opts,
+    size_t in_size, size_t out_size);
+void pipeline_release(pipeline *p);
+
+// Split length units (elements, rows, ...) into chunks of at most chunk units
+// and run the stages of all chunks. Chunk i uploads while chunk i-1 runs its
+// kernel and chunk i-2 downloads, as far as queues and buffers allow:
+// buffers are reused once the kernel (input) and download (output) of the
+// chunk that used them before are complete.
+int pipeline_run(pipeline *p, size_t length, size_t chunk,
+    pipeline_stage upload, pipeline_stage kernel, pipeline_stage download, void *user);
+
+// Busy time of the stages, elapsed time and overlap of the last run, with
+// verbose also the timeline of every chunk.
+void pipeline_report(const pipeline *p, int verbose);
+
+#endif /* PIPELINE_H */
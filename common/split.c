@@ -0,0 +1,209 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <split.h>
+
+void split_parse_args(int *argc, char **argv, split_options *opts) {
+  opts->devices = 1;
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--devices") && val) {
+      opts->devices = strcmp(val, "all") ? atoi(val) : 0;
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+
+  if (opts->devices < 0) opts->devices = 1;
+  if (opts->devices > SPLIT_MAX_DEVICES) opts->devices = SPLIT_MAX_DEVICES;
+}
+
+// Shares of the active devices proportional to their rates, or to their
+// scores as long as one of them has not been measured
+static void update_shares(split *s) {
+  double weight[SPLIT_MAX_DEVICES];
+  double total = 0;
+
+  int measured = 1;
+  for (int d = 0; d < s->active; ++d)
+    measured &= s->rate[d] > 0;
+
+  for (int d = 0; d < s->active; ++d) {
+    weight[d] = measured ? s->rate[d] : device_score(s->device[d]);
+    if (weight[d] <= 0)
+      weight[d] = 1;
+    total += weight[d];
+  }
+  for (int d = 0; d < SPLIT_MAX_DEVICES; ++d)
+    s->share[d] = d < s->active ? weight[d] / total : 0;
+}
+
+int split_init(split *s, cl_context context, const cl_device_id *devices, int count) {
+  cl_int status;
+
+  memset(s, 0, sizeof(split));
+  if (count < 1 || count > SPLIT_MAX_DEVICES) {
+    fprintf(stderr, "Error: cannot split across %d devices\n", count);
+    return 0;
+  }
+
+  for (int d = 0; d < count; ++d) {
+    s->device[d] = devices[d];
+    s->queue[d] = clCreateCommandQueue(context, devices[d], CL_QUEUE_PROFILING_ENABLE, &status);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not create queue of device %d\n", d);
+      print_error(status);
+      split_release(s);
+      return 0;
+    }
+    s->devices++;
+  }
+  split_use(s, count);
+  return 1;
+}
+
+void split_release(split *s) {
+  for (int d = 0; d < s->devices; ++d) {
+    if (s->queue[d]) clReleaseCommandQueue(s->queue[d]);
+    free(s->record[d]);
+  }
+  memset(s, 0, sizeof(split));
+}
+
+void split_use(split *s, int count) {
+  s->active = count < 1 ? 1 : (count > s->devices ? s->devices : count);
+  update_shares(s);
+}
+
+// Wait for event and record it in the benchmark, if any
+static void retire(split *s, int phase, cl_event event) {
+  if (s->b)
+    bench_event(s->b, phase, event);
+  else
+    clReleaseEvent(event);
+}
+
+void split_event(split *s, int d, int phase, cl_event event) {
+  if (s->events[d] == s->capacity[d]) {
+    int capacity = s->capacity[d] ? 2*s->capacity[d] : 16;
+    split_record *record = (split_record *) realloc(s->record[d], capacity * sizeof(split_record));
+    if (!record) {
+      fprintf(stderr, "Error: malloc failed\n");
+      clWaitForEvents(1, &event);
+      clReleaseEvent(event);
+      s->lost = 1;
+      return;
+    }
+    s->record[d] = record;
+    s->capacity[d] = capacity;
+  }
+  s->record[d][s->events[d]].event = event;
+  s->record[d][s->events[d]].phase = phase;
+  s->events[d]++;
+}
+
+int split_run(split *s, size_t length, size_t granularity, split_work work, void *user) {
+  double start = get_time();
+  int ok = 1;
+
+  if (granularity < 1)
+    granularity = 1;
+
+  // Range boundaries at the cumulative shares, rounded to whole blocks
+  size_t blocks = (length + granularity - 1) / granularity;
+  double cumulative = 0;
+  s->offset[0] = 0;
+  for (int d = 0; d < s->active; ++d) {
+    cumulative += s->share[d];
+    size_t offset = (size_t) (cumulative * blocks + 0.5) * granularity;
+    if (offset > length || d == s->active - 1) offset = length;
+    if (offset < s->offset[d]) offset = s->offset[d];
+    s->offset[d+1] = offset;
+  }
+
+  // Enqueue everything before waiting for anything
+  s->lost = 0;
+  for (int d = 0; d < s->active; ++d) {
+    s->events[d] = 0;
+    size_t count = s->offset[d+1] - s->offset[d];
+    if (ok && count)
+      ok = work(s, d, s->offset[d], count, user);
+    clFlush(s->queue[d]);
+  }
+
+  for (int d = 0; d < s->active; ++d) {
+    clFinish(s->queue[d]);
+
+    // Device time from the first command to the last, the clocks of devices differ
+    cl_ulong first = 0, last = 0;
+    for (int e = 0; e < s->events[d]; ++e) {
+      cl_ulong t0 = 0, t1 = 0;
+      clGetEventProfilingInfo(s->record[d][e].event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t0, NULL);
+      clGetEventProfilingInfo(s->record[d][e].event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t1, NULL);
+      if (!e || t0 < first) first = t0;
+      if (t1 > last) last = t1;
+      retire(s, s->record[d][e].phase, s->record[d][e].event);
+    }
+    s->events[d] = 0;
+    s->busy[d] = last > first ? (last - first) * 1e-9 : 0;
+  }
+
+  // A single device keeps the rate of its kernel time
+  if (s->b && s->devices > 1)
+    bench_wall(s->b, get_time() - start);
+  if (!ok || s->lost)
+    return 0;
+
+  // Rebalance: move towards the measured throughput, damped against noise
+  for (int d = 0; d < s->active; ++d) {
+    size_t count = s->offset[d+1] - s->offset[d];
+    if (!count || s->busy[d] <= 0)
+      continue;
+    double rate = count / s->busy[d];
+    s->rate[d] = s->rate[d] > 0 ? 0.5 * (s->rate[d] + rate) : rate;
+  }
+  update_shares(s);
+  return 1;
+}
+
+void split_report(const split *s) {
+  for (int d = 0; d < s->active; ++d) {
+    size_t sz = 0;
+    clGetDeviceInfo(s->device[d], CL_DEVICE_NAME, 0, NULL, &sz);
+    char *name = (char *) malloc(sz + 1);
+    if (name) {
+      name[0] = 0;
+      clGetDeviceInfo(s->device[d], CL_DEVICE_NAME, sz, name, NULL);
+    }
+
+    size_t count = s->offset[d+1] - s->offset[d];
+    printf("device %d: %s, units %lu-%lu (%.1f%%), busy %.3f ms, %g units/s, next share %.1f%%\n",
+        d, name ? name : "?", (unsigned long) s->offset[d], (unsigned long) s->offset[d+1],
+        s->offset[s->active] ? 100.0 * count / s->offset[s->active] : 0.0, s->busy[d] * 1e3,
+        s->busy[d] > 0 ? count / s->busy[d] : 0.0, 100 * s->share[d]);
+    free(name);
+  }
+}
+
+void split_scaling_report(const double *rate, int count, const char *unit) {
+  printf("%-8s %14s %10s %12s\n", "devices", unit, "speedup", "efficiency");
+  for (int i = 0; i < count; ++i) {
+    double speedup = rate[0] > 0 ? rate[i] / rate[0] : 0;
+    printf("%-8d %14f %10.2f %11.1f%%\n", i + 1, rate[i], speedup, 100 * speedup / (i + 1));
+  }
+}
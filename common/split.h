@@ -0,0 +1,68 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+#define SPLIT_MAX_DEVICES 16
+
+#define SPLIT_USAGE "[--devices N|all]"
+
+typedef struct {
+  int devices;    // devices of the platform to split across, 0 for all
+} split_options;
+
+// Remove --devices from argv, 1 by default.
+void split_parse_args(int *argc, char **argv, split_options *opts);
+
+typedef struct {
+  cl_event event;
+  int phase;
+} split_record;
+
+typedef struct {
+  int devices;                          // devices with a queue
+  int active;                           // the first active devices take part in split_run
+  cl_device_id device[SPLIT_MAX_DEVICES];
+  cl_command_queue queue[SPLIT_MAX_DEVICES];
+
+  double rate[SPLIT_MAX_DEVICES];       // units per second of device time, 0 until measured
+  double share[SPLIT_MAX_DEVICES];      // fraction of the units of the next run
+  size_t offset[SPLIT_MAX_DEVICES+1];   // ranges of the last run
+  double busy[SPLIT_MAX_DEVICES];       // device time of the last run, seconds
+
+  int events[SPLIT_MAX_DEVICES], capacity[SPLIT_MAX_DEVICES];
+  split_record *record[SPLIT_MAX_DEVICES];  // events of the running commands, grown as needed
+  int lost;                             // an event could not be kept in the current run
+
+  bench *b;       // if set, the commands are recorded here, with several devices also the host time of runs
+} split;
+
+// Create a profiling queue on each of count devices of context, all active.
+int split_init(split *s, cl_context context, const cl_device_id *devices, int count);
+void split_release(split *s);
+
+// Let the first count devices take part in the next runs.
+void split_use(split *s, int count);
+
+// Enqueue the commands for units [offset, offset+count) on the queue of
+// device d, recording their events with split_event. Returns 0 on failure.
+typedef int (*split_work)(split *s, int d, size_t offset, size_t count, void *user);
+
+// Record event of device d in phase, to be retired when all devices are done.
+void split_event(split *s, int d, int phase, cl_event event);
+
+// Split length units into one contiguous range per active device, in
+// multiples of granularity and proportional to the shares, and run work on
+// all devices at once. The shares start from device_score, then follow the
+// throughput measured over the device time of every run.
+int split_run(split *s, size_t length, size_t granularity, split_work work, void *user);
+
+// Range, device time and throughput of every device in the last run.
+void split_report(const split *s);
+
+// Speedup and efficiency of rate[i], the rate with i+1 devices, over one.
+void split_scaling_report(const double *rate, int count, const char *unit);
+
+#endif /* SPLIT_H */
@@ -0,0 +1,108 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <staging.h>
+
+int staging_init(staging *s, cl_context context, cl_command_queue queue) {
+  memset(s, 0, sizeof(staging));
+  s->context = context;
+  s->queue = queue;
+  return 1;
+}
+
+static void release_block(staging *s, staging_block *block) {
+  if (block->mem) {
+    clEnqueueUnmapMemObject(s->queue, block->mem, block->ptr, 0, NULL, NULL);
+    clFinish(s->queue);
+    clReleaseMemObject(block->mem);
+    s->pinned -= block->size;
+  } else {
+    free(block->ptr);
+  }
+  memset(block, 0, sizeof(staging_block));
+}
+
+void staging_release(staging *s) {
+  for (int i = 0; i < s->blocks; ++i)
+    release_block(s, &s->block[i]);
+  free(s->block);
+  memset(s, 0, sizeof(staging));
+}
+
+// Map a new buffer of size bytes, 0 on failure
+static int pin(staging *s, staging_block *block, size_t size) {
+  cl_int status;
+
+  block->mem = clCreateBuffer(s->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &status);
+  if (status != CL_SUCCESS) {
+    block->mem = NULL;
+    return 0;
+  }
+
+  block->ptr = clEnqueueMapBuffer(s->queue, block->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size,
+      0, NULL, NULL, &status);
+  if (status != CL_SUCCESS) {
+    clReleaseMemObject(block->mem);
+    block->mem = NULL;
+    block->ptr = NULL;
+    return 0;
+  }
+  s->pinned += size;
+  return 1;
+}
+
+void *staging_alloc(staging *s, size_t size) {
+  if (!size)
+    return NULL;
+
+  for (int i = 0; i < s->blocks; ++i) {
+    staging_block *block = &s->block[i];
+    if (!block->used && block->size >= size && block->size / 2 <= size) {
+      block->used = 1;
+      return block->ptr;
+    }
+  }
+
+  if (s->blocks == s->capacity) {
+    int capacity = s->capacity ? 2*s->capacity : 8;
+    staging_block *blocks = (staging_block *) realloc(s->block, capacity * sizeof(staging_block));
+    if (!blocks) {
+      fprintf(stderr, "Error: malloc failed\n");
+      return NULL;
+    }
+    s->block = blocks;
+    s->capacity = capacity;
+  }
+
+  staging_block *block = &s->block[s->blocks];
+  memset(block, 0, sizeof(staging_block));
+  if (!pin(s, block, size)) {
+    fprintf(stderr, "Warning: could not map %lu bytes of pinned memory, using pageable memory\n",
+        (unsigned long) size);
+    block->ptr = malloc(size);
+    if (!block->ptr) {
+      fprintf(stderr, "Error: malloc failed\n");
+      return NULL;
+    }
+  }
+  block->size = size;
+  block->used = 1;
+  s->blocks++;
+  return block->ptr;
+}
+
+void staging_free(staging *s, void *ptr) {
+  for (int i = 0; i < s->blocks; ++i) {
+    if (s->block[i].ptr == ptr) {
+      s->block[i].used = 0;
+      return;
+    }
+  }
+}
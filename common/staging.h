@@ -0,0 +1,36 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <CL/cl.h>
+
+// Host memory of a buffer with CL_MEM_ALLOC_HOST_PTR, mapped for its lifetime
+typedef struct {
+  cl_mem mem;       // NULL if the memory fell back to malloc
+  void *ptr;
+  size_t size;
+  int used;
+} staging_block;
+
+typedef struct {
+  cl_context context;
+  cl_command_queue queue;
+
+  int blocks, capacity;
+  staging_block *block;
+
+  size_t pinned;    // bytes of mapped buffers
+} staging;
+
+int staging_init(staging *s, cl_context context, cl_command_queue queue);
+
+// Unmap and release all blocks, allocated ones included.
+void staging_release(staging *s);
+
+// Host memory of size bytes that the runtime transfers from and to without
+// an intermediate copy: the mapping of a CL_MEM_ALLOC_HOST_PTR buffer, which
+// drivers back with page-locked memory. Freed blocks of up to twice the size
+// are reused. Falls back to malloc if no buffer can be mapped, NULL on failure.
+void *staging_alloc(staging *s, size_t size);
+void staging_free(staging *s, void *ptr);
+
+#endif /* STAGING_H */
@@ -0,0 +1,339 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#else
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <utils.h>
+#include <bench.h>
+#include <hostref.h>
+#include <stream.h>
+
+#define MB (1024.0*1024.0)
+
+void stream_parse_args(int *argc, char **argv, stream_options *opts) {
+  opts->input  = NULL;
+  opts->output = NULL;
+  opts->budget = 256 << 20;
+
+  int n = 1;
+  for (int i = 1; i < *argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = (i+1 < *argc) ? argv[i+1] : NULL;
+
+    if (!strcmp(arg, "--stream") && val && i+2 < *argc) {
+      opts->input = val;
+      opts->output = argv[i+2];
+      i += 2;
+      continue;
+    }
+
+    if (!strcmp(arg, "--budget") && val) {
+      double budget = atof(val);
+      opts->budget = budget > 0 ? (size_t) (budget * MB) : 0;
+    } else {
+      argv[n++] = argv[i];
+      continue;
+    }
+    ++i;
+  }
+  *argc = n;
+}
+
+int stream_open(stream *s, const stream_options *opts, cl_command_queue queue, size_t *width, size_t *height) {
+  memset(s, 0, sizeof(stream));
+  s->opts = opts;
+  s->queue = queue;
+
+  s->in = open_image(opts->input, &s->width, &s->height);
+  if (!s->in)
+    return 0;
+  s->data = (long long) ftell64(s->in);
+
+  *width = s->width;
+  *height = s->height;
+  return 1;
+}
+
+// Input rows of a band of rows output rows
+static size_t band_input(const stream *s, size_t rows) {
+  size_t in_rows = (size_t) ceil(rows * s->scale) + 2*s->halo;
+  return in_rows < s->height ? in_rows : s->height;
+}
+
+static size_t host_size(const stream *s, size_t rows) {
+  return STREAM_SLOTS * (band_input(s, rows) * s->width + rows * s->out_width * sizeof(float)) + s->out_width;
+}
+
+static size_t device_size(const stream *s, size_t rows, size_t device_in, size_t device_out) {
+  return band_input(s, rows) * device_in + rows * device_out;
+}
+
+int stream_plan(stream *s, size_t out_width, size_t out_height, double scale, int halo,
+    size_t device_in, size_t device_out, size_t max_rows) {
+  s->out_width = out_width;
+  s->out_height = out_height;
+  s->scale = scale;
+  s->halo = halo;
+
+  // Memory grows with the band, find the largest that fits
+  size_t budget = s->opts->budget;
+  size_t lo = 0, hi = out_height;
+  while (lo < hi) {
+    size_t rows = (lo + hi + 1) / 2;
+    if (host_size(s, rows) <= budget && device_size(s, rows, device_in, device_out) <= budget
+        && band_input(s, rows) <= max_rows && rows <= max_rows)
+      lo = rows;
+    else
+      hi = rows - 1;
+  }
+  if (lo == 0) {
+    fprintf(stderr, "Error: a band of one row needs %.2f MB of host and %.2f MB of device memory, budget %.2f MB\n",
+        host_size(s, 1) / MB, device_size(s, 1, device_in, device_out) / MB, budget / MB);
+    return 0;
+  }
+
+  s->band = lo;
+  s->in_rows = band_input(s, lo);
+  s->bands = (out_height + lo - 1) / lo;
+  s->host_size = host_size(s, lo);
+  s->device_size = device_size(s, lo, device_in, device_out);
+
+  for (int i = 0; i < STREAM_SLOTS; ++i) {
+    s->slot[i].slot = i;
+    s->slot[i].in = (unsigned char *) malloc(s->in_rows * s->width);
+    s->slot[i].out = (float *) malloc(s->band * s->out_width * sizeof(float));
+    if (!s->slot[i].in || !s->slot[i].out) {
+      fprintf(stderr, "Error: malloc failed\n");
+      return 0;
+    }
+  }
+  s->row = (unsigned char *) malloc(s->out_width);
+  if (!s->row) {
+    fprintf(stderr, "Error: malloc failed\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Wait for the commands of band
+static int retire(stream *s, stream_band *band) {
+  int ok = 1;
+  for (int e = 0; e < band->events; ++e) {
+    if (s->b) {
+      bench_event(s->b, band->phase[e], band->event[e]);
+      continue;
+    }
+    if (clWaitForEvents(1, &band->event[e]) != CL_SUCCESS)
+      ok = 0;
+    clReleaseEvent(band->event[e]);
+  }
+  band->events = 0;
+  return ok;
+}
+
+void stream_close(stream *s) {
+  if (s->queue)
+    clFinish(s->queue);
+  for (int i = 0; i < STREAM_SLOTS; ++i) {
+    for (int e = 0; e < s->slot[i].events; ++e)
+      clReleaseEvent(s->slot[i].event[e]);
+    free(s->slot[i].in);
+    free(s->slot[i].out);
+  }
+  free(s->row);
+  if (s->in)
+    fclose(s->in);
+  memset(s, 0, sizeof(stream));
+}
+
+void stream_event(stream_band *band, int phase, cl_event event) {
+  // No room left, wait for the command here so that it has finished by the
+  // time the band is retired
+  if (band->events == STREAM_MAX_EVENTS) {
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+    return;
+  }
+  band->phase[band->events] = phase;
+  band->event[band->events++] = event;
+}
+
+static int read_band(stream *s, stream_band *band) {
+  double start = get_time();
+  int ok = !fseek64(s->in, s->data + (long long) band->in_y * s->width, SEEK_SET)
+    && fread(band->in, 1, band->in_rows * s->width, s->in) == band->in_rows * s->width;
+  if (!ok)
+    fprintf(stderr, "Error: could not read rows %lu to %lu of %s\n", (unsigned long) band->in_y,
+        (unsigned long) (band->in_y + band->in_rows), s->opts->input);
+  s->read += get_time() - start;
+  return ok;
+}
+
+static int write_band(stream *s, const stream_band *band, FILE *out) {
+  double start = get_time();
+  int ok = 1;
+  for (size_t y = 0; ok && y < band->rows; ++y) {
+    const float *row = band->out + y * s->out_width;
+    for (size_t x = 0; x < s->out_width; ++x) {
+      float v = row[x];
+      s->row[x] = v <= 0 ? 0 : (v >= 255 ? 255 : (unsigned char) (v + 0.5f));
+    }
+    ok = fwrite(s->row, 1, s->out_width, out) == s->out_width;
+  }
+  if (!ok)
+    fprintf(stderr, "Error: could not write %s\n", s->opts->output);
+  s->write += get_time() - start;
+  return ok;
+}
+
+int stream_run(stream *s, stream_enqueue enqueue, void *user) {
+  double start = get_time();
+  s->read = s->write = 0;
+
+  FILE *out = fopen(s->opts->output, "wb");
+  if (!out || !write_pgm_header(out, s->out_width, s->out_height)) {
+    fprintf(stderr, "Error: could not open %s\n", s->opts->output);
+    if (out) fclose(out);
+    return 0;
+  }
+
+  int ok = 1;
+  for (size_t k = 0; k <= s->bands; ++k) {
+    // Process band k while band k-1 is written and band k+1 read
+    if (ok && k < s->bands) {
+      stream_band *band = &s->slot[k % STREAM_SLOTS];
+      band->index = k;
+      band->y = k * s->band;
+      band->rows = (s->out_height - band->y < s->band) ? s->out_height - band->y : s->band;
+
+      // Bands keep the same number of input rows, the last ones move up
+      long long in_y = (long long) floor(band->y * s->scale) - s->halo;
+      long long last = (long long) (s->height - s->in_rows);
+      band->in_y = (size_t) (in_y < 0 ? 0 : (in_y > last ? last : in_y));
+      band->in_rows = s->in_rows;
+
+      ok = read_band(s, band);
+      if (ok && !enqueue(s->queue, band, user)) {
+        fprintf(stderr, "Error: could not enqueue band %lu\n", (unsigned long) k);
+        ok = 0;
+      }
+      if (ok && clFlush(s->queue) != CL_SUCCESS)
+        ok = 0;
+    }
+
+    if (k > 0) {
+      stream_band *band = &s->slot[(k-1) % STREAM_SLOTS];
+      ok &= retire(s, band);
+      if (ok)
+        ok = write_band(s, band, out);
+    }
+  }
+
+  for (int i = 0; i < STREAM_SLOTS; ++i)
+    ok &= retire(s, &s->slot[i]);
+
+  if (fclose(out)) {
+    fprintf(stderr, "Error: could not write %s\n", s->opts->output);
+    ok = 0;
+  }
+
+  s->elapsed = get_time() - start;
+  if (s->b)
+    bench_wall(s->b, s->elapsed);
+  return ok;
+}
+
+// Input rows needed for output rows [y0, y1)
+static void window_input(const stream *s, size_t y0, size_t y1, size_t *in_y, size_t *in_rows) {
+  long long first = (long long) floor(y0 * s->scale) - s->halo;
+  long long end = (long long) ceil(y1 * s->scale) + s->halo;
+  if (first < 0) first = 0;
+  if (end > (long long) s->height) end = (long long) s->height;
+  *in_y = (size_t) first;
+  *in_rows = (size_t) (end - first);
+}
+
+long long stream_check(stream *s, stream_reference reference, void *user) {
+  // Rows on both sides of a boundary whose halo reaches into the other band
+  size_t reach = s->halo + 1;
+  size_t max_in_rows = (size_t) ceil(2*reach * s->scale) + 2*s->halo + 1;
+  if (max_in_rows > s->height)
+    max_in_rows = s->height;
+
+  size_t out_width, out_height;
+  FILE *out = open_image(s->opts->output, &out_width, &out_height);
+  if (!out)
+    return -1;
+  long long data = (long long) ftell64(out);
+
+  unsigned char *in = (unsigned char *) malloc(max_in_rows * s->width);
+  unsigned char *bytes = (unsigned char *) malloc(2*reach * s->out_width);
+  float *ref = (float *) malloc(2*reach * s->out_width * sizeof(float));
+  float *got = (float *) malloc(2*reach * s->out_width * sizeof(float));
+  long long mismatches = 0;
+  if (!in || !bytes || !ref || !got || out_width != s->out_width || out_height != s->out_height) {
+    fprintf(stderr, "Error: could not check %s\n", s->opts->output);
+    mismatches = -1;
+  }
+
+  // Boundaries at the top, between the bands and at the bottom, rows are checked once
+  size_t checked = 0;
+  for (size_t k = 0; mismatches >= 0 && k <= s->bands; ++k) {
+    size_t boundary = k < s->bands ? k * s->band : s->out_height;
+    size_t y0 = boundary > checked + reach ? boundary - reach : checked;
+    size_t y1 = boundary + reach < s->out_height ? boundary + reach : s->out_height;
+    if (y0 >= y1)
+      continue;
+    checked = y1;
+    size_t in_y, in_rows, rows = y1 - y0;
+    window_input(s, y0, y1, &in_y, &in_rows);
+
+    int ok = !fseek64(s->in, s->data + (long long) in_y * s->width, SEEK_SET)
+      && fread(in, 1, in_rows * s->width, s->in) == in_rows * s->width
+      && !fseek64(out, data + (long long) y0 * s->out_width, SEEK_SET)
+      && fread(bytes, 1, rows * s->out_width, out) == rows * s->out_width
+      && reference(in, in_y, in_rows, ref, y0, rows, user);
+    if (!ok) {
+      fprintf(stderr, "Error: could not check rows %lu to %lu\n", (unsigned long) y0, (unsigned long) y1);
+      mismatches = -1;
+      break;
+    }
+
+    for (size_t i = 0; i < rows * s->out_width; ++i) {
+      got[i] = bytes[i];
+      ref[i] = ref[i] <= 0 ? 0 : (ref[i] >= 255 ? 255 : ref[i]);
+    }
+    size_t wrong = compare_float(ref, got, rows * s->out_width, 1e-4f, 0.51f);
+    if (wrong)
+      fprintf(stderr, "in rows %lu to %lu\n", (unsigned long) y0, (unsigned long) y1);
+    mismatches += (long long) wrong;
+  }
+
+  free(in);
+  free(bytes);
+  free(ref);
+  free(got);
+  fclose(out);
+  return mismatches;
+}
+
+void stream_report(const stream *s) {
+  printf("stream: %lux%lu -> %lux%lu in %lu bands of %lu rows, %lu input rows\n",
+      (unsigned long) s->width, (unsigned long) s->height,
+      (unsigned long) s->out_width, (unsigned long) s->out_height,
+      (unsigned long) s->bands, (unsigned long) s->band, (unsigned long) s->in_rows);
+  printf("memory [MB]: host %.2f, device %.2f, budget %.2f, peak RSS %.2f\n",
+      s->host_size / MB, s->device_size / MB, s->opts->budget / MB, peak_rss() / MB);
+  if (s->elapsed > 0)
+    printf("time [s]: read %.3f, write %.3f, total %.3f; %.2f MPixel/s\n", s->read, s->write, s->elapsed,
+        s->out_width * s->out_height * 1e-6 / s->elapsed);
+}
@@ -0,0 +1,103 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Bands in flight: one is processed while the next is read and the previous
+// one written
+#define STREAM_SLOTS 2
+
+// Commands per band whose events are kept until the band is written
+#define STREAM_MAX_EVENTS 8
+
+#define STREAM_USAGE "[--stream IN OUT] [--budget MB]"
+
+typedef struct {
+  const char *input;    // .pgm or square raw .dat, NULL disables streaming
+  const char *output;   // 8-bit binary PGM
+  size_t budget;        // bytes of host and of device memory, each
+} stream_options;
+
+// Remove --stream and --budget from argv.
+void stream_parse_args(int *argc, char **argv, stream_options *opts);
+
+typedef struct {
+  size_t index;
+  size_t y, rows;         // output rows of the band
+  size_t in_y, in_rows;   // input rows of the band: the output rows plus halo
+  int slot;               // host memory of the band, device memory may be shared
+  unsigned char *in;      // in_rows x width bytes
+  float *out;             // rows x out_width floats
+
+  int events;
+  cl_event event[STREAM_MAX_EVENTS];
+  int phase[STREAM_MAX_EVENTS];
+} stream_band;
+
+// Enqueue the upload of band->in, the kernels and the download of the rows
+// of the band into band->out on queue, without waiting. Events are handed
+// over with stream_event. Returns 0 on failure.
+typedef int (*stream_enqueue)(cl_command_queue queue, stream_band *band, void *user);
+
+typedef struct {
+  const stream_options *opts;
+  cl_command_queue queue;
+  FILE *in;
+  long long data;             // file offset of the first pixel
+
+  size_t width, height;       // input
+  size_t out_width, out_height;
+  double scale;               // input rows per output row
+  int halo;                   // input rows beyond the band on both sides
+
+  size_t band;                // output rows per band
+  size_t in_rows;             // input rows per band
+  size_t bands;
+  size_t host_size, device_size;
+
+  stream_band slot[STREAM_SLOTS];
+  unsigned char *row;         // output row being written
+
+  bench *b;                   // if set, events and the wall time are recorded here
+  double read, write, elapsed; // seconds of the last run
+} stream;
+
+// Open opts->input and read its size, nothing else is read.
+int stream_open(stream *s, const stream_options *opts, cl_command_queue queue, size_t *width, size_t *height);
+
+// Choose the largest bands whose host memory and device memory fit into the
+// budget. The output is out_width x out_height, output row y needs the input
+// rows from y scale - halo to (y + 1) scale + halo. The device needs
+// device_in bytes per input row and device_out bytes per output row of a
+// band, and at most max_rows input and output rows. Allocates the host memory.
+int stream_plan(stream *s, size_t out_width, size_t out_height, double scale, int halo,
+    size_t device_in, size_t device_out, size_t max_rows);
+
+void stream_close(stream *s);
+
+// Keep event of a command of band, released when the band is written.
+void stream_event(stream_band *band, int phase, cl_event event);
+
+// Read the input band by band, process every band and write the output. File
+// I/O of the neighbouring bands overlaps the processing of a band.
+int stream_run(stream *s, stream_enqueue enqueue, void *user);
+
+// Compute output rows [y, y+rows) on the host into out, rows x out_width
+// floats, from the input rows [in_y, in_y+in_rows). These cover the halo of
+// the output rows or reach the edge of the image. Returns 0 on failure.
+typedef int (*stream_reference)(const unsigned char *in, size_t in_y, size_t in_rows,
+    float *out, size_t y, size_t rows, void *user);
+
+// Compare the output rows around every band boundary and at the top and the
+// bottom of the written output against reference, within the rounding to 8
+// bits. Returns the number of mismatching pixels, or -1 on failure.
+long long stream_check(stream *s, stream_reference reference, void *user);
+
+// Bands, memory, time spent on file I/O, peak RSS and throughput of the last run.
+void stream_report(const stream *s);
+
+#endif /* STREAM_H */
@@ -0,0 +1,263 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <tune.h>
+
+//
+// Tuning database
+//
+// One configuration per line:
+//   <device hash> <key> <dim> <local0> <local1> <local2> <time> <options>
+// The database is stored in OCL_TUNE_DB (default: tune.db in the working
+// directory).
+//
+
+#define TUNE_REPS 3
+#define TUNE_LINE 1024
+
+static const char *tune_db_path(void) {
+  const char *path = getenv("OCL_TUNE_DB");
+  return (path && *path) ? path : "tune.db";
+}
+
+static int parse_line(const char *line, cl_ulong *hash, char *key, size_t key_size, tune_config *config) {
+  unsigned long long h;
+  unsigned long l0, l1, l2;
+  int n;
+  char fmt[64];
+
+  snprintf(fmt, sizeof(fmt), "%%llx %%%ds %%u %%lu %%lu %%lu %%lf %%n", (int) key_size - 1);
+  if (sscanf(line, fmt, &h, key, &config->dim, &l0, &l1, &l2, &config->time, &n) != 7)
+    return 0;
+
+  *hash = h;
+  config->local[0] = l0;
+  config->local[1] = l1;
+  config->local[2] = l2;
+
+  // Remaining part of the line are the build options
+  strncpy(config->options, line + n, TUNE_MAX_OPTIONS-1);
+  config->options[TUNE_MAX_OPTIONS-1] = '\0';
+  config->options[strcspn(config->options, "\r\n")] = '\0';
+  return 1;
+}
+
+static void format_line(char *line, size_t size, cl_ulong hash, const char *key, const tune_config *config) {
+  snprintf(line, size, "%016llx %s %u %lu %lu %lu %e %s\n", (unsigned long long) hash, key, config->dim,
+      (unsigned long) config->local[0], (unsigned long) config->local[1],
+      (unsigned long) config->local[2], config->time, config->options);
+}
+
+int tune_lookup(cl_device_id device, const char *key, tune_config *config) {
+  FILE *fp = fopen(tune_db_path(), "r");
+  if (!fp)
+    return 0;
+
+  cl_ulong hash = device_hash(device);
+  char line[TUNE_LINE], line_key[TUNE_LINE];
+  int found = 0;
+
+  while (!found && fgets(line, sizeof(line), fp)) {
+    cl_ulong line_hash;
+    tune_config c;
+    if (!parse_line(line, &line_hash, line_key, sizeof(line_key), &c))
+      continue;
+
+    if (line_hash == hash && !strcmp(line_key, key)) {
+      *config = c;
+      found = 1;
+    }
+  }
+
+  fclose(fp);
+  return found;
+}
+
+int tune_store(cl_device_id device, const char *key, const tune_config *config) {
+  const char *path = tune_db_path();
+  cl_ulong hash = device_hash(device);
+
+  char *tmp = (char *) malloc(strlen(path) + 5);
+  if (!tmp)
+    return 0;
+  sprintf(tmp, "%s.tmp", path);
+
+  FILE *out = fopen(tmp, "w");
+  if (!out) {
+    fprintf(stderr, "Error: could not write tuning database %s\n", tmp);
+    free(tmp);
+    return 0;
+  }
+
+  // Copy all other entries, then append the new one
+  FILE *in = fopen(path, "r");
+  if (in) {
+    char line[TUNE_LINE], line_key[TUNE_LINE];
+    while (fgets(line, sizeof(line), in)) {
+      cl_ulong line_hash;
+      tune_config c;
+      if (parse_line(line, &line_hash, line_key, sizeof(line_key), &c)
+          && line_hash == hash && !strcmp(line_key, key))
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+
+  char line[TUNE_LINE];
+  format_line(line, sizeof(line), hash, key, config);
+  fputs(line, out);
+  fclose(out);
+
+  remove(path);
+  int ok = !rename(tmp, path);
+  free(tmp);
+  return ok;
+}
+
+//
+// Search
+//
+
+// Minimal kernel time over TUNE_REPS runs after one warm-up, negative on failure.
+static double measure(cl_command_queue queue, cl_kernel kernel, cl_uint dim,
+    const size_t *global, const size_t *local) {
+  double best = -1;
+
+  for (int rep = 0; rep <= TUNE_REPS; ++rep) {
+    cl_event event;
+    cl_ulong start, end;
+
+    if (clEnqueueNDRangeKernel(queue, kernel, dim, NULL, global, local, 0, NULL, &event) != CL_SUCCESS)
+      return -1;
+
+    cl_int status = clWaitForEvents(1, &event);
+    if (status == CL_SUCCESS)
+      status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    if (status == CL_SUCCESS)
+      status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+
+    if (status != CL_SUCCESS)
+      return -1;
+
+    double t = (end - start) * 1e-9;
+    if (rep > 0 && (best < 0 || t < best))
+      best = t;
+  }
+  return best;
+}
+
+static void try_candidate(cl_command_queue queue, cl_kernel kernel, const tune_problem *problem,
+    size_t wg_max, tune_config *config, tune_config *best) {
+  size_t global[3] = {1, 1, 1};
+
+  if (!problem->setup(kernel, config, global, problem->user))
+    return;
+
+  size_t total = 1;
+  for (cl_uint d = 0; d < config->dim; ++d) {
+    if (global[d] % config->local[d])
+      return;
+    total *= config->local[d];
+  }
+  if (total > wg_max || total < problem->min_local)
+    return;
+
+  double t = measure(queue, kernel, config->dim, global, config->local);
+  if (t < 0)
+    return;
+
+  fprintf(stderr, "  local {%lu, %lu, %lu} %-40s %f s\n", (unsigned long) config->local[0],
+      (unsigned long) config->local[1], (unsigned long) config->local[2], config->options, t);
+
+  if (best->time <= 0 || t < best->time) {
+    *best = *config;
+    best->time = t;
+  }
+}
+
+int tune_kernel(cl_context context, cl_device_id device, cl_command_queue queue,
+    const tune_problem *problem, const char *key, tune_config *best) {
+  cl_int status;
+
+  size_t max_items[3] = {1, 1, 1};
+  size_t dev_wg_max;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_items), max_items, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &dev_wg_max, NULL);
+
+  const char *no_variants[] = {"", NULL};
+  const char **variants = problem->variants ? problem->variants : no_variants;
+
+  memset(best, 0, sizeof(tune_config));
+  fprintf(stderr, "Tuning %s (%s):\n", problem->kernel, key);
+
+  for (const char **v = variants; *v; ++v) {
+    char options[1024];
+    snprintf(options, sizeof(options), "%s %s", problem->options ? problem->options : "", *v);
+
+    cl_program program;
+    if (!create_program(problem->source, &program, context, device, options)) {
+      if (program) clReleaseProgram(program);
+      continue;
+    }
+
+    cl_kernel kernel = clCreateKernel(program, problem->kernel, &status);
+    if (status != CL_SUCCESS) {
+      clReleaseProgram(program);
+      continue;
+    }
+
+    size_t wg_max;
+    status = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &wg_max, NULL);
+    if (status != CL_SUCCESS || wg_max > dev_wg_max)
+      wg_max = dev_wg_max;
+
+    tune_config config;
+    memset(&config, 0, sizeof(tune_config));
+    config.dim = problem->dim;
+    config.local[0] = config.local[1] = config.local[2] = 1;
+    strncpy(config.options, *v, TUNE_MAX_OPTIONS-1);
+
+    if (problem->fixed_local) {
+      try_candidate(queue, kernel, problem, wg_max, &config, best);
+    } else {
+      // All powers of two within the device limits
+      size_t lim[3];
+      for (int d = 0; d < 3; ++d)
+        lim[d] = ((cl_uint) d < problem->dim) ? max_items[d] : 1;
+
+      for (size_t l2 = 1; l2 <= lim[2] && l2 <= wg_max; l2 *= 2)
+        for (size_t l1 = 1; l1 <= lim[1] && l1*l2 <= wg_max; l1 *= 2)
+          for (size_t l0 = 1; l0 <= lim[0] && l0*l1*l2 <= wg_max; l0 *= 2) {
+            config.local[0] = l0;
+            config.local[1] = l1;
+            config.local[2] = l2;
+            try_candidate(queue, kernel, problem, wg_max, &config, best);
+          }
+    }
+
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+  }
+
+  if (best->time <= 0) {
+    fprintf(stderr, "Error: no valid configuration found for %s\n", problem->kernel);
+    return 0;
+  }
+
+  fprintf(stderr, "Best: local {%lu, %lu, %lu} %s %f s\n", (unsigned long) best->local[0],
+      (unsigned long) best->local[1], (unsigned long) best->local[2], best->options, best->time);
+
+  if (!tune_store(device, key, best))
+    fprintf(stderr, "Warning: could not store tuning result for %s\n", key);
+
+  return 1;
+}
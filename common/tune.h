@@ -0,0 +1,41 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <CL/cl.h>
+
+#define TUNE_MAX_OPTIONS 256
+
+typedef struct {
+  cl_uint dim;
+  size_t local[3];
+  char options[TUNE_MAX_OPTIONS]; // extra build options, e.g. "-DLOCAL_BUF_SIZE=512"
+  double time;                    // best kernel time in seconds, 0 if not measured
+} tune_config;
+
+// Set the kernel arguments for a candidate configuration and compute the
+// global size. Problems with fixed_local set also have to fill in
+// config->local. Return 0 to skip the candidate.
+typedef int (*tune_setup)(cl_kernel kernel, tune_config *config, size_t *global, void *user);
+
+typedef struct {
+  const char *source;     // kernel source file
+  const char *kernel;     // kernel name
+  const char *options;    // build options shared by all candidates
+  const char **variants;  // NULL-terminated list of extra build options, may be NULL
+  cl_uint dim;
+  size_t min_local;       // smallest work-group size to try
+  int fixed_local;        // local size is derived from the build options by setup
+  tune_setup setup;
+  void *user;
+} tune_problem;
+
+// Search local sizes and build option variants for the fastest configuration,
+// and store it in the tuning database under key.
+int tune_kernel(cl_context context, cl_device_id device, cl_command_queue queue,
+    const tune_problem *problem, const char *key, tune_config *best);
+
+// Look up a configuration for device and key, returns 0 if there is none.
+int tune_lookup(cl_device_id device, const char *key, tune_config *config);
+int tune_store(cl_device_id device, const char *key, const tune_config *config);
+
+#endif /* TUNE_H */
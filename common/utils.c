@@ -1,9 +1,14 @@
 #define _CRT_SECURE_NO_DEPRECATE
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <float.h>
 #include <utils.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 
 /**
@@ -120,3 +125,107 @@ int  write_bmp(const char *name, float *data_in, size_t width, size_t height, in
 
   return 1;
 }
+
+unsigned char *tile_image(const unsigned char *data, size_t width, size_t height,
+    size_t new_width, size_t new_height) {
+  unsigned char *img = (unsigned char *) malloc(new_width*new_height);
+  if (!img) {
+    fprintf(stderr, "Error: malloc failed\n");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < new_height; ++i) {
+    const unsigned char *row = data + (i % height)*width;
+    for (size_t j = 0; j < new_width; ++j) {
+      img[i*new_width+j] = row[j % width];
+    }
+  }
+  return img;
+}
+
+// Skip whitespace and comments between the fields of a PGM header
+static int pgm_field(FILE *f, size_t *value) {
+  int c = fgetc(f);
+  while (c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+    if (c == '#')
+      while (c != '\n' && c != EOF) c = fgetc(f);
+    c = fgetc(f);
+  }
+  if (c < '0' || c > '9')
+    return 0;
+
+  *value = 0;
+  while (c >= '0' && c <= '9') {
+    *value = *value*10 + (c - '0');
+    c = fgetc(f);
+  }
+  // a single whitespace character ends the field
+  return 1;
+}
+
+FILE *open_image(const char *name, size_t *width, size_t *height) {
+  FILE *f = fopen(name, "rb");
+  if (!f) {
+    fprintf(stderr, "Error: could not open %s\n", name);
+    return NULL;
+  }
+
+  size_t w, h;
+  char magic[2] = {0, 0};
+  if (fread(magic, 1, 2, f) == 2 && magic[0] == 'P' && magic[1] == '5') {
+    size_t max;
+    if (!pgm_field(f, &w) || !pgm_field(f, &h) || !pgm_field(f, &max) || max > 255) {
+      fprintf(stderr, "Error: %s is not an 8-bit binary PGM\n", name);
+      fclose(f);
+      return NULL;
+    }
+  } else {
+    long long end = -1;
+    if (!fseek64(f, 0, SEEK_END))
+      end = (long long) ftell64(f);
+    if (end < 0 || fseek64(f, 0, SEEK_SET)) {
+      fprintf(stderr, "Error: could not get the size of %s: %s\n", name, strerror(errno));
+      fclose(f);
+      return NULL;
+    }
+    size_t size = (size_t) end;
+    w = (size_t) sqrt((double) size);
+    while (w*w < size) ++w;
+    if (w*w != size || !size) {
+      fprintf(stderr, "Error: raw image %s is not square\n", name);
+      fclose(f);
+      return NULL;
+    }
+    h = w;
+  }
+
+  *width = w;
+  *height = h;
+  return f;
+}
+
+int write_pgm_header(FILE *f, size_t width, size_t height) {
+  return fprintf(f, "P5\n%lu %lu\n255\n", (unsigned long) width, (unsigned long) height) > 0;
+}
+
+int read_image(const char *name, unsigned char **data, size_t *width, size_t *height) {
+  size_t w, h;
+  FILE *f = open_image(name, &w, &h);
+  if (!f)
+    return 0;
+
+  size_t size = w*h;
+  unsigned char *img = (unsigned char *) malloc(size);
+  if (!img || fread(img, 1, size, f) != size) {
+    fprintf(stderr, "Error: could not read %s\n", name);
+    free(img);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+
+  *data = img;
+  *width = w;
+  *height = h;
+  return 1;
+}
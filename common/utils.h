@@ -6,6 +6,7 @@
 #else
 #include <stddef.h>
 #endif
+#include <stdio.h>
 
 enum {
   NORMAL=0,
@@ -15,4 +16,28 @@ enum {
 
 int write_bmp(const char *name, float *data, size_t width, size_t height, int filters);
 
+// Repeat an 8-bit image to fill new_width x new_height, returns a new buffer.
+unsigned char *tile_image(const unsigned char *data, size_t width, size_t height,
+    size_t new_width, size_t new_height);
+
+// Read an 8-bit grayscale image: binary PGM (P5) or raw .dat, which must be
+// square. Returns a new buffer in *data.
+int read_image(const char *name, unsigned char **data, size_t *width, size_t *height);
+
+// Open an image like read_image without reading it, the file is positioned
+// at the first pixel. Returns NULL on failure.
+FILE *open_image(const char *name, size_t *width, size_t *height);
+
+// Header of a binary 8-bit PGM, followed by width x height bytes.
+int write_pgm_header(FILE *f, size_t width, size_t height);
+
+// Seek and tell beyond 2 GB
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
 #endif /* UTILS_H */
@@ -1,4 +1,7 @@
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L   // setenv
+#endif
 #include <CL/cl.h>
 
 #include <fcntl.h>
@@ -13,31 +16,96 @@
 
 #include <ocllib.h>
 #include <utils.h>
+#include <bench.h>
+#include <hostref.h>
+#ifdef HAVE_CLFFT
 #include <clFFT.h>
+#endif
+
+#include "fftplan.h"
+#include "fftcache.h"
 
 #ifdef checkError
 #undef checkError
 #endif
 #define checkError(status, ...) _checkFFTError(__LINE__, __FILE__, status, __VA_ARGS__)
 
+enum {
+  ENGINE_NATIVE=0,    // Stockham kernels of fft.cl
+  ENGINE_CLFFT=1
+};
+
+static const char *engine_names[] = {"native", "clfft"};
+
+enum {
+  MODE_IMAGE=0,       // filter lena.dat with mask.dat
+  MODE_1D=1,
+  MODE_2D=2
+};
+
+static const char *mode_names[] = {"image", "1d", "2d"};
+
+enum {
+  MASK_DEVICE=0,      // mask the resident spectrum with apply_mask
+  MASK_HOST=1         // read the spectrum back and mask it on the host
+};
+
+static const char *site_names[] = {"device", "host"};
+
+enum {
+  LAYOUT_COMPLEX=0,   // complex input with zero imaginary parts
+  LAYOUT_REAL=1       // real input, half spectrum
+};
+
+static const char *layout_names[] = {"complex", "real"};
+
 static cl_platform_id platform;
 static cl_device_id device;
 static cl_context context;
 static cl_command_queue queue;
 
+static int engine;
+static int layout;
+static fft_cache plans;
+static fft_plan *plan;                  // owned by plans
+#ifdef HAVE_CLFFT
+static clfftPlanHandle *clfft_plan[2];  // forward and inverse of real transforms, owned by plans
+static int clfft_ready;
+#endif
+static cl_mem buffer_in, buffer_out, buffer_back;
+
 static cl_program program;
-static cl_kernel kernel;
-static cl_mem buffer_in_real, buffer_in_img, buffer_out_real, buffer_out_img;
+static cl_kernel kernel_mask, kernel_magnitude;
+static cl_mem buffer_mask, buffer_mag;
+static cl_float *image, *spectrum;
+
+// Release all cached plans
+static void drop_plans(void) {
+  fft_cache_clear(&plans);
+  plan = NULL;
+#ifdef HAVE_CLFFT
+  clfft_plan[0] = clfft_plan[1] = NULL;
+#endif
+}
 
 void teardown(int exit_status)
 {
-  if (buffer_in_real) clReleaseMemObject(buffer_in_real);
-  if (buffer_in_img) clReleaseMemObject(buffer_in_img);
-  if (buffer_out_real) clReleaseMemObject(buffer_out_real);
-  if (buffer_out_img) clReleaseMemObject(buffer_out_img);
-
-  if (kernel) clReleaseKernel(kernel);
+  if (buffer_in) clReleaseMemObject(buffer_in);
+  if (buffer_out) clReleaseMemObject(buffer_out);
+  if (buffer_back) clReleaseMemObject(buffer_back);
+  if (buffer_mask) clReleaseMemObject(buffer_mask);
+  if (buffer_mag) clReleaseMemObject(buffer_mag);
+  free(image);
+  free(spectrum);
+
+  if (kernel_mask) clReleaseKernel(kernel_mask);
+  if (kernel_magnitude) clReleaseKernel(kernel_magnitude);
   if (program) clReleaseProgram(program);
+
+  drop_plans();
+#ifdef HAVE_CLFFT
+  if (clfft_ready) clfftTeardown();
+#endif
   if (queue) clReleaseCommandQueue(queue);
   if (context) clReleaseContext(context);
 
@@ -46,6 +114,7 @@ void teardown(int exit_status)
 
 void print_fft_error(cl_int status) {
   switch (status) {
+#ifdef HAVE_CLFFT
     case CLFFT_BUGCHECK:
       fprintf(stderr,"CLFFT_BUGCHECK");
       break;
@@ -73,6 +142,7 @@ void print_fft_error(cl_int status) {
     case CLFFT_DEVICE_MISMATCH:
       fprintf(stderr,"CLFFT_DEVICE_MISMATCH");
       break;
+#endif
     default:
       print_error(status);
   }
@@ -95,28 +165,298 @@ void _checkFFTError(int line, const char *file, cl_int status, const char *msg,
   }
 }
 
-int main(int argc, char **argv) {
-  cl_int status;
+// Record event in b if set
+static void record(bench *b, int phase, cl_event event) {
+  if (b)
+    bench_event(b, phase, event);
+  else
+    clReleaseEvent(event);
+}
 
-  const char platform_name[] = "Intel";
+// Release a plan of the cache
+static void destroy_plan(const fft_key *key, void *p) {
+  if (key->engine == ENGINE_NATIVE)
+    fft_plan_release((fft_plan *) p);
+#ifdef HAVE_CLFFT
+  else
+    clfftDestroyPlan((clfftPlanHandle *) p);
+#endif
+  free(p);
+}
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
+#ifdef HAVE_CLFFT
+static clfftLayout clfft_layout(fft_layout layout) {
+  return layout == FFT_REAL ? CLFFT_REAL
+    : (layout == FFT_HERMITIAN ? CLFFT_HERMITIAN_INTERLEAVED : CLFFT_COMPLEX_INTERLEAVED);
+}
+
+// Bake the clFFT plan for key
+static clfftPlanHandle *bake_clfft_plan(const fft_key *key) {
+  clfftStatus fstatus;
+  clfftPlanHandle *handle = (clfftPlanHandle *) malloc(sizeof(clfftPlanHandle));
+  if (!handle) {
+    fprintf(stderr, "Error: malloc failed\n");
     teardown(-1);
   }
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+  size_t size[2] = {key->length[0], key->dims > 1 ? key->length[1] : 1};
+  size_t in_strides[2] = {key->in_stride[0], key->in_stride[1]};
+  size_t out_strides[2] = {key->out_stride[0], key->out_stride[1]};
+  clfftDim dim = key->dims > 1 ? CLFFT_2D : CLFFT_1D;
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "Error: could not create context");
+  fstatus = clfftCreateDefaultPlan(handle, context, dim, size);
+  checkError(fstatus, "Error: could not create plan");
 
-  print_device_info(device, 0);
+  fstatus = clfftSetPlanPrecision(*handle, key->precision == FFT_DOUBLE ? CLFFT_DOUBLE : CLFFT_SINGLE);
+  checkError(fstatus, "Error: could not set precision");
 
-  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
-  checkError(status, "Error: could not create command queue");
+  fstatus = clfftSetLayout(*handle, clfft_layout(key->in_layout), clfft_layout(key->out_layout));
+  checkError(fstatus, "Error: could not set layout");
+
+  fstatus = clfftSetResultLocation(*handle, key->in_place ? CLFFT_INPLACE : CLFFT_OUTOFPLACE);
+  checkError(fstatus, "Error: could not set result location");
+
+  fstatus = clfftSetPlanInStride(*handle, dim, in_strides);
+  checkError(fstatus, "Error: could not set strides");
+
+  fstatus = clfftSetPlanOutStride(*handle, dim, out_strides);
+  checkError(fstatus, "Error: could not set strides");
+
+  fstatus = clfftSetPlanBatchSize(*handle, key->batch);
+  checkError(fstatus, "Error: could not set batch size");
+
+  fstatus = clfftSetPlanDistance(*handle, key->in_dist, key->out_dist);
+  checkError(fstatus, "Error: could not set distance");
+
+  fstatus = clfftBakePlan(*handle, 1, &queue, NULL, NULL);
+  checkError(fstatus, "Error: could not bake plan");
+  return handle;
+}
+
+// The baked plan between the layouts, from the cache if possible
+static clfftPlanHandle *clfft_cached_plan(int dims, const size_t *length, size_t batch,
+    fft_layout in_layout, fft_layout out_layout) {
+  fft_key key;
+  fft_key_init(&key, ENGINE_CLFFT, context, dims, length, batch, in_layout, out_layout);
+
+  clfftPlanHandle *handle = (clfftPlanHandle *) fft_cache_find(&plans, &key);
+  if (!handle) {
+    handle = bake_clfft_plan(&key);
+    fft_cache_insert(&plans, &key, handle);
+  }
+  return handle;
+}
+#endif
+
+//
+// Plan batch transforms with the selected engine and layout: interleaved
+// complex data, or real data and the first length[0]/2+1 points of each row
+// of its spectrum. Plans are taken from the plan cache, only new ones are
+// built or baked.
+//
+static void setup_transform(int dims, const size_t *length, size_t batch) {
+  fft_layout in_layout = (layout == LAYOUT_REAL) ? FFT_REAL : FFT_COMPLEX;
+  fft_layout out_layout = (layout == LAYOUT_REAL) ? FFT_HERMITIAN : FFT_COMPLEX;
+
+  if (engine == ENGINE_NATIVE) {
+    fft_key key;
+    fft_key_init(&key, ENGINE_NATIVE, context, dims, length, batch, in_layout, out_layout);
+
+    plan = (fft_plan *) fft_cache_find(&plans, &key);
+    if (plan)
+      return;
+
+    plan = (fft_plan *) malloc(sizeof(fft_plan));
+    int ok = plan && ((layout == LAYOUT_REAL) ? fft_plan_init_real(plan, context, device, dims, length, batch)
+      : fft_plan_init(plan, context, device, dims, length, batch));
+    if (!ok) {
+      free(plan);
+      plan = NULL;
+      teardown(-1);
+    }
+    fft_cache_insert(&plans, &key, plan);
+    return;
+  }
+
+#ifdef HAVE_CLFFT
+  if (!clfft_ready) {
+    clfftSetupData fft_data;
+    clfftStatus fstatus;
+
+    // clFFT keeps the binaries of its kernels in CLFFT_CACHE_PATH; unless
+    // set, they go to the program cache so that later runs skip compiling
+    const char *dir = program_cache_dir();
+    if (dir && !getenv("CLFFT_CACHE_PATH")) {
+#ifdef _WIN32
+      _putenv_s("CLFFT_CACHE_PATH", dir);
+#else
+      setenv("CLFFT_CACHE_PATH", dir, 0);
+#endif
+    }
+
+    fstatus = clfftSetup(&fft_data);
+    checkError(fstatus, "Error: could not setup clFFT");
+    clfft_ready = 1;
+  }
+
+  clfft_plan[0] = clfft_cached_plan(dims, length, batch, in_layout, out_layout);
+  clfft_plan[1] = (layout == LAYOUT_REAL) ? clfft_cached_plan(dims, length, batch, out_layout, in_layout) : NULL;
+#else
+  (void) dims; (void) length; (void) batch;
+  (void) in_layout; (void) out_layout;
+  fprintf(stderr, "Error: fft was built without clFFT\n");
+  teardown(-1);
+#endif
+}
+
+static void print_transform(void) {
+  if (engine == ENGINE_NATIVE)
+    fft_plan_print(plan);
+  else
+    printf("fft: clFFT %s\n", layout_names[layout]);
+}
+
+// Device memory of the transform besides input and output
+static size_t scratch_size(void) {
+  size_t bytes = plan ? plan->scratch_size : 0;
+#ifdef HAVE_CLFFT
+  for (int i = 0; i < 2; ++i) {
+    size_t tmp = 0;
+    if (clfft_plan[i])
+      clfftGetTmpBufSize(*clfft_plan[i], &tmp);
+    bytes += tmp;
+  }
+#endif
+  return bytes;
+}
+
+// Transform in into out, recording the kernels in b if set
+static void transform(fft_direction direction, cl_mem in, cl_mem out, bench *b) {
+  if (engine == ENGINE_NATIVE) {
+    plan->b = b;
+    if (!fft_enqueue(plan, queue, direction, in, out)) {
+      teardown(-1);
+    }
+    return;
+  }
+
+#ifdef HAVE_CLFFT
+  cl_event event;
+  clfftPlanHandle handle = (direction == FFT_INVERSE && clfft_plan[1]) ? *clfft_plan[1] : *clfft_plan[0];
+  clfftStatus fstatus = clfftEnqueueTransform(handle,
+      direction == FFT_FORWARD ? CLFFT_FORWARD : CLFFT_BACKWARD, 1, &queue, 0, NULL, &event, &in, &out, NULL);
+  checkError(fstatus, "Error: could not enqueue transformation");
+  record(b, BENCH_KERNEL, event);
+#endif
+}
+
+//
+// Remove a regular distortion pattern from lena.dat: forward transform, zero
+// the frequencies outside mask.dat, inverse transform. With MASK_DEVICE the
+// spectrum stays on the device, MASK_HOST reads it back and masks on the host.
+// weights is the mask over the spectrum, see spectrum_weights.
+//
+static void filter_image(int site, int debug, size_t width, size_t height,
+    const cl_float *data_in, cl_float *data_out, const unsigned char *weights, bench *b) {
+  cl_int status;
+  cl_event event;
+  size_t spectrum_width = (layout == LAYOUT_REAL) ? width / 2 + 1 : width;
+  size_t points = spectrum_width * height;
+  size_t data_size = (layout == LAYOUT_REAL ? 1 : 2) * sizeof(cl_float) * width * height;
+  size_t spectrum_size = 2 * sizeof(cl_float) * points;
+  cl_uint n = (cl_uint) points;
+
+  status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, data_size, data_in, 0, NULL, &event);
+  checkError(status, "Error: could not write image");
+  record(b, BENCH_H2D, event);
+
+  transform(FFT_FORWARD, buffer_in, buffer_out, b);
+
+  if (site == MASK_DEVICE) {
+    if (debug) {
+      status  = clSetKernelArg(kernel_magnitude, 0, sizeof(cl_mem), &buffer_out);
+      status |= clSetKernelArg(kernel_magnitude, 1, sizeof(cl_mem), &buffer_mag);
+      status |= clSetKernelArg(kernel_magnitude, 2, sizeof(cl_uint), &n);
+      checkError(status, "Error: could not set magnitude arguments");
+    }
+
+    for (int masked = 0; masked < 2; ++masked) {
+      if (debug) {
+        status = clEnqueueNDRangeKernel(queue, kernel_magnitude, 1, NULL, &points, NULL, 0, NULL, NULL);
+        checkError(status, "Error: could not enqueue magnitude");
 
+        status = clEnqueueReadBuffer(queue, buffer_mag, CL_TRUE, 0, sizeof(cl_float) * points, image, 0, NULL, NULL);
+        checkError(status, "Error: could not read magnitude");
+
+        write_bmp(masked ? "mag_masked.bmp" : "mag.bmp", image, spectrum_width, height, DYNAMIC|LOG);
+      }
+      if (!masked) {
+        status  = clSetKernelArg(kernel_mask, 0, sizeof(cl_mem), &buffer_out);
+        status |= clSetKernelArg(kernel_mask, 1, sizeof(cl_mem), &buffer_mask);
+        status |= clSetKernelArg(kernel_mask, 2, sizeof(cl_uint), &n);
+        checkError(status, "Error: could not set mask arguments");
+
+        status = clEnqueueNDRangeKernel(queue, kernel_mask, 1, NULL, &points, NULL, 0, NULL, &event);
+        checkError(status, "Error: could not enqueue mask");
+        record(b, BENCH_KERNEL, event);
+      }
+    }
+  } else {
+    status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, spectrum_size, spectrum, 0, NULL, &event);
+    checkError(status, "Error: could not read spectrum");
+    record(b, BENCH_D2H, event);
+
+    for (int masked = 0; masked < 2; ++masked) {
+      if (debug) {
+        for (unsigned int i=0; i < points; ++i) {
+          image[i] = (float) sqrt(spectrum[2*i]*spectrum[2*i] + spectrum[2*i+1]*spectrum[2*i+1]);
+        }
+        write_bmp(masked ? "mag_masked.bmp" : "mag.bmp", image, spectrum_width, height, DYNAMIC|LOG);
+      }
+      if (!masked) {
+        for (unsigned int i = 0; i < points; ++i) {
+          spectrum[2*i] *= 0.5f * weights[i];
+          spectrum[2*i+1] *= 0.5f * weights[i];
+        }
+      }
+    }
+
+    status = clEnqueueWriteBuffer(queue, buffer_out, CL_FALSE, 0, spectrum_size, spectrum, 0, NULL, &event);
+    checkError(status, "Error: could not write masked spectrum");
+    record(b, BENCH_H2D, event);
+  }
+
+  transform(FFT_INVERSE, buffer_out, buffer_back, b);
+
+  status = clEnqueueReadBuffer(queue, buffer_back, CL_FALSE, 0, data_size, data_out, 0, NULL, &event);
+  checkError(status, "Error: could not read output");
+  record(b, BENCH_D2H, event);
+}
+
+// Weights of the points of the spectrum, 0 drops a point, 2 keeps it. Real
+// transforms keep the left half of a spectrum whose other half mirrors it, so
+// a mask that is not symmetric acts as the mean of itself and its mirror image,
+// which is what the real part of the complex result sees.
+static unsigned char *spectrum_weights(const unsigned char *mask, size_t width, size_t height) {
+  size_t spectrum_width = (layout == LAYOUT_REAL) ? width / 2 + 1 : width;
+  unsigned char *weights = (unsigned char *) malloc(spectrum_width * height);
+  if (!weights) {
+    fprintf(stderr, "Error: failed to allocate data\n");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < height; ++i) {
+    for (size_t j = 0; j < spectrum_width; ++j) {
+      size_t mirror = ((height - i) % height) * width + (width - j) % width;
+      weights[i*spectrum_width+j] = (layout == LAYOUT_REAL) ? (mask[i*width+j] != 0) + (mask[mirror] != 0)
+        : 2 * (mask[i*width+j] != 0);
+    }
+  }
+  return weights;
+}
+
+static void run_image(const bench_options *opts, int site, int debug) {
+  cl_int status;
   unsigned char *data;
   unsigned char *mask;
   size_t datasize, masksize, width=512, height=512;
@@ -126,172 +466,417 @@ int main(int argc, char **argv) {
   }
 
   if (!load_file("mask.dat", &mask, &masksize)) {
+    free(data);
     teardown(-1);
   }
 
-  size_t buf_size = sizeof(cl_float) * width * height;
-  size_t tmp_size = sizeof(cl_float) * width * height;
-
-  cl_float *data_in_real  = (cl_float *) malloc(buf_size);
-  cl_float *data_in_img  = (cl_float *) malloc(buf_size);
-  cl_float *data_out_real = (cl_float *) malloc(buf_size);
-  cl_float *data_out_img = (cl_float *) malloc(buf_size);
+  size_t pixels = width * height;
+  size_t values = (layout == LAYOUT_REAL) ? 1 : 2;
+  size_t spectrum_points = (layout == LAYOUT_REAL ? width / 2 + 1 : width) * height;
+  size_t data_size = values * sizeof(cl_float) * pixels;
+  size_t spectrum_size = 2 * sizeof(cl_float) * spectrum_points;
 
-  if (!data_in_real || !data_in_img || !data_out_real || !data_out_img) {
-    fprintf(stderr, "Error: failed to allocate data\n");
+  if (datasize < pixels || masksize < pixels) {
+    fprintf(stderr, "Error: lena.dat and mask.dat must hold %lux%lu pixels\n",
+        (unsigned long) width, (unsigned long) height);
     teardown(-1);
   }
 
-  memset(data_in_real, 0, buf_size);
-  memset(data_in_img, 0, buf_size);
-  memset(data_out_real, 0, buf_size);
-  memset(data_out_img, 0, tmp_size);
-
+  cl_float *data_in  = (cl_float *) malloc(data_size);
+  cl_float *data_out = (cl_float *) malloc(data_size);
+  unsigned char *weights = spectrum_weights(mask, width, height);
+  spectrum = (cl_float *) malloc(spectrum_size);
+  image = (cl_float *) malloc(sizeof(cl_float) * pixels);
 
-  for (unsigned int i = 0; i < width*height; ++i) {
-    data_in_real[i] = data[i];
+  if (!data_in || !data_out || !weights || !spectrum || !image) {
+    fprintf(stderr, "Error: failed to allocate data\n");
+    teardown(-1);
   }
 
-  write_bmp("lena.bmp", data_in_real, width, height, 0);
+  memset(data_in, 0, data_size);
+  for (unsigned int i = 0; i < pixels; ++i) {
+    data_in[values*i] = data[i];
+    image[i] = data[i];
+  }
 
-  buffer_in_real = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, buf_size, data_in_real, &status);
-  checkError(status, "Error: could not create buffer_in");
+  if (debug)
+    write_bmp("lena.bmp", image, width, height, 0);
 
-  buffer_in_img = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, buf_size, data_in_img, &status);
+  buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY, data_size, NULL, &status);
   checkError(status, "Error: could not create buffer_in");
 
-  buffer_out_real = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, buf_size, NULL, &status);
+  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, spectrum_size, NULL, &status);
   checkError(status, "Error: could not create buffer_out");
 
-  buffer_out_img = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  buffer_back = clCreateBuffer(context, CL_MEM_WRITE_ONLY, data_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_back");
 
-  clfftSetupData fft_data;
-  clfftStatus fstatus;
-  clfftPlanHandle plan;
-  cl_event event;
+  size_t size[2] = {width, height};
+  setup_transform(2, size, 1);
+  print_transform();
+  printf("device memory: %.2f MB image, spectrum and result, %.2f MB scratch\n",
+      (2 * data_size + spectrum_size) / 1048576.0, scratch_size() / 1048576.0);
 
-  fstatus = clfftSetup(&fft_data);
-  checkError(fstatus, "Error: could not setup clFFT");
+  // The mask is uploaded once, the magnitudes only exist for debug images
+  if (site == MASK_DEVICE) {
+    if (!create_program(KERNELDIR "/mask.cl", &program, context, device, "")) {
+      if (program) print_build_log(program, device);
+      teardown(-1);
+    }
 
-  size_t size[2] = {width,height};
+    kernel_mask = clCreateKernel(program, "apply_mask", &status);
+    checkError(status, "Error: could not create kernel");
 
-  fstatus = clfftCreateDefaultPlan(&plan, context, CLFFT_2D, size);
-  checkError(fstatus, "Error: could not create plan");
+    kernel_magnitude = clCreateKernel(program, "magnitude", &status);
+    checkError(status, "Error: could not create kernel");
+
+    buffer_mask = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, spectrum_points, weights, &status);
+    checkError(status, "Error: could not create buffer_mask");
+
+    if (debug) {
+      buffer_mag = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * spectrum_points, NULL, &status);
+      checkError(status, "Error: could not create buffer_mag");
+    }
+  }
+
+  char variant[64];
+  sprintf(variant, "%s-image-%s-%s", engine_names[engine], site_names[site], layout_names[layout]);
+
+  bench b;
+  if (!bench_init(&b, opts, "fft", variant, width)) {
+    teardown(-1);
+  }
+  // Latency per image is the host time from upload to download
+  bench_set_rate(&b, 1, "images/s");
+
+  while (bench_next(&b)) {
+    double start = get_time();
+    filter_image(site, 0, width, height, data_in, data_out, weights, &b);
+    bench_wall(&b, get_time() - start);
+  }
+
+  bench_report(&b);
+  double rate = bench_rate(&b);
+  if (rate > 0)
+    printf("latency: %f ms per image\n", 1e3 / rate);
+  bench_free(&b);
 
-  // 
-  // setup plan
+  //
+  // output results
   //
 
-  fstatus = clfftSetPlanLength(plan, CLFFT_2D, size);
-  checkError(fstatus, "Error: could not set size");
+  if (debug) {
+    filter_image(site, 1, width, height, data_in, data_out, weights, NULL);
+  }
 
-  fstatus = clfftSetPlanPrecision(plan, CLFFT_SINGLE);
-  checkError(fstatus, "Error: could not set precision");
+  for (unsigned int i=0; i < pixels; ++i) {
+    image[i] = data_out[values*i];
+  }
+  write_bmp("fft.bmp", image, width, height, DYNAMIC);
 
-  fstatus = clfftSetLayout(plan, CLFFT_COMPLEX_PLANAR, CLFFT_COMPLEX_PLANAR);
-  checkError(fstatus, "Error: could not set layout");
+  // The result of the real inverse is real
+  if (layout == LAYOUT_COMPLEX) {
+    for (unsigned int i=0; i < pixels; ++i) {
+      image[i] = data_out[2*i+1];
+    }
+    write_bmp("fft_i.bmp", image, width, height, DYNAMIC);
+  }
 
-  fstatus = clfftSetResultLocation(plan, CLFFT_OUTOFPLACE);
-  checkError(fstatus, "Error: could not set layout");
+  free(data_in);
+  free(data_out);
+  free(weights);
+  free(data);
+  free(mask);
+}
 
-  size_t strides[] = {1,width};
-  fstatus = clfftSetPlanInStride(plan, CLFFT_2D, strides);
-  checkError(fstatus, "Error: could not set layout");
+// Relative RMS and maximum error of n complex values against ref
+static void relative_error(const float *ref, const float *out, size_t n, double *rms, double *max) {
+  double diff = 0, norm = 0, max_diff = 0, max_ref = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double re = (double) out[2*i] - ref[2*i], im = (double) out[2*i+1] - ref[2*i+1];
+    double d = re*re + im*im, r = (double) ref[2*i]*ref[2*i] + (double) ref[2*i+1]*ref[2*i+1];
+    diff += d;
+    norm += r;
+    if (d > max_diff) max_diff = d;
+    if (r > max_ref) max_ref = r;
+  }
+  *rms = norm > 0 ? sqrt(diff / norm) : sqrt(diff);
+  *max = max_ref > 0 ? sqrt(max_diff / max_ref) : sqrt(max_diff);
+}
 
-  fstatus = clfftSetPlanOutStride(plan, CLFFT_2D, strides);
-  checkError(fstatus, "Error: could not set layout");
+//
+// Throughput of batch transforms of size or size x size points, checked
+// against the double precision transform of host_fft
+//
+static int run_benchmark(const bench_options *opts, int dims, size_t batch) {
+  cl_int status;
 
-  fstatus = clfftBakePlan(plan, 1, &queue, NULL, NULL);
-  checkError(fstatus, "Error: could not create plan");
+  size_t n = opts->size ? opts->size : (dims == 1 ? 4096 : 512);
+  size_t length[2] = {n, n};
+  size_t points = (dims == 1 ? n : n * n);
+  if (!batch)
+    batch = dims == 1 ? 256 : 4;
+  size_t total = points * batch;
+  size_t rows = total / n;
+
+  // Real transforms output the first n/2+1 points of every row
+  size_t values = (layout == LAYOUT_REAL) ? 1 : 2;
+  size_t spectrum_width = (layout == LAYOUT_REAL) ? n / 2 + 1 : n;
+  size_t data_size = values * sizeof(cl_float) * total;
+  size_t spectrum_size = 2 * sizeof(cl_float) * spectrum_width * rows;
+
+  cl_float *data_in = (cl_float *) malloc(data_size);
+  cl_float *data_out = (cl_float *) malloc(spectrum_size > data_size ? spectrum_size : data_size);
+  cl_float *ref = (cl_float *) malloc(2 * sizeof(cl_float) * total);
+
+  if (!data_in || !data_out || !ref) {
+    fprintf(stderr, "Error: failed to allocate data\n");
+    teardown(-1);
+  }
 
-  //
-  // forward transformation
-  //
-  cl_mem buffers_in[2] = {buffer_in_real, buffer_in_img};
-  cl_mem buffers_out[2] = {buffer_out_real, buffer_out_img};
+  srand(1);
+  for (size_t i = 0; i < values * total; ++i) {
+    data_in[i] = (float) rand() / RAND_MAX - 0.5f;
+  }
 
-  fstatus = clfftEnqueueTransform(plan,CLFFT_FORWARD, 1, &queue, 0, NULL, &event, buffers_in, buffers_out, NULL);
-  checkError(fstatus, "Error: could not enqueue transformation");
+  buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data_size, data_in, &status);
+  checkError(status, "Error: could not create buffer_in");
 
-  status = clEnqueueReadBuffer(queue, buffer_out_real, CL_FALSE, 0, buf_size, data_out_real, 0, NULL, NULL);
-  checkError(status, "Error: could not read buffer");
+  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, spectrum_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_out");
 
-  status = clEnqueueReadBuffer(queue, buffer_out_img, CL_FALSE, 0, buf_size, data_out_img, 0, NULL, NULL);
-  checkError(status, "Error: could not read buffer");
+  buffer_back = clCreateBuffer(context, CL_MEM_READ_WRITE, data_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_back");
 
-  status  = clFinish(queue);
-  checkError(status, "Error: could not finish queue");
+  setup_transform(dims, length, batch);
+  print_transform();
+  printf("device memory: %.2f MB input, %.2f MB spectrum, %.2f MB scratch\n",
+      data_size / 1048576.0, spectrum_size / 1048576.0, scratch_size() / 1048576.0);
 
-  for (unsigned int i=0; i < width*height; ++i) {
-    data_in_real[i] = (float) sqrt(data_out_real[i]*data_out_real[i] + data_out_img[i]*data_out_img[i]);
+  char variant[64];
+  sprintf(variant, "%s-%s-%s-x%lu", engine_names[engine], mode_names[dims], layout_names[layout], (unsigned long) batch);
+
+  bench b;
+  if (!bench_init(&b, opts, "fft", variant, n)) {
+    teardown(-1);
+  }
+  // 5 N log2 N per complex transform of N points, half of it for real ones
+  double gflop = 2.5 * values * points * log2((double) points) * batch * 1e-9;
+  bench_set_rate(&b, gflop, "GFLOP/s");
+
+  while (bench_next(&b)) {
+    transform(FFT_FORWARD, buffer_in, buffer_out, &b);
   }
 
-  write_bmp("mag.bmp", data_in_real, width, height, DYNAMIC|LOG);
+  status = clEnqueueReadBuffer(queue, buffer_out, CL_TRUE, 0, spectrum_size, data_out, 0, NULL, NULL);
+  checkError(status, "Error: could not read output");
+
+  bench_report(&b);
+  double rate = bench_rate(&b);
+  if (rate > 0)
+    printf("time per transform: %f us\n", 1e6 * gflop / rate / batch);
+  bench_free(&b);
 
   //
-  // apply mask
+  // accuracy against the host reference and of the round trip
   //
-
-  for (unsigned int i = 0; i < height; ++i) {
-    for (unsigned int j = 0; j < width; ++j) {
-      if (mask[i*width+j] == 0) {
-        data_out_real[i*width+j] = 0.f;
-        data_out_img[i*width+j] = 0.f;
-      }
+  for (size_t i = 0; i < total; ++i) {
+    ref[2*i] = data_in[values*i];
+    ref[2*i+1] = (layout == LAYOUT_REAL) ? 0.f : data_in[2*i+1];
+  }
+  int ok = host_fft(ref, n, rows, 1, n, -1);
+  if (ok && dims == 2) {
+    for (size_t i = 0; ok && i < batch; ++i) {
+      ok = host_fft(ref + 2 * i * points, n, n, n, 1, -1);
     }
   }
-  for (unsigned int i=0; i < width*height; ++i) {
-    data_in_real[i] = (float) sqrt(data_out_real[i]*data_out_real[i] + data_out_img[i]*data_out_img[i]);
+  if (!ok) {
+    teardown(-1);
   }
 
-  write_bmp("mag_masked.bmp", data_in_real, width, height, DYNAMIC|LOG);
+  // The left columns of the reference, in place
+  if (layout == LAYOUT_REAL) {
+    for (size_t r = 0; r < rows; ++r)
+      memmove(ref + 2 * r * spectrum_width, ref + 2 * r * n, 2 * sizeof(cl_float) * spectrum_width);
+  }
 
-  //
-  // write masked image
-  //
+  double rms, max;
+  relative_error(ref, data_out, spectrum_width * rows, &rms, &max);
+  printf("forward: relative error rms %g, max %g\n", rms, max);
 
-  status = clEnqueueWriteBuffer(queue, buffer_out_real, CL_FALSE, 0, buf_size, data_out_real, 0, NULL, NULL);
-  checkError(status, "Error: could not write masked data");
+  transform(FFT_INVERSE, buffer_out, buffer_back, NULL);
+  status = clEnqueueReadBuffer(queue, buffer_back, CL_TRUE, 0, data_size, data_out, 0, NULL, NULL);
+  checkError(status, "Error: could not read output");
 
-  status = clEnqueueWriteBuffer(queue, buffer_out_img, CL_FALSE, 0, buf_size, data_out_img, 0, NULL, NULL);
-  checkError(status, "Error: could not write masked data");
+  // Real values compared in pairs
+  double back_rms, back_max;
+  relative_error(data_in, data_out, values * total / 2, &back_rms, &back_max);
+  printf("round trip: relative error rms %g, max %g\n", back_rms, back_max);
+
+  // Single precision loses about log2 N bits of the epsilon
+  double tolerance = 1e-6 * log2((double) points);
+  ok = rms < tolerance && back_rms < tolerance;
+  if (!ok)
+    fprintf(stderr, "Error: relative error exceeds %g\n", tolerance);
+
+  free(data_in);
+  free(data_out);
+  free(ref);
+  return ok;
+}
 
+//
+// Latency of single calls that plan, transform and wait for the result, with
+// the plans released before every call (cold cache) or kept (warm cache).
+// Cold calls of the native engine still load the program from the program
+// cache, unless OCL_NO_CACHE is set.
+//
+static void run_latency(const bench_options *opts, int dims, size_t batch) {
+  cl_int status;
 
-  // 
-  // reverse transformation
-  //
+  size_t n = opts->size ? opts->size : (dims == 1 ? 1024 : 64);
+  size_t length[2] = {n, n};
+  if (!batch)
+    batch = 1;
+  size_t total = (dims == 1 ? n : n * n) * batch;
+  size_t values = (layout == LAYOUT_REAL) ? 1 : 2;
+  size_t data_size = values * sizeof(cl_float) * total;
+  size_t spectrum_size = 2 * sizeof(cl_float) * ((layout == LAYOUT_REAL) ? n / 2 + 1 : n) * (total / n);
+
+  cl_float *data_in = (cl_float *) malloc(data_size);
+  if (!data_in) {
+    fprintf(stderr, "Error: failed to allocate data\n");
+    teardown(-1);
+  }
 
-  fstatus = clfftEnqueueTransform(plan,CLFFT_BACKWARD, 1, &queue, 0, NULL, &event, buffers_out, buffers_in, NULL);
-  checkError(fstatus, "Error: could not create plan");
+  srand(1);
+  for (size_t i = 0; i < values * total; ++i) {
+    data_in[i] = (float) rand() / RAND_MAX - 0.5f;
+  }
 
-  //
-  // read results
-  //
+  buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data_size, data_in, &status);
+  checkError(status, "Error: could not create buffer_in");
+  free(data_in);
 
-  status = clEnqueueReadBuffer(queue, buffer_in_real, CL_TRUE, 0, buf_size, data_out_real, 0, NULL, NULL);
-  checkError(status, "Error: could not read output");
+  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, spectrum_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_out");
 
-  status = clEnqueueReadBuffer(queue, buffer_in_img, CL_TRUE, 0, buf_size, data_out_img, 0, NULL, NULL);
-  checkError(status, "Error: could not read output");
+  setup_transform(dims, length, batch);
+  print_transform();
+
+  for (int warm = 0; warm < 2; ++warm) {
+    char variant[64];
+    sprintf(variant, "%s-%s-%s-x%lu-%s", engine_names[engine], mode_names[dims], layout_names[layout],
+        (unsigned long) batch, warm ? "warm" : "cold");
+
+    bench b;
+    if (!bench_init(&b, opts, "fft", variant, n)) {
+      teardown(-1);
+    }
+    bench_set_rate(&b, 1, "calls/s");
+
+    while (bench_next(&b)) {
+      if (!warm)
+        drop_plans();
+
+      double start = get_time();
+      setup_transform(dims, length, batch);
+      transform(FFT_FORWARD, buffer_in, buffer_out, &b);
+      status = clFinish(queue);
+      checkError(status, "Error: could not finish successfully");
+      bench_wall(&b, get_time() - start);
+    }
 
-  status  = clFinish(queue);
-  checkError(status, "Error: could not finish queue");
+    bench_report(&b);
+    double rate = bench_rate(&b);
+    if (rate > 0)
+      printf("%s cache: %f ms per call\n", warm ? "warm" : "cold", 1e3 / rate);
+    bench_free(&b);
+  }
+  fft_cache_print(&plans);
+}
 
-  fstatus     = clfftDestroyPlan(&plan);
-  checkError(fstatus, "Error: could not destroy plan");
+int main(int argc, char **argv) {
+  cl_int status;
 
-  fstatus = clfftTeardown();
-  checkError(fstatus, "Error: could not teardown clFFT");
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  int mode = MODE_IMAGE;
+  int site = MASK_DEVICE;
+  int debug = 0;
+  int latency = 0;
+  size_t batch = 0;
+  int usage = 0;
+  engine = ENGINE_NATIVE;
+  layout = LAYOUT_COMPLEX;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], engine_names[ENGINE_NATIVE])) {
+      engine = ENGINE_NATIVE;
+    } else if (!strcmp(argv[i], engine_names[ENGINE_CLFFT])) {
+      engine = ENGINE_CLFFT;
+    } else if (!strcmp(argv[i], mode_names[MODE_IMAGE])) {
+      mode = MODE_IMAGE;
+    } else if (!strcmp(argv[i], mode_names[MODE_1D])) {
+      mode = MODE_1D;
+    } else if (!strcmp(argv[i], mode_names[MODE_2D])) {
+      mode = MODE_2D;
+    } else if (!strcmp(argv[i], site_names[MASK_DEVICE])) {
+      site = MASK_DEVICE;
+    } else if (!strcmp(argv[i], site_names[MASK_HOST])) {
+      site = MASK_HOST;
+    } else if (!strcmp(argv[i], layout_names[LAYOUT_COMPLEX])) {
+      layout = LAYOUT_COMPLEX;
+    } else if (!strcmp(argv[i], layout_names[LAYOUT_REAL])) {
+      layout = LAYOUT_REAL;
+    } else if (!strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "latency")) {
+      latency = 1;
+    } else if (atoi(argv[i]) > 0) {
+      batch = atoi(argv[i]);
+    } else {
+      usage = 1;
+    }
+  }
 
-  //
-  // output results
-  //
+  if (usage || (latency && mode == MODE_IMAGE)) {
+    fprintf(stderr, "Usage: %s [native|clfft] [image [device|host] [--debug]|1d|2d [latency]] [complex|real] [BATCH] "
+        BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  image masks the spectrum on the device or the host, --debug writes the spectra\n");
+    fprintf(stderr, "  latency times single calls with a cold and a warm plan cache\n");
+    fprintf(stderr, "  real transforms real input into half spectra\n");
+    fprintf(stderr, "  --size is the transform length of 1d and the side of 2d, products of 2, 3 and 5\n");
+    teardown(-1);
+  }
+
+  if (!select_device(&device_opts, "Intel", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
 
-  write_bmp("fft.bmp", data_out_real, width, height, DYNAMIC);
-  write_bmp("fft_i.bmp", data_out_img, width, height, DYNAMIC);
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "Error: could not create context");
 
-  free(data);
-  free(mask);
-  teardown(0);
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "Error: could not create command queue");
+
+  // Plans are kept for repeated transforms of the same shape, OCL_FFT_PLANS at most
+  const char *capacity = getenv("OCL_FFT_PLANS");
+  fft_cache_init(&plans, (capacity && *capacity) ? atoi(capacity) : FFT_CACHE_PLANS, destroy_plan);
+
+  int ok = 1;
+  if (mode == MODE_IMAGE)
+    run_image(&opts, site, debug);
+  else if (latency)
+    run_latency(&opts, mode, batch);
+  else
+    ok = run_benchmark(&opts, mode, batch);
+
+  teardown(ok ? 0 : -1);
 }
@@ -0,0 +1,215 @@
+//
+// Stockham FFT of interleaved complex single precision data, see fftplan.h.
+//
+// A pass of radix R after ns points have been combined reads the R inputs
+// j + r*n/R of butterfly j, multiplies input r by the twiddle
+// exp(dir 2 pi i r k / (ns R)) with k = j % ns, transforms them with an
+// R-point DFT and writes output r to (j/ns)*ns*R + k + r*ns. Stockham passes
+// are out of place, but need no bit reversal.
+//
+// Element k of transform t in batch item b is at
+// b*batch_dist + t*dist + k*stride, so the same kernels run over rows and
+// columns. dir is -1 for the forward and +1 for the inverse transform, the
+// output of the last pass is multiplied by scale.
+//
+
+// Largest radix, and bits per radix of the packed radices of fft_local
+#define MAX_RADIX 8
+#define RADIX_BITS 4
+
+inline float2 cmul(float2 a, float2 b) {
+    return (float2)(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
+}
+
+// a * i*dir
+inline float2 mul_i(float2 a, float dir) {
+    return (float2)(-dir*a.y, dir*a.x);
+}
+
+// twiddles[k] = (cos, sin) of 2 pi k / n
+inline float2 twiddle(global const float2 *twiddles, uint k, float dir) {
+    float2 t = twiddles[k];
+    return (float2)(t.x, dir*t.y);
+}
+
+inline void dft2(float2 *v) {
+    float2 a = v[0];
+    v[0] = a + v[1];
+    v[1] = a - v[1];
+}
+
+inline void dft3(float2 *v, float dir) {
+    const float c = -0.5f;
+    const float s = dir*0.86602540378443865f;
+    float2 t = v[1] + v[2];
+    float2 d = mul_i(v[2] - v[1], -s);
+    float2 a = v[0] + c*t;
+    v[0] = v[0] + t;
+    v[1] = a + d;
+    v[2] = a - d;
+}
+
+inline void dft4(float2 *v, float dir) {
+    float2 a0 = v[0] + v[2], a1 = v[0] - v[2];
+    float2 b0 = v[1] + v[3], b1 = mul_i(v[1] - v[3], dir);
+    v[0] = a0 + b0;
+    v[1] = a1 + b1;
+    v[2] = a0 - b0;
+    v[3] = a1 - b1;
+}
+
+inline void dft5(float2 *v, float dir) {
+    const float c1 = 0.30901699437494742f, c2 = -0.80901699437494742f;
+    const float s1 = dir*0.95105651629515357f, s2 = dir*0.58778525229247313f;
+    float2 t1 = v[1] + v[4], t2 = v[2] + v[3];
+    float2 d1 = v[1] - v[4], d2 = v[2] - v[3];
+    float2 a1 = v[0] + c1*t1 + c2*t2, a2 = v[0] + c2*t1 + c1*t2;
+    float2 b1 = mul_i(s1*d1 + s2*d2, 1.0f), b2 = mul_i(s2*d1 - s1*d2, 1.0f);
+    v[0] = v[0] + t1 + t2;
+    v[1] = a1 + b1;
+    v[4] = a1 - b1;
+    v[2] = a2 + b2;
+    v[3] = a2 - b2;
+}
+
+// Two DFT4 of the even and odd inputs, combined with exp(dir 2 pi i k / 8)
+inline void dft8(float2 *v, float dir) {
+    const float c = 0.70710678118654752f;
+    float2 e[4] = {v[0], v[2], v[4], v[6]};
+    float2 o[4] = {v[1], v[3], v[5], v[7]};
+    dft4(e, dir);
+    dft4(o, dir);
+    o[1] = c*(float2)(o[1].x - dir*o[1].y, o[1].y + dir*o[1].x);
+    o[2] = mul_i(o[2], dir);
+    o[3] = c*(float2)(-o[3].x - dir*o[3].y, dir*o[3].x - o[3].y);
+    for (int k = 0; k < 4; ++k) {
+        v[k] = e[k] + o[k];
+        v[k+4] = e[k] - o[k];
+    }
+}
+
+// Twiddle and transform the inputs of butterfly j of a pass
+inline void butterfly(float2 *v, uint radix, uint j, uint ns, uint n,
+                      global const float2 *twiddles, float dir) {
+    uint k = j % ns;
+    uint step = n / (ns*radix);
+    for (uint r = 1; r < radix; ++r)
+        v[r] = cmul(v[r], twiddle(twiddles, r*k*step, dir));
+
+    switch (radix) {
+        case 2: dft2(v); break;
+        case 3: dft3(v, dir); break;
+        case 4: dft4(v, dir); break;
+        case 5: dft5(v, dir); break;
+        case 8: dft8(v, dir); break;
+    }
+}
+
+//
+// One pass over global memory, a work-item per butterfly.
+// Global size: (n/radix, transforms, batch)
+//
+kernel void fft_pass(global const float2 *in, global float2 *out, global const float2 *twiddles,
+                     uint n, uint radix, uint ns, uint stride, uint dist, uint batch_dist,
+                     float dir, float scale) {
+    uint j = get_global_id(0);
+    uint base = get_global_id(2)*batch_dist + get_global_id(1)*dist;
+    uint m = n/radix;
+
+    float2 v[MAX_RADIX];
+    for (uint r = 0; r < radix; ++r)
+        v[r] = in[base + (j + r*m)*stride];
+
+    butterfly(v, radix, j, ns, n, twiddles, dir);
+
+    uint d = (j/ns)*ns*radix + j%ns;
+    for (uint r = 0; r < radix; ++r)
+        out[base + (d + r*ns)*stride] = scale*v[r];
+}
+
+//
+// All passes of a transform in local memory, a work-group per transform.
+// The radix of pass p is bits RADIX_BITS*p of radices. buf holds 2*n points.
+// Global size: (local size * transforms, batch)
+//
+kernel void fft_local(global const float2 *in, global float2 *out, global const float2 *twiddles,
+                      uint n, ulong radices, uint passes, uint stride, uint dist, uint batch_dist,
+                      float dir, float scale, local float2 *buf) {
+    uint lid = get_local_id(0);
+    uint lsize = get_local_size(0);
+    uint base = get_global_id(1)*batch_dist + get_group_id(0)*dist;
+
+    local float2 *src = buf, *dst = buf + n;
+    for (uint i = lid; i < n; i += lsize)
+        src[i] = in[base + i*stride];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint ns = 1;
+    for (uint p = 0; p < passes; ++p) {
+        uint radix = (uint) (radices >> (RADIX_BITS*p)) & ((1 << RADIX_BITS) - 1);
+        uint m = n/radix;
+
+        for (uint j = lid; j < m; j += lsize) {
+            float2 v[MAX_RADIX];
+            for (uint r = 0; r < radix; ++r)
+                v[r] = src[j + r*m];
+
+            butterfly(v, radix, j, ns, n, twiddles, dir);
+
+            uint d = (j/ns)*ns*radix + j%ns;
+            for (uint r = 0; r < radix; ++r)
+                dst[d + r*ns] = v[r];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        local float2 *swap = src;
+        src = dst;
+        dst = swap;
+        ns *= radix;
+    }
+
+    for (uint i = lid; i < n; i += lsize)
+        out[base + i*stride] = scale*src[i];
+}
+
+//
+// Real transforms of length 2m: the even and odd samples of a row are the
+// real and imaginary parts of m complex points z, whose transform Z splits into
+// the transforms E and O of the even and odd samples,
+//   E[k] = (Z[k] + conj(Z[m-k]))/2,  O[k] = -i (Z[k] - conj(Z[m-k]))/2,
+// and X[k] = E[k] + exp(-2 pi i k / 2m) O[k] for k = 0 ... m, Z[m] = Z[0].
+// twiddles[k] = (cos, sin) of 2 pi k / 2m. Rows are in_dist and out_dist
+// points apart.
+//
+
+// Global size: (m+1, rows)
+kernel void fft_real_forward(global const float2 *in, global float2 *out, global const float2 *twiddles,
+                             uint m, uint in_dist, uint out_dist) {
+    uint k = get_global_id(0);
+    uint row = get_global_id(1);
+
+    float2 a = in[row*in_dist + k % m];
+    float2 b = in[row*in_dist + (m - k) % m];
+    b.y = -b.y;
+
+    float2 e = 0.5f*(a + b);
+    float2 o = mul_i(0.5f*(a - b), -1.0f);
+    out[row*out_dist + k] = e + cmul(twiddle(twiddles, k, -1.0f), o);
+}
+
+// The inverse: Z[k] = E[k] + i O[k] from the half spectrum X, times 2, which
+// the inverse transform of the rows scales away.
+// Global size: (m, rows)
+kernel void fft_real_inverse(global const float2 *in, global float2 *out, global const float2 *twiddles,
+                             uint m, uint in_dist, uint out_dist) {
+    uint k = get_global_id(0);
+    uint row = get_global_id(1);
+
+    float2 a = in[row*in_dist + k];
+    float2 b = in[row*in_dist + m - k];
+    b.y = -b.y;
+
+    float2 e = a + b;
+    float2 o = cmul(a - b, twiddle(twiddles, k, 1.0f));
+    out[row*out_dist + k] = e + mul_i(o, 1.0f);
+}
@@ -0,0 +1,92 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "fftcache.h"
+
+// Points per row of a layout
+static size_t row_points(fft_layout layout, size_t length) {
+  return layout == FFT_HERMITIAN ? length / 2 + 1 : length;
+}
+
+void fft_key_init(fft_key *key, int engine, cl_context context, int dims, const size_t *length,
+    size_t batch, fft_layout in_layout, fft_layout out_layout) {
+  memset(key, 0, sizeof(fft_key));
+  key->engine = engine;
+  key->context = context;
+  key->dims = dims;
+  key->batch = batch ? batch : 1;
+  key->in_layout = in_layout;
+  key->out_layout = out_layout;
+  key->precision = FFT_SINGLE;
+
+  size_t in_width = row_points(in_layout, length[0]);
+  size_t out_width = row_points(out_layout, length[0]);
+  key->in_dist = in_width;
+  key->out_dist = out_width;
+  for (int d = 0; d < dims && d < FFT_MAX_DIMS; ++d) {
+    key->length[d] = length[d];
+    key->in_stride[d] = d ? in_width : 1;
+    key->out_stride[d] = d ? out_width : 1;
+    if (d) {
+      key->in_dist *= length[d];
+      key->out_dist *= length[d];
+    }
+  }
+}
+
+void fft_cache_init(fft_cache *c, int capacity, fft_destroy destroy) {
+  memset(c, 0, sizeof(fft_cache));
+  c->capacity = capacity < 2 ? 2 : (capacity > FFT_CACHE_MAX ? FFT_CACHE_MAX : capacity);
+  c->destroy = destroy;
+}
+
+void *fft_cache_find(fft_cache *c, const fft_key *key) {
+  for (int i = 0; i < c->count; ++i) {
+    if (!memcmp(&c->entry[i].key, key, sizeof(fft_key))) {
+      c->entry[i].last_use = ++c->clock;
+      c->hits++;
+      return c->entry[i].plan;
+    }
+  }
+  c->misses++;
+  return NULL;
+}
+
+void fft_cache_insert(fft_cache *c, const fft_key *key, void *plan) {
+  fft_cache_entry *e = &c->entry[c->count];
+
+  if (c->count == c->capacity) {
+    e = &c->entry[0];
+    for (int i = 1; i < c->count; ++i)
+      if (c->entry[i].last_use < e->last_use)
+        e = &c->entry[i];
+    if (c->destroy)
+      c->destroy(&e->key, e->plan);
+    c->evictions++;
+  } else {
+    c->count++;
+  }
+
+  memcpy(&e->key, key, sizeof(fft_key));
+  e->plan = plan;
+  e->last_use = ++c->clock;
+}
+
+void fft_cache_clear(fft_cache *c) {
+  for (int i = 0; i < c->count; ++i)
+    if (c->destroy)
+      c->destroy(&c->entry[i].key, c->entry[i].plan);
+  memset(c->entry, 0, sizeof(c->entry));
+  c->count = 0;
+}
+
+void fft_cache_print(const fft_cache *c) {
+  printf("plan cache: %d of %d plans, %lu hits, %lu misses, %lu evictions\n",
+      c->count, c->capacity, c->hits, c->misses, c->evictions);
+}
@@ -0,0 +1,77 @@
+#ifndef FFTCACHE_H
+#define FFTCACHE_H
+
+#include <CL/cl.h>
+
+#include "fftplan.h"
+
+// Largest number of plans in a cache, and the default
+#define FFT_CACHE_MAX 64
+#define FFT_CACHE_PLANS 8
+
+typedef enum {
+  FFT_COMPLEX=0,        // interleaved complex points
+  FFT_REAL=1,           // real points
+  FFT_HERMITIAN=2       // interleaved first length[0]/2+1 complex points of each row
+} fft_layout;
+
+typedef enum {
+  FFT_SINGLE=0,
+  FFT_DOUBLE=1
+} fft_precision;
+
+// Everything a baked plan depends on. Keys are compared bytewise, so they
+// have to be set up with fft_key_init before changing single fields.
+typedef struct {
+  int engine;           // which library made the plan, up to the caller
+  cl_context context;
+  int dims;
+  size_t length[FFT_MAX_DIMS];
+  size_t batch;
+  fft_layout in_layout, out_layout;
+  size_t in_stride[FFT_MAX_DIMS], out_stride[FFT_MAX_DIMS];
+  size_t in_dist, out_dist;
+  fft_precision precision;
+  int in_place;
+} fft_key;
+
+// Single precision, out of place transforms of contiguous rows and batches
+void fft_key_init(fft_key *key, int engine, cl_context context, int dims, const size_t *length,
+    size_t batch, fft_layout in_layout, fft_layout out_layout);
+
+// Releases a plan when it is evicted or the cache is cleared
+typedef void (*fft_destroy)(const fft_key *key, void *plan);
+
+typedef struct {
+  fft_key key;
+  void *plan;
+  unsigned long last_use;
+} fft_cache_entry;
+
+// Baked plans with least recently used eviction
+typedef struct {
+  fft_cache_entry entry[FFT_CACHE_MAX];
+  int capacity, count;
+  unsigned long clock;
+  unsigned long hits, misses, evictions;
+  fft_destroy destroy;
+} fft_cache;
+
+// capacity is clamped to 2..FFT_CACHE_MAX, so that the two plans of a real
+// transform are never evicted by each other
+void fft_cache_init(fft_cache *c, int capacity, fft_destroy destroy);
+
+// The plan for key, NULL on a miss
+void *fft_cache_find(fft_cache *c, const fft_key *key);
+
+// Add the plan for key, which the cache owns from now on. Evicts the least
+// recently used plan if the cache is full.
+void fft_cache_insert(fft_cache *c, const fft_key *key, void *plan);
+
+// Release all plans, the statistics are kept
+void fft_cache_clear(fft_cache *c);
+
+// e.g. "plan cache: 3 of 8 plans, 97 hits, 3 misses, 0 evictions"
+void fft_cache_print(const fft_cache *c);
+
+#endif /* FFTCACHE_H */
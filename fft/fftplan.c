@@ -0,0 +1,410 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+#include "fftplan.h"
+
+// Bits per radix in the packed radices of fft_local, see fft.cl
+#define RADIX_BITS 4
+
+// Largest work-group of fft_local
+#define MAX_LOCAL_SIZE 256
+
+// Radices largest first: fewer passes over memory
+static const int radices[] = {8, 4, 2, 5, 3};
+
+// Split length into radices, 0 if it has other prime factors
+static int factorize(fft_axis *a) {
+  size_t rest = a->length;
+  a->passes = 0;
+
+  for (int i = 0; i < (int) (sizeof(radices) / sizeof(radices[0])); ++i) {
+    while (rest % radices[i] == 0) {
+      if (a->passes == FFT_MAX_PASSES)
+        return 0;
+      a->radix[a->passes++] = radices[i];
+      rest /= radices[i];
+    }
+  }
+  return rest == 1;
+}
+
+// (cos, sin) of 2 pi k / n for k < count, exact in double and rounded once
+static cl_mem create_twiddles(fft_plan *p, size_t n, size_t count) {
+  cl_int status;
+
+  cl_float *twiddles = (cl_float *) malloc(2 * count * sizeof(cl_float));
+  if (!twiddles) {
+    fprintf(stderr, "Error: malloc failed\n");
+    return NULL;
+  }
+  const double pi = 3.14159265358979323846;
+  for (size_t k = 0; k < count; ++k) {
+    twiddles[2*k]   = (cl_float) cos(2 * pi * k / n);
+    twiddles[2*k+1] = (cl_float) sin(2 * pi * k / n);
+  }
+  cl_mem buffer = clCreateBuffer(p->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      2 * count * sizeof(cl_float), twiddles, &status);
+  free(twiddles);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create twiddle table\n");
+    print_error(status);
+    return NULL;
+  }
+  return buffer;
+}
+
+static int init_axis(fft_plan *p, fft_axis *a, size_t length, cl_ulong local_mem, size_t max_group) {
+  a->length = length;
+  if (length < 2 || !factorize(a)) {
+    fprintf(stderr, "Error: FFT length %lu is not a product of 2, 3 and 5\n", (unsigned long) length);
+    return 0;
+  }
+
+  a->twiddles = create_twiddles(p, length, length);
+  if (!a->twiddles)
+    return 0;
+
+  // Two buffers of the transform in local memory, a work-item per butterfly
+  // of the largest radix where possible
+  a->local_size = 0;
+  if (2 * length * 2 * sizeof(cl_float) <= local_mem) {
+    size_t butterflies = length / a->radix[0];
+    a->local_size = 1;
+    while (2 * a->local_size <= butterflies && 2 * a->local_size <= max_group && 2 * a->local_size <= MAX_LOCAL_SIZE)
+      a->local_size *= 2;
+  }
+  return 1;
+}
+
+static cl_mem create_scratch(fft_plan *p, size_t points) {
+  cl_int status;
+  cl_mem buffer = clCreateBuffer(p->context, CL_MEM_READ_WRITE, points * 2 * sizeof(cl_float), NULL, &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create FFT buffer\n");
+    print_error(status);
+    return NULL;
+  }
+  p->scratch_size += points * 2 * sizeof(cl_float);
+  return buffer;
+}
+
+static int plan_init(fft_plan *p, cl_context context, cl_device_id device, int dims,
+    const size_t *length, size_t batch, int real) {
+  cl_int status;
+
+  memset(p, 0, sizeof(fft_plan));
+  p->context = context;
+  p->device = device;
+  p->dims = dims;
+  p->batch = batch ? batch : 1;
+  p->real = real;
+
+  if (dims < 1 || dims > FFT_MAX_DIMS) {
+    fprintf(stderr, "Error: %d-dimensional FFTs are not supported\n", dims);
+    return 0;
+  }
+  if (real && (length[0] % 2 || length[0] < 4)) {
+    fprintf(stderr, "Error: real FFT length %lu is not even\n", (unsigned long) length[0]);
+    return 0;
+  }
+
+  if (!create_program(KERNELDIR "/fft.cl", &p->program, context, device, "")) {
+    if (p->program) print_build_log(p->program, device);
+    fft_plan_release(p);
+    return 0;
+  }
+
+  p->kernel_pass = clCreateKernel(p->program, "fft_pass", &status);
+  if (status == CL_SUCCESS)
+    p->kernel_local = clCreateKernel(p->program, "fft_local", &status);
+  if (status == CL_SUCCESS && real)
+    p->kernel_real_forward = clCreateKernel(p->program, "fft_real_forward", &status);
+  if (status == CL_SUCCESS && real)
+    p->kernel_real_inverse = clCreateKernel(p->program, "fft_real_inverse", &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create FFT kernels\n");
+    print_error(status);
+    fft_plan_release(p);
+    return 0;
+  }
+
+  cl_ulong local_mem = 0;
+  size_t max_group = 1;
+  clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem, NULL);
+  clGetKernelWorkGroupInfo(p->kernel_local, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_group, NULL);
+
+  // Real rows are transformed as complex rows of half the length
+  p->width = length[0];
+  p->points = p->batch;
+  int global_passes = 0;
+  for (int d = 0; d < dims; ++d) {
+    size_t n = (real && !d) ? length[d] / 2 : length[d];
+    if (!init_axis(p, &p->axis[d], n, local_mem, max_group)) {
+      fft_plan_release(p);
+      return 0;
+    }
+    p->points *= length[d];
+    global_passes |= !p->axis[d].local_size;
+  }
+
+  // The largest layout the passes run over: the half spectrum of real plans
+  size_t points = real ? p->points / p->width * (p->width / 2 + 1) : p->points;
+  if (global_passes) {
+    p->tmp = create_scratch(p, points);
+    if (!p->tmp) {
+      fft_plan_release(p);
+      return 0;
+    }
+  }
+  if (real) {
+    p->spectrum = create_scratch(p, points);
+    p->real_twiddles = create_twiddles(p, p->width, p->width / 2 + 1);
+    if (!p->spectrum || !p->real_twiddles) {
+      fft_plan_release(p);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int fft_plan_init(fft_plan *p, cl_context context, cl_device_id device, int dims,
+    const size_t *length, size_t batch) {
+  return plan_init(p, context, device, dims, length, batch, 0);
+}
+
+int fft_plan_init_real(fft_plan *p, cl_context context, cl_device_id device, int dims,
+    const size_t *length, size_t batch) {
+  return plan_init(p, context, device, dims, length, batch, 1);
+}
+
+void fft_plan_release(fft_plan *p) {
+  for (int d = 0; d < FFT_MAX_DIMS; ++d)
+    if (p->axis[d].twiddles) clReleaseMemObject(p->axis[d].twiddles);
+  if (p->real_twiddles) clReleaseMemObject(p->real_twiddles);
+  if (p->tmp) clReleaseMemObject(p->tmp);
+  if (p->spectrum) clReleaseMemObject(p->spectrum);
+  if (p->kernel_pass) clReleaseKernel(p->kernel_pass);
+  if (p->kernel_local) clReleaseKernel(p->kernel_local);
+  if (p->kernel_real_forward) clReleaseKernel(p->kernel_real_forward);
+  if (p->kernel_real_inverse) clReleaseKernel(p->kernel_real_inverse);
+  if (p->program) clReleaseProgram(p->program);
+  memset(p, 0, sizeof(fft_plan));
+}
+
+static void complete(fft_plan *p, cl_event event) {
+  if (p->b)
+    bench_event(p->b, BENCH_KERNEL, event);
+  else
+    clReleaseEvent(event);
+}
+
+// Layout of the transforms along axis d of rows of width points: stride
+// between points, distance between transforms, their number per batch item,
+// the batch distance and the points of the whole batch
+typedef struct {
+  cl_uint stride, dist, batch_dist;
+  size_t transforms;
+  size_t points;
+} fft_axis_layout;
+
+static void axis_layout(const fft_plan *p, int d, size_t width, fft_axis_layout *l) {
+  size_t height = p->dims > 1 ? p->axis[1].length : 1;
+
+  l->batch_dist = (cl_uint) (width * height);
+  l->points = width * height * p->batch;
+  if (d == 0) {
+    l->stride = 1;
+    l->dist = (cl_uint) width;
+    l->transforms = height;
+  } else {
+    l->stride = (cl_uint) width;
+    l->dist = 1;
+    l->transforms = width;
+  }
+}
+
+static int enqueue_local(fft_plan *p, cl_command_queue queue, const fft_axis *a, const fft_axis_layout *l,
+    cl_float dir, cl_float scale, cl_mem in, cl_mem out) {
+  cl_int status;
+  cl_uint n = (cl_uint) a->length, passes = (cl_uint) a->passes;
+  cl_ulong packed = 0;
+  for (int i = 0; i < a->passes; ++i)
+    packed |= (cl_ulong) a->radix[i] << (RADIX_BITS * i);
+
+  int arg = 0;
+  status  = clSetKernelArg(p->kernel_local, arg++, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_mem), &out);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_mem), &a->twiddles);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_uint), &n);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_ulong), &packed);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_uint), &passes);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_uint), &l->stride);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_uint), &l->dist);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_uint), &l->batch_dist);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_float), &dir);
+  status |= clSetKernelArg(p->kernel_local, arg++, sizeof(cl_float), &scale);
+  status |= clSetKernelArg(p->kernel_local, arg++, 2 * a->length * 2 * sizeof(cl_float), NULL);
+  if (status != CL_SUCCESS)
+    return status;
+
+  size_t global[2] = {a->local_size * l->transforms, p->batch};
+  size_t local[2] = {a->local_size, 1};
+  cl_event event;
+  status = clEnqueueNDRangeKernel(queue, p->kernel_local, 2, NULL, global, local, 0, NULL, &event);
+  if (status == CL_SUCCESS)
+    complete(p, event);
+  return status;
+}
+
+// A kernel per pass, alternating between tmp and out so that the last pass
+// writes out. Transforms in place start with tmp and may need a final copy.
+static int enqueue_passes(fft_plan *p, cl_command_queue queue, const fft_axis *a, const fft_axis_layout *l,
+    cl_float dir, cl_float scale, cl_mem in, cl_mem out) {
+  cl_int status = CL_SUCCESS;
+  cl_mem src = in;
+  cl_mem dst = ((a->passes % 2) && in != out) ? out : p->tmp;
+  cl_uint ns = 1;
+
+  for (int i = 0; i < a->passes; ++i) {
+    cl_uint n = (cl_uint) a->length, radix = (cl_uint) a->radix[i];
+    cl_float pass_scale = (i == a->passes - 1) ? scale : 1.0f;
+
+    int arg = 0;
+    status  = clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_mem), &src);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_mem), &dst);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_mem), &a->twiddles);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &n);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &radix);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &ns);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &l->stride);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &l->dist);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_uint), &l->batch_dist);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_float), &dir);
+    status |= clSetKernelArg(p->kernel_pass, arg++, sizeof(cl_float), &pass_scale);
+    if (status != CL_SUCCESS)
+      return status;
+
+    size_t global[3] = {a->length / radix, l->transforms, p->batch};
+    cl_event event;
+    status = clEnqueueNDRangeKernel(queue, p->kernel_pass, 3, NULL, global, NULL, 0, NULL, &event);
+    if (status != CL_SUCCESS)
+      return status;
+    complete(p, event);
+
+    src = dst;
+    dst = (dst == p->tmp) ? out : p->tmp;
+    ns *= radix;
+  }
+
+  if (src != out) {
+    cl_event event;
+    status = clEnqueueCopyBuffer(queue, src, out, 0, 0, l->points * 2 * sizeof(cl_float), 0, NULL, &event);
+    if (status == CL_SUCCESS)
+      complete(p, event);
+  }
+  return status;
+}
+
+static int enqueue_axis(fft_plan *p, cl_command_queue queue, int d, size_t width,
+    cl_float dir, cl_float scale, cl_mem in, cl_mem out) {
+  const fft_axis *a = &p->axis[d];
+  fft_axis_layout l;
+  axis_layout(p, d, width, &l);
+
+  cl_int status = a->local_size ? enqueue_local(p, queue, a, &l, dir, scale, in, out)
+    : enqueue_passes(p, queue, a, &l, dir, scale, in, out);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not enqueue FFT of axis %d\n", d);
+    print_error(status);
+    return 0;
+  }
+  return 1;
+}
+
+// Split the transform of the packed rows into the half spectrum, or back
+static int enqueue_real(fft_plan *p, cl_command_queue queue, cl_kernel kernel, cl_mem in, cl_mem out,
+    size_t in_width, size_t out_width) {
+  cl_int status;
+  cl_uint m = (cl_uint) (p->width / 2);
+  cl_uint in_dist = (cl_uint) in_width, out_dist = (cl_uint) out_width;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &out);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &p->real_twiddles);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), &m);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), &in_dist);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_uint), &out_dist);
+
+  cl_event event;
+  size_t rows = p->points / p->width;
+  size_t global[2] = {out_width, rows};
+  if (status == CL_SUCCESS)
+    status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, NULL, 0, NULL, &event);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not enqueue real FFT\n");
+    print_error(status);
+    return 0;
+  }
+  complete(p, event);
+  return 1;
+}
+
+int fft_enqueue(fft_plan *p, cl_command_queue queue, fft_direction direction, cl_mem in, cl_mem out) {
+  cl_float dir = (direction == FFT_INVERSE) ? 1.0f : -1.0f;
+  cl_float scale = (direction == FFT_INVERSE) ? (cl_float) (1.0 / (p->points / p->batch)) : 1.0f;
+  size_t m = p->width / 2;
+
+  if (!p->real) {
+    // Later axes transform the output of the first in place, the last one scales
+    for (int d = 0; d < p->dims; ++d) {
+      if (!enqueue_axis(p, queue, d, p->width, dir, d == p->dims - 1 ? scale : 1.0f, d ? out : in, out))
+        return 0;
+    }
+    return 1;
+  }
+
+  // Rows of real points are transformed as m complex points, then split into
+  // the m+1 points of the half spectrum; columns run over the half spectrum
+  if (direction == FFT_FORWARD) {
+    return enqueue_axis(p, queue, 0, m, dir, 1.0f, in, p->spectrum)
+      && enqueue_real(p, queue, p->kernel_real_forward, p->spectrum, out, m, m + 1)
+      && (p->dims < 2 || enqueue_axis(p, queue, 1, m + 1, dir, 1.0f, out, out));
+  }
+
+  // Backwards, without touching in; the rows are scaled by 1/N
+  cl_mem src = in;
+  if (p->dims > 1) {
+    if (!enqueue_axis(p, queue, 1, m + 1, dir, 1.0f, in, p->spectrum))
+      return 0;
+    src = p->spectrum;
+  }
+  return enqueue_real(p, queue, p->kernel_real_inverse, src, out, m + 1, m)
+    && enqueue_axis(p, queue, 0, m, dir, scale, out, out);
+}
+
+void fft_plan_print(const fft_plan *p) {
+  printf("fft: %s", p->real ? "real " : "");
+  for (int d = 0; d < p->dims; ++d)
+    printf("%s%lu", d ? "x" : "", (unsigned long) (d ? p->axis[d].length : p->width));
+  printf(" x %lu (", (unsigned long) p->batch);
+  for (int d = 0; d < p->dims; ++d) {
+    const fft_axis *a = &p->axis[d];
+    printf("%s", d ? ", " : "");
+    for (int i = 0; i < a->passes; ++i)
+      printf("%s%d", i ? "*" : "", a->radix[i]);
+    if (a->local_size)
+      printf(" local %lu", (unsigned long) a->local_size);
+  }
+  printf("), scratch %.1f MB\n", p->scratch_size / 1048576.0);
+}
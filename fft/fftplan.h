@@ -0,0 +1,72 @@
+#ifndef FFTPLAN_H
+#define FFTPLAN_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Passes of a transform, radices 2, 3, 4, 5 and 8
+#define FFT_MAX_PASSES 16
+
+#define FFT_MAX_DIMS 2
+
+typedef enum {
+  FFT_FORWARD=0,
+  FFT_INVERSE=1
+} fft_direction;
+
+// Transform along one axis
+typedef struct {
+  size_t length;
+  int passes;
+  int radix[FFT_MAX_PASSES];
+  cl_mem twiddles;      // (cos, sin) of 2 pi k / length
+  size_t local_size;    // work-group size of fft_local, 0 if the axis runs a kernel per pass
+} fft_axis;
+
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_program program;
+  cl_kernel kernel_pass, kernel_local;
+  cl_kernel kernel_real_forward, kernel_real_inverse;
+
+  int dims;
+  int real;             // real input, half spectrum output
+  size_t batch;
+  size_t width;         // length[0], twice the length of axis 0 of real plans
+  fft_axis axis[FFT_MAX_DIMS];
+  size_t points;        // points of the whole batch in the time domain
+  cl_mem tmp;           // ping-pong buffer of the passes over global memory
+  cl_mem spectrum;      // rows before the split into the half spectrum, real plans only
+  cl_mem real_twiddles; // (cos, sin) of 2 pi k / width for k <= width/2
+  size_t scratch_size;  // bytes of tmp and spectrum
+
+  bench *b;             // if set, the kernels are recorded here
+} fft_plan;
+
+// Plan batch transforms of dims (1 or 2) dimensions of interleaved complex
+// floats. length[0] is the contiguous axis, transforms of a batch follow each
+// other. Lengths are products of 2, 3 and 5. Axes whose two buffers of points
+// fit into local memory run all passes in one kernel, others a kernel per pass.
+int fft_plan_init(fft_plan *p, cl_context context, cl_device_id device, int dims,
+    const size_t *length, size_t batch);
+void fft_plan_release(fft_plan *p);
+
+// Plan transforms of real data of an even length[0] like fft_plan_init. The
+// forward transform of a row of length[0] floats yields the first
+// length[0]/2+1 complex points of its spectrum, the rest follows by symmetry;
+// 2D transforms are the columns of these half rows. The inverse takes the half
+// spectrum back to real data. Both take half the work and memory of complex
+// transforms of the same length.
+int fft_plan_init_real(fft_plan *p, cl_context context, cl_device_id device, int dims,
+    const size_t *length, size_t batch);
+
+// Transform in into out, which may be the same buffer unless the plan is real.
+// The inverse is scaled by 1/N like the backward transform of clFFT.
+int fft_enqueue(fft_plan *p, cl_command_queue queue, fft_direction direction, cl_mem in, cl_mem out);
+
+// Radices of the passes of each axis, e.g. "512x512 (8*8*8, 8*8*8) x 1".
+void fft_plan_print(const fft_plan *p);
+
+#endif /* FFTPLAN_H */
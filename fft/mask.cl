@@ -0,0 +1,18 @@
+//
+// Frequency domain filtering of the fft example, on interleaved complex data
+// that stays on the device between the forward and the inverse transform.
+//
+
+// Scale the points by half their weight: 0 drops a point, 2 keeps it
+kernel void apply_mask(global float2 *data, global const uchar *weights, uint n) {
+    uint i = get_global_id(0);
+    if (i < n)
+        data[i] *= 0.5f*weights[i];
+}
+
+// Magnitude of every point, for the debug images
+kernel void magnitude(global const float2 *data, global float *out, uint n) {
+    uint i = get_global_id(0);
+    if (i < n)
+        out[i] = length(data[i]);
+}
@@ -0,0 +1,360 @@
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <ocllib.h>
+#include <utils.h>
+#include <bench.h>
+#include <tune.h>
+#include <hostref.h>
+
+#include "convolution.h"
+#include "fftconv.h"
+
+static cl_platform_id platform;
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue queue;
+
+static convolution conv;
+static fftconv fconv;
+static conv_mask mask;
+static cl_mem buffer_in, buffer_out;
+
+void teardown(int exit_status)
+{
+  convolution_release(&conv);
+  convolution_cache_clear();
+  fftconv_release(&fconv);
+  fftconv_cache_clear();
+  conv_mask_free(&mask);
+  if (buffer_in) clReleaseMemObject(buffer_in);
+  if (buffer_out) clReleaseMemObject(buffer_out);
+  if (queue) clReleaseCommandQueue(queue);
+  if (context) clReleaseContext(context);
+
+  exit(exit_status);
+}
+
+typedef struct {
+  cl_int width, height;
+} conv_args;
+
+// Tuning runs the 2D kernel or the first pass of a separable mask
+static int conv_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const conv_args *a = (const conv_args *) user;
+
+  int lx = 16, ly = 16;
+  sscanf(config->options, "-DLOCAL_X=%d -DLOCAL_Y=%d", &lx, &ly);
+  config->local[0] = lx;
+  config->local[1] = ly;
+
+  cl_int status = convolution_set_args(kernel, buffer_in, buffer_out, conv.weights, a->width, a->height);
+
+  work_size[0] = (a->width + lx - 1) / lx * lx;
+  work_size[1] = (a->height + ly - 1) / ly * ly;
+  return status == CL_SUCCESS;
+}
+
+// Rows of the result checked against the host, bounds the cost of large masks
+#define CHECK_ROWS 64
+
+typedef enum {
+  ENGINE_AUTO=0,
+  ENGINE_DIRECT=1,
+  ENGINE_FFT=2
+} conv_engine;
+
+static const char *engine_names[] = {"auto", "direct", "fft"};
+
+// Timed runs per engine when choosing between them, after a warm-up run
+#define ENGINE_REPS 3
+
+// Host time of the fastest run of the direct or the FFT convolution
+static double time_engine(conv_engine engine, cl_int width, cl_int height) {
+  double best = 0;
+
+  for (int i = 0; i <= ENGINE_REPS; ++i) {
+    double start = get_time();
+    int ok = (engine == ENGINE_FFT) ? fftconv_run(&fconv, buffer_in, buffer_out)
+      : convolution_run(&conv, buffer_in, buffer_out, width, height);
+    cl_int status = clFinish(queue);
+    if (!ok || status != CL_SUCCESS)
+      teardown(-1);
+
+    double seconds = get_time() - start;
+    if (i == 1 || (i > 1 && seconds < best))
+      best = seconds;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  const char *mask_name = (argc > 1) ? argv[1] : "gauss5";
+  int literals = (argc > 2 && !strcmp(argv[2], "literal"));
+  int force_2d = (argc > 3 && !strcmp(argv[3], "2d"));
+  conv_engine engine = ENGINE_AUTO;
+  if (argc > 4 && !strcmp(argv[4], "direct")) engine = ENGINE_DIRECT;
+  if (argc > 4 && !strcmp(argv[4], "fft")) engine = ENGINE_FFT;
+
+  if (argc > 5 || (argc > 2 && !literals && strcmp(argv[2], "constant"))
+      || (argc > 3 && !force_2d && strcmp(argv[3], "auto"))
+      || (argc > 4 && engine == ENGINE_AUTO && strcmp(argv[4], "auto"))) {
+    fprintf(stderr, "Usage: %s [MASK] [constant|literal] [auto|2d] [auto|direct|fft] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  MASK is boxN, gaussN, sobel-x, sobel-y, laplacian, sharpen or a file\n");
+    teardown(-1);
+  }
+
+  if (!conv_mask_preset(mask_name, &mask) && !conv_mask_load(mask_name, &mask))
+    teardown(-1);
+
+  // The direct convolution is limited to smaller masks
+  int direct_ok = mask.width <= CONV_MAX_DIRECT && mask.height <= CONV_MAX_DIRECT;
+  if (engine == ENGINE_DIRECT && !direct_ok) {
+    fprintf(stderr, "Error: direct convolution supports masks up to %dx%d, use fft\n", CONV_MAX_DIRECT, CONV_MAX_DIRECT);
+    teardown(-1);
+  }
+  if (!direct_ok)
+    engine = ENGINE_FFT;
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  cl_event event;
+
+  unsigned char *data;
+  size_t datasize;
+
+  if (!load_file("lena.dat", &data, &datasize)) {
+    teardown(-1);
+  }
+
+  size_t width  = 512;
+  size_t height = 512;
+
+  // Larger problem sizes repeat the input image
+  if (opts.size && opts.size != width) {
+    unsigned char *tiled = tile_image(data, width, height, opts.size, opts.size);
+    free(data);
+    data = tiled;
+    if (!data) teardown(-1);
+    width = height = opts.size;
+  }
+  size_t buf_size = width*height*sizeof(cl_float);
+
+  float *data_in  = malloc(buf_size);
+  float *data_out = malloc(buf_size);
+  if (!data_in || !data_out) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
+  }
+
+  for (size_t i = 0; i < width*height; ++i) {
+    data_in[i] = data[i];
+  }
+
+  buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY, buf_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_in");
+
+  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
+  checkError(status, "Error: could not create buffer_out");
+
+  if (engine != ENGINE_FFT) {
+    if (!convolution_init(&conv, context, device, queue, &mask, literals, !force_2d, NULL))
+      teardown(-1);
+
+    //
+    // Select the work-group size: run the auto-tuner or use the tuning database
+    //
+    conv_args args = {(cl_int) width, (cl_int) height};
+
+    char key[256];
+    snprintf(key, sizeof(key), "conv-%dx%d-%s-%s-%lux%lu", mask.width, mask.height,
+        conv.separable ? "separable" : "2d", conv.literals ? "literal" : "constant",
+        (unsigned long) width, (unsigned long) height);
+
+    tune_config config = {2, {16, 16, 1}, "", 0};
+
+    if (opts.tune) {
+      char *options = convolution_options(&mask, conv.literals, conv.separable);
+      if (!options) {
+        fprintf(stderr,"\nError: malloc failed\n");
+        teardown(-1);
+      }
+
+      char variants[16][TUNE_MAX_OPTIONS];
+      const char *variant_list[17];
+      int n = 0;
+      for (int lx = 8; lx <= 64; lx *= 2) {
+        for (int ly = 1; ly <= 32 && lx*ly <= 1024; ly *= 2) {
+          if (n < 16 && lx*ly >= 64) {
+            snprintf(variants[n], TUNE_MAX_OPTIONS, "-DLOCAL_X=%d -DLOCAL_Y=%d", lx, ly);
+            variant_list[n] = variants[n];
+            n++;
+          }
+        }
+      }
+      variant_list[n] = NULL;
+
+      tune_problem problem = {KERNELDIR "/convolve.cl", conv.separable ? "conv_rows" : "conv_2d",
+        options, variant_list, 2, 1, 1, conv_setup, &args};
+
+      tune_config tuned;
+      if (tune_kernel(context, device, queue, &problem, key, &tuned))
+        config = tuned;
+      free(options);
+    } else {
+      tune_lookup(device, key, &config);
+    }
+
+    if (config.local[0] != conv.local[0] || config.local[1] != conv.local[1]) {
+      convolution_release(&conv);
+      if (!convolution_init(&conv, context, device, queue, &mask, literals, !force_2d, config.local))
+        teardown(-1);
+    }
+  }
+
+  if (engine != ENGINE_DIRECT && !fftconv_init(&fconv, context, device, queue, &mask, width, height))
+    teardown(-1);
+
+  //
+  // Choose between the direct and the FFT convolution: measure both once per
+  // device, mask and image size and keep the faster in the tuning database
+  //
+  if (engine == ENGINE_AUTO) {
+    char engine_key[256];
+    snprintf(engine_key, sizeof(engine_key), "conv-engine-%dx%d-%s-%s-%lux%lu", mask.width, mask.height,
+        conv.separable ? "separable" : "2d", conv.literals ? "literal" : "constant",
+        (unsigned long) width, (unsigned long) height);
+
+    tune_config choice;
+    if (!opts.tune && tune_lookup(device, engine_key, &choice)) {
+      engine = strcmp(choice.options, "fft") ? ENGINE_DIRECT : ENGINE_FFT;
+      printf("engine: %s from the tuning database\n", engine_names[engine]);
+    } else {
+      status = clEnqueueWriteBuffer(queue, buffer_in, CL_TRUE, 0, buf_size, data_in, 0, NULL, NULL);
+      checkError(status, "Error: could not copy data into device");
+
+      double direct_time = time_engine(ENGINE_DIRECT, (cl_int) width, (cl_int) height);
+      double fft_time = time_engine(ENGINE_FFT, (cl_int) width, (cl_int) height);
+      engine = (fft_time < direct_time) ? ENGINE_FFT : ENGINE_DIRECT;
+      printf("engine: %s, direct %.3f ms, fft %.3f ms\n", engine_names[engine],
+          direct_time * 1e3, fft_time * 1e3);
+
+      memset(&choice, 0, sizeof(choice));
+      strcpy(choice.options, engine_names[engine]);
+      choice.time = (engine == ENGINE_FFT) ? fft_time : direct_time;
+      tune_store(device, engine_key, &choice);
+    }
+
+    if (engine == ENGINE_FFT)
+      convolution_release(&conv);
+    else
+      fftconv_release(&fconv);
+  }
+
+  char variant[64];
+  if (engine == ENGINE_FFT) {
+    printf("mask: %s %dx%d, fft\n", mask_name, mask.width, mask.height);
+    fftconv_print(&fconv);
+    snprintf(variant, sizeof(variant), "%dx%d-fft", mask.width, mask.height);
+  } else {
+    printf("mask: %s %dx%d, %s, %s, local {%lu, %lu}\n", mask_name, mask.width, mask.height,
+        conv.separable ? "separable" : "2d", conv.literals ? "literal" : "constant",
+        (unsigned long) conv.local[0], (unsigned long) conv.local[1]);
+    snprintf(variant, sizeof(variant), "%dx%d-%s-%s", mask.width, mask.height,
+        conv.separable ? "separable" : "2d", conv.literals ? "literal" : "constant");
+  }
+
+  bench b;
+  if (!bench_init(&b, &opts, "conv", variant, width)) {
+    teardown(-1);
+  }
+  bench_set_rate(&b, width*height*1e-6, "MPixel/s");
+
+  conv.b = &b;
+  fconv.b = &b;
+  int ok = 1;
+  while (ok && bench_next(&b)) {
+    status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, &event);
+    checkError(status, "Error: could not copy data into device");
+    bench_event(&b, BENCH_H2D, event);
+
+    if (engine == ENGINE_FFT)
+      ok = fftconv_run(&fconv, buffer_in, buffer_out);
+    else
+      ok = convolution_run(&conv, buffer_in, buffer_out, (cl_int) width, (cl_int) height);
+
+    // read results back
+    status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, buf_size, data_out, 0, NULL, &event);
+    checkError(status, "Error: could not copy data into device");
+    bench_event(&b, BENCH_D2H, event);
+  }
+  conv.b = NULL;
+  fconv.b = NULL;
+
+  status  = clFinish(queue);
+  checkError(status, "Error: could not finish successfully");
+
+  if (ok)
+    bench_report(&b);
+  bench_free(&b);
+
+  //
+  // Compare the first rows with the host
+  //
+  size_t rows = height < CHECK_ROWS ? height : CHECK_ROWS;
+  float *ref = malloc(rows*width*sizeof(float));
+  if (ok && ref) {
+    int rx = mask.width/2, ry = mask.height/2;
+    for (int y = 0; y < (int) rows; ++y) {
+      for (int x = 0; x < (int) width; ++x) {
+        double sum = 0;
+        for (int j = 0; j < mask.height; ++j) {
+          int yj = y + j - ry < 0 ? 0 : (y + j - ry >= (int) height ? (int) height - 1 : y + j - ry);
+          for (int i = 0; i < mask.width; ++i) {
+            int xi = x + i - rx < 0 ? 0 : (x + i - rx >= (int) width ? (int) width - 1 : x + i - rx);
+            sum += mask.values[j*mask.width + i] * data_in[(size_t) yj*width + xi];
+          }
+        }
+        ref[(size_t) y*width + x] = (float) sum;
+      }
+    }
+    compare_float(ref, data_out, rows*width, 1e-3f, 1e-2f);
+  }
+  free(ref);
+
+  write_bmp("conv.bmp", data_out, width, height, DYNAMIC);
+
+  free(data);
+  free(data_in);
+  free(data_out);
+  teardown(ok ? 0 : -1);
+}
@@ -0,0 +1,403 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+#include "convolution.h"
+
+//
+// Masks
+//
+
+static int mask_alloc(conv_mask *mask, int width, int height) {
+  mask->width = width;
+  mask->height = height;
+  mask->values = calloc((size_t) width * height, sizeof(float));
+  return mask->values != NULL;
+}
+
+int conv_mask_preset(const char *name, conv_mask *mask) {
+  static const float sobel_x[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+  static const float sobel_y[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+  static const float laplacian[] = {0, 1, 0, 1, -4, 1, 0, 1, 0};
+  static const float sharpen[] = {0, -1, 0, -1, 5, -1, 0, -1, 0};
+  const float *values = NULL;
+  int n = 0;
+
+  memset(mask, 0, sizeof(conv_mask));
+
+  if (!strcmp(name, "sobel-x")) values = sobel_x;
+  if (!strcmp(name, "sobel-y")) values = sobel_y;
+  if (!strcmp(name, "laplacian")) values = laplacian;
+  if (!strcmp(name, "sharpen")) values = sharpen;
+
+  if (values) {
+    if (!mask_alloc(mask, 3, 3))
+      return 0;
+    memcpy(mask->values, values, 9 * sizeof(float));
+    return 1;
+  }
+
+  if (sscanf(name, "box%d", &n) == 1 && n > 0 && n % 2 && n <= CONV_MAX_MASK) {
+    if (!mask_alloc(mask, n, n))
+      return 0;
+    for (int i = 0; i < n*n; ++i)
+      mask->values[i] = 1.0f / (n*n);
+    return 1;
+  }
+
+  if (sscanf(name, "gauss%d", &n) == 1 && n > 0 && n % 2 && n <= CONV_MAX_MASK) {
+    // Binomial coefficients approximate the Gaussian
+    double row[CONV_MAX_MASK];
+    double sum = 0;
+    row[0] = 1;
+    for (int i = 1; i < n; ++i)
+      row[i] = row[i-1] * (n - i) / i;
+    for (int i = 0; i < n; ++i)
+      sum += row[i];
+
+    if (!mask_alloc(mask, n, n))
+      return 0;
+    for (int y = 0; y < n; ++y)
+      for (int x = 0; x < n; ++x)
+        mask->values[y*n + x] = (float) (row[y] * row[x] / (sum * sum));
+    return 1;
+  }
+
+  return 0;
+}
+
+int conv_mask_load(const char *name, conv_mask *mask) {
+  int width, height;
+
+  memset(mask, 0, sizeof(conv_mask));
+
+  FILE *f = fopen(name, "r");
+  if (!f) {
+    fprintf(stderr, "Error: could not open mask %s\n", name);
+    return 0;
+  }
+
+  if (fscanf(f, "%d %d", &width, &height) != 2 || width < 1 || height < 1 || !(width % 2) || !(height % 2)
+      || width > CONV_MAX_MASK || height > CONV_MAX_MASK) {
+    fprintf(stderr, "Error: mask %s must start with an odd width and height up to %d\n", name, CONV_MAX_MASK);
+    fclose(f);
+    return 0;
+  }
+
+  if (!mask_alloc(mask, width, height)) {
+    fclose(f);
+    return 0;
+  }
+
+  for (int i = 0; i < width*height; ++i) {
+    if (fscanf(f, "%f", &mask->values[i]) != 1) {
+      fprintf(stderr, "Error: mask %s has fewer than %d values\n", name, width*height);
+      conv_mask_free(mask);
+      fclose(f);
+      return 0;
+    }
+  }
+
+  fclose(f);
+  return 1;
+}
+
+void conv_mask_free(conv_mask *mask) {
+  free(mask->values);
+  mask->values = NULL;
+}
+
+int conv_mask_separable(const conv_mask *mask, float *row, float *col) {
+  const int w = mask->width, h = mask->height;
+  const float *m = mask->values;
+
+  // The largest value is the pivot of the rank-1 factorization
+  int px = 0, py = 0;
+  float max = 0;
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      if (fabsf(m[y*w + x]) > max) {
+        max = fabsf(m[y*w + x]);
+        px = x;
+        py = y;
+      }
+
+  if (max == 0)
+    return 0;
+
+  const float pivot = m[py*w + px];
+  for (int x = 0; x < w; ++x)
+    row[x] = m[py*w + x];
+  for (int y = 0; y < h; ++y)
+    col[y] = m[y*w + px] / pivot;
+
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      if (fabsf(col[y] * row[x] - m[y*w + x]) > 1e-6f * max)
+        return 0;
+  return 1;
+}
+
+//
+// Program cache: programs are specialized for the shape of a mask, and for
+// its values if they are baked in, so convolutions of the same shape share
+// one program.
+//
+
+#define CONV_CACHE_SIZE 16
+
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  char *options;
+  cl_program program;
+} cache_entry;
+
+static cache_entry cache[CONV_CACHE_SIZE];
+static int cache_next;
+
+// Returns a program for options that the caller has to release, NULL on failure
+static cl_program cached_program(cl_context context, cl_device_id device, const char *options, int *hit) {
+  cl_program program = NULL;
+
+  for (int i = 0; i < CONV_CACHE_SIZE; ++i) {
+    if (cache[i].program && cache[i].context == context && cache[i].device == device
+        && !strcmp(cache[i].options, options)) {
+      clRetainProgram(cache[i].program);
+      *hit = 1;
+      return cache[i].program;
+    }
+  }
+
+  *hit = 0;
+  if (!create_program(KERNELDIR "/convolve.cl", &program, context, device, options)) {
+    if (program) {
+      print_build_log(program, device);
+      clReleaseProgram(program);
+    }
+    return NULL;
+  }
+
+  // Replace the oldest entry
+  cache_entry *e = &cache[cache_next];
+  cache_next = (cache_next + 1) % CONV_CACHE_SIZE;
+  if (e->program) clReleaseProgram(e->program);
+  free(e->options);
+
+  e->options = malloc(strlen(options) + 1);
+  if (e->options) {
+    strcpy(e->options, options);
+    e->context = context;
+    e->device = device;
+    e->program = program;
+    clRetainProgram(program);
+  } else {
+    e->program = NULL;
+  }
+  return program;
+}
+
+void convolution_cache_clear(void) {
+  for (int i = 0; i < CONV_CACHE_SIZE; ++i) {
+    if (cache[i].program) clReleaseProgram(cache[i].program);
+    free(cache[i].options);
+    memset(&cache[i], 0, sizeof(cache_entry));
+  }
+  cache_next = 0;
+}
+
+//
+// Convolution
+//
+
+// Append " -Dname=v0,v1,..." with exact float literals
+static char *append_values(char *p, const char *name, const float *values, int n) {
+  p += sprintf(p, " -D%s=", name);
+  for (int i = 0; i < n; ++i)
+    p += sprintf(p, "%s%.9ef", i ? "," : "", values[i]);
+  return p;
+}
+
+char *convolution_options(const conv_mask *mask, int literals, int separable) {
+  const int n = mask->width * mask->height;
+  float row[CONV_MAX_MASK], col[CONV_MAX_MASK];
+
+  if (n > CONV_MAX_LITERALS)
+    literals = 0;
+  if (separable && !conv_mask_separable(mask, row, col))
+    separable = 0;
+
+  // at most 20 characters per value
+  char *options = malloc(128 + (literals ? 20 * (size_t) (n + mask->width + mask->height) : 0));
+  if (!options)
+    return NULL;
+
+  char *p = options;
+  p += sprintf(p, "-I. -DMASK_W=%d -DMASK_H=%d", mask->width, mask->height);
+  if (literals) {
+    if (separable) {
+      p = append_values(p, "ROW_VALUES", row, mask->width);
+      p = append_values(p, "COL_VALUES", col, mask->height);
+    } else {
+      p = append_values(p, "MASK_VALUES", mask->values, n);
+    }
+  }
+  return options;
+}
+
+cl_int convolution_set_args(cl_kernel kernel, cl_mem in, cl_mem out, cl_mem weights,
+    cl_int width, cl_int height) {
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &out);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &weights);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &width);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &height);
+  return status;
+}
+
+int convolution_init(convolution *c, cl_context context, cl_device_id device, cl_command_queue queue,
+    const conv_mask *mask, int literals, int allow_separable, const size_t *local) {
+  float row[CONV_MAX_MASK], col[CONV_MAX_MASK];
+  cl_int status;
+
+  memset(c, 0, sizeof(convolution));
+  c->context = context;
+  c->device = device;
+  c->queue = queue;
+  c->mask_width = mask->width;
+  c->mask_height = mask->height;
+  c->separable = allow_separable && conv_mask_separable(mask, row, col);
+  c->literals = literals && mask->width * mask->height <= CONV_MAX_LITERALS;
+  c->local[0] = local ? local[0] : 16;
+  c->local[1] = local ? local[1] : 16;
+
+  if (mask->width < 1 || mask->height < 1 || !(mask->width % 2) || !(mask->height % 2)
+      || mask->width > CONV_MAX_DIRECT || mask->height > CONV_MAX_DIRECT) {
+    fprintf(stderr, "Error: invalid mask size %dx%d\n", mask->width, mask->height);
+    return 0;
+  }
+
+  char *options = convolution_options(mask, c->literals, c->separable);
+  char *build_options = options ? malloc(strlen(options) + 64) : NULL;
+  if (!build_options) {
+    fprintf(stderr, "Error: malloc failed\n");
+    free(options);
+    return 0;
+  }
+  sprintf(build_options, "%s -DLOCAL_X=%lu -DLOCAL_Y=%lu", options,
+      (unsigned long) c->local[0], (unsigned long) c->local[1]);
+  free(options);
+
+  c->program = cached_program(context, device, build_options, &c->cache_hit);
+  free(build_options);
+  if (!c->program)
+    return 0;
+
+  if (c->separable) {
+    c->kernel_rows = clCreateKernel(c->program, "conv_rows", &status);
+    if (status == CL_SUCCESS)
+      c->kernel_cols = clCreateKernel(c->program, "conv_cols", &status);
+  } else {
+    c->kernel_2d = clCreateKernel(c->program, "conv_2d", &status);
+  }
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create convolution kernels\n");
+    print_error(status);
+    convolution_release(c);
+    return 0;
+  }
+
+  // The weights are passed even if they are baked into the program
+  if (c->separable) {
+    c->weights = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        mask->width * sizeof(cl_float), row, &status);
+    if (status == CL_SUCCESS)
+      c->col_weights = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+          mask->height * sizeof(cl_float), col, &status);
+  } else {
+    c->weights = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        mask->width * mask->height * sizeof(cl_float), mask->values, &status);
+  }
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create convolution weights\n");
+    print_error(status);
+    convolution_release(c);
+    return 0;
+  }
+  return 1;
+}
+
+void convolution_release(convolution *c) {
+  if (c->weights) clReleaseMemObject(c->weights);
+  if (c->col_weights) clReleaseMemObject(c->col_weights);
+  if (c->tmp) clReleaseMemObject(c->tmp);
+  if (c->kernel_2d) clReleaseKernel(c->kernel_2d);
+  if (c->kernel_rows) clReleaseKernel(c->kernel_rows);
+  if (c->kernel_cols) clReleaseKernel(c->kernel_cols);
+  if (c->program) clReleaseProgram(c->program);
+  c->weights = c->col_weights = c->tmp = NULL;
+  c->kernel_2d = c->kernel_rows = c->kernel_cols = NULL;
+  c->program = NULL;
+}
+
+static int enqueue(convolution *c, cl_kernel kernel, cl_mem in, cl_mem out, cl_mem weights,
+    cl_int width, cl_int height) {
+  size_t global[2] = {
+    (width + c->local[0] - 1) / c->local[0] * c->local[0],
+    (height + c->local[1] - 1) / c->local[1] * c->local[1]
+  };
+  cl_event event;
+
+  cl_int status = convolution_set_args(kernel, in, out, weights, width, height);
+  if (status == CL_SUCCESS)
+    status = clEnqueueNDRangeKernel(c->queue, kernel, 2, NULL, global, c->local, 0, NULL, &event);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not enqueue convolution\n");
+    print_error(status);
+    return 0;
+  }
+
+  if (c->b)
+    bench_event(c->b, BENCH_KERNEL, event);
+  else
+    clReleaseEvent(event);
+  return 1;
+}
+
+int convolution_run(convolution *c, cl_mem in, cl_mem out, cl_int width, cl_int height) {
+  cl_int status;
+
+  if (!c->separable)
+    return enqueue(c, c->kernel_2d, in, out, c->weights, width, height);
+
+  // (Re)allocate the intermediate image if it is too small
+  size_t tmp_size = (size_t) width * height * sizeof(cl_float);
+  size_t current_size = 0;
+  if (c->tmp)
+    clGetMemObjectInfo(c->tmp, CL_MEM_SIZE, sizeof(size_t), &current_size, NULL);
+  if (current_size < tmp_size) {
+    if (c->tmp) clReleaseMemObject(c->tmp);
+    c->tmp = clCreateBuffer(c->context, CL_MEM_READ_WRITE, tmp_size, NULL, &status);
+    if (status != CL_SUCCESS) {
+      c->tmp = NULL;
+      fprintf(stderr, "Error: could not create convolution buffer\n");
+      print_error(status);
+      return 0;
+    }
+  }
+
+  return enqueue(c, c->kernel_rows, in, c->tmp, c->weights, width, height)
+    && enqueue(c, c->kernel_cols, c->tmp, out, c->col_weights, width, height);
+}
@@ -0,0 +1,79 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Largest mask dimension
+#define CONV_MAX_MASK 127
+
+// Largest mask dimension of the direct convolution of convolve.cl, larger
+// masks are run through the FFT by fftconv.c
+#define CONV_MAX_DIRECT 31
+
+// Masks with at most this many values are baked into the program as literals
+#define CONV_MAX_LITERALS 256
+
+typedef struct {
+  int width, height;  // odd
+  float *values;      // row by row
+} conv_mask;
+
+// Predefined masks: boxN, gaussN (binomial), sobel-x, sobel-y, laplacian,
+// sharpen. Returns 0 for unknown names.
+int conv_mask_preset(const char *name, conv_mask *mask);
+
+// Read a mask from a text file: width and height, then the values row by row.
+int conv_mask_load(const char *name, conv_mask *mask);
+void conv_mask_free(conv_mask *mask);
+
+// Factor mask into row (width values) and col (height values) such that
+// mask[y][x] = col[y] * row[x]. Returns 0 if the mask is not separable.
+int conv_mask_separable(const conv_mask *mask, float *row, float *col);
+
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;       // shared with other convolutions of the same shape
+  cl_kernel kernel_2d;      // full mask, if not separable
+  cl_kernel kernel_rows;    // first pass of a separable mask
+  cl_kernel kernel_cols;    // second pass of a separable mask
+
+  int mask_width, mask_height;
+  int separable;
+  int literals;             // mask values are baked into the program
+  size_t local[2];
+  int cache_hit;            // program was taken from the program cache
+
+  cl_mem weights;           // 2D mask or row weights
+  cl_mem col_weights;       // column weights of a separable mask
+  cl_mem tmp;               // result of the first pass
+
+  bench *b;                 // if set, kernels are recorded here
+} convolution;
+
+// Build options specializing convolve.cl for mask, without the work-group
+// size. Returns a string to be freed by the caller, NULL on failure.
+char *convolution_options(const conv_mask *mask, int literals, int separable);
+
+// Build, or take from the program cache, the kernels for mask. literals
+// bakes the values into the program, if there are at most CONV_MAX_LITERALS.
+// Separable masks are run as two 1D passes unless allow_separable is 0.
+// local is the work-group size, NULL for the default. Masks are limited to
+// CONV_MAX_DIRECT.
+int convolution_init(convolution *c, cl_context context, cl_device_id device, cl_command_queue queue,
+    const conv_mask *mask, int literals, int allow_separable, const size_t *local);
+void convolution_release(convolution *c);
+
+cl_int convolution_set_args(cl_kernel kernel, cl_mem in, cl_mem out, cl_mem weights,
+    cl_int width, cl_int height);
+
+// Convolve the width x height float image in into out
+int convolution_run(convolution *c, cl_mem in, cl_mem out, cl_int width, cl_int height);
+
+// Release all cached programs
+void convolution_cache_clear(void);
+
+#endif /* CONVOLUTION_H */
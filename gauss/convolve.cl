@@ -0,0 +1,134 @@
+// 2D convolution specialized at build time for one mask shape, see
+// convolution.c. The mask is applied as a correlation, like in gauss.cl,
+// pixels beyond the border are clamped to the edge.
+//
+// Build options:
+//   -DMASK_W=w -DMASK_H=h      mask size, both odd
+//   -DLOCAL_X=x -DLOCAL_Y=y    work-group size
+//   -DMASK_VALUES=a,b,...      bake the 2D mask into the program instead of
+//                              reading it from the weights argument
+//   -DROW_VALUES=... -DCOL_VALUES=...
+//                              the same for the 1D masks of the separable passes
+//
+// With known sizes all loops over the mask are unrolled, with baked values the
+// multiplications with zero and one are folded away by the compiler.
+
+#ifndef LOCAL_X
+#define LOCAL_X 16
+#endif
+#ifndef LOCAL_Y
+#define LOCAL_Y 16
+#endif
+
+#define RX (MASK_W/2)
+#define RY (MASK_H/2)
+
+#ifdef MASK_VALUES
+constant float mask_values[] = {MASK_VALUES};
+#define MASK(w, i) mask_values[i]
+#else
+#define MASK(w, i) w[i]
+#endif
+
+#ifdef ROW_VALUES
+constant float row_values[] = {ROW_VALUES};
+#define ROW(w, i) row_values[i]
+#else
+#define ROW(w, i) w[i]
+#endif
+
+#ifdef COL_VALUES
+constant float col_values[] = {COL_VALUES};
+#define COL(w, i) col_values[i]
+#else
+#define COL(w, i) w[i]
+#endif
+
+#define CLAMP_X(x) clamp(x, 0, width-1)
+#define CLAMP_Y(y) clamp(y, 0, height-1)
+
+// Full MASK_W x MASK_H mask, weights holds it row by row
+kernel __attribute__((reqd_work_group_size(LOCAL_X, LOCAL_Y, 1)))
+void conv_2d(global const float *in, global float *out, constant float *weights, int width, int height) {
+    local float tile[LOCAL_Y + 2*RY][LOCAL_X + 2*RX];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int x0 = get_group_id(0)*LOCAL_X - RX;
+    const int y0 = get_group_id(1)*LOCAL_Y - RY;
+
+    for (int j = ly; j < LOCAL_Y + 2*RY; j += LOCAL_Y)
+        for (int i = lx; i < LOCAL_X + 2*RX; i += LOCAL_X)
+            tile[j][i] = in[CLAMP_Y(y0 + j)*width + CLAMP_X(x0 + i)];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= width || y >= height)
+        return;
+
+    float sum = 0.0f;
+    #pragma unroll
+    for (int j = 0; j < MASK_H; j++) {
+        #pragma unroll
+        for (int i = 0; i < MASK_W; i++)
+            sum += MASK(weights, j*MASK_W + i) * tile[ly + j][lx + i];
+    }
+
+    out[y*width + x] = sum;
+}
+
+// First pass of a separable mask: the MASK_W weights of the rows
+kernel __attribute__((reqd_work_group_size(LOCAL_X, LOCAL_Y, 1)))
+void conv_rows(global const float *in, global float *out, constant float *weights, int width, int height) {
+    local float tile[LOCAL_Y][LOCAL_X + 2*RX];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int x0 = get_group_id(0)*LOCAL_X - RX;
+    const int y = CLAMP_Y((int) get_global_id(1));
+
+    for (int i = lx; i < LOCAL_X + 2*RX; i += LOCAL_X)
+        tile[ly][i] = in[y*width + CLAMP_X(x0 + i)];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int x = get_global_id(0);
+    if (x >= width || get_global_id(1) >= height)
+        return;
+
+    float sum = 0.0f;
+    #pragma unroll
+    for (int i = 0; i < MASK_W; i++)
+        sum += ROW(weights, i) * tile[ly][lx + i];
+
+    out[y*width + x] = sum;
+}
+
+// Second pass of a separable mask: the MASK_H weights of the columns
+kernel __attribute__((reqd_work_group_size(LOCAL_X, LOCAL_Y, 1)))
+void conv_cols(global const float *in, global float *out, constant float *weights, int width, int height) {
+    local float tile[LOCAL_Y + 2*RY][LOCAL_X];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int x = CLAMP_X((int) get_global_id(0));
+    const int y0 = get_group_id(1)*LOCAL_Y - RY;
+
+    for (int j = ly; j < LOCAL_Y + 2*RY; j += LOCAL_Y)
+        tile[j][lx] = in[CLAMP_Y(y0 + j)*width + x];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int y = get_global_id(1);
+    if (get_global_id(0) >= width || y >= height)
+        return;
+
+    float sum = 0.0f;
+    #pragma unroll
+    for (int j = 0; j < MASK_H; j++)
+        sum += COL(weights, j) * tile[ly + j][lx];
+
+    out[y*width + x] = sum;
+}
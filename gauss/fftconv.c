@@ -0,0 +1,370 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <hostref.h>
+#include <fftplan.h>
+
+#include "fftconv.h"
+
+// Padding, multiplying and adding up a tile cost about as much as this many
+// FFT passes over it
+#define TILE_OVERHEAD 4.0
+
+//
+// Spectrum cache: the mask spectrum depends on the mask values and the tile
+// size only, so repeated filtering with the same mask computes it once.
+//
+
+#define FFTCONV_CACHE_SIZE 16
+
+typedef struct {
+  cl_context context;
+  size_t tile[2];
+  int width, height;
+  float *values;
+  cl_mem spectrum;
+} cache_entry;
+
+static cache_entry cache[FFTCONV_CACHE_SIZE];
+static int cache_next;
+
+static int same_mask(const cache_entry *e, const fftconv *c, const conv_mask *mask) {
+  return e->spectrum && e->context == c->context && e->tile[0] == c->tile[0] && e->tile[1] == c->tile[1]
+    && e->width == mask->width && e->height == mask->height
+    && !memcmp(e->values, mask->values, (size_t) mask->width * mask->height * sizeof(float));
+}
+
+// Half spectrum of the mask, flipped for the correlation of convolve.cl and
+// centered at the origin of a tile. Computed in double precision on the host.
+static cl_mem compute_spectrum(const fftconv *c, const conv_mask *mask) {
+  const size_t nx = c->tile[0], ny = c->tile[1], half = nx / 2 + 1;
+  const int rx = mask->width / 2, ry = mask->height / 2;
+  cl_int status;
+
+  float *data = calloc(2 * nx * ny, sizeof(float));
+  if (!data) {
+    fprintf(stderr, "Error: malloc failed\n");
+    return NULL;
+  }
+
+  for (int y = 0; y < mask->height; ++y) {
+    for (int x = 0; x < mask->width; ++x) {
+      size_t u = (rx - x + nx) % nx, v = (ry - y + ny) % ny;
+      data[2 * (v*nx + u)] = mask->values[y*mask->width + x];
+    }
+  }
+
+  if (!host_fft(data, nx, ny, 1, nx, -1) || !host_fft(data, ny, nx, nx, 1, -1)) {
+    fprintf(stderr, "Error: malloc failed\n");
+    free(data);
+    return NULL;
+  }
+
+  // Keep the first half+1 points of every row
+  for (size_t v = 1; v < ny; ++v)
+    memmove(data + 2 * v*half, data + 2 * v*nx, 2 * half * sizeof(float));
+
+  cl_mem spectrum = clCreateBuffer(c->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+      2 * half * ny * sizeof(cl_float), data, &status);
+  free(data);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create mask spectrum\n");
+    print_error(status);
+    return NULL;
+  }
+  return spectrum;
+}
+
+// Returns a spectrum that the caller has to release, NULL on failure
+static cl_mem cached_spectrum(const fftconv *c, const conv_mask *mask, int *hit) {
+  for (int i = 0; i < FFTCONV_CACHE_SIZE; ++i) {
+    if (same_mask(&cache[i], c, mask)) {
+      clRetainMemObject(cache[i].spectrum);
+      *hit = 1;
+      return cache[i].spectrum;
+    }
+  }
+
+  *hit = 0;
+  cl_mem spectrum = compute_spectrum(c, mask);
+  if (!spectrum)
+    return NULL;
+
+  // Replace the oldest entry
+  cache_entry *e = &cache[cache_next];
+  cache_next = (cache_next + 1) % FFTCONV_CACHE_SIZE;
+  if (e->spectrum) clReleaseMemObject(e->spectrum);
+  free(e->values);
+
+  size_t values_size = (size_t) mask->width * mask->height * sizeof(float);
+  e->values = malloc(values_size);
+  if (e->values) {
+    memcpy(e->values, mask->values, values_size);
+    e->context = c->context;
+    e->tile[0] = c->tile[0];
+    e->tile[1] = c->tile[1];
+    e->width = mask->width;
+    e->height = mask->height;
+    e->spectrum = spectrum;
+    clRetainMemObject(spectrum);
+  } else {
+    e->spectrum = NULL;
+  }
+  return spectrum;
+}
+
+void fftconv_cache_clear(void) {
+  for (int i = 0; i < FFTCONV_CACHE_SIZE; ++i) {
+    if (cache[i].spectrum) clReleaseMemObject(cache[i].spectrum);
+    free(cache[i].values);
+    memset(&cache[i], 0, sizeof(cache_entry));
+  }
+  cache_next = 0;
+}
+
+//
+// Convolution
+//
+
+static int smooth(size_t n) {
+  static const size_t primes[] = {2, 3, 5};
+  for (int i = 0; i < 3; ++i)
+    while (n % primes[i] == 0)
+      n /= primes[i];
+  return n == 1;
+}
+
+// Tile lengths with the fewest operations for the whole image: larger tiles
+// waste less on the overlap, but take longer per point
+static int choose_tiles(fftconv *c) {
+  const size_t rx = c->mask_width / 2, ry = c->mask_height / 2;
+  double best = 0;
+
+  c->tile[0] = c->tile[1] = 0;
+  for (size_t nx = 2*rx + 2; nx <= FFTCONV_MAX_TILE; ++nx) {
+    if (nx % 2 || nx < 4 || !smooth(nx))
+      continue;
+    for (size_t ny = 2*ry + 2; ny <= FFTCONV_MAX_TILE; ++ny) {
+      if (!smooth(ny))
+        continue;
+      size_t bx = nx - 2*rx, by = ny - 2*ry;
+      double tiles = (double) ((c->width + 2*rx + bx - 1) / bx) * ((c->height + 2*ry + by - 1) / by);
+      double cost = tiles * nx * ny * (log2((double) nx * ny) + TILE_OVERHEAD);
+      if (!c->tile[0] || cost < best) {
+        best = cost;
+        c->tile[0] = nx;
+        c->tile[1] = ny;
+      }
+    }
+  }
+
+  if (!c->tile[0]) {
+    fprintf(stderr, "Error: mask %dx%d is too large for FFT tiles of %d points\n",
+        c->mask_width, c->mask_height, FFTCONV_MAX_TILE);
+    return 0;
+  }
+
+  for (int d = 0; d < 2; ++d) {
+    size_t r = (d ? c->mask_height : c->mask_width) / 2;
+    c->block[d] = c->tile[d] - 2*r;
+    c->tiles[d] = ((d ? c->height : c->width) + 2*r + c->block[d] - 1) / c->block[d];
+  }
+
+  // Bands of about equal size whose spectra fit into FFTCONV_BATCH_BYTES
+  size_t band_bytes = c->tiles[0] * (c->tile[0] / 2 + 1) * c->tile[1] * 2 * sizeof(cl_float);
+  size_t rows = FFTCONV_BATCH_BYTES / band_bytes;
+  if (rows < 1) rows = 1;
+  size_t bands = (c->tiles[1] + rows - 1) / rows;
+  c->band = (c->tiles[1] + bands - 1) / bands;
+  return 1;
+}
+
+static cl_mem create_buffer(fftconv *c, size_t size) {
+  cl_int status;
+  cl_mem buffer = clCreateBuffer(c->context, CL_MEM_READ_WRITE, size, NULL, &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create FFT convolution buffer\n");
+    print_error(status);
+    return NULL;
+  }
+  return buffer;
+}
+
+int fftconv_init(fftconv *c, cl_context context, cl_device_id device, cl_command_queue queue,
+    const conv_mask *mask, size_t width, size_t height) {
+  cl_int status;
+
+  memset(c, 0, sizeof(fftconv));
+  c->context = context;
+  c->device = device;
+  c->queue = queue;
+  c->mask_width = mask->width;
+  c->mask_height = mask->height;
+  c->width = width;
+  c->height = height;
+
+  if (mask->width < 1 || mask->height < 1 || !(mask->width % 2) || !(mask->height % 2)) {
+    fprintf(stderr, "Error: invalid mask size %dx%d\n", mask->width, mask->height);
+    return 0;
+  }
+  if (!choose_tiles(c))
+    return 0;
+
+  if (!create_program(KERNELDIR "/fftconv.cl", &c->program, context, device, "")) {
+    if (c->program) print_build_log(c->program, device);
+    fftconv_release(c);
+    return 0;
+  }
+
+  c->kernel_pad = clCreateKernel(c->program, "tile_pad", &status);
+  if (status == CL_SUCCESS)
+    c->kernel_multiply = clCreateKernel(c->program, "multiply_spectrum", &status);
+  if (status == CL_SUCCESS)
+    c->kernel_add = clCreateKernel(c->program, "overlap_add", &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create FFT convolution kernels\n");
+    print_error(status);
+    fftconv_release(c);
+    return 0;
+  }
+
+  size_t batch = c->band * c->tiles[0];
+  size_t points = c->tile[0] * c->tile[1] * batch;
+  if (!fft_plan_init_real(&c->plan, context, device, 2, c->tile, batch)) {
+    fftconv_release(c);
+    return 0;
+  }
+
+  c->spectrum = cached_spectrum(c, mask, &c->cache_hit);
+  c->buffer = create_buffer(c, points * sizeof(cl_float));
+  c->spectra = create_buffer(c, points / c->tile[0] * (c->tile[0] / 2 + 1) * 2 * sizeof(cl_float));
+  if (!c->spectrum || !c->buffer || !c->spectra) {
+    fftconv_release(c);
+    return 0;
+  }
+  return 1;
+}
+
+void fftconv_release(fftconv *c) {
+  fft_plan_release(&c->plan);
+  if (c->spectrum) clReleaseMemObject(c->spectrum);
+  if (c->buffer) clReleaseMemObject(c->buffer);
+  if (c->spectra) clReleaseMemObject(c->spectra);
+  if (c->kernel_pad) clReleaseKernel(c->kernel_pad);
+  if (c->kernel_multiply) clReleaseKernel(c->kernel_multiply);
+  if (c->kernel_add) clReleaseKernel(c->kernel_add);
+  if (c->program) clReleaseProgram(c->program);
+  c->spectrum = c->buffer = c->spectra = NULL;
+  c->kernel_pad = c->kernel_multiply = c->kernel_add = NULL;
+  c->program = NULL;
+}
+
+// Image, tile and band geometry shared by tile_pad and overlap_add, after
+// the two buffers
+static cl_int set_tile_args(const fftconv *c, cl_kernel kernel, cl_mem in, cl_mem out, cl_int first_row) {
+  cl_int width = (cl_int) c->width, height = (cl_int) c->height;
+  cl_int tile_w = (cl_int) c->tile[0], tile_h = (cl_int) c->tile[1];
+  cl_int block_w = (cl_int) c->block[0], block_h = (cl_int) c->block[1];
+  cl_int rx = c->mask_width / 2, ry = c->mask_height / 2;
+  cl_int tiles_x = (cl_int) c->tiles[0];
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &out);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &width);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &height);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &tile_w);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &tile_h);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &block_w);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &block_h);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &rx);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &ry);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &tiles_x);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &first_row);
+  return status;
+}
+
+static int enqueue(fftconv *c, cl_kernel kernel, cl_uint dims, const size_t *global, cl_int status) {
+  cl_event event;
+
+  if (status == CL_SUCCESS)
+    status = clEnqueueNDRangeKernel(c->queue, kernel, dims, NULL, global, NULL, 0, NULL, &event);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not enqueue FFT convolution\n");
+    print_error(status);
+    return 0;
+  }
+
+  if (c->b)
+    bench_event(c->b, BENCH_KERNEL, event);
+  else
+    clReleaseEvent(event);
+  return 1;
+}
+
+int fftconv_run(fftconv *c, cl_mem in, cl_mem out) {
+  const size_t batch = c->band * c->tiles[0];
+  const size_t half = c->tile[0] / 2 + 1;
+  const cl_uint n = (cl_uint) (half * c->tile[1]);
+  const size_t ry = c->mask_height / 2;
+  cl_int status;
+
+  c->plan.b = c->b;
+  for (size_t first_row = 0; first_row < c->tiles[1]; first_row += c->band) {
+    cl_int first = (cl_int) first_row;
+    cl_int rows = (cl_int) (c->tiles[1] - first_row < c->band ? c->tiles[1] - first_row : c->band);
+
+    // Rows of pixels covered by the band
+    size_t y0 = first_row * c->block[1] > 2*ry ? first_row * c->block[1] - 2*ry : 0;
+    size_t y1 = (first_row + rows) * c->block[1];
+    if (y1 > c->height) y1 = c->height;
+    cl_int start = (cl_int) y0;
+
+    size_t pad_global[3] = {c->tile[0], c->tile[1], batch};
+    if (!enqueue(c, c->kernel_pad, 3, pad_global, set_tile_args(c, c->kernel_pad, in, c->buffer, first)))
+      return 0;
+
+    if (!fft_enqueue(&c->plan, c->queue, FFT_FORWARD, c->buffer, c->spectra))
+      return 0;
+
+    int arg = 0;
+    status  = clSetKernelArg(c->kernel_multiply, arg++, sizeof(cl_mem), &c->spectra);
+    status |= clSetKernelArg(c->kernel_multiply, arg++, sizeof(cl_mem), &c->spectrum);
+    status |= clSetKernelArg(c->kernel_multiply, arg++, sizeof(cl_uint), &n);
+    size_t multiply_global[2] = {n, batch};
+    if (!enqueue(c, c->kernel_multiply, 2, multiply_global, status))
+      return 0;
+
+    if (!fft_enqueue(&c->plan, c->queue, FFT_INVERSE, c->spectra, c->buffer))
+      return 0;
+
+    status = set_tile_args(c, c->kernel_add, c->buffer, out, first);
+    arg = 12;
+    status |= clSetKernelArg(c->kernel_add, arg++, sizeof(cl_int), &rows);
+    status |= clSetKernelArg(c->kernel_add, arg++, sizeof(cl_int), &start);
+    size_t add_global[2] = {c->width, y1 - y0};
+    if (!enqueue(c, c->kernel_add, 2, add_global, status))
+      return 0;
+  }
+  c->plan.b = NULL;
+  return 1;
+}
+
+void fftconv_print(const fftconv *c) {
+  printf("fft convolution: tiles %lux%lu (blocks %lux%lu), %lux%lu tiles in bands of %lu, mask spectrum %s\n",
+      (unsigned long) c->tile[0], (unsigned long) c->tile[1],
+      (unsigned long) c->block[0], (unsigned long) c->block[1],
+      (unsigned long) c->tiles[0], (unsigned long) c->tiles[1], (unsigned long) c->band,
+      c->cache_hit ? "cached" : "computed");
+  fft_plan_print(&c->plan);
+}
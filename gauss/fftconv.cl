@@ -0,0 +1,67 @@
+//
+// Overlap-add convolution of fftconv.c. Block (tx, ty) holds the points of
+// the image extended by the mask radius (rx, ry) with its edge values, from
+// (tx*block_w - rx, ty*block_h - ry) on. It is placed at (rx, ry) into a tile
+// of tile_w x tile_h points that is zero elsewhere, so that its convolution
+// with the mask fits into the tile without wrapping around. Output pixel
+// (x, y) is then at (x - tx*block_w + 2*rx, y - ty*block_h + 2*ry) of every
+// tile that covers it.
+//
+// A batch is a band of whole rows of tiles starting at row first_row.
+//
+
+// Pad the blocks of a band into tiles
+kernel void tile_pad(global const float *in, global float *tiles, int width, int height,
+                     int tile_w, int tile_h, int block_w, int block_h, int rx, int ry,
+                     int tiles_x, int first_row) {
+    const int u = get_global_id(0);
+    const int v = get_global_id(1);
+    const int t = get_global_id(2);
+    const int tx = t % tiles_x;
+    const int ty = first_row + t / tiles_x;
+
+    float value = 0.0f;
+    if (u >= rx && u < rx + block_w && v >= ry && v < ry + block_h) {
+        int x = clamp(tx*block_w - 2*rx + u, 0, width-1);
+        int y = clamp(ty*block_h - 2*ry + v, 0, height-1);
+        value = in[y*width + x];
+    }
+    tiles[((size_t) t*tile_h + v)*tile_w + u] = value;
+}
+
+// Multiply the half spectra of the tiles with the one of the mask, n points each
+kernel void multiply_spectrum(global float2 *spectra, global const float2 *mask, uint n) {
+    const uint i = get_global_id(0);
+    const size_t j = (size_t) get_global_id(1)*n + i;
+    if (i < n) {
+        float2 a = spectra[j], b = mask[i];
+        spectra[j] = (float2)(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
+    }
+}
+
+// Sum the tiles of a band covering the rows from y0 on. Pixels whose first
+// tile is in the band are written, the others add to the earlier bands.
+kernel void overlap_add(global const float *tiles, global float *out, int width, int height,
+                        int tile_w, int tile_h, int block_w, int block_h, int rx, int ry,
+                        int tiles_x, int first_row, int rows, int y0) {
+    const int x = get_global_id(0);
+    const int y = y0 + get_global_id(1);
+    if (x >= width || y >= height)
+        return;
+
+    const int tx0 = x / block_w;
+    const int tx1 = min((x + 2*rx) / block_w, tiles_x - 1);
+    const int ty0 = max(y / block_h, first_row);
+    const int ty1 = min((y + 2*ry) / block_h, first_row + rows - 1);
+
+    float sum = 0.0f;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            size_t t = (size_t) (ty - first_row)*tiles_x + tx;
+            sum += tiles[(t*tile_h + y - ty*block_h + 2*ry)*tile_w + x - tx*block_w + 2*rx];
+        }
+    }
+
+    const size_t i = (size_t) y*width + x;
+    out[i] = (y / block_h >= first_row) ? sum : out[i] + sum;
+}
@@ -0,0 +1,63 @@
+#ifndef FFTCONV_H
+#define FFTCONV_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+#include <fftplan.h>
+
+#include "convolution.h"
+
+// Largest FFT length of a tile along each axis
+#define FFTCONV_MAX_TILE 1024
+
+// Bytes of the tile spectra of one batch, the image is filtered in bands of
+// rows of tiles that fit
+#define FFTCONV_BATCH_BYTES (64 << 20)
+
+// Convolution through the FFT by overlap-add: the image, extended by the mask
+// radius with its edge values, is cut into blocks that are padded with zeros
+// to tiles of the FFT length. The tiles are transformed in batches, multiplied
+// with the spectrum of the mask and transformed back, the overlapping tiles
+// are summed up into the output. The cost per pixel grows with the log of the
+// tile size instead of with the mask area.
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel_pad, kernel_multiply, kernel_add;
+
+  int mask_width, mask_height;
+  size_t width, height;     // image size
+  size_t tile[2];           // FFT lengths of a tile
+  size_t block[2];          // image points per tile, the tile minus the mask
+  size_t tiles[2];          // tiles per row and column
+  size_t band;              // rows of tiles per batch
+  int cache_hit;            // mask spectrum was taken from the spectrum cache
+
+  fft_plan plan;            // real 2D transforms of a band of tiles
+  cl_mem spectrum;          // half spectrum of the mask
+  cl_mem buffer;            // tiles of a band
+  cl_mem spectra;           // their half spectra
+
+  bench *b;                 // if set, kernels are recorded here
+} fftconv;
+
+// Plan the convolution of width x height images with mask. Tile sizes are
+// chosen for the fewest operations, the mask spectrum is computed on the host
+// or taken from the spectrum cache.
+int fftconv_init(fftconv *c, cl_context context, cl_device_id device, cl_command_queue queue,
+    const conv_mask *mask, size_t width, size_t height);
+void fftconv_release(fftconv *c);
+
+// Convolve the float image in into out like convolution_run
+int fftconv_run(fftconv *c, cl_mem in, cl_mem out);
+
+// Tiles and transforms, e.g. "tiles 256x256 (190x190), 22x22 in bands of 8"
+void fftconv_print(const fftconv *c);
+
+// Release all cached mask spectra
+void fftconv_cache_clear(void);
+
+#endif /* FFTCONV_H */
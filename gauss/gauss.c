@@ -13,6 +13,11 @@
 
 #include <ocllib.h>
 #include <utils.h>
+#include <bench.h>
+#include <tune.h>
+#include <hostref.h>
+#include <batch.h>
+#include <stream.h>
 
 static cl_platform_id platform;
 static cl_device_id device;
@@ -20,14 +25,31 @@ static cl_context context;
 static cl_command_queue queue;
 
 static cl_program program;
-static cl_kernel kernel;
-static cl_mem buffer_in, buffer_out;
+static cl_kernel kernel, kernel_cols;
+static cl_mem buffer_in, buffer_tmp, buffer_out, buffer_weights;
+
+// Batch mode: one set of buffers per command queue
+static batch pipeline;
+static cl_mem pool_in[BATCH_MAX_QUEUES], pool_tmp[BATCH_MAX_QUEUES], pool_out[BATCH_MAX_QUEUES];
+
+// Streaming mode: the device buffers hold one band of the input
+static stream streaming;
 
 void teardown(int exit_status)
 {
+  stream_close(&streaming);
+  batch_release(&pipeline);
+  for (int i = 0; i < BATCH_MAX_QUEUES; ++i) {
+    if (pool_in[i]) clReleaseMemObject(pool_in[i]);
+    if (pool_tmp[i]) clReleaseMemObject(pool_tmp[i]);
+    if (pool_out[i]) clReleaseMemObject(pool_out[i]);
+  }
   if (buffer_in) clReleaseMemObject(buffer_in);
+  if (buffer_tmp) clReleaseMemObject(buffer_tmp);
   if (buffer_out) clReleaseMemObject(buffer_out);
+  if (buffer_weights) clReleaseMemObject(buffer_weights);
   if (kernel) clReleaseKernel(kernel);
+  if (kernel_cols) clReleaseKernel(kernel_cols);
   if (program) clReleaseProgram(program);
   if (queue) clReleaseCommandQueue(queue);
   if (context) clReleaseContext(context);
@@ -35,119 +57,584 @@ void teardown(int exit_status)
   exit(exit_status);
 }
 
-int main(int argc, char **argv) {
+enum {
+  GAUSS_3X3=0,  // fixed 3x3 mask
+  GAUSS_MASK=1, // (2 radius + 1)^2 mask
+  GAUSS_ROWS=2, // first pass of the separable filter
+  GAUSS_COLS=3  // second pass of the separable filter
+};
+
+static const char *kernel_names[] = {"gauss", "gauss_mask", "gauss_rows", "gauss_cols"};
+
+typedef struct {
+  int kernel;
+  cl_int width, height, radius;
+} gauss_args;
+
+static int gauss_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const gauss_args *a = (const gauss_args *) user;
   cl_int status;
 
-  const char *platform_name = "NVIDIA";
+  // Tiles of the separable passes with a halo in the direction of the filter
+  size_t tile_size = (a->kernel == GAUSS_ROWS)
+    ? (config->local[0] + 2*a->radius) * config->local[1]
+    : config->local[0] * (config->local[1] + 2*a->radius);
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
-    teardown(-1);
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), a->kernel == GAUSS_COLS ? &buffer_tmp : &buffer_in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), a->kernel == GAUSS_ROWS ? &buffer_tmp : &buffer_out);
+  if (a->kernel != GAUSS_3X3) {
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_weights);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->radius);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->width);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->height);
+  }
+  if (a->kernel == GAUSS_ROWS || a->kernel == GAUSS_COLS)
+    status |= clSetKernelArg(kernel, arg++, tile_size * sizeof(cl_float), NULL);
+  if (status != CL_SUCCESS)
+    return 0;
+
+  if (a->kernel == GAUSS_3X3) {
+    work_size[0] = a->width;
+    work_size[1] = a->height;
+  } else {
+    // The other kernels check bounds, round up to whole work groups
+    size_t l0 = config->local[0] ? config->local[0] : 1;
+    size_t l1 = config->local[1] ? config->local[1] : 1;
+    work_size[0] = (a->width + l0 - 1) / l0 * l0;
+    work_size[1] = (a->height + l1 - 1) / l1 * l1;
+  }
+  return 1;
+}
+
+// Normalized weights of the 1D Gaussian, 2 radius + 1 entries
+static float *gauss_weights(float sigma, int radius) {
+  float *weights = malloc((2*radius + 1) * sizeof(float));
+  if (!weights)
+    return NULL;
+
+  double sum = 0;
+  for (int i = -radius; i <= radius; ++i) {
+    weights[i + radius] = (float) exp(-(double) i*i / (2.0*sigma*sigma));
+    sum += weights[i + radius];
   }
+  for (int i = 0; i <= 2*radius; ++i)
+    weights[i] = (float) (weights[i] / sum);
+  return weights;
+}
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+// Separable filter on the host with the same clamping as the device
+static int gauss_host(const unsigned char *in, float *out, const float *weights, int radius,
+    int width, int height) {
+  float *tmp = malloc((size_t) width * height * sizeof(float));
+  if (!tmp)
+    return 0;
+
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x) {
+      double sum = 0;
+      for (int i = -radius; i <= radius; ++i) {
+        int xi = x + i < 0 ? 0 : (x + i >= width ? width - 1 : x + i);
+        sum += weights[i + radius] * in[(size_t) y*width + xi] / 255.0;
+      }
+      tmp[(size_t) y*width + x] = (float) sum;
+    }
+
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x) {
+      double sum = 0;
+      for (int j = -radius; j <= radius; ++j) {
+        int yj = y + j < 0 ? 0 : (y + j >= height ? height - 1 : y + j);
+        sum += weights[j + radius] * tmp[(size_t) yj*width + x];
+      }
+      out[(size_t) y*width + x] = (float) (sum * 255);
+    }
+
+  free(tmp);
+  return 1;
+}
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "could not create context");
+typedef struct {
+  const float *weights;
+  int radius;
+  size_t width;
+} gauss_check;
+
+// Host filter of output rows of a stream, from the input rows around them
+static int gauss_reference(const unsigned char *in, size_t in_y, size_t in_rows,
+    float *out, size_t y, size_t rows, void *user) {
+  const gauss_check *c = (const gauss_check *) user;
+  float *window = malloc(c->width * in_rows * sizeof(float));
+  int ok = window && gauss_host(in, window, c->weights, c->radius, (int) c->width, (int) in_rows);
+  if (ok)
+    memcpy(out, window + (y - in_y) * c->width, rows * c->width * sizeof(float));
+  free(window);
+  return ok;
+}
 
-  const char name[] = KERNELDIR "/gauss.cl";
+// Input, intermediate (separable only) and output memory of one image
+static void gauss_buffers(int buffer_input, int separable, size_t width, size_t height,
+    cl_mem *in, cl_mem *tmp, cl_mem *out) {
+  cl_int status;
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
-    teardown(-1);
+  if (buffer_input) {
+    *in = clCreateBuffer(context, CL_MEM_READ_ONLY, width*height, NULL, &status);
+    checkError(status, "Error: could not create buffer_in");
+  } else {
+    cl_image_format format = { CL_R, CL_UNORM_INT8};
+    *in = clCreateImage2D (context, CL_MEM_READ_ONLY, &format,
+      width, height, 0,
+      NULL,
+      &status);
+    checkError(status, "Error: could not create image");
+  }
+
+  *out = clCreateBuffer(context, CL_MEM_READ_WRITE, width*height*sizeof(cl_float), NULL, &status);
+  checkError(status, "Error: could not create buffer_out");
+
+  if (separable) {
+    *tmp = clCreateBuffer(context, CL_MEM_READ_WRITE, width*height*sizeof(cl_float), NULL, &status);
+    checkError(status, "Error: could not create buffer_tmp");
+  }
+}
+
+typedef struct {
+  int separable, buffer_input;
+  size_t width, height;
+  size_t *work_size, *work_size_cols;
+  size_t *local, *local_cols;
+} gauss_batch;
+
+static int gauss_enqueue(batch_slot *slot, const batch_image *image, void *user) {
+  const gauss_batch *g = (const gauss_batch *) user;
+  cl_mem in = pool_in[slot->index], tmp = pool_tmp[slot->index], out = pool_out[slot->index];
+  cl_event event;
+  cl_int status;
+
+  size_t origin[] = {0,0,0};
+  size_t region[] = {g->width, g->height, 1};
+
+  if (g->buffer_input)
+    status = clEnqueueWriteBuffer(slot->queue, in, CL_FALSE, 0, g->width*g->height, image->data, 0, NULL, &event);
+  else
+    status = clEnqueueWriteImage(slot->queue, in, CL_FALSE, origin, region, g->width, 0, image->data, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_H2D, event);
+
+  // The kernels are shared by all slots, arguments are captured at enqueue
+  status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), g->separable ? &tmp : &out);
+  if (status != CL_SUCCESS)
+    return 0;
+  status = clEnqueueNDRangeKernel(slot->queue, kernel, 2, NULL, g->work_size, g->local, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_KERNEL, event);
+
+  if (g->separable) {
+    status  = clSetKernelArg(kernel_cols, 0, sizeof(cl_mem), &tmp);
+    status |= clSetKernelArg(kernel_cols, 1, sizeof(cl_mem), &out);
+    if (status != CL_SUCCESS)
+      return 0;
+    status = clEnqueueNDRangeKernel(slot->queue, kernel_cols, 2, NULL, g->work_size_cols, g->local_cols, 0, NULL, &event);
+    if (status != CL_SUCCESS)
+      return 0;
+    batch_event(slot, BENCH_KERNEL, event);
+  }
+
+  status = clEnqueueReadBuffer(slot->queue, out, CL_FALSE, 0, g->width*g->height*sizeof(cl_float), slot->out, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_D2H, event);
+  return 1;
+}
+
+typedef struct {
+  int separable, buffer_input;
+  size_t width;
+  size_t *work_size, *work_size_cols;
+  size_t *local, *local_cols;
+} gauss_stream;
+
+// The kernels filter all input rows of the band, the rows of the band are read back
+static int gauss_enqueue_band(cl_command_queue queue, stream_band *band, void *user) {
+  const gauss_stream *g = (const gauss_stream *) user;
+  cl_event event;
+  cl_int status;
+
+  size_t origin[] = {0,0,0};
+  size_t region[] = {g->width, band->in_rows, 1};
+
+  if (g->buffer_input)
+    status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, g->width*band->in_rows, band->in, 0, NULL, &event);
+  else
+    status = clEnqueueWriteImage(queue, buffer_in, CL_FALSE, origin, region, g->width, 0, band->in, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_H2D, event);
+
+  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, g->work_size, g->local, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_KERNEL, event);
+
+  if (g->separable) {
+    status = clEnqueueNDRangeKernel(queue, kernel_cols, 2, NULL, g->work_size_cols, g->local_cols, 0, NULL, &event);
+    if (status != CL_SUCCESS)
+      return 0;
+    stream_event(band, BENCH_KERNEL, event);
   }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
+  size_t row_size = g->width*sizeof(cl_float);
+  status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, (band->y - band->in_y)*row_size, band->rows*row_size,
+      band->out, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_D2H, event);
+  return 1;
+}
 
-  status = clBuildProgram(program, 1, &device, "-I.", NULL, NULL);
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to create build %s: ", name);
+// Select the local size of a kernel: run the auto-tuner or use the tuning database
+static void gauss_config(const bench_options *opts, const char *options, gauss_args *args, tune_config *config) {
+  char key[256];
+  snprintf(key, sizeof(key), "%s-%lux%lu-r%d%s", kernel_names[args->kernel], (unsigned long) args->width,
+      (unsigned long) args->height, args->radius, strstr(options, "BUFFER_INPUT") ? "-buffer" : "");
+
+  // A local size of 0 leaves the choice to the runtime, the separable passes need one
+  tune_config fallback = {2, {0, 0, 1}, "", 0};
+  if (args->kernel == GAUSS_ROWS || args->kernel == GAUSS_COLS) {
+    fallback.local[0] = 32;
+    fallback.local[1] = 8;
   }
+  *config = fallback;
+
+  if (opts->tune) {
+    tune_problem problem = {KERNELDIR "/gauss.cl", kernel_names[args->kernel], options, NULL,
+      2, 1, 0, gauss_setup, args};
 
-  free(source);
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      *config = tuned;
+  } else {
+    tune_lookup(device, key, config);
+  }
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  batch_options batch_opts;
+  batch_parse_args(&argc, argv, &batch_opts);
+
+  stream_options stream_opts;
+  stream_parse_args(&argc, argv, &stream_opts);
+
+  int separable = (argc > 1 && !strcmp(argv[1], "separable"));
+  int buffer_input = (argc > 2 && !strcmp(argv[2], "buffer"));
+  float sigma = (argc > 3) ? (float) atof(argv[3]) : (separable ? 1.0f : 0.0f);
+  int radius = (argc > 4) ? atoi(argv[4]) : (int) ceil(3*sigma);
+
+  if (argc > 5 || (argc > 1 && !separable && strcmp(argv[1], "mask"))
+      || (argc > 2 && !buffer_input && strcmp(argv[2], "image"))
+      || (buffer_input && !separable) || sigma < 0 || (separable && sigma == 0) || (sigma > 0 && radius < 1)
+      || (batch_opts.count && stream_opts.input)) {
+    fprintf(stderr, "Usage: %s [mask|separable] [image|buffer] [SIGMA [RADIUS]] " BENCH_USAGE " " DEVICE_USAGE " " BATCH_USAGE " " STREAM_USAGE "\n", argv[0]);
+    fprintf(stderr, "  mask without SIGMA is the fixed 3x3 mask, separable needs a SIGMA above 0\n");
+    fprintf(stderr, "  buffer input requires separable\n");
+    fprintf(stderr, "  --batch N filters N images, cycling through the --input images (default lena.dat)\n");
+    fprintf(stderr, "  --stream filters IN (.pgm or .dat) into the PGM OUT in bands that fit into --budget (default 256 MB)\n");
+    teardown(-1);
+  }
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
 
   print_device_info(device, 0);
 
   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
   checkError(status, "could not create command queue");
 
-  cl_ulong start, end;
   cl_event event;
 
-  unsigned char *data;
+  unsigned char *data = NULL;
   size_t datasize;
 
-  if (!load_file("lena.dat", &data, &datasize)) {
+  size_t width  = 512;
+  size_t height = 512;
+
+  batch_image *images = NULL;
+  int nimages = 0;
+
+  if (batch_opts.count) {
+    if (!batch_load(&batch_opts, "lena.dat", &images, &nimages))
+      teardown(-1);
+    width = images[0].width;
+    height = images[0].height;
+
+    // The result of the last image of the batch is checked
+    const batch_image *last = &images[(batch_opts.count - 1) % nimages];
+    data = malloc(width*height);
+    if (!data) {
+      fprintf(stderr,"\nError: malloc failed\n");
+      teardown(-1);
+    }
+    memcpy(data, last->data, width*height);
+    printf("batch: %d images from %d inputs, %d queues\n", batch_opts.count, nimages, batch_opts.queues);
+  } else if (stream_opts.input) {
+    if (!stream_open(&streaming, &stream_opts, queue, &width, &height))
+      teardown(-1);
+  } else if (!load_file("lena.dat", &data, &datasize)) {
     teardown(-1);
   }
 
-  size_t width  = 512;
-  size_t height = 512;
-  size_t buf_size = width*height*sizeof(cl_float);
+  // Larger problem sizes repeat the input image
+  if (!stream_opts.input && opts.size && (opts.size != width || opts.size != height)) {
+    unsigned char *tiled = tile_image(data, width, height, opts.size, opts.size);
+    free(data);
+    data = tiled;
+    if (!data || !batch_tile(images, nimages, opts.size, opts.size)) teardown(-1);
+    width = height = opts.size;
+  }
+
+  // Streaming: the kernels filter bands of rows, a band has radius rows of
+  // halo on both sides
+  size_t rows = height;
+  if (stream_opts.input) {
+    cl_ulong max_alloc;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+    size_t max_rows = (size_t) (max_alloc / (width*sizeof(cl_float)));
+    if (!buffer_input) {
+      size_t max_height;
+      clGetDeviceInfo(device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t), &max_height, NULL);
+      if (max_height < max_rows) max_rows = max_height;
+    }
+
+    size_t device_row = width*(1 + (separable ? 2 : 1)*sizeof(cl_float));
+    if (!stream_plan(&streaming, width, height, 1.0, radius > 1 ? radius : 1, device_row, 0, max_rows))
+      teardown(-1);
+    rows = streaming.in_rows;
+  }
+  size_t buf_size = width*rows*sizeof(cl_float);
 
-  float *data_out = malloc(buf_size);
-  if (!data_out) {
+  float *data_out = stream_opts.input ? NULL : malloc(buf_size);
+  if (!data_out && !stream_opts.input) {
     fprintf(stderr,"\nError: malloc failed\n");
     teardown(-1);
   }
 
-  kernel = clCreateKernel(program, "gauss", &status);
-  checkError(status, "could not create kernel");
+  gauss_buffers(buffer_input, separable, width, rows, &buffer_in, &buffer_tmp, &buffer_out);
+
+  //
+  // Weights: 1D for the separable filter, the outer product for the mask
+  //
+  float *weights = NULL;
+  if (sigma > 0) {
+    weights = gauss_weights(sigma, radius);
+    if (!weights) {
+      fprintf(stderr,"\nError: malloc failed\n");
+      teardown(-1);
+    }
+
+    int size = 2*radius + 1;
+    size_t weights_size = (separable ? size : size*size) * sizeof(cl_float);
+
+    cl_ulong max_constant;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(cl_ulong), &max_constant, NULL);
+    if (weights_size > max_constant) {
+      fprintf(stderr, "Error: mask of radius %d exceeds the constant memory\n", radius);
+      teardown(-1);
+    }
+
+    float *mask = weights;
+    if (!separable) {
+      mask = malloc(weights_size);
+      if (!mask) {
+        fprintf(stderr,"\nError: malloc failed\n");
+        teardown(-1);
+      }
+      for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+          mask[y*size + x] = weights[y] * weights[x];
+    }
+
+    buffer_weights = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, weights_size, mask, &status);
+    checkError(status, "Error: could not create buffer_weights");
+    if (mask != weights)
+      free(mask);
+
+    printf("sigma: %f, radius: %d\n", sigma, radius);
+  }
 
-  cl_image_format format = { CL_R, CL_UNORM_INT8};
-  buffer_in = clCreateImage2D (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format,
-    width, height, 0,
-    data,
-    &status);
-  checkError(status, "Error: could not create image");
+  //
+  // Select the work-group sizes: run the auto-tuner or use the tuning database
+  //
+  const char name[] = KERNELDIR "/gauss.cl";
+  const char *options = buffer_input ? "-I. -DBUFFER_INPUT" : "-I.";
 
-  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  gauss_args args = {separable ? GAUSS_ROWS : (sigma > 0 ? GAUSS_MASK : GAUSS_3X3),
+    (cl_int) width, (cl_int) rows, radius};
+  gauss_args args_cols = {GAUSS_COLS, (cl_int) width, (cl_int) rows, radius};
 
-  // execute kernel
-  int arg = 0;
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
-  checkError(status, "Error: could not set args");
+  tune_config config, config_cols;
+  gauss_config(&opts, options, &args, &config);
+  if (separable)
+    gauss_config(&opts, options, &args_cols, &config_cols);
 
-  size_t work_size[] = {width, height};
-  size_t local_size[] = {1, 1};
+  if (!create_program(name, &program, context, device, options)) {
+    if (program) print_build_log(program, device);
+    teardown(-1);
+  }
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
+  kernel = clCreateKernel(program, kernel_names[args.kernel], &status);
+  checkError(status, "could not create kernel");
 
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
+  // execute kernel
+  size_t work_size[2], work_size_cols[2];
+  if (!gauss_setup(kernel, &config, work_size, &args)) {
+    fprintf(stderr, "Error: could not set args\n");
+    teardown(-1);
+  }
 
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+  if (separable) {
+    kernel_cols = clCreateKernel(program, kernel_names[GAUSS_COLS], &status);
+    checkError(status, "could not create kernel");
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+    if (!gauss_setup(kernel_cols, &config_cols, work_size_cols, &args_cols)) {
+      fprintf(stderr, "Error: could not set args\n");
+      teardown(-1);
+    }
+  }
+
+  size_t *local_size = config.local[0] ? config.local : NULL;
+
+  size_t origin[] = {0,0,0};
+  size_t region[] = {width, height, 1};
+
+  char variant[64];
+  if (separable)
+    snprintf(variant, sizeof(variant), "separable-%s-r%d", buffer_input ? "buffer" : "image", radius);
+  else if (sigma > 0)
+    snprintf(variant, sizeof(variant), "mask-r%d", radius);
+  else
+    snprintf(variant, sizeof(variant), "3x3");
+  if (batch_opts.count) {
+    size_t n = strlen(variant);
+    snprintf(variant + n, sizeof(variant) - n, "-batch%d-q%d", batch_opts.count, batch_opts.queues);
+  } else if (stream_opts.input) {
+    size_t n = strlen(variant);
+    snprintf(variant + n, sizeof(variant) - n, "-stream%lu", (unsigned long) streaming.band);
+  }
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+  bench b;
+  if (!bench_init(&b, &opts, "gauss", variant, width)) {
+    teardown(-1);
+  }
 
-  // read results back
-  status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, buf_size, data_out, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  int ok = 1;
+  if (batch_opts.count) {
+    //
+    // Batch mode: images are spread over the queues, each with its own buffers
+    //
+    if (!batch_init(&pipeline, context, device, batch_opts.queues, buf_size))
+      teardown(-1);
+    for (int i = 0; i < pipeline.slots; ++i)
+      gauss_buffers(buffer_input, separable, width, height, &pool_in[i], &pool_tmp[i], &pool_out[i]);
+
+    gauss_batch g = {separable, buffer_input, width, height, work_size, work_size_cols,
+      local_size, config_cols.local};
+
+    bench_set_rate(&b, batch_opts.count, "images/s");
+    pipeline.b = &b;
+    while (ok && bench_next(&b))
+      ok = batch_run(&pipeline, batch_opts.count, images, nimages, gauss_enqueue, &g);
+    pipeline.b = NULL;
+
+    if (ok)
+      memcpy(data_out, pipeline.slot[pipeline.last].out, buf_size);
+  } else if (stream_opts.input) {
+    //
+    // Streaming mode: the image is read, filtered and written band by band
+    //
+    gauss_stream g = {separable, buffer_input, width, work_size, work_size_cols,
+      local_size, config_cols.local};
+
+    bench_set_rate(&b, width*height*1e-6, "MPixel/s");
+    streaming.b = &b;
+    while (ok && bench_next(&b))
+      ok = stream_run(&streaming, gauss_enqueue_band, &g);
+    streaming.b = NULL;
+  } else {
+    bench_set_rate(&b, width*height*1e-6, "MPixel/s");
+
+    while (bench_next(&b)) {
+      if (buffer_input)
+        status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, width*height, data, 0, NULL, &event);
+      else
+        status = clEnqueueWriteImage(queue, buffer_in, CL_FALSE, origin, region, width, 0, data, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_H2D, event);
+
+      status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, local_size, 0, NULL, &event);
+      checkError(status, "Error: could not enqueue kernel");
+      bench_event(&b, BENCH_KERNEL, event);
+
+      if (separable) {
+        status = clEnqueueNDRangeKernel(queue, kernel_cols, 2, NULL, work_size_cols, config_cols.local, 0, NULL, &event);
+        checkError(status, "Error: could not enqueue kernel");
+        bench_event(&b, BENCH_KERNEL, event);
+      }
+
+      // read results back
+      status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, buf_size, data_out, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_D2H, event);
+    }
+  }
 
   status  = clFinish(queue);
   checkError(status, "Error: could not finish successfully");
 
-  double elapsed = (end - start) * 1e-9f;
-  printf("time: %f\n", elapsed);
+  if (ok)
+    bench_report(&b);
+  bench_free(&b);
+
+  if (stream_opts.input) {
+    if (ok)
+      stream_report(&streaming);
+    // Errors of the bands show at their seams and in the last bands, which are moved up
+    if (ok && weights) {
+      gauss_check check = {weights, radius, width};
+      stream_check(&streaming, gauss_reference, &check);
+    }
+    free(weights);
+    teardown(ok ? 0 : -1);
+  }
+
+  // Both filters with a generated mask compute the same separable Gaussian
+  if (ok && weights) {
+    float *ref = malloc(buf_size);
+    if (ref && gauss_host(data, ref, weights, radius, (int) width, (int) height))
+      compare_float(ref, data_out, width*height, 1e-4f, 1e-2f);
+    free(ref);
+  }
+  free(weights);
 
   write_bmp("gauss.bmp", data_out, width, height, NORMAL);
 
+  batch_free_images(images, nimages);
   free(data);
   free(data_out);
-  teardown(0);
+  teardown(ok ? 0 : -1);
 }
-
-
@@ -17,3 +17,95 @@ kernel void gauss(read_only image2d_t in, global float *out) {
 
     out[pos.x+pos.y*get_global_size(0)] = sum*255;
 }
+
+// Gaussian of any radius with a (2 radius + 1)^2 mask generated on the host,
+// for comparison with the separable filter
+kernel void gauss_mask(read_only image2d_t in, global float *out, constant float *mask,
+        int radius, int width, int height) {
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+    const int size = 2*radius + 1;
+
+    if (pos.x >= width || pos.y >= height)
+        return;
+
+    float sum = 0.0f;
+    for(int y = -radius; y <= radius; y++) {
+        for(int x = -radius; x <= radius; x++) {
+            sum += mask[(y+radius)*size+x+radius]
+                * read_imagef(in, sampler, pos + (int2)(x,y)).x;
+        }
+    }
+
+    out[pos.x+pos.y*width] = sum*255;
+}
+
+// Separable Gaussian: gauss_rows filters the rows of the input into tmp,
+// gauss_cols the columns of tmp into out. weights holds the 2 radius + 1
+// weights of the 1D Gaussian. Each work group loads its tile of the input
+// plus a halo of radius pixels on both sides into local memory, tile has
+// (local size + 2 radius) x local size floats in the direction of the filter.
+// Pixels beyond the border are clamped to the edge.
+//
+// With -DBUFFER_INPUT the input is a buffer of width x height bytes instead
+// of an image.
+
+#ifdef BUFFER_INPUT
+#define INPUT global const uchar *
+#define READ_INPUT(img, px, py) (img[(py)*width + (px)] * (1.0f/255))
+#else
+#define INPUT read_only image2d_t
+#define READ_INPUT(img, px, py) read_imagef(img, sampler, (int2)(px, py)).x
+#endif
+
+kernel void gauss_rows(INPUT in, global float *tmp, constant float *weights,
+        int radius, int width, int height, local float *tile) {
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lw = get_local_size(0);
+    const int x = get_global_id(0);
+    const int y = min((int) get_global_id(1), height-1);
+    const int x0 = get_group_id(0)*lw - radius;
+    const int span = lw + 2*radius;
+
+    local float *row = tile + ly*span;
+    for (int i = lx; i < span; i += lw)
+        row[i] = READ_INPUT(in, clamp(x0 + i, 0, width-1), y);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (x >= width || get_global_id(1) >= height)
+        return;
+
+    float sum = 0.0f;
+    for (int i = 0; i <= 2*radius; i++)
+        sum += weights[i] * row[lx + i];
+
+    tmp[y*width + x] = sum;
+}
+
+kernel void gauss_cols(global const float *tmp, global float *out, constant float *weights,
+        int radius, int width, int height, local float *tile) {
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lw = get_local_size(0);
+    const int lh = get_local_size(1);
+    const int x = min((int) get_global_id(0), width-1);
+    const int y = get_global_id(1);
+    const int y0 = get_group_id(1)*lh - radius;
+    const int span = lh + 2*radius;
+
+    // The tile is stored row-major, lw wide, so that loads are coalesced
+    for (int j = ly; j < span; j += lh)
+        tile[j*lw + lx] = tmp[clamp(y0 + j, 0, height-1)*width + x];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_global_id(0) >= width || y >= height)
+        return;
+
+    float sum = 0.0f;
+    for (int j = 0; j <= 2*radius; j++)
+        sum += weights[j] * tile[(ly + j)*lw + lx];
+
+    out[y*width + x] = sum*255;
+}
@@ -13,6 +13,10 @@
 
 #include "ocllib.h"
 #include <utils.h>
+#include <bench.h>
+#include <tune.h>
+#include <batch.h>
+#include <stream.h>
 
 static cl_platform_id platform;
 static cl_device_id device;
@@ -23,8 +27,21 @@ static cl_program program;
 static cl_kernel kernel;
 static cl_mem buffer_in, buffer_out;
 
+// Batch mode: one input and output image per command queue
+static batch pipeline;
+static cl_mem pool_in[BATCH_MAX_QUEUES], pool_out[BATCH_MAX_QUEUES];
+
+// Streaming mode: the images hold one band of the input and of the output
+static stream streaming;
+
 void teardown(int exit_status)
 {
+  stream_close(&streaming);
+  batch_release(&pipeline);
+  for (int i = 0; i < BATCH_MAX_QUEUES; ++i) {
+    if (pool_in[i]) clReleaseMemObject(pool_in[i]);
+    if (pool_out[i]) clReleaseMemObject(pool_out[i]);
+  }
   if (buffer_in) clReleaseMemObject(buffer_in);
   if (buffer_out) clReleaseMemObject(buffer_out);
   if (kernel) clReleaseKernel(kernel);
@@ -35,138 +52,344 @@ void teardown(int exit_status)
   exit(exit_status);
 }
 
-int main(int argc, char **argv) {
+static int interpolation_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const size_t *size = (const size_t *) user;
   cl_int status;
+  (void) config;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <scale>\n", argv[0]);
-    teardown(-1);
-  }
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
 
-  cl_float scale = strtof(argv[1],NULL);
-  printf("scale: %f\n", scale);
+  work_size[0] = size[0];
+  work_size[1] = size[1];
+  return status == CL_SUCCESS;
+}
 
-  const char *platform_name = "NVIDIA";
+// Input image and scaled output image
+static void interpolation_images(size_t width, size_t height, size_t new_width, size_t new_height,
+    cl_mem *in, cl_mem *out) {
+  cl_int status;
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
-    teardown(-1);
-  }
+  cl_image_format format = { CL_R, CL_UNORM_INT8};
+  *in = clCreateImage2D (context, CL_MEM_READ_ONLY, &format,
+    width, height, 0,
+    NULL,
+    &status);
+  checkError(status, "Error: could not create image");
+
+  cl_image_format format2 = { CL_R, CL_FLOAT};
+  *out = clCreateImage2D (context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, &format2,
+    new_width, new_height, 0,
+    NULL,
+    &status);
+  checkError(status, "Error: could not create image");
+}
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+typedef struct {
+  size_t width, height, new_width, new_height;
+  size_t *work_size, *local;
+} interpolation_batch;
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "could not create context");
+static int interpolation_enqueue(batch_slot *slot, const batch_image *image, void *user) {
+  const interpolation_batch *p = (const interpolation_batch *) user;
+  cl_mem in = pool_in[slot->index], out = pool_out[slot->index];
+  cl_event event;
+  cl_int status;
 
-  const char name[] = KERNELDIR "/interpolation.cl";
+  size_t origin[] = {0,0,0};
+  size_t region_in[] = {p->width, p->height, 1};
+  size_t region[] = {p->new_width, p->new_height, 1};
+
+  status = clEnqueueWriteImage(slot->queue, in, CL_FALSE, origin, region_in, p->width, 0, image->data, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_H2D, event);
+
+  // The kernel is shared by all slots, arguments are captured at enqueue
+  status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+  status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+  if (status != CL_SUCCESS)
+    return 0;
+  status = clEnqueueNDRangeKernel(slot->queue, kernel, 2, NULL, p->work_size, p->local, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_KERNEL, event);
+
+  status = clEnqueueReadImage(slot->queue, out, CL_FALSE, origin, region, p->new_width*sizeof(cl_float), 0, slot->out, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  batch_event(slot, BENCH_D2H, event);
+  return 1;
+}
+
+// Scale the input rows of the band into the output rows of the band
+static int interpolation_enqueue_band(cl_command_queue queue, stream_band *band, void *user) {
+  const size_t *size = (const size_t *) user;
+  cl_event event;
+  cl_int status;
+
+  size_t origin[] = {0,0,0};
+  size_t region_in[] = {size[0], band->in_rows, 1};
+  size_t region[] = {size[1], band->rows, 1};
+
+  status = clEnqueueWriteImage(queue, buffer_in, CL_FALSE, origin, region_in, size[0], 0, band->in, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_H2D, event);
+
+  cl_int out_y = (cl_int) band->y, in_y = (cl_int) band->in_y;
+  status  = clSetKernelArg(kernel, 3, sizeof(cl_int), &out_y);
+  status |= clSetKernelArg(kernel, 4, sizeof(cl_int), &in_y);
+  if (status != CL_SUCCESS)
+    return 0;
+  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, region, NULL, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_KERNEL, event);
+
+  status = clEnqueueReadImage(queue, buffer_out, CL_FALSE, origin, region, size[1]*sizeof(cl_float), 0, band->out, 0, NULL, &event);
+  if (status != CL_SUCCESS)
+    return 0;
+  stream_event(band, BENCH_D2H, event);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  batch_options batch_opts;
+  batch_parse_args(&argc, argv, &batch_opts);
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
+  stream_options stream_opts;
+  stream_parse_args(&argc, argv, &stream_opts);
+
+  if (argc != 2 || (batch_opts.count && stream_opts.input)) {
+    fprintf(stderr, "Usage: %s " BENCH_USAGE " " DEVICE_USAGE " " BATCH_USAGE " " STREAM_USAGE " <scale>\n", argv[0]);
+    fprintf(stderr, "  --batch N scales N images, cycling through the --input images (default lena.dat)\n");
+    fprintf(stderr, "  --stream scales IN (.pgm or .dat) into the PGM OUT in bands that fit into --budget (default 256 MB)\n");
     teardown(-1);
   }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
+  cl_float scale = strtof(argv[1],NULL);
+  printf("scale: %f\n", scale);
 
-  status = clBuildProgram(program, 1, &device, "-I.", NULL, NULL);
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to create build %s: ", name);
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
   }
 
-  free(source);
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
 
   print_device_info(device, 0);
 
   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
   checkError(status, "could not create command queue");
 
-  cl_ulong start, end;
   cl_event event;
 
-  unsigned char *data;
+  unsigned char *data = NULL;
   size_t datasize;
 
-  if (!load_file("lena.dat", &data, &datasize)) {
+  size_t width  = 512;
+  size_t height = 512;
+
+  batch_image *images = NULL;
+  int nimages = 0;
+
+  if (batch_opts.count) {
+    if (!batch_load(&batch_opts, "lena.dat", &images, &nimages))
+      teardown(-1);
+    width = images[0].width;
+    height = images[0].height;
+    printf("batch: %d images from %d inputs, %d queues\n", batch_opts.count, nimages, batch_opts.queues);
+  } else if (stream_opts.input) {
+    if (!stream_open(&streaming, &stream_opts, queue, &width, &height))
+      teardown(-1);
+  } else if (!load_file("lena.dat", &data, &datasize)) {
     teardown(-1);
   }
 
-  size_t width  = 512;
-  size_t height = 512;
+  // Larger problem sizes repeat the input image
+  if (!stream_opts.input && opts.size && (opts.size != width || opts.size != height)) {
+    if (images) {
+      if (!batch_tile(images, nimages, opts.size, opts.size)) teardown(-1);
+    } else {
+      unsigned char *tiled = tile_image(data, width, height, opts.size, opts.size);
+      free(data);
+      data = tiled;
+      if (!data) teardown(-1);
+    }
+    width = height = opts.size;
+  }
 
   size_t new_width = (size_t) ((int) width*scale);
   size_t new_height = (size_t) ((int) height*scale);
   printf("new size: %d %d\n", (int) new_width, (int) new_height);
 
-  size_t buf_size = new_width*new_height*sizeof(cl_float);
+  // Streaming: bands of output rows from the input rows they sample plus a
+  // halo for the linear filter
+  size_t rows = height, new_rows = new_height;
+  if (stream_opts.input) {
+    size_t max_height;
+    clGetDeviceInfo(device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t), &max_height, NULL);
+    if (!stream_plan(&streaming, new_width, new_height, (double) height / new_height, 2,
+          width, new_width*sizeof(cl_float), max_height))
+      teardown(-1);
+    rows = streaming.in_rows;
+    new_rows = streaming.band;
+  }
+
+  size_t buf_size = new_width*new_rows*sizeof(cl_float);
 
-  float *data_out = malloc(buf_size);
-  if (!data_out) {
+  float *data_out = stream_opts.input ? NULL : malloc(buf_size);
+  if (!data_out && !stream_opts.input) {
     fprintf(stderr,"\nError: malloc failed\n");
     teardown(-1);
   }
 
-  kernel = clCreateKernel(program, "interpolation", &status);
-  checkError(status, "could not create kernel");
+  interpolation_images(width, rows, new_width, new_rows, &buffer_in, &buffer_out);
 
-  cl_image_format format = { CL_R, CL_UNORM_INT8};
-  buffer_in = clCreateImage2D (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format,
-    width, height, 0,
-    data,
-    &status);
-  checkError(status, "Error: could not create image");
+  //
+  // Select the work-group size: run the auto-tuner or use the tuning database
+  //
+  const char name[] = KERNELDIR "/interpolation.cl";
+  size_t problem_size[] = {new_width, new_height};
 
-  cl_image_format format2 = { CL_R, CL_FLOAT};
-  buffer_out = clCreateImage2D (context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, &format2,
-    new_width, new_height, 0,
-    NULL,
-    &status);
-  checkError(status, "Error: could not create image");
+  char key[256];
+  snprintf(key, sizeof(key), "interpolation-%lux%lu", (unsigned long) problem_size[0], (unsigned long) problem_size[1]);
 
-  // execute kernel
-  int arg = 0;
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
-  checkError(status, "Error: could not set args");
+  // A local size of 0 leaves the choice to the runtime
+  tune_config config = {2, {0, 0, 1}, "", 0};
 
-  size_t work_size[] = {new_width, new_height};
-  size_t local_size[] = {1, 1};
+  if (opts.tune && !stream_opts.input) {
+    tune_problem problem = {name, "interpolation", "-I.", NULL, 2, 1, 0, interpolation_setup, problem_size};
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      config = tuned;
+  } else {
+    tune_lookup(device, key, &config);
+  }
 
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
+  if (!create_program(name, &program, context, device, "-I.")) {
+    if (program) print_build_log(program, device);
+    teardown(-1);
+  }
 
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+  kernel = clCreateKernel(program, stream_opts.input ? "interpolation_band" : "interpolation", &status);
+  checkError(status, "could not create kernel");
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+  if (stream_opts.input) {
+    cl_float2 band_scale;
+    band_scale.s[0] = (cl_float) width / new_width;
+    band_scale.s[1] = (cl_float) height / new_height;
+    status = clSetKernelArg(kernel, 2, sizeof(cl_float2), &band_scale);
+    checkError(status, "Error: could not set args");
+  }
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+  // execute kernel
+  size_t work_size[2];
+  if (!interpolation_setup(kernel, &config, work_size, problem_size)) {
+    fprintf(stderr, "Error: could not set args\n");
+    teardown(-1);
+  }
+
+  size_t *local_size = config.local[0] ? config.local : NULL;
 
-  // read results back
   size_t origin[] = {0,0,0};
+  size_t region_in[] = {width, height, 1};
   size_t region[] = {new_width, new_height, 1};
-  status = clEnqueueReadImage(queue, buffer_out, CL_FALSE, origin, region, new_width*sizeof(cl_float), 0, data_out, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+
+  char variant[64];
+  if (batch_opts.count)
+    snprintf(variant, sizeof(variant), "%s-batch%d-q%d", argv[1], batch_opts.count, batch_opts.queues);
+  else if (stream_opts.input)
+    snprintf(variant, sizeof(variant), "%s-stream%lu", argv[1], (unsigned long) streaming.band);
+  else
+    snprintf(variant, sizeof(variant), "%s", argv[1]);
+
+  bench b;
+  if (!bench_init(&b, &opts, "interpolation", variant, width)) {
+    teardown(-1);
+  }
+
+  int ok = 1;
+  if (batch_opts.count) {
+    //
+    // Batch mode: images are spread over the queues, each with its own images
+    //
+    if (!batch_init(&pipeline, context, device, batch_opts.queues, buf_size))
+      teardown(-1);
+    for (int i = 0; i < pipeline.slots; ++i)
+      interpolation_images(width, height, new_width, new_height, &pool_in[i], &pool_out[i]);
+
+    interpolation_batch p = {width, height, new_width, new_height, work_size, local_size};
+
+    bench_set_rate(&b, batch_opts.count, "images/s");
+    pipeline.b = &b;
+    while (ok && bench_next(&b))
+      ok = batch_run(&pipeline, batch_opts.count, images, nimages, interpolation_enqueue, &p);
+    pipeline.b = NULL;
+
+    if (ok)
+      memcpy(data_out, pipeline.slot[pipeline.last].out, buf_size);
+  } else if (stream_opts.input) {
+    //
+    // Streaming mode: the image is read, scaled and written band by band
+    //
+    size_t size[] = {width, new_width};
+
+    bench_set_rate(&b, new_width*new_height*1e-6, "MPixel/s");
+    streaming.b = &b;
+    while (ok && bench_next(&b))
+      ok = stream_run(&streaming, interpolation_enqueue_band, size);
+    streaming.b = NULL;
+  } else {
+    bench_set_rate(&b, new_width*new_height*1e-6, "MPixel/s");
+
+    while (bench_next(&b)) {
+      status = clEnqueueWriteImage(queue, buffer_in, CL_FALSE, origin, region_in, width, 0, data, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_H2D, event);
+
+      status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, local_size, 0, NULL, &event);
+      checkError(status, "Error: could not enqueue kernel");
+      bench_event(&b, BENCH_KERNEL, event);
+
+      // read results back
+      status = clEnqueueReadImage(queue, buffer_out, CL_FALSE, origin, region, new_width*sizeof(cl_float), 0, data_out, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_D2H, event);
+    }
+  }
 
   status  = clFinish(queue);
   checkError(status, "Error: could not finish successfully");
 
-  double elapsed = (end - start) * 1e-9f;
-  printf("time: %f\n", elapsed);
+  if (ok)
+    bench_report(&b);
+  bench_free(&b);
+
+  if (stream_opts.input) {
+    if (ok)
+      stream_report(&streaming);
+    teardown(ok ? 0 : -1);
+  }
 
   write_bmp("scale.bmp", data_out, new_width, new_height, NORMAL);
 
+  batch_free_images(images, nimages);
   free(data);
   free(data_out);
-  teardown(0);
+  teardown(ok ? 0 : -1);
 }
 
 
@@ -10,3 +10,20 @@ kernel void interpolation(read_only image2d_t in, write_only image2d_t out) {
 
     write_imagef(out, pos, pix);
 }
+
+const sampler_t sampler_band = CLK_NORMALIZED_COORDS_FALSE |
+                               CLK_FILTER_LINEAR |
+                               CLK_ADDRESS_CLAMP_TO_EDGE;
+
+// Rows out_y ... of the scaled image from a band of the input that starts at
+// row in_y, with the mapping of interpolation: scale is the size of the input
+// over the size of the output.
+kernel void interpolation_band(read_only image2d_t in, write_only image2d_t out,
+                               float2 scale, int out_y, int in_y) {
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    float2 src = (float2)(pos.x, pos.y + out_y) * scale - (float2)(0, in_y);
+
+    float4 pix = read_imagef(in, sampler_band, src)*255;
+
+    write_imagef(out, pos, pix);
+}
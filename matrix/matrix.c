@@ -13,95 +13,245 @@
 #include <math.h>
 
 #include <ocllib.h>
+#include <bench.h>
+#include <tune.h>
+#include <hostref.h>
+#include <staging.h>
+#include <split.h>
+
+// Default tile and register block size of matrix_mul6, passed to the kernel as build options
+#ifndef TILE_SIZE
+#define TILE_SIZE 32
+#endif
+
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4
+#endif
 
 static cl_platform_id platform;
-static cl_device_id device;
 static cl_context context;
-static cl_command_queue queue;
 
-static cl_program program;
-static cl_kernel kernel;
-static cl_mem buffer_A, buffer_B, buffer_C;
+// Devices the rows of C are split across, one queue each
+static split parts;
+
+// Program, kernel and full-size buffers of every device, so that rows can
+// move between devices from one run to the next
+static cl_program program[SPLIT_MAX_DEVICES];
+static cl_kernel kernel[SPLIT_MAX_DEVICES];
+static cl_mem buffer_A[SPLIT_MAX_DEVICES], buffer_B[SPLIT_MAX_DEVICES], buffer_C[SPLIT_MAX_DEVICES];
+
+// Pinned host memory of A, B and C
+static staging pinned;
 
 void teardown(int exit_status)
 {
-  if (buffer_A) clReleaseMemObject(buffer_A);
-  if (buffer_B) clReleaseMemObject(buffer_B);
-  if (buffer_C) clReleaseMemObject(buffer_C);
-  if (kernel) clReleaseKernel(kernel);
-  if (program) clReleaseProgram(program);
-  if (queue) clReleaseCommandQueue(queue);
+  staging_release(&pinned);
+  for (int d = 0; d < SPLIT_MAX_DEVICES; ++d) {
+    if (buffer_A[d]) clReleaseMemObject(buffer_A[d]);
+    if (buffer_B[d]) clReleaseMemObject(buffer_B[d]);
+    if (buffer_C[d]) clReleaseMemObject(buffer_C[d]);
+    if (kernel[d]) clReleaseKernel(kernel[d]);
+    if (program[d]) clReleaseProgram(program[d]);
+  }
+  split_release(&parts);
   if (context) clReleaseContext(context);
 
   exit(exit_status);
 }
 
-void matrix_mul(const float *A, const float *B, float *C, cl_int M) {
-  for (int i=0; i<M; i++){
-    for (int j=0; j<M; j++){
-      for (int k=0; k<M; k++) {
-        C[i*M+j] += A[i*M+k] * B[k*M+j];
-      }
+typedef struct {
+  int variant;
+  cl_int M, N, K;
+  cl_int rows;          // rows of C computed by the device, the first ones of its buffers
+  cl_mem A, B, C;
+} matrix_args;
+
+static void matrix_default_config(int variant, tune_config *config) {
+  memset(config, 0, sizeof(tune_config));
+  config->local[1] = config->local[2] = 1;
+
+  switch(variant) {
+    case 1:
+    case 2:
+      config->dim = 2;
+      config->local[0] = 32;
+      config->local[1] = 32;
+      break;
+    case 3:
+    case 4:
+      config->dim = 1;
+      config->local[0] = 32;
+      break;
+    case 5:
+      config->dim = 1;
+      config->local[0] = 128;
+      break;
+    case 6:
+      config->dim = 2;
+      snprintf(config->options, TUNE_MAX_OPTIONS, "-DTILE_SIZE=%d -DBLOCK_SIZE=%d", TILE_SIZE, BLOCK_SIZE);
+      break;
+  }
+}
+
+static int matrix_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const matrix_args *a = (const matrix_args *) user;
+  cl_int status;
+
+  int arg = 0;
+  // Kernels 1-5 take the row stride, kernel 6 the rows
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &a->A);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &a->B);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &a->C);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), a->variant == 6 ? &a->rows : &a->M);
+  if (a->variant == 6) {
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->N);
+    status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->K);
+  }
+  if (status != CL_SUCCESS)
+    return 0;
+
+  switch(a->variant) {
+    case 1:
+    case 2:
+      work_size[0]  = a->rows;
+      work_size[1]  = a->M;
+      break;
+    case 3:
+    case 4:
+    case 5:
+      work_size[0]  = a->rows;
+      break;
+    case 6: {
+      // Work-items compute block x block elements, dimension 0 runs over columns
+      int tile = TILE_SIZE, block = BLOCK_SIZE;
+      sscanf(config->options, "-DTILE_SIZE=%d -DBLOCK_SIZE=%d", &tile, &block);
+
+      config->local[0] = tile/block;
+      config->local[1] = tile/block;
+
+      work_size[0]  = (a->N+tile-1)/tile*config->local[0];
+      work_size[1]  = (a->rows+tile-1)/tile*config->local[1];
+      break;
     }
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+// Host matrices and the arguments and configuration of every device
+typedef struct {
+  const float *A, *B;
+  float *C;
+  matrix_args args[SPLIT_MAX_DEVICES];
+  tune_config config[SPLIT_MAX_DEVICES];
+} matrix_split;
+
+// Rows [offset, offset+count) of C on device d: upload the rows of A, all of
+// B and the rows of C, which the kernels accumulate into, and read C back.
+static int matrix_work(split *s, int d, size_t offset, size_t count, void *user) {
+  matrix_split *m = (matrix_split *) user;
+  matrix_args *a = &m->args[d];
+  cl_command_queue queue = s->queue[d];
+  cl_event event;
+  cl_int status;
+
+  a->rows = (cl_int) count;
+  size_t work_size[2];
+  if (!matrix_setup(kernel[d], &m->config[d], work_size, a)) {
+    fprintf(stderr, "Error: could not set args\n");
+    return 0;
   }
+
+  status = clEnqueueWriteBuffer(queue, a->A, CL_FALSE, 0, count*a->K*sizeof(cl_float), m->A + offset*a->K, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_H2D, event);
+
+  status = clEnqueueWriteBuffer(queue, a->B, CL_FALSE, 0, (size_t) a->K*a->N*sizeof(cl_float), m->B, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_H2D, event);
+
+  status = clEnqueueWriteBuffer(queue, a->C, CL_FALSE, 0, count*a->N*sizeof(cl_float), m->C + offset*a->N, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_H2D, event);
+
+  status = clEnqueueNDRangeKernel(queue, kernel[d], m->config[d].dim, NULL, work_size, m->config[d].local, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_KERNEL, event);
+
+  // read results back
+  status = clEnqueueReadBuffer(queue, a->C, CL_FALSE, 0, count*a->N*sizeof(cl_float), m->C + offset*a->N, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_D2H, event);
+  return 1;
+
+error_ret:
+  fprintf(stderr, "Error: could not enqueue rows %lu-%lu on device %d\n", (unsigned long) offset,
+      (unsigned long) (offset + count), d);
+  print_error(status);
+  return 0;
 }
 
 int main(int argc, char **argv) {
   cl_int status;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <kernel>\n", argv[0]);
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  split_options split_opts;
+  split_parse_args(&argc, argv, &split_opts);
+
+  if (argc != 2 && argc != 4) {
+    fprintf(stderr, "Usage: %s " BENCH_USAGE " " DEVICE_USAGE " " SPLIT_USAGE " <kernel> [<N> <K>]\n", argv[0]);
+    fprintf(stderr, "Computes C(MxN) += A(MxK) * B(KxN) with M given by --size\n");
+    fprintf(stderr, "  with --devices the rows are split across the devices of the platform\n");
     teardown(-1);
   }
 
-  const char *platform_name = "NVIDIA";
-
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
+  cl_device_id devices[SPLIT_MAX_DEVICES];
+  cl_uint device_count;
+  if (!select_devices(&device_opts, "NVIDIA", &platform, devices,
+        split_opts.devices ? split_opts.devices : SPLIT_MAX_DEVICES, &device_count)) {
     print_platforms();
     teardown(-1);
   }
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
-
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  context = clCreateContext(NULL, device_count, devices, NULL, NULL, &status);
   checkError(status, "could not create context");
 
-  const char name[] = KERNELDIR "/matrix.cl";
+  for (cl_uint d = 0; d < device_count; ++d)
+    print_device_info(devices[d], d > 0);
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
+  if (!split_init(&parts, context, devices, device_count))
     teardown(-1);
-  }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
-
-  status = clBuildProgram(program, 1, &device, "-I. -cl-fast-relaxed-math -cl-mad-enable -cl-nv-verbose", NULL, NULL);
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to build program %s: ", name);
+  int variant = atoi(argv[1]);
+  if (variant < 1 || variant > 6) {
+    fprintf(stderr, "Invalid kernel number\n");
+    teardown(-1);
   }
-  print_build_log(program, device);
 
-  free(source);
+  cl_int M  = opts.size ? (cl_int) opts.size : 1024;
+  cl_int N  = (argc == 4) ? atoi(argv[2]) : M;
+  cl_int K  = (argc == 4) ? atoi(argv[3]) : M;
 
-  print_device_info(device, 0);
-
-  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
-  checkError(status, "could not create command queue");
+  if (variant < 6 && (N != M || K != M)) {
+    fprintf(stderr, "Error: kernel %d only supports square matrices\n", variant);
+    teardown(-1);
+  }
 
-  cl_ulong start, end;
-  cl_event event;
+  size_t buf_size_A = (size_t) M*K*sizeof(cl_float);
+  size_t buf_size_B = (size_t) K*N*sizeof(cl_float);
+  size_t buf_size = (size_t) M*N*sizeof(cl_float);
 
-  cl_int M  = 1024;
-  size_t buf_size = M*M*sizeof(cl_float);
+  staging_init(&pinned, context, parts.queue[0]);
 
-  float *A  = malloc(buf_size);
-  float *B  = malloc(buf_size);
-  float *C  = malloc(buf_size);
+  float *A  = staging_alloc(&pinned, buf_size_A);
+  float *B  = staging_alloc(&pinned, buf_size_B);
+  float *C  = staging_alloc(&pinned, buf_size);
   float *Ref  = malloc(buf_size);
   if (!A || !B || !C || !Ref) {
     fprintf(stderr,"\nError: malloc failed\n");
@@ -109,11 +259,16 @@ int main(int argc, char **argv) {
   }
 
   memset(C, 0, buf_size);
+  memset(Ref, 0, buf_size);
 
   for (int i = 0; i < M; ++i) {
-    for (int j = 0; j < M; ++j) {
-      A[i*M+j] = (float) i;
-      B[i*M+j] = (float) j;
+    for (int k = 0; k < K; ++k) {
+      A[i*K+k] = (float) i;
+    }
+  }
+  for (int k = 0; k < K; ++k) {
+    for (int j = 0; j < N; ++j) {
+      B[k*N+j] = (float) j;
     }
   }
 
@@ -126,6 +281,32 @@ int main(int argc, char **argv) {
   }
 #endif
 
+  matrix_split m;
+  m.A = A;
+  m.B = B;
+  m.C = C;
+
+  for (int d = 0; d < parts.devices; ++d) {
+    buffer_A[d] = clCreateBuffer(context, CL_MEM_READ_ONLY, buf_size_A, NULL, &status);
+    checkError(status, "Error: could not create buffer_in");
+
+    buffer_B[d] = clCreateBuffer(context, CL_MEM_READ_ONLY, buf_size_B, NULL, &status);
+    checkError(status, "Error: could not create buffer_out");
+
+    buffer_C[d] = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
+    checkError(status, "Error: could not create buffer_out");
+
+    matrix_args args = {variant, M, N, K, M, buffer_A[d], buffer_B[d], buffer_C[d]};
+    m.args[d] = args;
+  }
+
+  //
+  // Select local size and build options for every device: run the auto-tuner
+  // or use the tuning database, falling back to the defaults
+  //
+  const char name[] = KERNELDIR "/matrix.cl";
+  const char base_options[] = "-I. -cl-fast-relaxed-math -cl-mad-enable -cl-nv-verbose";
+
   char kernelname[256];
 #ifdef WIN32
   _snprintf(kernelname, 256, "matrix_mul%s", argv[1]);
@@ -133,129 +314,122 @@ int main(int argc, char **argv) {
   snprintf(kernelname, 256, "matrix_mul%s", argv[1]);
 #endif
 
-  kernel = clCreateKernel(program, kernelname, &status);
-  checkError(status, "could not create kernel %s", kernelname);
+  char key[sizeof(kernelname) + 64];
+  snprintf(key, sizeof(key), "%s-%dx%dx%d", kernelname, M, N, K);
 
-  buffer_A = clCreateBuffer(context, CL_MEM_READ_ONLY, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_in");
+  // Candidate build options: private/local buffers sized to the problem, tile and block sizes
+  char variants[16][TUNE_MAX_OPTIONS];
+  const char *variant_list[17];
+  int n = 0;
 
-  buffer_B = clCreateBuffer(context, CL_MEM_READ_ONLY, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  if (variant == 4 || variant == 5) {
+    for (int buf = 1024; buf >= K && n < 16; buf /= 2) {
+      snprintf(variants[n], TUNE_MAX_OPTIONS, "-DPRIVATE_BUF_SIZE=%d -DLOCAL_BUF_SIZE=%d", buf, buf);
+      variant_list[n] = variants[n];
+      n++;
+    }
+  } else if (variant == 6) {
+    for (int tile = 16; tile <= 64; tile *= 2) {
+      for (int block = 2; block <= 8; block *= 2) {
+        snprintf(variants[n], TUNE_MAX_OPTIONS, "-DTILE_SIZE=%d -DBLOCK_SIZE=%d", tile, block);
+        variant_list[n] = variants[n];
+        n++;
+      }
+    }
+  }
+  variant_list[n] = NULL;
 
-  buffer_C = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  // Rows are split in multiples of the work-group size of the row dimension,
+  // kernel 6 pads partial tiles itself
+  size_t granularity = 1;
 
-  status = clEnqueueWriteBuffer(queue, buffer_A, CL_FALSE, 0, buf_size, A, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  for (int d = 0; d < parts.devices; ++d) {
+    tune_config *config = &m.config[d];
+    matrix_default_config(variant, config);
 
-  status = clEnqueueWriteBuffer(queue, buffer_B, CL_FALSE, 0, buf_size, B, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+    if (opts.tune) {
+      tune_problem problem = {name, kernelname, base_options, n ? variant_list : NULL,
+        config->dim, 1, variant == 6, matrix_setup, &m.args[d]};
 
-  status = clEnqueueWriteBuffer(queue, buffer_C, CL_FALSE, 0, buf_size, C, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+      tune_config tuned;
+      if (tune_kernel(context, parts.device[d], parts.queue[d], &problem, key, &tuned))
+        *config = tuned;
+    } else {
+      tune_lookup(parts.device[d], key, config);
+    }
 
-  // execute kernel
-  int arg = 0;
-  status = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_A);
-  status = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_B);
-  status = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_C);
-  status = clSetKernelArg(kernel, arg++, sizeof(cl_int), &M);
-  checkError(status, "Error: could not set args");
+    char options[1024];
+    snprintf(options, sizeof(options), "%s %s", base_options, config->options);
 
-  size_t dim;
-  size_t work_size[2];
-  size_t local_size[2];
+    if (!create_program(name, &program[d], context, parts.device[d], options)) {
+      if (program[d]) print_build_log(program[d], parts.device[d]);
+      teardown(-1);
+    }
+    print_build_log(program[d], parts.device[d]);
 
-  switch(atoi(argv[1])) {
-    case 1:
-      dim=2;
-      work_size[0]  = M;
-      work_size[1]  = M;
+    kernel[d] = clCreateKernel(program[d], kernelname, &status);
+    checkError(status, "could not create kernel %s", kernelname);
 
-      local_size[0] = 32;
-      local_size[1] = 32;
-      break;
-    case 2:
-      dim=2;
-      work_size[0]  = M;
-      work_size[1]  = M;
+    if (variant < 6 && config->local[0] > granularity)
+      granularity = config->local[0];
+  }
 
-      local_size[0] = 32;
-      local_size[1] = 32;
-      break;
-    case 3:
-      dim=1;
-      work_size[0]  = M;
+  //
+  // Benchmark with 1 to all devices if there are several, to report the scaling
+  //
+  double rates[SPLIT_MAX_DEVICES];
+  int first = parts.devices > 1 ? 1 : parts.devices;
 
-      local_size[0] = 32;
-      break;
-    case 4:
-      dim=1;
-      work_size[0]  = M;
+  for (int used = first; used <= parts.devices; ++used) {
+    split_use(&parts, used);
 
-      local_size[0] = 32;
-      break;
-    case 5:
-      dim=1;
-      work_size[0]  = M;
+    char variant_name[64];
+    if (parts.devices > 1)
+      snprintf(variant_name, sizeof(variant_name), "%s-d%d", argv[1], used);
+    else
+      snprintf(variant_name, sizeof(variant_name), "%s", argv[1]);
 
-      local_size[0] = 128;
-      break;
-    default:
-      fprintf(stderr, "Invalid kernel number\n");
+    bench b;
+    if (!bench_init(&b, &opts, "matrix", variant_name, M)) {
       teardown(-1);
-  }
-
-  status = clEnqueueNDRangeKernel(queue, kernel, dim, NULL, work_size, local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
-
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
-
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+    }
+    bench_set_rate(&b, 2.0*M*N*K*1e-9, "GFLOP/s");
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+    parts.b = &b;
+    while (bench_next(&b)) {
+      // The kernels accumulate into C, so it is reset every repetition
+      memset(C, 0, buf_size);
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+      if (!split_run(&parts, M, granularity, matrix_work, &m)) {
+        bench_free(&b);
+        teardown(-1);
+      }
+    }
+    parts.b = NULL;
 
-  // read results back
-  status = clEnqueueReadBuffer(queue, buffer_C, CL_FALSE, 0, buf_size, C, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+    bench_report(&b);
+    rates[used-1] = bench_rate(&b);
+    bench_free(&b);
 
-  status  = clFinish(queue);
-  checkError(status, "Error: could not finish successfully");
+    if (parts.devices > 1)
+      split_report(&parts);
+  }
 
-  double elapsed = (end - start)*1e-9;
-  double gflops = M*M*M*1e-9/elapsed*2;
-  printf("time: %f\n", elapsed);
-  printf("gflops: %f\n", gflops);
+  if (parts.devices > 1)
+    split_scaling_report(rates, parts.devices, "GFLOP/s");
 
 #define CHECK
 #ifdef CHECK
-  matrix_mul(A,B,Ref,M);
-
-  int correct = 1;
-  for (int i = 0; i < M; ++i) {
-    for (int j = 0; j < M; ++j) {
-      if (Ref[i*M+j] != C[i*M+j]) {
-        correct = 0;
-      }
-    }
-  }
-
-  if (!correct)
-    fprintf(stderr, "Compare failed\n");
+  double check_start = get_time();
+  host_sgemm(A,B,Ref,M,N,K);
+  compare_products(Ref, C, (size_t) M*N, K);
+  printf("verification: %f s\n", get_time() - check_start);
 #endif
 
 
-  free(A);
-  free(B);
-  free(C);
+  staging_free(&pinned, A);
+  staging_free(&pinned, B);
+  staging_free(&pinned, C);
   free(Ref);
   teardown(0);
 }
-
-
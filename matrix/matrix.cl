@@ -83,3 +83,97 @@ kernel void matrix_mul5(global float *A, global float *B, global float *C, int M
         C[i*M+j] += tmp;
     }
 }
+
+//
+// 2D-tiled matrix multiplication C += A*B with register blocking.
+//
+// A is MxK, B is KxN and C is MxN, all row-major. Each work-group computes a
+// TILE_SIZE x TILE_SIZE tile of C and stages the matching tiles of A and B in
+// local memory. Every work-item accumulates a BLOCK_SIZE x BLOCK_SIZE block of
+// C in registers, strided by TILE_SIZE/BLOCK_SIZE so neighbouring work-items
+// read neighbouring elements of Bsub.
+//
+// Dimension 0 runs over columns of C to get coalesced loads of B and stores to
+// C. The local size has to be (TILE_SIZE/BLOCK_SIZE, TILE_SIZE/BLOCK_SIZE), the
+// global size is rounded up to a multiple of it; out-of-range elements are
+// padded with zeros.
+//
+#ifndef TILE_SIZE
+#define TILE_SIZE 32
+#endif
+
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4
+#endif
+
+#define BLOCK_THREADS (TILE_SIZE/BLOCK_SIZE)
+
+kernel void matrix_mul6(global float *A, global float *B, global float *C, int M, int N, int K) {
+    const int tx = get_local_id(0);
+    const int ty = get_local_id(1);
+    const int row0 = get_group_id(1)*TILE_SIZE;
+    const int col0 = get_group_id(0)*TILE_SIZE;
+
+    local float Asub[TILE_SIZE][TILE_SIZE];
+    local float Bsub[TILE_SIZE][TILE_SIZE];
+
+    float acc[BLOCK_SIZE][BLOCK_SIZE];
+    #pragma unroll
+    for (int r=0; r<BLOCK_SIZE; ++r) {
+        #pragma unroll
+        for (int c=0; c<BLOCK_SIZE; ++c) {
+            acc[r][c] = 0.0f;
+        }
+    }
+
+    for (int k0=0; k0<K; k0+=TILE_SIZE) {
+        // Every work-item loads BLOCK_SIZE x BLOCK_SIZE elements of each tile
+        #pragma unroll
+        for (int r=0; r<BLOCK_SIZE; ++r) {
+            const int lr = ty + r*BLOCK_THREADS;
+            #pragma unroll
+            for (int c=0; c<BLOCK_SIZE; ++c) {
+                const int lc = tx + c*BLOCK_THREADS;
+
+                const int arow = row0 + lr;
+                const int acol = k0 + lc;
+                Asub[lr][lc] = (arow < M && acol < K) ? A[arow*K+acol] : 0.0f;
+
+                const int brow = k0 + lr;
+                const int bcol = col0 + lc;
+                Bsub[lr][lc] = (brow < K && bcol < N) ? B[brow*N+bcol] : 0.0f;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k=0; k<TILE_SIZE; ++k) {
+            float Breg[BLOCK_SIZE];
+            #pragma unroll
+            for (int c=0; c<BLOCK_SIZE; ++c) {
+                Breg[c] = Bsub[k][tx + c*BLOCK_THREADS];
+            }
+
+            #pragma unroll
+            for (int r=0; r<BLOCK_SIZE; ++r) {
+                const float a = Asub[ty + r*BLOCK_THREADS][k];
+                #pragma unroll
+                for (int c=0; c<BLOCK_SIZE; ++c) {
+                    acc[r][c] += a * Breg[c];
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    #pragma unroll
+    for (int r=0; r<BLOCK_SIZE; ++r) {
+        const int row = row0 + ty + r*BLOCK_THREADS;
+        #pragma unroll
+        for (int c=0; c<BLOCK_SIZE; ++c) {
+            const int col = col0 + tx + c*BLOCK_THREADS;
+            if (row < M && col < N) {
+                C[row*N+col] += acc[r][c];
+            }
+        }
+    }
+}
@@ -0,0 +1,178 @@
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <arena.h>
+
+static cl_platform_id platform;
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue queue;
+
+static arena pool;
+
+// Buffers alive at the same time, the oldest is freed for every new one
+#define LIVE 32
+static cl_mem live[LIVE];
+
+static int use_arena;
+
+static void release_buffer(cl_mem mem) {
+  if (use_arena)
+    arena_free(&pool, mem);
+  else
+    clReleaseMemObject(mem);
+}
+
+void teardown(int exit_status)
+{
+  for (int i = 0; i < LIVE; ++i)
+    if (live[i]) release_buffer(live[i]);
+  arena_release(&pool);
+  if (queue) clReleaseCommandQueue(queue);
+  if (context) clReleaseContext(context);
+
+  exit(exit_status);
+}
+
+// Sizes from 1 KB to 4 MB, uniform in their logarithm, the same sequence for both modes
+static size_t next_size(unsigned int *seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  int bits = 10 + (int) ((*seed >> 8) % 12);
+  size_t size = (size_t) 1 << bits;
+  return size + ((*seed >> 4) % size);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  use_arena = (argc > 1 && !strcmp(argv[1], "arena"));
+
+  if (argc > 2 || (argc > 1 && !use_arena && strcmp(argv[1], "raw"))) {
+    fprintf(stderr, "Usage: %s [raw|arena] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  --size is the number of allocations per repetition (default 1000)\n");
+    teardown(-1);
+  }
+
+  size_t count = opts.size ? opts.size : 1000;
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  if (use_arena && !arena_init(&pool, context, device, CL_MEM_READ_WRITE, 0))
+    teardown(-1);
+
+  double *latency = malloc(count * sizeof(double));
+  double *all = NULL;
+  size_t samples = 0;
+  if (!latency) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
+  }
+
+  bench b;
+  if (!bench_init(&b, &opts, "alloc", use_arena ? "arena" : "raw", count)) {
+    free(latency);
+    teardown(-1);
+  }
+  bench_set_rate(&b, (double) count, "allocs/s");
+
+  //
+  // Allocate count buffers, each written once, and free the oldest
+  //
+  cl_uint word = 0;
+  int ok = 1;
+  while (ok && bench_next(&b)) {
+    unsigned int seed = 1;
+    double total = 0;
+
+    for (size_t i = 0; ok && i < count; ++i) {
+      size_t size = next_size(&seed);
+      cl_mem *slot = &live[i % LIVE];
+      if (*slot) {
+        release_buffer(*slot);
+        *slot = NULL;
+      }
+
+      double start = get_time();
+      *slot = use_arena ? arena_alloc(&pool, size, &status)
+        : clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+
+      // Runtimes may defer the allocation to the first use
+      if (status == CL_SUCCESS)
+        status = clEnqueueWriteBuffer(queue, *slot, CL_TRUE, 0, sizeof(cl_uint), &word, 0, NULL, NULL);
+      latency[i] = get_time() - start;
+      total += latency[i];
+
+      if (status != CL_SUCCESS) {
+        fprintf(stderr, "Error: could not allocate %lu bytes\n", (unsigned long) size);
+        print_error(status);
+        ok = 0;
+      }
+    }
+
+    for (int i = 0; i < LIVE; ++i) {
+      if (live[i]) release_buffer(live[i]);
+      live[i] = NULL;
+    }
+    bench_wall(&b, total);
+
+    // Latencies of the timed repetitions
+    if (ok && b.rep >= 0) {
+      double *grown = realloc(all, (samples + count) * sizeof(double));
+      if (!grown) {
+        fprintf(stderr,"\nError: malloc failed\n");
+        ok = 0;
+        break;
+      }
+      all = grown;
+      memcpy(all + samples, latency, count * sizeof(double));
+      samples += count;
+    }
+  }
+
+  if (ok)
+    bench_report(&b);
+  bench_free(&b);
+
+  if (ok && samples) {
+    double sum = 0;
+    for (size_t i = 0; i < samples; ++i)
+      sum += all[i];
+    qsort(all, samples, sizeof(double), compare_double);
+    printf("latency [us]: mean %.2f, median %.2f, p99 %.2f, max %.2f\n", sum / samples * 1e6,
+        all[samples / 2] * 1e6, all[(size_t) (samples * 0.99)] * 1e6, all[samples - 1] * 1e6);
+  }
+  if (ok && use_arena)
+    arena_report(&pool);
+
+  free(all);
+  free(latency);
+  teardown(ok ? 0 : -1);
+}
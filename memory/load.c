@@ -0,0 +1,242 @@
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+static cl_platform_id platform;
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue queue;
+
+static cl_program program;
+static cl_kernel kernel;
+static cl_mem buffer_sums;
+
+void teardown(int exit_status)
+{
+  if (buffer_sums) clReleaseMemObject(buffer_sums);
+  if (kernel) clReleaseKernel(kernel);
+  if (program) clReleaseProgram(program);
+  if (queue) clReleaseCommandQueue(queue);
+  if (context) clReleaseContext(context);
+
+  exit(exit_status);
+}
+
+enum {
+  LOAD_READ=0,      // load_file into the heap, copied into the buffer
+  LOAD_MAP=1,       // map_file, copied into the buffer
+  LOAD_ZERO_COPY=2  // map_file, the buffer uses the mapped pages
+};
+
+static const char *mode_names[] = {"read", "map", "zerocopy"};
+
+// Work items of the checksum kernel, each adds a strided part of the input
+#define CHECKSUM_ITEMS 65536
+
+// Input written before the benchmark and removed after it
+#define LOAD_FILE "load.dat"
+
+// Words of a hash sequence, so that a wrong or partial upload changes the sum
+static int write_input(const char *name, size_t size) {
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    fprintf(stderr, "Error: could not open %s\n", name);
+    return 0;
+  }
+
+  const size_t chunk = 1 << 20;
+  cl_uint *words = (cl_uint *) malloc(chunk);
+  if (!words) {
+    fprintf(stderr, "Error: malloc failed\n");
+    fclose(f);
+    return 0;
+  }
+
+  int ok = 1;
+  cl_uint word = 0;
+  for (size_t done = 0; ok && done < size; done += chunk) {
+    size_t n = (size - done < chunk) ? size - done : chunk;
+    for (size_t i = 0; i < n / sizeof(cl_uint); ++i)
+      words[i] = (word++) * 2654435761u;
+    ok = fwrite(words, 1, n, f) == n;
+  }
+  free(words);
+
+  if (fclose(f) || !ok) {
+    fprintf(stderr, "Error: could not write %s\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+static cl_uint host_checksum(const unsigned char *data, size_t size) {
+  cl_uint sum = 0;
+  for (size_t i = 0; i + sizeof(cl_uint) <= size; i += sizeof(cl_uint)) {
+    cl_uint word;
+    memcpy(&word, data + i, sizeof(cl_uint));
+    sum += word;
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  int mode = LOAD_MAP;
+  if (argc > 1) {
+    for (mode = 0; mode <= LOAD_ZERO_COPY && strcmp(argv[1], mode_names[mode]); ++mode)
+      ;
+  }
+
+  if (argc > 2 || mode > LOAD_ZERO_COPY) {
+    fprintf(stderr, "Usage: %s [read|map|zerocopy] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  --size is the input in MB (default 64)\n");
+    teardown(-1);
+  }
+
+  size_t megabytes = opts.size ? opts.size : 64;
+  size_t size = megabytes << 20;
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  cl_ulong max_alloc;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  if (size > max_alloc) {
+    fprintf(stderr, "Error: %lu MB exceed the largest buffer of %lu MB\n",
+        (unsigned long) megabytes, (unsigned long) (max_alloc >> 20));
+    teardown(-1);
+  }
+
+  if (!create_program(KERNELDIR "/load.cl", &program, context, device, "")) {
+    if (program) print_build_log(program, device);
+    teardown(-1);
+  }
+
+  kernel = clCreateKernel(program, "checksum", &status);
+  checkError(status, "could not create kernel");
+
+  buffer_sums = clCreateBuffer(context, CL_MEM_WRITE_ONLY, CHECKSUM_ITEMS*sizeof(cl_uint), NULL, &status);
+  checkError(status, "Error: could not create buffer_sums");
+
+  cl_uint *sums = malloc(CHECKSUM_ITEMS*sizeof(cl_uint));
+  if (!sums) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
+  }
+
+  //
+  // Input file, read once so that all modes start from the page cache
+  //
+  if (!write_input(LOAD_FILE, size)) {
+    free(sums);
+    teardown(-1);
+  }
+
+  mapped_file file;
+  if (!map_file(LOAD_FILE, &file)) {
+    remove(LOAD_FILE);
+    free(sums);
+    teardown(-1);
+  }
+  cl_uint expected = host_checksum(file.data, file.size);
+  unmap_file(&file);
+
+  printf("input: %s, %lu MB, %s\n", LOAD_FILE, (unsigned long) megabytes, mode_names[mode]);
+
+  bench b;
+  if (!bench_init(&b, &opts, "load", mode_names[mode], megabytes)) {
+    remove(LOAD_FILE);
+    free(sums);
+    teardown(-1);
+  }
+  bench_set_rate(&b, size*1e-9, "GB/s");
+
+  // A repetition loads the file into a buffer and reads it once on the device
+  cl_uint words = (cl_uint) (size / sizeof(cl_uint));
+  size_t work_size = CHECKSUM_ITEMS;
+  cl_event event;
+  int ok = 1;
+
+  while (ok && bench_next(&b)) {
+    double start = get_time();
+
+    unsigned char *data = NULL;
+    size_t data_size;
+    cl_mem buffer = NULL;
+
+    if (mode == LOAD_READ) {
+      ok = load_file(LOAD_FILE, &data, &data_size);
+      if (ok)
+        buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data_size, data, &status);
+    } else {
+      ok = map_file(LOAD_FILE, &file);
+      if (ok)
+        buffer = map_file_buffer(context, &file, mode == LOAD_ZERO_COPY, &status);
+    }
+    if (!ok)
+      break;
+    checkError(status, "Error: could not create buffer");
+
+    bench_time(&b, BENCH_H2D, get_time() - start);
+
+    status  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &buffer_sums);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &words);
+    checkError(status, "Error: could not set args");
+
+    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &work_size, NULL, 0, NULL, &event);
+    checkError(status, "Error: could not enqueue kernel");
+    bench_event(&b, BENCH_KERNEL, event);
+
+    status = clEnqueueReadBuffer(queue, buffer_sums, CL_FALSE, 0, CHECKSUM_ITEMS*sizeof(cl_uint), sums, 0, NULL, &event);
+    checkError(status, "Error: could not copy data from device");
+    bench_event(&b, BENCH_D2H, event);
+
+    bench_wall(&b, get_time() - start);
+
+    cl_uint sum = 0;
+    for (int i = 0; i < CHECKSUM_ITEMS; ++i)
+      sum += sums[i];
+    if (sum != expected) {
+      fprintf(stderr, "Error: checksum %08x, expected %08x\n", sum, expected);
+      ok = 0;
+    }
+
+    clReleaseMemObject(buffer);
+    if (mode == LOAD_READ)
+      free(data);
+    else
+      unmap_file(&file);
+  }
+
+  if (ok)
+    bench_report(&b);
+  bench_free(&b);
+
+  remove(LOAD_FILE);
+  free(sums);
+  teardown(ok ? 0 : -1);
+}
@@ -0,0 +1,13 @@
+// Sum of all words of data, wrapping around: every work item adds the words
+// gid, gid + global size, ..., so that loads are coalesced. The host adds the
+// partial sums.
+kernel void checksum(global const uint *data, global uint *sums, uint n) {
+    const uint gid = get_global_id(0);
+    const uint size = get_global_size(0);
+
+    uint sum = 0;
+    for (uint i = gid; i < n; i += size)
+        sum += data[i];
+
+    sums[gid] = sum;
+}
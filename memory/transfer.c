@@ -0,0 +1,199 @@
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <staging.h>
+
+static cl_platform_id platform;
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue queue;
+
+static cl_mem buffer;
+static staging pinned;
+static void *host;
+
+void teardown(int exit_status)
+{
+  if (buffer) clReleaseMemObject(buffer);
+  staging_release(&pinned);
+  free(host);
+  if (queue) clReleaseCommandQueue(queue);
+  if (context) clReleaseContext(context);
+
+  exit(exit_status);
+}
+
+enum {
+  TRANSFER_PAGEABLE=0,    // read and write from malloc memory
+  TRANSFER_PINNED=1,      // read and write from staging memory
+  TRANSFER_MAPPED=2,      // map a CL_MEM_ALLOC_HOST_PTR buffer
+  TRANSFER_HOST_PTR=3     // map a CL_MEM_USE_HOST_PTR buffer
+};
+
+static const char *mode_names[] = {"pageable", "pinned", "mapped", "usehostptr"};
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  int mode = TRANSFER_PINNED;
+  if (argc > 1) {
+    for (mode = 0; mode <= TRANSFER_HOST_PTR && strcmp(argv[1], mode_names[mode]); ++mode)
+      ;
+  }
+
+  if (argc > 2 || mode > TRANSFER_HOST_PTR) {
+    fprintf(stderr, "Usage: %s [pageable|pinned|mapped|usehostptr] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  --size is the transfer in KB (default 65536)\n");
+    teardown(-1);
+  }
+
+  size_t kilobytes = opts.size ? opts.size : 65536;
+  size_t size = kilobytes << 10;
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  cl_ulong max_alloc;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  if (size > max_alloc) {
+    fprintf(stderr, "Error: %lu KB exceed the largest buffer of %lu KB\n",
+        (unsigned long) kilobytes, (unsigned long) (max_alloc >> 10));
+    teardown(-1);
+  }
+
+  //
+  // Host memory the data comes from and goes to, and the device buffer
+  //
+  staging_init(&pinned, context, queue);
+
+  unsigned char *src, *dst;
+  if (mode == TRANSFER_PINNED) {
+    src = staging_alloc(&pinned, size);
+    dst = staging_alloc(&pinned, size);
+  } else {
+    src = malloc(size);
+    dst = malloc(size);
+  }
+  if (!src || !dst) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
+  }
+  for (size_t i = 0; i < size; ++i)
+    src[i] = (unsigned char) (i * 7 + i / 4096);
+
+  cl_mem_flags flags = CL_MEM_READ_WRITE;
+  if (mode == TRANSFER_MAPPED) {
+    flags |= CL_MEM_ALLOC_HOST_PTR;
+  } else if (mode == TRANSFER_HOST_PTR) {
+    // Page-aligned and a multiple of a cache line, so that runtimes can use it in place
+    size_t host_size = (size + 63) / 64 * 64;
+    host = malloc(host_size + MAP_FILE_ALIGNMENT);
+    if (!host) {
+      fprintf(stderr,"\nError: malloc failed\n");
+      teardown(-1);
+    }
+    flags |= CL_MEM_USE_HOST_PTR;
+  }
+  void *host_ptr = host ? (void *) (((size_t) host + MAP_FILE_ALIGNMENT - 1) / MAP_FILE_ALIGNMENT * MAP_FILE_ALIGNMENT) : NULL;
+
+  buffer = clCreateBuffer(context, flags, size, host_ptr, &status);
+  checkError(status, "Error: could not create buffer");
+
+  printf("transfer: %lu KB, %s\n", (unsigned long) kilobytes, mode_names[mode]);
+
+  bench b;
+  if (!bench_init(&b, &opts, "transfer", mode_names[mode], kilobytes)) {
+    teardown(-1);
+  }
+  // Both directions, the rate is based on the host time of the round trip,
+  // which includes the copies into and out of mappings
+  bench_set_rate(&b, 2*size*1e-9, "GB/s");
+
+  while (bench_next(&b)) {
+    // Events are recorded after the round trip, for the breakdown by phase
+    cl_event events[4];
+    int phases[4];
+    int n = 0;
+    double start = get_time();
+
+    if (mode == TRANSFER_PAGEABLE || mode == TRANSFER_PINNED) {
+      status = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, size, src, 0, NULL, &events[n]);
+      checkError(status, "Error: could not copy data into device");
+      phases[n++] = BENCH_H2D;
+
+      status = clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, size, dst, 0, NULL, &events[n]);
+      checkError(status, "Error: could not copy data from device");
+      phases[n++] = BENCH_D2H;
+    } else {
+      // The host writes into the mapping, the unmap makes it visible to the device
+      void *ptr = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size,
+          0, NULL, &events[n], &status);
+      checkError(status, "Error: could not map buffer");
+      phases[n++] = BENCH_H2D;
+
+      memcpy(ptr, src, size);
+
+      status = clEnqueueUnmapMemObject(queue, buffer, ptr, 0, NULL, &events[n]);
+      checkError(status, "Error: could not unmap buffer");
+      phases[n++] = BENCH_H2D;
+
+      ptr = clEnqueueMapBuffer(queue, buffer, CL_TRUE, CL_MAP_READ, 0, size, 0, NULL, &events[n], &status);
+      checkError(status, "Error: could not map buffer");
+      phases[n++] = BENCH_D2H;
+
+      memcpy(dst, ptr, size);
+
+      status = clEnqueueUnmapMemObject(queue, buffer, ptr, 0, NULL, &events[n]);
+      checkError(status, "Error: could not unmap buffer");
+      phases[n++] = BENCH_D2H;
+    }
+
+    status = clFinish(queue);
+    checkError(status, "Error: could not finish successfully");
+    bench_wall(&b, get_time() - start);
+
+    for (int i = 0; i < n; ++i)
+      bench_event(&b, phases[i], events[i]);
+  }
+
+  status  = clFinish(queue);
+  checkError(status, "Error: could not finish successfully");
+
+  bench_report(&b);
+  bench_free(&b);
+
+  int ok = !memcmp(src, dst, size);
+  if (!ok)
+    fprintf(stderr, "Error: data differs after the round trip\n");
+
+  if (mode == TRANSFER_PINNED) {
+    staging_free(&pinned, src);
+    staging_free(&pinned, dst);
+  } else {
+    free(src);
+    free(dst);
+  }
+  teardown(ok ? 0 : -1);
+}
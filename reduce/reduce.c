@@ -12,161 +12,447 @@
 #include <math.h>
 
 #include <ocllib.h>
+#include <bench.h>
+#include <tune.h>
+#include <staging.h>
+#include <split.h>
+
+#include "reduction.h"
 
 static cl_platform_id platform;
 static cl_device_id device;
 static cl_context context;
 static cl_command_queue queue;
 
-static cl_program program;
-static cl_kernel kernel;
-static cl_mem buffer_in, buffer_out;
+static reduction r;
+static cl_mem buffer_in, buffer_out, buffer_index;
+
+// Pinned host memory of the input
+static staging pinned;
+
+// With several devices, the input is split across them, each with its own
+// reduction and input buffer
+static split parts;
+static reduction part[SPLIT_MAX_DEVICES];
+static cl_mem part_in[SPLIT_MAX_DEVICES];
 
 void teardown(int exit_status)
 {
+  staging_release(&pinned);
+  reduction_release(&r);
+  for (int d = 0; d < SPLIT_MAX_DEVICES; ++d) {
+    reduction_release(&part[d]);
+    if (part_in[d]) clReleaseMemObject(part_in[d]);
+  }
+  split_release(&parts);
   if (buffer_in) clReleaseMemObject(buffer_in);
   if (buffer_out) clReleaseMemObject(buffer_out);
-  if (kernel) clReleaseKernel(kernel);
-  if (program) clReleaseProgram(program);
+  if (buffer_index) clReleaseMemObject(buffer_index);
   if (queue) clReleaseCommandQueue(queue);
   if (context) clReleaseContext(context);
 
   exit(exit_status);
 }
 
-int main(int argc, char **argv) {
+// Smallest work-group size
+#define MIN_LOCAL_SIZE 16
+
+typedef struct {
+  cl_ulong length;
+  size_t partial_size;
+  int has_index;
+} reduce_args;
+
+// Tuning runs the first pass of the reduction
+static int reduce_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const reduce_args *args = (const reduce_args *) user;
+  int vector_width = 4;
+
+  const char *vw = strstr(config->options, "-DVECTOR_WIDTH=");
+  if (vw)
+    vector_width = atoi(vw + strlen("-DVECTOR_WIDTH="));
+
+  cl_int status = reduction_set_args(kernel, buffer_in, args->length, 0, buffer_out, buffer_index,
+      config->local[0], args->partial_size, args->has_index);
+
+  work_size[0] = reduction_groups(args->length, config->local[0], vector_width) * config->local[0];
+  return status == CL_SUCCESS;
+}
+
+typedef struct {
+  int ok;
+  double rate;      // GB/s
+  double value;
+  cl_ulong index;
+} reduce_result;
+
+// Input and results of the devices, which are read without waiting
+typedef struct {
+  const float *data;
+  size_t in_size[SPLIT_MAX_DEVICES];    // bytes of part_in
+  unsigned char partial[SPLIT_MAX_DEVICES][sizeof(cl_double)];
+  cl_ulong index[SPLIT_MAX_DEVICES];
+} reduce_split;
+
+// Reduce elements [offset, offset+count) on device d and read the result
+static int reduce_work(split *s, int d, size_t offset, size_t count, void *user) {
+  reduce_split *rs = (reduce_split *) user;
+  reduction *pr = &part[d];
+  cl_event event;
   cl_int status;
 
-  const char *platform_name = "NVIDIA";
+  if (count > pr->max_chunk) {
+    fprintf(stderr, "Error: %lu elements exceed the largest buffer of device %d\n", (unsigned long) count, d);
+    return 0;
+  }
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
-    teardown(-1);
+  // Grow the input buffer when rebalancing moves elements to the device
+  if (rs->in_size[d] < count * sizeof(cl_float)) {
+    if (part_in[d]) clReleaseMemObject(part_in[d]);
+    rs->in_size[d] = 0;
+    part_in[d] = clCreateBuffer(context, CL_MEM_READ_ONLY, count * sizeof(cl_float), NULL, &status);
+    if (status != CL_SUCCESS) {
+      part_in[d] = NULL;
+      goto error_ret;
+    }
+    rs->in_size[d] = count * sizeof(cl_float);
   }
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+  status = clEnqueueWriteBuffer(s->queue[d], part_in[d], CL_FALSE, 0, count * sizeof(cl_float),
+      rs->data + offset, 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_H2D, event);
+
+  // The passes are not recorded, waiting for them would serialize the devices
+  if (!reduction_run(pr, part_in[d], count, offset))
+    return 0;
+
+  status = clEnqueueReadBuffer(s->queue[d], pr->partial[pr->result], CL_FALSE, 0, pr->partial_size,
+      rs->partial[d], 0, NULL, &event);
+  if (status != CL_SUCCESS) goto error_ret;
+  split_event(s, d, BENCH_D2H, event);
+
+  rs->index[d] = 0;
+  if (pr->has_index) {
+    status = clEnqueueReadBuffer(s->queue[d], pr->partial_index[pr->result], CL_FALSE, 0, sizeof(cl_ulong),
+        &rs->index[d], 0, NULL, &event);
+    if (status != CL_SUCCESS) goto error_ret;
+    split_event(s, d, BENCH_D2H, event);
+  }
+  return 1;
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "could not create context");
+error_ret:
+  fprintf(stderr, "Error: could not enqueue the reduction on device %d\n", d);
+  print_error(status);
+  return 0;
+}
 
-  const char name[] = KERNELDIR "/reduce.cl";
+// Combine the results of the devices of the last run. The ranges are in
+// order, so of equal elements the first one is selected, as on one device.
+static void merge_results(const reduce_split *rs, reduce_op op, double *value, cl_ulong *index) {
+  int first = 1;
+  for (int d = 0; d < parts.active; ++d) {
+    if (parts.offset[d+1] == parts.offset[d])
+      continue;
+
+    double v = reduction_partial_value(&part[d], rs->partial[d]);
+    if (first || ((op == REDUCE_MIN || op == REDUCE_ARGMIN) ? v < *value
+          : (op == REDUCE_MAX || op == REDUCE_ARGMAX) && v > *value)) {
+      *value = v;
+      *index = rs->index[d];
+    } else if (op == REDUCE_SUM) {
+      *value += v;
+    }
+    first = 0;
+  }
+}
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
-    teardown(-1);
+// Benchmark the reduction of data split across 1 to all devices. Device 0
+// uses config, the others the entry of key in their tuning database.
+static void reduce_run_split(const bench_options *opts, reduce_op op, reduce_precision precision,
+    const tune_config *config, const char *key, const float *data, size_t width, reduce_result *result) {
+  reduce_split rs;
+  memset(&rs, 0, sizeof(reduce_split));
+  rs.data = data;
+
+  for (int d = 0; d < parts.devices; ++d) {
+    tune_config device_config = {1, {64, 1, 1}, "", 0};
+    if (d == 0)
+      device_config = *config;
+    else
+      tune_lookup(parts.device[d], key, &device_config);
+
+    if (!reduction_init(&part[d], context, parts.device[d], parts.queue[d], op, precision,
+          device_config.options, device_config.local[0]))
+      goto release;
   }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
+  double rates[SPLIT_MAX_DEVICES];
+  result->ok = 1;
+  for (int used = 1; result->ok && used <= parts.devices; ++used) {
+    split_use(&parts, used);
+
+    char variant[64];
+    snprintf(variant, sizeof(variant), "%s-%s-d%d", reduce_op_name(op), reduce_precision_name(precision), used);
+
+    bench b;
+    if (!bench_init(&b, opts, "reduce", variant, width)) {
+      teardown(-1);
+    }
+    bench_set_rate(&b, width*sizeof(cl_float)*1e-9, "GB/s");
+
+    // Ranges are a multiple of any vector width, like the chunks of reduction_host
+    parts.b = &b;
+    while (result->ok && bench_next(&b)) {
+      result->ok = split_run(&parts, width, 16, reduce_work, &rs);
+      if (result->ok)
+        merge_results(&rs, op, &result->value, &result->index);
+    }
+    parts.b = NULL;
+
+    if (result->ok) {
+      bench_report(&b);
+      rates[used-1] = bench_rate(&b);
+      split_report(&parts);
+    }
+    bench_free(&b);
+  }
 
-  status = clBuildProgram(program, 1, &device, "-I.", NULL, NULL);
+  if (result->ok) {
+    split_scaling_report(rates, parts.devices, "GB/s");
+    result->rate = rates[parts.devices-1];
+  }
 
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to create build %s: ", name);
+release:
+  for (int d = 0; d < parts.devices; ++d) {
+    reduction_release(&part[d]);
+    if (part_in[d]) clReleaseMemObject(part_in[d]);
+    part_in[d] = NULL;
   }
+}
 
-  free(source);
+// Tune or look up the configuration, then benchmark the reduction of data.
+static void reduce_run(const bench_options *opts, const pipeline_options *chunking, reduce_op op,
+    reduce_precision precision, const float *data, size_t width, reduce_result *result) {
+  cl_int status;
 
-  print_device_info(device, 0);
+  memset(result, 0, sizeof(reduce_result));
 
-  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
-  checkError(status, "could not create command queue");
+  cl_ulong max_alloc;
+  status = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  checkError(status, "Error: could not query device");
 
-  cl_ulong start, end;
-  cl_event event;
+  //
+  // Select work-group size and vector width: run the auto-tuner or use the tuning database
+  //
+  char key[256];
+  snprintf(key, sizeof(key), "reduce-%s-%s-%lu", reduce_op_name(op), reduce_precision_name(precision),
+      (unsigned long) width);
 
-  size_t width  = 1024+1024;
-  size_t buf_size = width*sizeof(cl_float);
+  tune_config config = {1, {64, 1, 1}, "", 0};
 
-  kernel = clCreateKernel(program, "reduce", &status);
-  checkError(status, "could not create kernel");
+  if (opts->tune) {
+    // Tune on the first chunk if the input does not fit into one buffer
+    reduce_args args = {width, reduce_partial_size(precision), (op == REDUCE_ARGMIN || op == REDUCE_ARGMAX)};
+    if (args.length * sizeof(cl_float) > max_alloc)
+      args.length = max_alloc / sizeof(cl_float);
 
-  size_t work_size = width;
-  size_t local_size = 64;
-  size_t local_buf_size = local_size * sizeof(cl_float);
-  size_t groups = width / local_size;
-  size_t res_buf_size = groups * sizeof(cl_float);
+    buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        args.length * sizeof(cl_float), (void *) data, &status);
+    checkError(status, "Error: could not create buffer_in");
 
-  float *data_in  = malloc(buf_size);
-  float *data_out = malloc(res_buf_size);
-  if (!data_in || !data_out) {
-    fprintf(stderr,"\nError: malloc failed\n");
+    buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, REDUCE_MAX_GROUPS * args.partial_size, NULL, &status);
+    checkError(status, "Error: could not create buffer_out");
+
+    buffer_index = clCreateBuffer(context, CL_MEM_READ_WRITE, REDUCE_MAX_GROUPS * sizeof(cl_ulong), NULL, &status);
+    checkError(status, "Error: could not create buffer_index");
+
+    char options[128];
+    snprintf(options, sizeof(options), "-I. %s %s", reduce_op_define(op), reduce_precision_define(precision));
+
+    const char *variants[] = {"-DVECTOR_WIDTH=1", "-DVECTOR_WIDTH=2", "-DVECTOR_WIDTH=4",
+      "-DVECTOR_WIDTH=8", "-DVECTOR_WIDTH=16", NULL};
+    tune_problem problem = {KERNELDIR "/reduce.cl", "reduce", options, variants,
+      1, MIN_LOCAL_SIZE, 0, reduce_setup, &args};
+
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      config = tuned;
+
+    clReleaseMemObject(buffer_in);
+    clReleaseMemObject(buffer_out);
+    clReleaseMemObject(buffer_index);
+    buffer_in = buffer_out = buffer_index = NULL;
+  } else {
+    tune_lookup(device, key, &config);
+  }
+
+  if (parts.devices > 1) {
+    reduce_run_split(opts, op, precision, &config, key, data, width, result);
+    return;
+  }
+
+  if (!reduction_init(&r, context, device, queue, op, precision, config.options, config.local[0]))
+    return;
+  r.chunking = *chunking;
+
+  char variant[64];
+  snprintf(variant, sizeof(variant), "%s-%s", reduce_op_name(op), reduce_precision_name(precision));
+
+  bench b;
+  if (!bench_init(&b, opts, "reduce", variant, width)) {
     teardown(-1);
   }
+  bench_set_rate(&b, width*sizeof(cl_float)*1e-9, "GB/s");
 
-  for (unsigned int i = 0; i < width; ++i) {
-    data_in[i] = (float) (i % 16);
+  r.b = &b;
+  result->ok = 1;
+  while (result->ok && bench_next(&b)) {
+    result->ok = reduction_host(&r, data, width, &result->value, &result->index);
   }
+  r.b = NULL;
 
-  buffer_in = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_in");
+  status  = clFinish(queue);
+  checkError(status, "Error: could not finish successfully");
 
-  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, res_buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  if (result->ok) {
+    bench_report(&b);
+    result->rate = bench_rate(&b);
+    printf("passes: %d\n", r.passes);
+    pipeline_report(&r.pipe, chunking->timeline);
+  }
 
-  status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  bench_free(&b);
+  reduction_release(&r);
+}
 
-  // execute kernel
-  int arg = 0;
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
-  status  = clSetKernelArg(kernel, arg++, local_buf_size, NULL);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_int), &width);
-  checkError(status, "Error: could not set args");
+int main(int argc, char **argv) {
+  cl_int status;
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &work_size, &local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
 
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
 
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+  pipeline_options chunking;
+  pipeline_parse_args(&argc, argv, &chunking);
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+  split_options split_opts;
+  split_parse_args(&argc, argv, &split_opts);
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+  int op = (argc > 1) ? reduce_op_parse(argv[1]) : REDUCE_SUM;
 
-  // read results back
-  status = clEnqueueReadBuffer(queue, buffer_out, CL_TRUE, 0, res_buf_size, data_out, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  // "all" compares the cost of all precision modes
+  int all = (argc > 2 && !strcmp(argv[2], "all"));
+  int precision = (argc > 2 && !all) ? reduce_precision_parse(argv[2]) : PRECISION_FLOAT;
 
-  status  = clFinish(queue);
-  checkError(status, "Error: could not finish successfully");
+  if (argc > 3 || op < 0 || precision < 0 || ((all || precision != PRECISION_FLOAT) && op != REDUCE_SUM)) {
+    fprintf(stderr, "Usage: %s [sum|min|max|argmin|argmax] [float|kahan|double-float|double|all] " BENCH_USAGE " " DEVICE_USAGE " " PIPELINE_USAGE " " SPLIT_USAGE "\n", argv[0]);
+    fprintf(stderr, "  precision modes other than float are only available for sum\n");
+    fprintf(stderr, "  the input is uploaded in --chunks chunks, overlapping with the reduction of earlier ones\n");
+    fprintf(stderr, "  with --devices the input is split across the devices of the platform instead\n");
+    teardown(-1);
+  }
 
-  float clsum = 0;
-  for (unsigned int i = 0; i < groups; ++i) {
-    clsum += data_out[i];
+  cl_device_id devices[SPLIT_MAX_DEVICES];
+  cl_uint device_count;
+  if (!select_devices(&device_opts, "NVIDIA", &platform, devices,
+        split_opts.devices ? split_opts.devices : SPLIT_MAX_DEVICES, &device_count)) {
+    print_platforms();
+    teardown(-1);
   }
+  device = devices[0];
 
-#ifdef DEBUG
-  for (int i = 0; i < groups; ++i) {
-    printf("%.0f ", data_out[i]);
+  context = clCreateContext(NULL, device_count, devices, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  for (cl_uint d = 0; d < device_count; ++d)
+    print_device_info(devices[d], d > 0);
+
+  if (device_count > 1 && !split_init(&parts, context, devices, device_count))
+    teardown(-1);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  size_t width  = opts.size ? opts.size : 16*1024*1024;
+  size_t buf_size = width*sizeof(cl_float);
+
+  staging_init(&pinned, context, queue);
+
+  float *data_in  = staging_alloc(&pinned, buf_size);
+  if (!data_in) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
   }
-#endif
 
-  double elapsed = (end - start) * 1e-9f;
-  printf("time: %f\n", elapsed);
+  // Not exactly representable, so plain float sums accumulate rounding errors
+  for (size_t i = 0; i < width; ++i) {
+    data_in[i] = (float) (i % 16) + 0.1f;
+  }
 
-  float sum = 0;
-  for (unsigned int i = 0; i < width; ++i) {
+  //
+  // Reference on the host
+  //
+  double sum = 0;
+  float value = data_in[0];
+  size_t index = 0;
+  for (size_t i = 0; i < width; ++i) {
     sum += data_in[i];
+    if ((op == REDUCE_MIN || op == REDUCE_ARGMIN) ? data_in[i] < value : data_in[i] > value) {
+      value = data_in[i];
+      index = i;
+    }
   }
 
-  if (sum != clsum)
-    fprintf(stderr, "Compare failed: %f != %f\n", clsum, sum);
+  cl_ulong max_alloc;
+  status = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  checkError(status, "Error: could not query device");
+
+  double copy_bandwidth = device_bandwidth(context, queue, buf_size < max_alloc ? buf_size : max_alloc);
+
+  int first = all ? PRECISION_FLOAT : precision;
+  int last = all ? PRECISION_MODES - 1 : precision;
+  reduce_result results[PRECISION_MODES];
+
+  for (int p = first; p <= last; ++p) {
+    reduce_result *res = &results[p];
+    reduce_run(&opts, &chunking, op, p, data_in, width, res);
+    if (!res->ok) {
+      fprintf(stderr, "Warning: reduction with precision %s failed\n", reduce_precision_name(p));
+      continue;
+    }
+
+    printf("bandwidth: %f GB/s", res->rate);
+    if (copy_bandwidth > 0)
+      printf(" (%.1f%% of %f GB/s copy bandwidth)", 100 * res->rate / copy_bandwidth, copy_bandwidth);
+    printf("\n");
+
+    if (op == REDUCE_SUM) {
+      // Plain float accumulation is expected to lose precision on large inputs
+      double error = fabs(res->value - sum) / fabs(sum);
+      double tolerance = (p == PRECISION_FLOAT) ? 1e-4 : 1e-6;
+      if (error > tolerance)
+        fprintf(stderr, "Compare failed: %f != %f (relative error %e)\n", res->value, sum, error);
+    } else if ((float) res->value != value) {
+      fprintf(stderr, "Compare failed: %f != %f\n", res->value, value);
+    } else if ((op == REDUCE_ARGMIN || op == REDUCE_ARGMAX) && res->index != index) {
+      fprintf(stderr, "Compare failed: index %lu != %lu\n", (unsigned long) res->index, (unsigned long) index);
+    }
+  }
 
+  if (all) {
+    printf("%-14s %12s %12s %14s\n", "precision", "GB/s", "rel. time", "rel. error");
+    for (int p = first; p <= last; ++p) {
+      if (!results[p].ok)
+        continue;
+      double cost = (results[p].rate > 0 && results[first].ok) ? results[first].rate / results[p].rate : 0;
+      printf("%-14s %12f %12.2f %14e\n", reduce_precision_name(p), results[p].rate, cost,
+          fabs(results[p].value - sum) / fabs(sum));
+    }
+  }
 
-  free(data_in);
-  free(data_out);
+  staging_free(&pinned, data_in);
   teardown(0);
 }
-
-
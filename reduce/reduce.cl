@@ -1,29 +1,293 @@
 // Inspired by
 // http://developer.amd.com/resources/documentation-articles/articles-whitepapers/opencl-optimization-case-study-simple-reductions/
 //
-kernel void reduce(global float *src, global float *dest, local float *tmp, int length) {
-    int global_index = get_global_id(0);
-    float accumulator = 0.f;
-    // Loop sequentially over chunks of input vector
-    while (global_index < length) {
-        float element = src[global_index];
-        accumulator += element;
-        global_index += get_global_size(0);
+// The operator is selected at build time with one of
+//   -DREDUCE_SUM, -DREDUCE_MIN, -DREDUCE_MAX, -DREDUCE_ARGMIN, -DREDUCE_ARGMAX
+// or supplied by the user, either as an associative and commutative operator
+// that also works on vectors
+//   -DIDENTITY=0.0f -DCOMBINE(a,b)=fmax(fabs(a),fabs(b))
+// or as a comparison that selects an element and its index
+//   -DREDUCE_INDEX -DIDENTITY=INFINITY -DBETTER(a,b)=(fabs(a)<fabs(b))
+// VECTOR_WIDTH (1, 2, 4, 8 or 16) sets the width of the loads in the
+// sequential accumulation loop. The local size has to be a power of two.
+//
+// Sums can be computed with more precision:
+//   -DPRECISION_KAHAN         compensated sequential accumulation, float tree
+//   -DPRECISION_DOUBLE_FLOAT  compensated sequential accumulation, tree and
+//                             partial results in float2 (hi, lo) pairs
+//   -DPRECISION_DOUBLE        accumulation, tree and partial results in double
+//
+
+#if defined(REDUCE_SUM)
+#define IDENTITY 0.0f
+#define COMBINE(a,b) ((a) + (b))
+#elif defined(REDUCE_MIN)
+#define IDENTITY INFINITY
+#define COMBINE(a,b) fmin(a, b)
+#elif defined(REDUCE_MAX)
+#define IDENTITY (-INFINITY)
+#define COMBINE(a,b) fmax(a, b)
+#elif defined(REDUCE_ARGMIN)
+#define REDUCE_INDEX
+#define IDENTITY INFINITY
+#define BETTER(a,b) ((a) < (b))
+#elif defined(REDUCE_ARGMAX)
+#define REDUCE_INDEX
+#define IDENTITY (-INFINITY)
+#define BETTER(a,b) ((a) > (b))
+#endif
+
+#if !defined(IDENTITY) || (!defined(COMBINE) && !defined(BETTER))
+#error "No reduction operator defined"
+#endif
+
+#if (defined(PRECISION_KAHAN) || defined(PRECISION_DOUBLE_FLOAT) || defined(PRECISION_DOUBLE)) \
+    && !defined(REDUCE_SUM)
+#error "Precision modes are only available for REDUCE_SUM"
+#endif
+
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+
+#define CAT_(a,b) a##b
+#define CAT(a,b) CAT_(a,b)
+#define VEC(type,n) CAT(type,n)
+#define VLOAD(n) CAT(vload,n)
+#define VSTORE(n) CAT(vstore,n)
+
+#if VECTOR_WIDTH == 2
+#define LANES (ulong2)(0,1)
+#elif VECTOR_WIDTH == 4
+#define LANES (ulong4)(0,1,2,3)
+#elif VECTOR_WIDTH == 8
+#define LANES (ulong8)(0,1,2,3,4,5,6,7)
+#elif VECTOR_WIDTH == 16
+#define LANES (ulong16)(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15)
+#endif
+
+//
+// Sequential accumulation: acc_t/acc_vec_t hold the running value of a work
+// item, compensated modes carry the lost low-order bits in <name>_c.
+//
+
+#if defined(PRECISION_DOUBLE)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double acc_t;
+#define TO_ACC(x) ((double) (x))
+#if VECTOR_WIDTH > 1
+typedef VEC(double,VECTOR_WIDTH) acc_vec_t;
+#define TO_ACC_VEC(x) CAT(convert_double,VECTOR_WIDTH)(x)
+#endif
+#else
+typedef float acc_t;
+#define TO_ACC(x) (x)
+#if VECTOR_WIDTH > 1
+typedef VEC(float,VECTOR_WIDTH) acc_vec_t;
+#define TO_ACC_VEC(x) (x)
+#endif
+#endif
+
+#if defined(PRECISION_KAHAN) || defined(PRECISION_DOUBLE_FLOAT)
+#define DECLARE_ACC(type, a) type a = (type) (IDENTITY); type a##_c = (type) (0.0f)
+#define ACC_ADD(type, a, x) { \
+    type y_ = (x) - a##_c; \
+    type t_ = a + y_; \
+    a##_c = (t_ - a) - y_; \
+    a = t_; \
+}
+#else
+#define DECLARE_ACC(type, a) type a = (type) (IDENTITY)
+#define ACC_ADD(type, a, x) a = COMBINE(a, x);
+#endif
+
+//
+// Partial results: partial_t is the type of the tree phase and of the
+// results passed between passes.
+//
+
+#if defined(PRECISION_DOUBLE_FLOAT)
+typedef float2 partial_t;
+
+// Error-free sum of two floats as (hi, lo)
+float2 two_sum(float a, float b) {
+    float s = a + b;
+    float v = s - a;
+    float e = (a - (s - v)) + (b - v);
+    return (float2) (s, e);
+}
+
+float2 df_add(float2 a, float2 b) {
+    float2 s = two_sum(a.x, b.x);
+    float2 t = two_sum(a.y, b.y);
+    s.y += t.x;
+    s = two_sum(s.x, s.y);
+    s.y += t.y;
+    return two_sum(s.x, s.y);
+}
+
+#define PARTIAL_IDENTITY ((float2) (0.0f, 0.0f))
+#define PARTIAL_COMBINE(a,b) df_add(a, b)
+#define ACC_RESULT(a) two_sum(a, -a##_c)
+#elif defined(PRECISION_DOUBLE)
+typedef double partial_t;
+#define PARTIAL_IDENTITY 0.0
+#define PARTIAL_COMBINE(a,b) ((a) + (b))
+#define ACC_RESULT(a) (a)
+#elif defined(PRECISION_KAHAN)
+typedef float partial_t;
+#define PARTIAL_IDENTITY 0.0f
+#define PARTIAL_COMBINE(a,b) ((a) + (b))
+#define ACC_RESULT(a) (a - a##_c)
+#else
+typedef float partial_t;
+#define PARTIAL_IDENTITY (IDENTITY)
+#ifdef REDUCE_INDEX
+#define PARTIAL_COMBINE(a,b) (BETTER(b, a) ? (b) : (a))
+#else
+#define PARTIAL_COMBINE(a,b) COMBINE(a, b)
+#endif
+#define ACC_RESULT(a) (a)
+#endif
+
+// Add element v with index i to the accumulator. Ties select the lower index,
+// so the result does not depend on the work distribution.
+#ifdef REDUCE_INDEX
+#define ACCUMULATE(acc, acc_index, v, i) \
+    if (BETTER(v, acc) || ((v) == (acc) && (i) < (acc_index))) { \
+        acc = v; \
+        acc_index = i; \
     }
+#else
+#define ACCUMULATE(acc, acc_index, v, i) acc = PARTIAL_COMBINE(acc, v);
+#endif
 
+// Reduce the values of the work group in local memory and write the result
+// of the group to dest.
+void reduce_group(partial_t accumulator, ulong accumulator_index,
+                  global partial_t *dest, global ulong *dest_index,
+                  local partial_t *tmp, local ulong *tmp_index) {
     // Perform parallel reduction
     int local_index = get_local_id(0);
     tmp[local_index] = accumulator;
+#ifdef REDUCE_INDEX
+    tmp_index[local_index] = accumulator_index;
+#endif
     barrier(CLK_LOCAL_MEM_FENCE);
     for(int offset = get_local_size(0) / 2; offset > 0; offset = offset / 2) {
         if (local_index < offset) {
-            float other = tmp[local_index + offset];
-            float mine = tmp[local_index];
-            tmp[local_index] = mine + other;
+            partial_t other = tmp[local_index + offset];
+            partial_t mine = tmp[local_index];
+#ifdef REDUCE_INDEX
+            ulong other_index = tmp_index[local_index + offset];
+            ulong mine_index = tmp_index[local_index];
+            ACCUMULATE(mine, mine_index, other, other_index)
+            tmp_index[local_index] = mine_index;
+#else
+            ACCUMULATE(mine, 0, other, 0)
+#endif
+            tmp[local_index] = mine;
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
     if (local_index == 0) {
         dest[get_group_id(0)] = tmp[0];
+#ifdef REDUCE_INDEX
+        dest_index[get_group_id(0)] = tmp_index[0];
+#endif
+    }
+}
+
+// First pass: reduces length elements of src to one partial result per work
+// group. The index of an element is its position plus index_base.
+kernel void reduce(global const float *src, ulong length, ulong index_base,
+                   global partial_t *dest, global ulong *dest_index,
+                   local partial_t *tmp, local ulong *tmp_index) {
+    size_t global_index = get_global_id(0);
+    size_t global_size = get_global_size(0);
+
+    partial_t accumulator = PARTIAL_IDENTITY;
+    ulong accumulator_index = ULONG_MAX;
+    ulong tail = 0;
+
+#if VECTOR_WIDTH > 1
+    // Loop sequentially over chunks of input vector, VECTOR_WIDTH elements at a time
+    ulong vectors = length / VECTOR_WIDTH;
+#ifdef REDUCE_INDEX
+    VEC(float,VECTOR_WIDTH) vacc = (VEC(float,VECTOR_WIDTH)) (IDENTITY);
+    VEC(ulong,VECTOR_WIDTH) vacc_index = (VEC(ulong,VECTOR_WIDTH)) (ULONG_MAX);
+
+    for (ulong i = global_index; i < vectors; i += global_size) {
+        VEC(float,VECTOR_WIDTH) element = VLOAD(VECTOR_WIDTH)(i, src);
+        // Lanes only see increasing indices, a strict comparison keeps the first
+        VEC(ulong,VECTOR_WIDTH) index = (VEC(ulong,VECTOR_WIDTH)) (index_base + i * VECTOR_WIDTH) + LANES;
+        VEC(long,VECTOR_WIDTH) better = CAT(convert_long,VECTOR_WIDTH)(BETTER(element, vacc));
+        vacc = select(vacc, element, CAT(convert_int,VECTOR_WIDTH)(better));
+        vacc_index = select(vacc_index, index, better);
+    }
+
+    float lanes[VECTOR_WIDTH];
+    ulong lanes_index[VECTOR_WIDTH];
+    VSTORE(VECTOR_WIDTH)(vacc, 0, lanes);
+    VSTORE(VECTOR_WIDTH)(vacc_index, 0, lanes_index);
+    for (int l = 0; l < VECTOR_WIDTH; ++l) {
+        ACCUMULATE(accumulator, accumulator_index, lanes[l], lanes_index[l])
+    }
+#else
+    DECLARE_ACC(acc_vec_t, vacc);
+
+    for (ulong i = global_index; i < vectors; i += global_size) {
+        ACC_ADD(acc_vec_t, vacc, TO_ACC_VEC(VLOAD(VECTOR_WIDTH)(i, src)))
     }
+
+    acc_t lanes[VECTOR_WIDTH];
+    VSTORE(VECTOR_WIDTH)(vacc, 0, lanes);
+#if defined(PRECISION_KAHAN) || defined(PRECISION_DOUBLE_FLOAT)
+    acc_t lanes_c[VECTOR_WIDTH];
+    VSTORE(VECTOR_WIDTH)(vacc_c, 0, lanes_c);
+#endif
+    for (int l = 0; l < VECTOR_WIDTH; ++l) {
+        acc_t lane = lanes[l];
+#if defined(PRECISION_KAHAN) || defined(PRECISION_DOUBLE_FLOAT)
+        acc_t lane_c = lanes_c[l];
+#endif
+        accumulator = PARTIAL_COMBINE(accumulator, ACC_RESULT(lane));
+    }
+#endif
+    tail = vectors * VECTOR_WIDTH;
+#endif
+
+    // Remaining elements
+#ifdef REDUCE_INDEX
+    for (ulong i = tail + global_index; i < length; i += global_size) {
+        ACCUMULATE(accumulator, accumulator_index, src[i], index_base + i)
+    }
+#else
+    DECLARE_ACC(acc_t, acc);
+    for (ulong i = tail + global_index; i < length; i += global_size) {
+        ACC_ADD(acc_t, acc, TO_ACC(src[i]))
+    }
+    accumulator = PARTIAL_COMBINE(accumulator, ACC_RESULT(acc));
+#endif
+
+    reduce_group(accumulator, accumulator_index, dest, dest_index, tmp, tmp_index);
+}
+
+// Later passes: reduce length partial results of a previous pass, reading the
+// indices of selected elements from src_index.
+kernel void reduce_partials(global const partial_t *src, global const ulong *src_index, ulong length,
+                            global partial_t *dest, global ulong *dest_index,
+                            local partial_t *tmp, local ulong *tmp_index) {
+    partial_t accumulator = PARTIAL_IDENTITY;
+    ulong accumulator_index = ULONG_MAX;
+
+    for (ulong i = get_global_id(0); i < length; i += get_global_size(0)) {
+#ifdef REDUCE_INDEX
+        ACCUMULATE(accumulator, accumulator_index, src[i], src_index[i])
+#else
+        ACCUMULATE(accumulator, accumulator_index, src[i], 0)
+#endif
+    }
+
+    reduce_group(accumulator, accumulator_index, dest, dest_index, tmp, tmp_index);
 }
@@ -0,0 +1,451 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+#include "reduction.h"
+
+static const char *op_names[] = {"sum", "min", "max", "argmin", "argmax", "user"};
+static const char *op_defines[] = {"-DREDUCE_SUM", "-DREDUCE_MIN", "-DREDUCE_MAX",
+  "-DREDUCE_ARGMIN", "-DREDUCE_ARGMAX", ""};
+
+int reduce_op_parse(const char *name) {
+  for (int op = REDUCE_SUM; op < REDUCE_USER; ++op)
+    if (!strcmp(name, op_names[op]))
+      return op;
+  return -1;
+}
+
+const char *reduce_op_name(reduce_op op) {
+  return op_names[op];
+}
+
+const char *reduce_op_define(reduce_op op) {
+  return op_defines[op];
+}
+
+static const char *precision_names[] = {"float", "kahan", "double-float", "double"};
+static const char *precision_defines[] = {"", "-DPRECISION_KAHAN", "-DPRECISION_DOUBLE_FLOAT",
+  "-DPRECISION_DOUBLE"};
+
+int reduce_precision_parse(const char *name) {
+  for (int p = PRECISION_FLOAT; p < PRECISION_MODES; ++p)
+    if (!strcmp(name, precision_names[p]))
+      return p;
+  return -1;
+}
+
+const char *reduce_precision_name(reduce_precision precision) {
+  return precision_names[precision];
+}
+
+const char *reduce_precision_define(reduce_precision precision) {
+  return precision_defines[precision];
+}
+
+size_t reduce_partial_size(reduce_precision precision) {
+  // float2 and double partial results
+  return precision >= PRECISION_DOUBLE_FLOAT ? 2*sizeof(cl_float) : sizeof(cl_float);
+}
+
+double reduction_partial_value(const reduction *r, const void *partial) {
+  float f[2];
+  double d;
+
+  switch (r->precision) {
+    case PRECISION_DOUBLE_FLOAT:
+      memcpy(f, partial, sizeof(f));
+      return (double) f[0] + f[1];
+    case PRECISION_DOUBLE:
+      memcpy(&d, partial, sizeof(d));
+      return d;
+    default:
+      memcpy(f, partial, sizeof(float));
+      return f[0];
+  }
+}
+
+size_t reduction_groups(cl_ulong length, size_t local_size, int vector_width) {
+  cl_ulong per_group = (cl_ulong) local_size * vector_width;
+  cl_ulong groups = (length + per_group - 1) / per_group;
+
+  if (groups < 1) groups = 1;
+  if (groups > REDUCE_MAX_GROUPS) groups = REDUCE_MAX_GROUPS;
+  return (size_t) groups;
+}
+
+cl_int reduction_set_args(cl_kernel kernel, cl_mem src, cl_ulong length, cl_ulong index_base,
+    cl_mem dest, cl_mem dest_index, size_t local_size, size_t partial_size, int has_index) {
+  // Local buffers must not be empty, even if the operator has no index
+  size_t local_index_size = (has_index ? local_size : 1) * sizeof(cl_ulong);
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &src);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &length);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &index_base);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &dest);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &dest_index);
+  status |= clSetKernelArg(kernel, arg++, local_size * partial_size, NULL);
+  status |= clSetKernelArg(kernel, arg++, local_index_size, NULL);
+  return status;
+}
+
+static cl_int set_partials_args(reduction *r, cl_mem src, cl_mem src_index, cl_ulong length,
+    cl_mem dest, cl_mem dest_index) {
+  size_t local_index_size = (r->has_index ? r->local_size : 1) * sizeof(cl_ulong);
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(r->kernel_partials, arg++, sizeof(cl_mem), &src);
+  status |= clSetKernelArg(r->kernel_partials, arg++, sizeof(cl_mem), &src_index);
+  status |= clSetKernelArg(r->kernel_partials, arg++, sizeof(cl_ulong), &length);
+  status |= clSetKernelArg(r->kernel_partials, arg++, sizeof(cl_mem), &dest);
+  status |= clSetKernelArg(r->kernel_partials, arg++, sizeof(cl_mem), &dest_index);
+  status |= clSetKernelArg(r->kernel_partials, arg++, r->local_size * r->partial_size, NULL);
+  status |= clSetKernelArg(r->kernel_partials, arg++, local_index_size, NULL);
+  return status;
+}
+
+int reduction_init(reduction *r, cl_context context, cl_device_id device, cl_command_queue queue,
+    reduce_op op, reduce_precision precision, const char *options, size_t local_size) {
+  cl_int status;
+
+  memset(r, 0, sizeof(reduction));
+  r->context = context;
+  r->device = device;
+  r->queue = queue;
+  r->op = op;
+  r->precision = precision;
+  r->partial_size = reduce_partial_size(precision);
+  r->has_index = (op == REDUCE_ARGMIN || op == REDUCE_ARGMAX);
+  r->local_size = local_size;
+  r->vector_width = 4;
+  pipeline_default_options(&r->chunking);
+
+  if (!options) options = "";
+
+  // Keep the host in sync with the vector width of the kernel
+  const char *vw = strstr(options, "-DVECTOR_WIDTH=");
+  if (vw)
+    r->vector_width = atoi(vw + strlen("-DVECTOR_WIDTH="));
+  if (op == REDUCE_USER && strstr(options, "-DREDUCE_INDEX"))
+    r->has_index = 1;
+
+  if (local_size == 0 || (local_size & (local_size - 1))) {
+    fprintf(stderr, "Error: local size %lu of reduction is not a power of two\n", (unsigned long) local_size);
+    return 0;
+  }
+  if (r->vector_width < 1) {
+    fprintf(stderr, "Error: invalid vector width %d\n", r->vector_width);
+    return 0;
+  }
+  if (precision != PRECISION_FLOAT && op != REDUCE_SUM) {
+    fprintf(stderr, "Error: precision %s is only available for sums\n", reduce_precision_name(precision));
+    return 0;
+  }
+  if (precision == PRECISION_DOUBLE) {
+    cl_device_fp_config fp64 = 0;
+    clGetDeviceInfo(device, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, NULL);
+    if (!fp64) {
+      fprintf(stderr, "Error: device does not support double precision\n");
+      return 0;
+    }
+  }
+
+  char build_options[1024];
+  snprintf(build_options, sizeof(build_options), "-I. %s %s %s", reduce_op_define(op),
+      reduce_precision_define(precision), options);
+
+  if (!create_program(KERNELDIR "/reduce.cl", &r->program, context, device, build_options)) {
+    if (r->program) print_build_log(r->program, device);
+    reduction_release(r);
+    return 0;
+  }
+
+  r->kernel = clCreateKernel(r->program, "reduce", &status);
+  if (status == CL_SUCCESS)
+    r->kernel_partials = clCreateKernel(r->program, "reduce_partials", &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create reduce kernel\n");
+    print_error(status);
+    reduction_release(r);
+    return 0;
+  }
+
+  // Largest chunk of input on the device, a multiple of any vector width
+  cl_ulong max_alloc;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  r->max_chunk = (max_alloc / sizeof(cl_float)) & ~(cl_ulong) 15;
+
+  for (int i = 0; i < 2; ++i) {
+    r->partial[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, REDUCE_MAX_GROUPS * r->partial_size, NULL, &status);
+    if (status == CL_SUCCESS)
+      r->partial_index[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, REDUCE_MAX_GROUPS * sizeof(cl_ulong), NULL, &status);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not create reduction buffers\n");
+      print_error(status);
+      reduction_release(r);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void reduction_release(reduction *r) {
+  for (int i = 0; i < 2; ++i) {
+    if (r->partial[i]) clReleaseMemObject(r->partial[i]);
+    if (r->partial_index[i]) clReleaseMemObject(r->partial_index[i]);
+    r->partial[i] = r->partial_index[i] = NULL;
+  }
+  pipeline_release(&r->pipe);
+  if (r->kernel) clReleaseKernel(r->kernel);
+  if (r->kernel_partials) clReleaseKernel(r->kernel_partials);
+  if (r->program) clReleaseProgram(r->program);
+  r->kernel = NULL;
+  r->kernel_partials = NULL;
+  r->program = NULL;
+}
+
+// Record event in the benchmark, if any. Commands are in order, so without a
+// benchmark there is nothing to wait for.
+static void complete(reduction *r, int phase, cl_event event) {
+  if (r->b)
+    bench_event(r->b, phase, event);
+  else
+    clReleaseEvent(event);
+}
+
+// Passes until a single element remains. The input is either data (first is
+// set) or partial results with indices in src_index.
+static int run_passes(reduction *r, int first, cl_mem src, cl_mem src_index, cl_ulong length, cl_ulong index_base) {
+  cl_int status;
+  int out = 0;
+
+  r->passes = 0;
+  do {
+    size_t groups = reduction_groups(length, r->local_size, r->vector_width);
+    size_t global_size = groups * r->local_size;
+    cl_kernel kernel = first ? r->kernel : r->kernel_partials;
+
+    if (first)
+      status = reduction_set_args(kernel, src, length, index_base, r->partial[out], r->partial_index[out],
+          r->local_size, r->partial_size, r->has_index);
+    else
+      status = set_partials_args(r, src, src_index, length, r->partial[out], r->partial_index[out]);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not set reduction args\n");
+      print_error(status);
+      return 0;
+    }
+
+    cl_event event;
+    status = clEnqueueNDRangeKernel(r->queue, kernel, 1, NULL, &global_size, &r->local_size, 0, NULL, &event);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not enqueue reduction pass %d\n", r->passes);
+      print_error(status);
+      return 0;
+    }
+    complete(r, BENCH_KERNEL, event);
+
+    // The partial results are the input of the next pass
+    first = 0;
+    src = r->partial[out];
+    src_index = r->partial_index[out];
+    length = groups;
+    out ^= 1;
+    r->passes++;
+  } while (length > 1);
+
+  r->result = out ^ 1;
+  return 1;
+}
+
+int reduction_run(reduction *r, cl_mem src, cl_ulong length, cl_ulong index_base) {
+  return run_passes(r, 1, src, NULL, length, index_base);
+}
+
+// Read the raw partial result and its index
+static int read_partial(reduction *r, unsigned char *partial, cl_ulong *index) {
+  cl_int status;
+  cl_event event;
+
+  *index = 0;
+  status = clEnqueueReadBuffer(r->queue, r->partial[r->result], CL_TRUE, 0, r->partial_size, partial, 0, NULL, &event);
+  if (status == CL_SUCCESS) {
+    complete(r, BENCH_D2H, event);
+
+    if (r->has_index) {
+      status = clEnqueueReadBuffer(r->queue, r->partial_index[r->result], CL_TRUE, 0, sizeof(cl_ulong), index, 0, NULL, &event);
+      if (status == CL_SUCCESS)
+        complete(r, BENCH_D2H, event);
+    }
+  }
+
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not read reduction result\n");
+    print_error(status);
+    return 0;
+  }
+  return 1;
+}
+
+int reduction_read(reduction *r, double *value, cl_ulong *index) {
+  unsigned char partial[sizeof(cl_double)];
+  cl_ulong partial_index;
+
+  if (!read_partial(r, partial, &partial_index))
+    return 0;
+
+  *value = reduction_partial_value(r, partial);
+  if (index) *index = partial_index;
+  return 1;
+}
+
+// Result of a chunk on the device and the host: partial result and index
+#define CHUNK_RESULT (2*sizeof(cl_ulong))
+
+// State of reduction_host shared by the pipeline stages
+typedef struct {
+  reduction *r;
+  const float *data;
+  unsigned char *results;   // CHUNK_RESULT bytes per chunk
+  int passes;
+} host_chunks;
+
+static int upload_chunk(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  const host_chunks *h = (const host_chunks *) user;
+
+  cl_int status = clEnqueueWriteBuffer(queue, chunk->in, CL_FALSE, 0, chunk->count * sizeof(cl_float),
+      h->data + chunk->offset, 0, NULL, event);
+  return status == CL_SUCCESS;
+}
+
+// All chunks share the partial buffers of the passes, so the result is copied
+// to the output buffer of the chunk before the next chunk overwrites them.
+static int reduce_chunk(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  host_chunks *h = (host_chunks *) user;
+  reduction *r = h->r;
+  cl_int status;
+
+  r->queue = queue;
+  if (!reduction_run(r, chunk->in, chunk->count, chunk->offset))
+    return 0;
+  h->passes += r->passes;
+
+  status = clEnqueueCopyBuffer(queue, r->partial[r->result], chunk->out, 0, 0, r->partial_size, 0, NULL, event);
+  if (status == CL_SUCCESS && r->has_index) {
+    clReleaseEvent(*event);
+    status = clEnqueueCopyBuffer(queue, r->partial_index[r->result], chunk->out, 0, sizeof(cl_ulong),
+        sizeof(cl_ulong), 0, NULL, event);
+  }
+  return status == CL_SUCCESS;
+}
+
+static int download_chunk(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  const host_chunks *h = (const host_chunks *) user;
+
+  cl_int status = clEnqueueReadBuffer(queue, chunk->out, CL_FALSE, 0, CHUNK_RESULT,
+      h->results + chunk->index * CHUNK_RESULT, 0, NULL, event);
+  return status == CL_SUCCESS;
+}
+
+int reduction_host(reduction *r, const float *data, cl_ulong length, double *value, cl_ulong *index) {
+  cl_int status;
+
+  if (length == 0) {
+    fprintf(stderr, "Error: nothing to reduce\n");
+    return 0;
+  }
+
+  // Chunks are a multiple of any vector width and fit into one device buffer
+  int chunk_count = r->chunking.chunks > 0 ? r->chunking.chunks : 1;
+  cl_ulong chunk_length = (length + chunk_count - 1) / chunk_count;
+  chunk_length = (chunk_length + 15) & ~(cl_ulong) 15;
+  if (chunk_length > r->max_chunk)
+    chunk_length = r->max_chunk;
+  cl_ulong chunks = (length + chunk_length - 1) / chunk_length;
+
+  // (Re)create the staging buffers if they are too small
+  size_t chunk_size = (size_t) chunk_length * sizeof(cl_float);
+  if (r->pipe.in_size < chunk_size || r->pipe.queues != r->chunking.queues || r->pipe.buffers != r->chunking.buffers) {
+    pipeline_release(&r->pipe);
+    if (!pipeline_init(&r->pipe, r->context, r->device, &r->chunking, chunk_size, CHUNK_RESULT))
+      return 0;
+  }
+
+  // Partial results of the chunks as read from the device
+  unsigned char *results = (unsigned char *) malloc(chunks * CHUNK_RESULT);
+  unsigned char *partials = (unsigned char *) malloc(chunks * r->partial_size);
+  cl_ulong *indices = (cl_ulong *) malloc(chunks * sizeof(cl_ulong));
+  if (!results || !partials || !indices) {
+    fprintf(stderr, "Error: malloc failed\n");
+    free(results);
+    free(partials);
+    free(indices);
+    return 0;
+  }
+
+  // The stages record into the benchmark once all chunks are complete,
+  // waiting for single events would serialize them
+  bench *b = r->b;
+  cl_command_queue queue = r->queue;
+  host_chunks h = {r, data, results, 0};
+
+  r->b = NULL;
+  r->pipe.b = b;
+  int ok = pipeline_run(&r->pipe, (size_t) length, (size_t) chunk_length, upload_chunk, reduce_chunk, download_chunk, &h);
+  r->pipe.b = NULL;
+  r->b = b;
+  r->queue = queue;
+  int passes = h.passes;
+
+  for (cl_ulong c = 0; ok && c < chunks; ++c) {
+    memcpy(partials + c * r->partial_size, results + c * CHUNK_RESULT, r->partial_size);
+    if (r->has_index)
+      memcpy(&indices[c], results + c * CHUNK_RESULT + sizeof(cl_ulong), sizeof(cl_ulong));
+    else
+      indices[c] = 0;
+  }
+
+  // Combine the results of the chunks with one more reduction on the device
+  if (ok && chunks > 1) {
+    cl_mem chunk_values = clCreateBuffer(r->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        chunks * r->partial_size, partials, &status);
+    cl_mem chunk_indices = NULL;
+    if (status == CL_SUCCESS)
+      chunk_indices = clCreateBuffer(r->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+          chunks * sizeof(cl_ulong), indices, &status);
+
+    if (status == CL_SUCCESS) {
+      ok = run_passes(r, 0, chunk_values, chunk_indices, chunks, 0)
+        && read_partial(r, partials, &indices[0]);
+      passes += r->passes;
+    } else {
+      fprintf(stderr, "Error: could not create buffers for chunk results\n");
+      print_error(status);
+      ok = 0;
+    }
+
+    if (chunk_values) clReleaseMemObject(chunk_values);
+    if (chunk_indices) clReleaseMemObject(chunk_indices);
+  }
+
+  if (ok) {
+    *value = reduction_partial_value(r, partials);
+    if (index) *index = indices[0];
+  }
+  r->passes = passes;
+
+  free(results);
+  free(partials);
+  free(indices);
+  return ok;
+}
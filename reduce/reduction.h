@@ -0,0 +1,98 @@
+#ifndef REDUCTION_H
+#define REDUCTION_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+#include <pipeline.h>
+
+// Maximum number of work groups of a pass, i.e. of partial results
+#define REDUCE_MAX_GROUPS 1024
+
+typedef enum {
+  REDUCE_SUM=0,
+  REDUCE_MIN=1,
+  REDUCE_MAX=2,
+  REDUCE_ARGMIN=3,
+  REDUCE_ARGMAX=4,
+  REDUCE_USER=5  // operator given in the build options, see reduce.cl
+} reduce_op;
+
+// Precision of sums, see reduce.cl
+typedef enum {
+  PRECISION_FLOAT=0,
+  PRECISION_KAHAN=1,        // compensated accumulation, float tree
+  PRECISION_DOUBLE_FLOAT=2, // compensated accumulation, float2 (hi, lo) tree
+  PRECISION_DOUBLE=3,       // double accumulation and tree, needs cl_khr_fp64
+  PRECISION_MODES=4
+} reduce_precision;
+
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;          // first pass over the input
+  cl_kernel kernel_partials; // later passes over partial results
+
+  reduce_op op;
+  reduce_precision precision;
+  size_t partial_size;  // size of a partial result on the device
+  int has_index;        // operator selects an element, results carry its index
+  size_t local_size;
+  int vector_width;
+  cl_ulong max_chunk;   // largest number of elements in one device buffer
+
+  cl_mem partial[2], partial_index[2]; // ping-pong buffers of the passes
+  int result;           // partial buffer holding the result of the last reduction
+  pipeline_options chunking; // chunks, queues and buffers of reduction_host
+  pipeline pipe;        // staging buffers of reduction_host
+
+  bench *b;             // if set, transfers and passes are recorded here
+  int passes;           // passes of the last reduction
+} reduction;
+
+// Parse "sum", "min", "max", "argmin" or "argmax", returns -1 otherwise.
+int reduce_op_parse(const char *name);
+const char *reduce_op_name(reduce_op op);
+
+// Build option selecting op in reduce.cl, empty for REDUCE_USER
+const char *reduce_op_define(reduce_op op);
+
+// Parse "float", "kahan", "double-float" or "double", returns -1 otherwise.
+int reduce_precision_parse(const char *name);
+const char *reduce_precision_name(reduce_precision precision);
+const char *reduce_precision_define(reduce_precision precision);
+size_t reduce_partial_size(reduce_precision precision);
+
+// Build the reduce kernels for op. Precision modes other than PRECISION_FLOAT
+// require REDUCE_SUM. options are appended to the build options, e.g.
+// -DVECTOR_WIDTH=8 or the definition of a user operator. local_size has to be
+// a power of two.
+int reduction_init(reduction *r, cl_context context, cl_device_id device, cl_command_queue queue,
+    reduce_op op, reduce_precision precision, const char *options, size_t local_size);
+void reduction_release(reduction *r);
+
+// Number of work groups of a pass over length elements
+size_t reduction_groups(cl_ulong length, size_t local_size, int vector_width);
+
+// Set the arguments of the first pass
+cl_int reduction_set_args(cl_kernel kernel, cl_mem src, cl_ulong length, cl_ulong index_base,
+    cl_mem dest, cl_mem dest_index, size_t local_size, size_t partial_size, int has_index);
+
+// Reduce length elements of a device buffer, leaving the result on the device.
+// Indices of selected elements are offset by index_base.
+int reduction_run(reduction *r, cl_mem src, cl_ulong length, cl_ulong index_base);
+
+// Read the result of the last reduction_run, index may be NULL.
+int reduction_read(reduction *r, double *value, cl_ulong *index);
+
+// Value of a partial result of partial_size bytes as read from the device,
+// e.g. from partial[result] without waiting in reduction_read.
+double reduction_partial_value(const reduction *r, const void *partial);
+
+// Reduce host data of any size, uploading it in chunks that fit the device.
+// Uploads of later chunks overlap with the passes over earlier ones.
+int reduction_host(reduction *r, const float *data, cl_ulong length, double *value, cl_ulong *index);
+
+#endif /* REDUCTION_H */
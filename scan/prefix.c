@@ -0,0 +1,330 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include <ocllib.h>
+#include <bench.h>
+
+#include "prefix.h"
+
+static const char *type_names[] = {"float", "uint"};
+static const char *type_defines[] = {"", "-DSCAN_UINT"};
+
+int scan_type_parse(const char *name) {
+  for (int type = SCAN_FLOAT; type < SCAN_TYPES; ++type)
+    if (!strcmp(name, type_names[type]))
+      return type;
+  return -1;
+}
+
+const char *scan_type_name(scan_type type) {
+  return type_names[type];
+}
+
+const char *scan_type_define(scan_type type) {
+  return type_defines[type];
+}
+
+// Both element types have the same size
+#define ELEMENT_SIZE sizeof(cl_float)
+
+size_t prefix_local_mem(size_t local_size, int items) {
+  size_t block = local_size * items;
+  // see PAD in scan.cl
+  return (block + block / 32 + local_size) * ELEMENT_SIZE;
+}
+
+static cl_ulong blocks(const prefix_scan *p, cl_ulong length) {
+  cl_ulong n = (length + p->block - 1) / p->block;
+  return n < 1 ? 1 : n;
+}
+
+cl_int prefix_set_args(cl_kernel kernel, cl_mem src, cl_mem dest, cl_mem block_sums, cl_mem carry,
+    cl_ulong length, int exclusive, size_t local_size, int items) {
+  size_t block = local_size * items;
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &src);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &dest);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &block_sums);
+  // a NULL buffer is passed as NULL pointer
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), carry ? &carry : NULL);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &length);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &exclusive);
+  status |= clSetKernelArg(kernel, arg++, (block + block / 32) * ELEMENT_SIZE, NULL);
+  status |= clSetKernelArg(kernel, arg++, local_size * ELEMENT_SIZE, NULL);
+  return status;
+}
+
+int prefix_init(prefix_scan *p, cl_context context, cl_device_id device, cl_command_queue queue,
+    scan_type type, int exclusive, const char *options, size_t local_size) {
+  cl_int status;
+
+  memset(p, 0, sizeof(prefix_scan));
+  p->context = context;
+  p->device = device;
+  p->queue = queue;
+  p->type = type;
+  p->exclusive = exclusive;
+  p->local_size = local_size;
+  p->items = 8;
+
+  if (!options) options = "";
+
+  // Keep the host in sync with the block size of the kernel
+  const char *items = strstr(options, "-DITEMS=");
+  if (items)
+    p->items = atoi(items + strlen("-DITEMS="));
+
+  if (local_size == 0 || (local_size & (local_size - 1))) {
+    fprintf(stderr, "Error: local size %lu of scan is not a power of two\n", (unsigned long) local_size);
+    return 0;
+  }
+  if (p->items < 1) {
+    fprintf(stderr, "Error: invalid number of items %d\n", p->items);
+    return 0;
+  }
+  p->block = (cl_ulong) local_size * p->items;
+
+  char build_options[1024];
+  snprintf(build_options, sizeof(build_options), "-I. %s %s", scan_type_define(type), options);
+
+  if (!create_program(KERNELDIR "/scan.cl", &p->program, context, device, build_options)) {
+    if (p->program) print_build_log(p->program, device);
+    prefix_release(p);
+    return 0;
+  }
+
+  p->kernel_blocks = clCreateKernel(p->program, "scan_blocks", &status);
+  if (status == CL_SUCCESS)
+    p->kernel_add = clCreateKernel(p->program, "scan_add", &status);
+  if (status == CL_SUCCESS)
+    p->kernel_carry = clCreateKernel(p->program, "scan_carry", &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create scan kernels\n");
+    print_error(status);
+    prefix_release(p);
+    return 0;
+  }
+
+  // Largest chunk on the device, limited by the levels of block sums
+  cl_ulong max_alloc;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+  p->max_chunk = max_alloc / ELEMENT_SIZE;
+
+  cl_ulong limit = 1;
+  for (int l = 0; l < PREFIX_MAX_LEVELS && limit < p->max_chunk; ++l)
+    limit *= p->block;
+  if (limit < p->max_chunk)
+    p->max_chunk = limit;
+
+  // Block sums of the largest chunk, the last level holds its total
+  cl_ulong length = p->max_chunk;
+  for (int l = 0; l < PREFIX_MAX_LEVELS; ++l) {
+    length = blocks(p, length);
+    p->sums[l] = clCreateBuffer(context, CL_MEM_READ_WRITE, length * ELEMENT_SIZE, NULL, &status);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not create scan buffers\n");
+      print_error(status);
+      prefix_release(p);
+      return 0;
+    }
+    if (length == 1)
+      break;
+  }
+
+  p->carry = clCreateBuffer(context, CL_MEM_READ_WRITE, ELEMENT_SIZE, NULL, &status);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not create scan buffers\n");
+    print_error(status);
+    prefix_release(p);
+    return 0;
+  }
+  return 1;
+}
+
+void prefix_release(prefix_scan *p) {
+  for (int l = 0; l < PREFIX_MAX_LEVELS; ++l) {
+    if (p->sums[l]) clReleaseMemObject(p->sums[l]);
+    p->sums[l] = NULL;
+  }
+  if (p->carry) clReleaseMemObject(p->carry);
+  if (p->chunk) clReleaseMemObject(p->chunk);
+  if (p->kernel_blocks) clReleaseKernel(p->kernel_blocks);
+  if (p->kernel_add) clReleaseKernel(p->kernel_add);
+  if (p->kernel_carry) clReleaseKernel(p->kernel_carry);
+  if (p->program) clReleaseProgram(p->program);
+  p->carry = NULL;
+  p->chunk = NULL;
+  p->kernel_blocks = NULL;
+  p->kernel_add = NULL;
+  p->kernel_carry = NULL;
+  p->program = NULL;
+}
+
+// Record event in the benchmark, if any. Commands are in order, so without a
+// benchmark there is nothing to wait for.
+static void complete(prefix_scan *p, int phase, cl_event event) {
+  if (p->b)
+    bench_event(p->b, phase, event);
+  else
+    clReleaseEvent(event);
+}
+
+static int enqueue(prefix_scan *p, cl_kernel kernel, size_t global_size, size_t local_size) {
+  cl_event event;
+  cl_int status = clEnqueueNDRangeKernel(p->queue, kernel, 1, NULL, &global_size, &local_size, 0, NULL, &event);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not enqueue scan pass %d\n", p->passes);
+    print_error(status);
+    return 0;
+  }
+  complete(p, BENCH_KERNEL, event);
+  p->passes++;
+  return 1;
+}
+
+// Scan the levels of block sums up to a single block, then add the scanned
+// sums back down. Only level 0 uses the carry, the last level is the total.
+static int run_levels(prefix_scan *p, cl_mem src, cl_mem dest, cl_ulong length, cl_mem carry) {
+  cl_ulong lengths[PREFIX_MAX_LEVELS];
+  cl_mem data[PREFIX_MAX_LEVELS];
+  int levels = 0;
+  cl_int status;
+
+  if (length > p->max_chunk) {
+    fprintf(stderr, "Error: scan of %lu elements exceeds the device limit of %lu\n",
+        (unsigned long) length, (unsigned long) p->max_chunk);
+    return 0;
+  }
+
+  p->passes = 0;
+  for (;;) {
+    cl_ulong groups = blocks(p, length);
+
+    lengths[levels] = length;
+    data[levels] = dest;
+    status = prefix_set_args(p->kernel_blocks, src, dest, p->sums[levels], levels ? NULL : carry,
+        length, levels ? 1 : p->exclusive, p->local_size, p->items);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not set scan args\n");
+      print_error(status);
+      return 0;
+    }
+    if (!enqueue(p, p->kernel_blocks, (size_t) groups * p->local_size, p->local_size))
+      return 0;
+
+    if (groups == 1)
+      break;
+
+    // The block sums are scanned in place by the next level
+    src = dest = p->sums[levels];
+    length = groups;
+    levels++;
+  }
+
+  for (int l = levels - 1; l >= 0; --l) {
+    int arg = 0;
+    status  = clSetKernelArg(p->kernel_add, arg++, sizeof(cl_mem), &data[l]);
+    status |= clSetKernelArg(p->kernel_add, arg++, sizeof(cl_mem), &p->sums[l]);
+    status |= clSetKernelArg(p->kernel_add, arg++, sizeof(cl_ulong), &lengths[l]);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not set scan args\n");
+      print_error(status);
+      return 0;
+    }
+    if (!enqueue(p, p->kernel_add, (size_t) blocks(p, lengths[l]) * p->local_size, p->local_size))
+      return 0;
+  }
+
+  // Total of this scan for the next chunk
+  if (carry) {
+    int arg = 0;
+    status  = clSetKernelArg(p->kernel_carry, arg++, sizeof(cl_mem), &carry);
+    status |= clSetKernelArg(p->kernel_carry, arg++, sizeof(cl_mem), &p->sums[levels]);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not set scan args\n");
+      print_error(status);
+      return 0;
+    }
+    if (!enqueue(p, p->kernel_carry, 1, 1))
+      return 0;
+  }
+  return 1;
+}
+
+int prefix_run(prefix_scan *p, cl_mem src, cl_mem dest, cl_ulong length) {
+  return run_levels(p, src, dest, length, NULL);
+}
+
+int prefix_host(prefix_scan *p, const void *data, void *out, cl_ulong length) {
+  static const cl_uint zero = 0;
+  cl_int status;
+  cl_event event;
+
+  cl_ulong chunk_length = length < p->max_chunk ? length : p->max_chunk;
+  cl_ulong chunks = chunk_length ? (length + chunk_length - 1) / chunk_length : 0;
+
+  // (Re)allocate the staging buffer if it is too small, chunks are scanned in place
+  size_t chunk_size = (size_t) (chunk_length ? chunk_length : 1) * ELEMENT_SIZE;
+  size_t current_size = 0;
+  if (p->chunk)
+    clGetMemObjectInfo(p->chunk, CL_MEM_SIZE, sizeof(size_t), &current_size, NULL);
+  if (current_size < chunk_size) {
+    if (p->chunk) clReleaseMemObject(p->chunk);
+    p->chunk = clCreateBuffer(p->context, CL_MEM_READ_WRITE, chunk_size, NULL, &status);
+    if (status != CL_SUCCESS) {
+      p->chunk = NULL;
+      fprintf(stderr, "Error: could not create scan buffer\n");
+      print_error(status);
+      return 0;
+    }
+  }
+
+  // The bit pattern of 0.0f is zero, too
+  status = clEnqueueWriteBuffer(p->queue, p->carry, CL_FALSE, 0, ELEMENT_SIZE, &zero, 0, NULL, &event);
+  if (status != CL_SUCCESS) {
+    fprintf(stderr, "Error: could not copy data into device\n");
+    print_error(status);
+    return 0;
+  }
+  complete(p, BENCH_H2D, event);
+
+  int passes = 0;
+  for (cl_ulong c = 0; c < chunks; ++c) {
+    cl_ulong offset = c * chunk_length;
+    cl_ulong n = (length - offset < chunk_length) ? length - offset : chunk_length;
+    size_t bytes = (size_t) n * ELEMENT_SIZE;
+
+    status = clEnqueueWriteBuffer(p->queue, p->chunk, CL_FALSE, 0, bytes,
+        (const unsigned char *) data + offset * ELEMENT_SIZE, 0, NULL, &event);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not copy data into device\n");
+      print_error(status);
+      return 0;
+    }
+    complete(p, BENCH_H2D, event);
+
+    if (!run_levels(p, p->chunk, p->chunk, n, p->carry))
+      return 0;
+    passes += p->passes;
+
+    status = clEnqueueReadBuffer(p->queue, p->chunk, CL_TRUE, 0, bytes,
+        (unsigned char *) out + offset * ELEMENT_SIZE, 0, NULL, &event);
+    if (status != CL_SUCCESS) {
+      fprintf(stderr, "Error: could not read scan result\n");
+      print_error(status);
+      return 0;
+    }
+    complete(p, BENCH_D2H, event);
+  }
+
+  p->passes = passes;
+  return 1;
+}
@@ -0,0 +1,68 @@
+#ifndef PREFIX_H
+#define PREFIX_H
+
+#include <CL/cl.h>
+
+#include <bench.h>
+
+// Maximum number of levels of block sums, enough for 2^32 elements with
+// blocks of 32 elements
+#define PREFIX_MAX_LEVELS 8
+
+typedef enum {
+  SCAN_FLOAT=0,
+  SCAN_UINT=1,
+  SCAN_TYPES=2
+} scan_type;
+
+typedef struct {
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel_blocks;  // scan of blocks, one per work group
+  cl_kernel kernel_add;     // add scanned block sums to the level below
+  cl_kernel kernel_carry;   // running total between chunks of prefix_host
+
+  scan_type type;
+  int exclusive;
+  size_t local_size;
+  int items;                // elements per work item
+  cl_ulong block;           // elements per work group
+  cl_ulong max_chunk;       // largest number of elements in one device buffer
+
+  cl_mem sums[PREFIX_MAX_LEVELS]; // block sums of each level
+  cl_mem carry;             // running total of prefix_host
+  cl_mem chunk;             // staging buffer of prefix_host
+
+  bench *b;                 // if set, transfers and kernels are recorded here
+  int passes;               // kernel launches of the last scan
+} prefix_scan;
+
+// Parse "float" or "uint", returns -1 otherwise.
+int scan_type_parse(const char *name);
+const char *scan_type_name(scan_type type);
+const char *scan_type_define(scan_type type);
+
+// Local memory of a work group of scan_blocks
+size_t prefix_local_mem(size_t local_size, int items);
+
+// Build the scan kernels. options are appended to the build options, e.g.
+// -DITEMS=8. local_size has to be a power of two.
+int prefix_init(prefix_scan *p, cl_context context, cl_device_id device, cl_command_queue queue,
+    scan_type type, int exclusive, const char *options, size_t local_size);
+void prefix_release(prefix_scan *p);
+
+// Set the arguments of scan_blocks, carry may be NULL
+cl_int prefix_set_args(cl_kernel kernel, cl_mem src, cl_mem dest, cl_mem block_sums, cl_mem carry,
+    cl_ulong length, int exclusive, size_t local_size, int items);
+
+// Scan length elements of src into dest on the device, src and dest may be
+// the same buffer. length must not exceed max_chunk.
+int prefix_run(prefix_scan *p, cl_mem src, cl_mem dest, cl_ulong length);
+
+// Scan host data of any size into out, uploading it in chunks that fit the
+// device. Elements are float or cl_uint according to the scan type.
+int prefix_host(prefix_scan *p, const void *data, void *out, cl_ulong length);
+
+#endif /* PREFIX_H */
@@ -0,0 +1,228 @@
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#include <CL/cl.h>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <ocllib.h>
+#include <bench.h>
+#include <tune.h>
+#include <hostref.h>
+
+#include "prefix.h"
+
+static cl_platform_id platform;
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue queue;
+
+static prefix_scan p;
+static cl_mem buffer_in, buffer_out, buffer_sums;
+
+void teardown(int exit_status)
+{
+  prefix_release(&p);
+  if (buffer_in) clReleaseMemObject(buffer_in);
+  if (buffer_out) clReleaseMemObject(buffer_out);
+  if (buffer_sums) clReleaseMemObject(buffer_sums);
+  if (queue) clReleaseCommandQueue(queue);
+  if (context) clReleaseContext(context);
+
+  exit(exit_status);
+}
+
+// Smallest work-group size and number of items, determine the size of the
+// block sums buffer when tuning
+#define MIN_LOCAL_SIZE 16
+#define MIN_ITEMS 2
+
+static cl_ulong local_mem_size;
+
+typedef struct {
+  cl_ulong length;
+  int exclusive;
+} scan_args;
+
+// Tuning runs the first level of the scan
+static int scan_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const scan_args *args = (const scan_args *) user;
+  int items = 8;
+
+  const char *it = strstr(config->options, "-DITEMS=");
+  if (it)
+    items = atoi(it + strlen("-DITEMS="));
+
+  if (prefix_local_mem(config->local[0], items) > local_mem_size)
+    return 0;
+
+  cl_int status = prefix_set_args(kernel, buffer_in, buffer_out, buffer_sums, NULL,
+      args->length, args->exclusive, config->local[0], items);
+
+  size_t block = config->local[0] * items;
+  work_size[0] = (args->length + block - 1) / block * config->local[0];
+  return status == CL_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
+
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  int exclusive = (argc > 1 && !strcmp(argv[1], "exclusive"));
+  int type = (argc > 2) ? scan_type_parse(argv[2]) : SCAN_FLOAT;
+
+  if (argc > 3 || type < 0 || (argc > 1 && !exclusive && strcmp(argv[1], "inclusive"))) {
+    fprintf(stderr, "Usage: %s [inclusive|exclusive] [float|uint] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    teardown(-1);
+  }
+
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
+  }
+
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
+
+  print_device_info(device, 0);
+
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  checkError(status, "could not create command queue");
+
+  size_t width  = opts.size ? opts.size : 16*1024*1024;
+  size_t buf_size = width*sizeof(cl_float);
+
+  // float and uint elements have the same size
+  void *data_in  = malloc(buf_size);
+  void *data_out = malloc(buf_size);
+  void *data_ref = malloc(buf_size);
+  if (!data_in || !data_out || !data_ref) {
+    fprintf(stderr,"\nError: malloc failed\n");
+    teardown(-1);
+  }
+
+  for (size_t i = 0; i < width; ++i) {
+    if (type == SCAN_FLOAT)
+      ((float *) data_in)[i] = (float) (i % 16);
+    else
+      ((cl_uint *) data_in)[i] = (cl_uint) (i % 16);
+  }
+
+  //
+  // Reference and comparison on the host
+  //
+  double host_start = get_time();
+  if (type == SCAN_FLOAT)
+    host_scan_float(data_in, data_ref, width, exclusive);
+  else
+    host_scan_uint(data_in, data_ref, width, exclusive);
+  double host_time = get_time() - host_start;
+
+  printf("host scan: %f s, %f GB/s (%d threads)\n", host_time,
+      host_time > 0 ? buf_size * 1e-9 / host_time : 0, host_threads());
+
+  //
+  // Select work-group size and items per work item: run the auto-tuner or use the tuning database
+  //
+  char key[256];
+  snprintf(key, sizeof(key), "scan-%s-%lu", scan_type_name(type), (unsigned long) width);
+
+  tune_config config = {1, {128, 1, 1}, "", 0};
+
+  if (opts.tune) {
+    cl_ulong max_alloc;
+    status  = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+    status |= clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    checkError(status, "Error: could not query device");
+
+    // Tune on the first chunk if the input does not fit into one buffer
+    scan_args args = {width, exclusive};
+    if (args.length * sizeof(cl_float) > max_alloc)
+      args.length = max_alloc / sizeof(cl_float);
+
+    buffer_in = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        args.length * sizeof(cl_float), data_in, &status);
+    checkError(status, "Error: could not create buffer_in");
+
+    buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, args.length * sizeof(cl_float), NULL, &status);
+    checkError(status, "Error: could not create buffer_out");
+
+    size_t max_groups = (args.length + MIN_LOCAL_SIZE * MIN_ITEMS - 1) / (MIN_LOCAL_SIZE * MIN_ITEMS);
+    buffer_sums = clCreateBuffer(context, CL_MEM_READ_WRITE, max_groups * sizeof(cl_float), NULL, &status);
+    checkError(status, "Error: could not create buffer_sums");
+
+    char options[128];
+    snprintf(options, sizeof(options), "-I. %s", scan_type_define(type));
+
+    const char *variants[] = {"-DITEMS=2", "-DITEMS=4", "-DITEMS=8", "-DITEMS=16", NULL};
+    tune_problem problem = {KERNELDIR "/scan.cl", "scan_blocks", options, variants,
+      1, MIN_LOCAL_SIZE, 0, scan_setup, &args};
+
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      config = tuned;
+
+    clReleaseMemObject(buffer_in);
+    clReleaseMemObject(buffer_out);
+    clReleaseMemObject(buffer_sums);
+    buffer_in = buffer_out = buffer_sums = NULL;
+  } else {
+    tune_lookup(device, key, &config);
+  }
+
+  if (!prefix_init(&p, context, device, queue, type, exclusive, config.options, config.local[0]))
+    teardown(-1);
+
+  bench b;
+  if (!bench_init(&b, &opts, "scan", exclusive ? "exclusive" : "inclusive", width)) {
+    teardown(-1);
+  }
+  bench_set_rate(&b, buf_size*1e-9, "GB/s");
+
+  p.b = &b;
+  int ok = 1;
+  while (ok && bench_next(&b)) {
+    ok = prefix_host(&p, data_in, data_out, width);
+  }
+  p.b = NULL;
+
+  status  = clFinish(queue);
+  checkError(status, "Error: could not finish successfully");
+
+  if (ok) {
+    bench_report(&b);
+    printf("passes: %d\n", p.passes);
+    printf("bandwidth: %f GB/s (host scan %f GB/s)\n", bench_rate(&b),
+        host_time > 0 ? buf_size * 1e-9 / host_time : 0);
+
+    if (type == SCAN_FLOAT) {
+      // The device adds in a different order than the host
+      compare_float(data_ref, data_out, width, 1e-5f, 1e-6f);
+    } else {
+      const cl_uint *ref = (const cl_uint *) data_ref, *out = (const cl_uint *) data_out;
+      for (size_t i = 0; i < width; ++i) {
+        if (ref[i] != out[i]) {
+          fprintf(stderr, "Compare failed at %lu: %u != %u\n", (unsigned long) i, out[i], ref[i]);
+          break;
+        }
+      }
+    }
+  }
+
+  bench_free(&b);
+  free(data_in);
+  free(data_out);
+  free(data_ref);
+  teardown(ok ? 0 : -1);
+}
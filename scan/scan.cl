@@ -0,0 +1,134 @@
+// Device-wide prefix scan.
+//
+// scan_blocks scans blocks of ITEMS * local size elements, one block per work
+// group: each work item scans ITEMS consecutive elements sequentially, the
+// totals of the work items are scanned with the work-efficient up-sweep /
+// down-sweep tree of Blelloch in local memory. The total of each block is
+// written to block_sums, which is scanned by the next level; scan_add then
+// adds the scanned block sums to the blocks of the level below.
+//
+// Build options:
+//   -DSCAN_UINT      scan uint instead of float
+//   -DITEMS=n        elements per work item, default 8
+//
+// The local size has to be a power of two.
+
+#if defined(SCAN_UINT)
+typedef uint T;
+#else
+typedef float T;
+#endif
+
+#ifndef ITEMS
+#define ITEMS 8
+#endif
+
+// One padding element every 32 elements, so that work items reading ITEMS
+// consecutive elements hit different local memory banks
+#define PAD(i) ((i) + ((i) >> 5))
+
+// Exclusive scan of the n (power of two) elements in sums, returns their total
+T block_scan(local T *sums, uint lid, uint n) {
+  uint offset = 1;
+
+  // up-sweep: build the tree of partial sums in place
+  for (uint d = n >> 1; d > 0; d >>= 1) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d) {
+      uint ai = offset * (2*lid + 1) - 1;
+      uint bi = offset * (2*lid + 2) - 1;
+      sums[bi] += sums[ai];
+    }
+    offset <<= 1;
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  T total = sums[n - 1];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (lid == 0)
+    sums[n - 1] = 0;
+
+  // down-sweep: push the prefixes back down the tree
+  for (uint d = 1; d < n; d <<= 1) {
+    offset >>= 1;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < d) {
+      uint ai = offset * (2*lid + 1) - 1;
+      uint bi = offset * (2*lid + 2) - 1;
+      T t = sums[ai];
+      sums[ai] = sums[bi];
+      sums[bi] += t;
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  return total;
+}
+
+// src and dest may be the same buffer. carry may be NULL, otherwise carry[0]
+// is added to all results but not to the block sums.
+kernel void scan_blocks(global const T *src, global T *dest, global T *block_sums,
+    global const T *carry, ulong length, int exclusive, local T *tmp, local T *sums)
+{
+  const uint lid = get_local_id(0);
+  const uint local_size = get_local_size(0);
+  const uint block = local_size * ITEMS;
+  const ulong base = (ulong) get_group_id(0) * block;
+
+  // Coalesced load of the block, zero beyond the end
+  for (uint i = lid; i < block; i += local_size) {
+    ulong k = base + i;
+    tmp[PAD(i)] = (k < length) ? src[k] : 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Sequential scan of the elements of this work item
+  const uint first = lid * ITEMS;
+  T sum = 0;
+  for (uint i = 0; i < ITEMS; ++i) {
+    T x = tmp[PAD(first + i)];
+    tmp[PAD(first + i)] = exclusive ? sum : sum + x;
+    sum += x;
+  }
+  sums[lid] = sum;
+
+  T total = block_scan(sums, lid, local_size);
+
+  T offset = sums[lid];
+  if (carry)
+    offset += carry[0];
+  for (uint i = 0; i < ITEMS; ++i)
+    tmp[PAD(first + i)] += offset;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (uint i = lid; i < block; i += local_size) {
+    ulong k = base + i;
+    if (k < length)
+      dest[k] = tmp[PAD(i)];
+  }
+
+  if (lid == 0)
+    block_sums[get_group_id(0)] = total;
+}
+
+// Add the scanned block sums of the next level to the blocks of data
+kernel void scan_add(global T *data, global const T *offsets, ulong length)
+{
+  const uint lid = get_local_id(0);
+  const uint local_size = get_local_size(0);
+  const uint block = local_size * ITEMS;
+  const ulong base = (ulong) get_group_id(0) * block;
+  const T offset = offsets[get_group_id(0)];
+
+  for (uint i = lid; i < block; i += local_size) {
+    ulong k = base + i;
+    if (k < length)
+      data[k] += offset;
+  }
+}
+
+// Advance the running total of a chunked scan by the total of the last chunk
+kernel void scan_carry(global T *carry, global const T *total)
+{
+  carry[0] += total[0];
+}
@@ -12,6 +12,8 @@
 #include <math.h>
 
 #include <ocllib.h>
+#include <bench.h>
+#include <tune.h>
 
 static cl_platform_id platform;
 static cl_device_id device;
@@ -34,72 +36,123 @@ void teardown(int exit_status)
   exit(exit_status);
 }
 
-int main(int argc, char **argv) {
+// Smallest work-group size, determines the size of the result buffer
+#define MIN_LOCAL_SIZE 16
+
+// Precision of the tree, see sync.cl
+enum {
+  SYNC_FLOAT=0,
+  SYNC_DOUBLE_FLOAT=1,
+  SYNC_DOUBLE=2,
+  SYNC_PRECISIONS=3
+};
+
+static const char *precision_names[] = {"float", "double-float", "double"};
+static const char *precision_defines[] = {"-I.", "-I. -DPRECISION_DOUBLE_FLOAT", "-I. -DPRECISION_DOUBLE"};
+static const size_t partial_sizes[] = {sizeof(cl_float), 2*sizeof(cl_float), sizeof(cl_double)};
+
+typedef struct {
+  cl_int length;
+  size_t partial_size;
+} sync_args;
+
+static int sync_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const sync_args *args = (const sync_args *) user;
+  size_t local_buf_size = config->local[0] * args->partial_size;
   cl_int status;
 
-  const char *platform_name = "NVIDIA";
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
+  status |= clSetKernelArg(kernel, arg++, local_buf_size, NULL);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &args->length);
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
-    teardown(-1);
+  // round up to whole work groups
+  work_size[0] = (args->length + config->local[0] - 1) / config->local[0] * config->local[0];
+  return status == CL_SUCCESS;
+}
+
+// Value of the partial result of group i
+static double partial_value(int precision, const unsigned char *data_out, size_t i) {
+  float f[2];
+  double d;
+
+  switch (precision) {
+    case SYNC_DOUBLE_FLOAT:
+      memcpy(f, data_out + i * 2*sizeof(float), sizeof(f));
+      return (double) f[0] + f[1];
+    case SYNC_DOUBLE:
+      memcpy(&d, data_out + i * sizeof(double), sizeof(d));
+      return d;
+    default:
+      memcpy(f, data_out + i * sizeof(float), sizeof(float));
+      return f[0];
   }
+}
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+int main(int argc, char **argv) {
+  cl_int status;
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "could not create context");
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
 
-  const char name[] = KERNELDIR "/sync.cl";
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
-    teardown(-1);
+  int precision = SYNC_FLOAT;
+  if (argc == 2) {
+    for (precision = 0; precision < SYNC_PRECISIONS; ++precision)
+      if (!strcmp(argv[1], precision_names[precision]))
+        break;
   }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
-
-  status = clBuildProgram(program, 1, &device, "-I.", NULL, NULL);
+  if (argc > 2 || precision == SYNC_PRECISIONS) {
+    fprintf(stderr, "Usage: %s [float|double-float|double] " BENCH_USAGE " " DEVICE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  kahan is not available, the tree has no sequential accumulation to compensate\n");
+    teardown(-1);
+  }
+  size_t partial_size = partial_sizes[precision];
 
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to create build %s: ", name);
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
   }
 
-  free(source);
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
 
   print_device_info(device, 0);
 
+  if (precision == SYNC_DOUBLE) {
+    cl_device_fp_config fp64 = 0;
+    clGetDeviceInfo(device, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(fp64), &fp64, NULL);
+    if (!fp64) {
+      fprintf(stderr, "Error: device does not support double precision\n");
+      teardown(-1);
+    }
+  }
+
   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
   checkError(status, "could not create command queue");
 
-  cl_ulong start, end;
   cl_event event;
 
-  size_t width  = 1024*1024;
+  size_t width  = opts.size ? opts.size : 1024*1024;
   size_t buf_size = width*sizeof(cl_float);
 
-  kernel = clCreateKernel(program, "sync", &status);
-  checkError(status, "could not create kernel");
-
-  size_t work_size = width;
-  size_t local_size = 64;
-  size_t local_buf_size = local_size * sizeof(cl_float);
-  size_t groups = width / local_size;
-  size_t res_buf_size = groups * sizeof(cl_float);
+  size_t groups = (width + MIN_LOCAL_SIZE - 1) / MIN_LOCAL_SIZE;
+  size_t res_buf_size = groups * partial_size;
 
   float *data_in  = malloc(buf_size);
-  float *data_out = malloc(res_buf_size);
+  unsigned char *data_out = malloc(res_buf_size);
   if (!data_in || !data_out) {
     fprintf(stderr,"\nError: malloc failed\n");
     teardown(-1);
   }
 
+  // Not exactly representable, so plain float sums accumulate rounding errors
   for (unsigned int i = 0; i < width; ++i) {
-    data_in[i] = (float) (i%16);
+    data_in[i] = (float) (i%16) + 0.1f;
   }
 
   buffer_in = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
@@ -108,59 +161,94 @@ int main(int argc, char **argv) {
   buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, res_buf_size, NULL, &status);
   checkError(status, "Error: could not create buffer_out");
 
-  status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  //
+  // Select the work-group size: run the auto-tuner or use the tuning database
+  //
+  const char name[] = KERNELDIR "/sync.cl";
+  const char *options = precision_defines[precision];
+  sync_args args = {(cl_int) width, partial_size};
 
-  // execute kernel
-  int arg = 0;
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
-  status  = clSetKernelArg(kernel, arg++, local_buf_size, NULL);
-  checkError(status, "Error: could not set args");
+  char key[256];
+  snprintf(key, sizeof(key), "sync-%s-%lu", precision_names[precision], (unsigned long) width);
+
+  tune_config config = {1, {64, 1, 1}, "", 0};
+
+  if (opts.tune) {
+    tune_problem problem = {name, "sync", options, NULL, 1, MIN_LOCAL_SIZE, 0, sync_setup, &args};
+
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      config = tuned;
+  } else {
+    tune_lookup(device, key, &config);
+  }
+
+  if (!create_program(name, &program, context, device, options)) {
+    if (program) print_build_log(program, device);
+    teardown(-1);
+  }
+
+  kernel = clCreateKernel(program, "sync", &status);
+  checkError(status, "could not create kernel");
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &work_size, &local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
+  // execute kernel
+  size_t work_size;
+  if (!sync_setup(kernel, &config, &work_size, &args)) {
+    fprintf(stderr, "Error: could not set args\n");
+    teardown(-1);
+  }
 
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
+  size_t local_size = config.local[0];
+  groups = (width + local_size - 1) / local_size;
+  res_buf_size = groups * partial_size;
 
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+  bench b;
+  if (!bench_init(&b, &opts, "sync", precision_names[precision], width)) {
+    teardown(-1);
+  }
+  bench_set_rate(&b, width*sizeof(cl_float)*1e-9, "GB/s");
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+  while (bench_next(&b)) {
+    status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, &event);
+    checkError(status, "Error: could not copy data into device");
+    bench_event(&b, BENCH_H2D, event);
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &work_size, &local_size, 0, NULL, &event);
+    checkError(status, "Error: could not enqueue kernel");
+    bench_event(&b, BENCH_KERNEL, event);
 
-  // read results back
-  status = clEnqueueReadBuffer(queue, buffer_out, CL_TRUE, 0, res_buf_size, data_out, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+    // read results back
+    status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, res_buf_size, data_out, 0, NULL, &event);
+    checkError(status, "Error: could not copy data into device");
+    bench_event(&b, BENCH_D2H, event);
+  }
 
   status  = clFinish(queue);
   checkError(status, "Error: could not finish successfully");
 
-  float clsum = 0;
+  bench_report(&b);
+  bench_free(&b);
+
+  double clsum = 0;
   for (unsigned int i = 0; i < groups; ++i) {
-    clsum += data_out[i];
+    clsum += partial_value(precision, data_out, i);
   }
 
 
 #if DEBUG
-  for (int i = 0; i < width; ++i) {
-    printf("%.0f ", data_out[i]);
+  for (int i = 0; i < groups; ++i) {
+    printf("%.0f ", partial_value(precision, data_out, i));
   }
 #endif
 
-  double elapsed = (end - start) * 1e-9f;
-  printf("time: %f\n", elapsed);
-
-  float sum = 0;
+  double sum = 0;
   for (unsigned int i = 0; i < width; ++i) {
     sum += data_in[i];
   }
 
-  if (sum != clsum)
+  double error = fabs(clsum - sum) / fabs(sum);
+  printf("relative error: %e\n", error);
+  if (error > (precision == SYNC_FLOAT ? 1e-5 : 1e-12))
     fprintf(stderr, "Compare failed: %f != %f\n", clsum, sum);
 
 
@@ -1,8 +1,47 @@
-kernel void sync(global float *src, global float *dest, local float *tmp) {
+// The tree can be computed with more precision, selected at build time:
+//   -DPRECISION_DOUBLE_FLOAT  float2 (hi, lo) pairs
+//   -DPRECISION_DOUBLE        double, needs cl_khr_fp64
+// Each element is loaded once, so there is no sequential phase to compensate.
+
+#if defined(PRECISION_DOUBLE_FLOAT)
+typedef float2 sum_t;
+
+// Error-free sum of two floats as (hi, lo)
+float2 two_sum(float a, float b) {
+    float s = a + b;
+    float v = s - a;
+    float e = (a - (s - v)) + (b - v);
+    return (float2) (s, e);
+}
+
+float2 df_add(float2 a, float2 b) {
+    float2 s = two_sum(a.x, b.x);
+    float2 t = two_sum(a.y, b.y);
+    s.y += t.x;
+    s = two_sum(s.x, s.y);
+    s.y += t.y;
+    return two_sum(s.x, s.y);
+}
+
+#define TO_SUM(x) ((float2) ((x), 0.f))
+#define ADD(a,b) df_add(a, b)
+#elif defined(PRECISION_DOUBLE)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double sum_t;
+#define TO_SUM(x) ((double) (x))
+#define ADD(a,b) ((a) + (b))
+#else
+typedef float sum_t;
+#define TO_SUM(x) (x)
+#define ADD(a,b) ((a) + (b))
+#endif
+
+kernel void sync(global float *src, global sum_t *dest, local sum_t *tmp, int length) {
     int tid = get_local_id(0);
     int i = get_global_id(0);
 
-    tmp[tid] = src[i];
+    // the last work group may be partially filled
+    tmp[tid] = TO_SUM((i < length) ? src[i] : 0.f);
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -11,7 +50,7 @@ kernel void sync(global float *src, global float *dest, local float *tmp) {
     {
         if (tid < s)
         {
-            tmp[tid] += tmp[tid + s];
+            tmp[tid] = ADD(tmp[tid], tmp[tid + s]);
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
@@ -12,6 +12,9 @@
 #include <math.h>
 
 #include <ocllib.h>
+#include <bench.h>
+#include <tune.h>
+#include <pipeline.h>
 
 static cl_platform_id platform;
 static cl_device_id device;
@@ -20,12 +23,15 @@ static cl_command_queue queue;
 
 static cl_program program;
 static cl_kernel kernel;
-static cl_mem buffer_in, buffer_out;
+static cl_mem buffer_in, buffer_out, buffer_leaders;
+static pipeline band_pipeline;
 
 void teardown(int exit_status)
 {
+  pipeline_release(&band_pipeline);
   if (buffer_in) clReleaseMemObject(buffer_in);
   if (buffer_out) clReleaseMemObject(buffer_out);
+  if (buffer_leaders) clReleaseMemObject(buffer_leaders);
   if (kernel) clReleaseKernel(kernel);
   if (program) clReleaseProgram(program);
   if (queue) clReleaseCommandQueue(queue);
@@ -34,53 +40,239 @@ void teardown(int exit_status)
   exit(exit_status);
 }
 
-int main(int argc, char **argv) {
+// Default tile of comp_tiled, see comp.cl
+#define TILE 32
+#define ROWS 8
+
+enum {
+  COMP_NAIVE=0,
+  COMP_TILED=1,
+  COMP_SQUARE=2, // in place, square matrices
+  COMP_CYCLES=3  // in place, rectangular matrices
+};
+
+static const char *kernel_names[] = {"comp", "comp_tiled", "comp_square", "comp_cycles"};
+
+typedef struct {
+  int mode;
+  cl_int width, height;
+  cl_ulong cycles;
+} comp_args;
+
+static int comp_setup(cl_kernel kernel, tune_config *config, size_t *work_size, void *user) {
+  const comp_args *a = (const comp_args *) user;
+  cl_ulong height = a->height;
+  cl_ulong size = (cl_ulong) a->width * a->height;
   cl_int status;
 
-  const char *platform_name = "NVIDIA";
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
+  switch (a->mode) {
+    case COMP_NAIVE:
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
+      break;
+    case COMP_TILED:
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->width);
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->height);
+      break;
+    case COMP_SQUARE:
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &a->width);
+      break;
+    case COMP_CYCLES:
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_leaders);
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &a->cycles);
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &height);
+      status |= clSetKernelArg(kernel, arg++, sizeof(cl_ulong), &size);
+      break;
+  }
+  if (status != CL_SUCCESS)
+    return 0;
+
+  switch (a->mode) {
+    case COMP_NAIVE:
+      work_size[0] = a->width;
+      work_size[1] = a->height;
+      break;
+    case COMP_TILED:
+    case COMP_SQUARE: {
+      // Work groups of TILE x ROWS work items copy a tile each
+      int tile = TILE, rows = ROWS;
+      sscanf(config->options, "-DTILE=%d -DROWS=%d", &tile, &rows);
+      if (rows > tile)
+        return 0;
+
+      config->local[0] = tile;
+      config->local[1] = rows;
+
+      work_size[0] = (a->width+tile-1)/tile*config->local[0];
+      work_size[1] = (a->height+tile-1)/tile*config->local[1];
+      break;
+    }
+    case COMP_CYCLES: {
+      // One work item per cycle
+      size_t local = config->local[0] ? config->local[0] : 1;
+      work_size[0] = (size_t) ((a->cycles + local - 1) / local * local);
+      break;
+    }
+  }
+  return 1;
+}
 
-  if (!find_platform(platform_name, &platform)) {
-    fprintf(stderr,"Error: Platform \"%s\" not found\n", platform_name);
-    print_platforms();
-    teardown(-1);
+// Pipeline mode: bands of rows of the input are transposed by comp_tiled into
+// blocks of columns of the output
+typedef struct {
+  size_t width, height;   // of the whole matrix
+  size_t elem;            // bytes per element
+  int tile;
+  size_t *local;
+  const float *src;
+  float *dst;
+} comp_bands;
+
+static int band_upload(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  const comp_bands *p = (const comp_bands *) user;
+  size_t row = p->width * p->elem;
+
+  cl_int status = clEnqueueWriteBuffer(queue, chunk->in, CL_FALSE, 0, chunk->count * row,
+      (const char *) p->src + chunk->offset * row, 0, NULL, event);
+  return status == CL_SUCCESS;
+}
+
+static int band_kernel(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  const comp_bands *p = (const comp_bands *) user;
+  cl_int width = (cl_int) p->width;
+  cl_int height = (cl_int) chunk->count;
+  cl_int status;
+
+  int arg = 0;
+  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &chunk->in);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_mem), &chunk->out);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &width);
+  status |= clSetKernelArg(kernel, arg++, sizeof(cl_int), &height);
+  if (status != CL_SUCCESS)
+    return 0;
+
+  size_t work_size[2];
+  work_size[0] = (p->width + p->tile - 1) / p->tile * p->local[0];
+  work_size[1] = (chunk->count + p->tile - 1) / p->tile * p->local[1];
+
+  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, p->local, 0, NULL, event);
+  return status == CL_SUCCESS;
+}
+
+// Row j of a transposed band is part of row j of the output
+static int band_download(cl_command_queue queue, const pipeline_chunk *chunk, cl_event *event, void *user) {
+  const comp_bands *p = (const comp_bands *) user;
+  size_t band_row = chunk->count * p->elem;
+
+  size_t buffer_origin[] = {0, 0, 0};
+  size_t host_origin[] = {chunk->offset * p->elem, 0, 0};
+  size_t region[] = {band_row, p->width, 1};
+
+  cl_int status = clEnqueueReadBufferRect(queue, chunk->out, CL_FALSE, buffer_origin, host_origin, region,
+      band_row, 0, p->height * p->elem, 0, p->dst, 0, NULL, event);
+  return status == CL_SUCCESS;
+}
+
+// Leaders, i.e. smallest indices, of the cycles of the in-place transpose of
+// a matrix of height rows, see comp_cycles in comp.cl. Fixed points are left
+// out. Returns NULL if malloc fails.
+static cl_ulong *cycle_leaders(size_t width, size_t height, cl_ulong *cycles) {
+  cl_ulong size = (cl_ulong) width * height;
+  unsigned char *visited = calloc((size_t) (size + 7) / 8, 1);
+  size_t capacity = 1024;
+  cl_ulong *leaders = malloc(capacity * sizeof(cl_ulong));
+
+  *cycles = 0;
+  if (!visited || !leaders) {
+    free(visited);
+    free(leaders);
+    return NULL;
   }
 
-  status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL);
-  checkError (status, "Error: could not query devices");
+  // The first and the last element stay in place
+  for (cl_ulong k = 1; k + 1 < size; ++k) {
+    if (visited[k / 8] & (1 << (k % 8)))
+      continue;
+
+    cl_ulong next = k * height % (size - 1);
+    if (next == k)
+      continue;
+
+    if (*cycles == capacity) {
+      capacity *= 2;
+      cl_ulong *grown = realloc(leaders, capacity * sizeof(cl_ulong));
+      if (!grown) {
+        free(visited);
+        free(leaders);
+        return NULL;
+      }
+      leaders = grown;
+    }
+    leaders[(*cycles)++] = k;
 
-  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-  checkError(status, "could not create context");
+    for (cl_ulong j = k; !(visited[j / 8] & (1 << (j % 8))); j = j * height % (size - 1))
+      visited[j / 8] |= 1 << (j % 8);
+  }
 
-  const char name[] = KERNELDIR "/comp.cl";
+  free(visited);
+  return leaders;
+}
+
+int main(int argc, char **argv) {
+  cl_int status;
 
-  unsigned char *source;
-  size_t size;
-  if (!load_file(name, &source, &size)) {
+  bench_options opts;
+  bench_parse_args(&argc, argv, &opts);
+
+  device_options device_opts;
+  device_parse_args(&argc, argv, &device_opts);
+
+  pipeline_options chunking;
+  pipeline_parse_args(&argc, argv, &chunking);
+
+  int tiled = (argc > 1 && !strcmp(argv[1], "tiled"));
+  int inplace = (argc > 1 && !strcmp(argv[1], "inplace"));
+  int pipelined = (argc > 1 && !strcmp(argv[1], "pipeline"));
+
+  // Elements of float, float2 or float4
+  const char *elem = (argc > 2) ? argv[2] : "float";
+  int components = 0;
+  if (!strcmp(elem, "float")) components = 1;
+  if (!strcmp(elem, "float2")) components = 2;
+  if (!strcmp(elem, "float4")) components = 4;
+
+  if (argc > 4 || components == 0 || (argc > 1 && !tiled && !inplace && !pipelined && strcmp(argv[1], "naive"))) {
+    fprintf(stderr, "Usage: %s [naive|tiled|inplace|pipeline] [float|float2|float4] [HEIGHT] " BENCH_USAGE " " DEVICE_USAGE " " PIPELINE_USAGE "\n", argv[0]);
+    fprintf(stderr, "  the matrix is --size elements wide and HEIGHT high, square by default\n");
+    fprintf(stderr, "  pipeline transposes --chunks bands of rows, overlapping transfers and kernels\n");
     teardown(-1);
   }
 
-  program = clCreateProgramWithSource(context, 1, (const char **) &source, &size, &status);
-  checkError(status, "Error: failed to create program %s: ", name);
-
-  status = clBuildProgram(program, 1, &device, "-I.", NULL, NULL);
-  if (status != CL_SUCCESS) {
-    print_build_log(program, device);
-    checkError(status, "Error: failed to create build %s: ", name);
+  if (!select_device(&device_opts, "NVIDIA", &platform, &device)) {
+    print_platforms();
+    teardown(-1);
   }
 
-  free(source);
+  context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+  checkError(status, "could not create context");
 
   print_device_info(device, 0);
 
   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
   checkError(status, "could not create command queue");
 
-  cl_ulong start, end;
   cl_event event;
 
-  size_t width  = 1024;
-  size_t height = 1024;
-  size_t buf_size = width*height*sizeof(cl_float);
+  size_t width  = opts.size ? opts.size : 1024;
+  size_t height = (argc > 3) ? (size_t) atoi(argv[3]) : width;
+  size_t buf_size = width*height*components*sizeof(cl_float);
+
+  if (height == 0) {
+    fprintf(stderr, "Error: invalid height\n");
+    teardown(-1);
+  }
 
   float *data_in  = malloc(buf_size);
   float *data_out = malloc(buf_size);
@@ -89,88 +281,223 @@ int main(int argc, char **argv) {
     teardown(-1);
   }
 
-  for (unsigned int i = 0; i < width*height; ++i) {
-    data_in[i] = (float) i;
+  // Floats hold integers exactly only up to 2^24, so large inputs get a hash
+  // of the index instead of the index to tell misplaced elements apart
+  for (size_t i = 0; i < width*height*components; ++i) {
+    data_in[i] = (float) (((cl_uint) i * 2654435761u) >> 8);
   }
 
 #if DEBUG
   for (int i = 0; i < height; ++i) {
     for (int j = 0; j < width; ++j) {
-      printf("%.0f ", data_in[i*width+j]);
+      printf("%.0f ", data_in[(i*width+j)*components]);
     }
     printf("\n");
   }
 #endif
 
-  kernel = clCreateKernel(program, "comp", &status);
-  checkError(status, "could not create kernel");
+  comp_args args = {COMP_NAIVE, (cl_int) width, (cl_int) height, 0};
+  if (tiled || pipelined)
+    args.mode = COMP_TILED;
+  if (inplace)
+    args.mode = (width == height) ? COMP_SQUARE : COMP_CYCLES;
 
-  buffer_in = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_in");
+  // In-place transposes need a single buffer, rectangular ones also the cycle leaders.
+  // The pipeline has its own buffers per band, the whole matrix is only needed for tuning.
+  size_t device_memory = 0;
 
-  buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
-  checkError(status, "Error: could not create buffer_out");
+  if (!pipelined || opts.tune) {
+    buffer_in = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
+    checkError(status, "Error: could not create buffer_in");
+    device_memory += buf_size;
+  }
 
-  status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  if (!inplace && (!pipelined || opts.tune)) {
+    buffer_out = clCreateBuffer(context, CL_MEM_READ_WRITE, buf_size, NULL, &status);
+    checkError(status, "Error: could not create buffer_out");
+    device_memory += buf_size;
+  }
 
-  // execute kernel
-  int arg = 0;
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_in);
-  status  = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer_out);
-  checkError(status, "Error: could not set args");
+  if (args.mode == COMP_CYCLES) {
+    double start = get_time();
+    cl_ulong *leaders = cycle_leaders(width, height, &args.cycles);
+    if (!leaders) {
+      fprintf(stderr,"\nError: malloc failed\n");
+      teardown(-1);
+    }
+    printf("cycles: %lu (%f s)\n", (unsigned long) args.cycles, get_time() - start);
+
+    if (args.cycles) {
+      buffer_leaders = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+          args.cycles * sizeof(cl_ulong), leaders, &status);
+      checkError(status, "Error: could not create buffer_leaders");
+      device_memory += args.cycles * sizeof(cl_ulong);
+    }
+    free(leaders);
+  }
+
+  if (!pipelined)
+    printf("device memory: %.1f MB\n", device_memory / (1024.0 * 1024.0));
+
+  //
+  // Select the work-group size: run the auto-tuner or use the tuning database
+  //
+  const char name[] = KERNELDIR "/comp.cl";
+  const char *kernelname = kernel_names[args.mode];
+
+  char base_options[64];
+  snprintf(base_options, sizeof(base_options), "-I. -DELEM=%s", elem);
+
+  char key[256];
+  snprintf(key, sizeof(key), "%s-%s-%lux%lu", kernelname, elem, (unsigned long) width, (unsigned long) height);
+
+  // 32x32 work-groups unless tuned, a tuned local size of 0 leaves the choice to the runtime
+  tune_config config = {2, {32, 32, 1}, "", 0};
+  int use_tiles = (args.mode == COMP_TILED || args.mode == COMP_SQUARE);
+  if (use_tiles)
+    snprintf(config.options, TUNE_MAX_OPTIONS, "-DTILE=%d -DROWS=%d", TILE, ROWS);
+  if (args.mode == COMP_CYCLES) {
+    config.dim = 1;
+    config.local[0] = 64;
+    config.local[1] = 1;
+  }
+
+  if (opts.tune) {
+    // Candidate tiles of comp_tiled and comp_square
+    char variants[16][TUNE_MAX_OPTIONS];
+    const char *variant_list[17];
+    int n = 0;
+
+    if (use_tiles) {
+      for (int tile = 8; tile <= 64; tile *= 2) {
+        for (int rows = 2; rows <= 16 && rows <= tile; rows *= 2) {
+          snprintf(variants[n], TUNE_MAX_OPTIONS, "-DTILE=%d -DROWS=%d", tile, rows);
+          variant_list[n] = variants[n];
+          n++;
+        }
+      }
+    }
+    variant_list[n] = NULL;
+
+    tune_problem problem = {name, kernelname, base_options, n ? variant_list : NULL,
+      config.dim, 1, use_tiles, comp_setup, &args};
 
-  size_t work_size[] = {width, height};
-  size_t local_size[] = {32, 32};
+    tune_config tuned;
+    if (tune_kernel(context, device, queue, &problem, key, &tuned))
+      config = tuned;
+  } else {
+    tune_lookup(device, key, &config);
+  }
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, work_size, local_size, 0, NULL, &event);
-  checkError(status, "Error: could not enqueue kernel");
+  char options[TUNE_MAX_OPTIONS + 64];
+  snprintf(options, sizeof(options), "%s %s", base_options, config.options);
 
-  status = clWaitForEvents(1, &event);
-  checkError(status, "Error: could not wait for event");
+  if (!create_program(name, &program, context, device, options)) {
+    if (program) print_build_log(program, device);
+    teardown(-1);
+  }
 
-  status  = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
-  checkError(status, "Error: could not get start profile information");
+  kernel = clCreateKernel(program, kernelname, &status);
+  checkError(status, "could not create kernel");
 
-  status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
-  checkError(status, "Error: could not get end profile information");
+  // execute kernel
+  size_t work_size[2];
+  if (!comp_setup(kernel, &config, work_size, &args)) {
+    fprintf(stderr, "Error: could not set args\n");
+    teardown(-1);
+  }
 
-  status = clReleaseEvent(event);
-  checkError(status, "Error: could not release event");
+  // The naive kernel needs work groups that divide the matrix
+  size_t *local_size = config.local[0] ? config.local : NULL;
+  if (args.mode == COMP_NAIVE && local_size && (work_size[0] % local_size[0] || work_size[1] % local_size[1]))
+    local_size = NULL;
 
-  // read results back
-  status = clEnqueueReadBuffer(queue, buffer_out, CL_FALSE, 0, buf_size, data_out, 0, NULL, NULL);
-  checkError(status, "Error: could not copy data into device");
+  char variant[64];
+  if (pipelined)
+    snprintf(variant, sizeof(variant), "pipeline-q%d-b%d-%s", chunking.queues, chunking.buffers, elem);
+  else
+    snprintf(variant, sizeof(variant), "%s-%s", inplace ? "inplace" : tiled ? "tiled" : "naive", elem);
+
+  bench b;
+  if (!bench_init(&b, &opts, "comp", variant, width)) {
+    teardown(-1);
+  }
+  bench_set_rate(&b, 2*buf_size*1e-9, "GB/s");
+
+  int ok = 1;
+  if (pipelined) {
+    // Bands of whole tiles
+    int tile = TILE, rows = ROWS;
+    sscanf(config.options, "-DTILE=%d -DROWS=%d", &tile, &rows);
+
+    size_t band_rows = (height + chunking.chunks - 1) / chunking.chunks;
+    band_rows = (band_rows + tile - 1) / tile * tile;
+    size_t band_size = band_rows * width * components * sizeof(cl_float);
+
+    if (!pipeline_init(&band_pipeline, context, device, &chunking, band_size, band_size))
+      teardown(-1);
+    printf("device memory: %.1f MB\n", (device_memory + 2 * band_pipeline.buffers * band_size) / (1024.0 * 1024.0));
+
+    comp_bands bands = {width, height, components * sizeof(cl_float), tile, config.local, data_in, data_out};
+
+    band_pipeline.b = &b;
+    while (ok && bench_next(&b))
+      ok = pipeline_run(&band_pipeline, height, band_rows, band_upload, band_kernel, band_download, &bands);
+    band_pipeline.b = NULL;
+  } else {
+    while (bench_next(&b)) {
+      status = clEnqueueWriteBuffer(queue, buffer_in, CL_FALSE, 0, buf_size, data_in, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_H2D, event);
+
+      // nothing to do for matrices without cycles
+      if (args.mode != COMP_CYCLES || args.cycles) {
+        status = clEnqueueNDRangeKernel(queue, kernel, config.dim, NULL, work_size, local_size, 0, NULL, &event);
+        checkError(status, "Error: could not enqueue kernel");
+        bench_event(&b, BENCH_KERNEL, event);
+      }
+
+      // read results back
+      status = clEnqueueReadBuffer(queue, inplace ? buffer_in : buffer_out, CL_FALSE, 0, buf_size, data_out, 0, NULL, &event);
+      checkError(status, "Error: could not copy data into device");
+      bench_event(&b, BENCH_D2H, event);
+    }
+  }
 
   status  = clFinish(queue);
   checkError(status, "Error: could not finish successfully");
 
+  if (ok) {
+    bench_report(&b);
+    if (pipelined)
+      pipeline_report(&band_pipeline, chunking.timeline);
+  }
+  bench_free(&b);
+
 #if DEBUG
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      printf("%.0f ", data_out[i*width+j]);
+  for (int i = 0; i < width; ++i) {
+    for (int j = 0; j < height; ++j) {
+      printf("%.0f ", data_out[(i*height+j)*components]);
     }
     printf("\n");
   }
 #endif
 
-  double elapsed = (end - start) * 1e-9f;
-  printf("time: %f\n", elapsed);
-
   int correct = 1;
-  for (unsigned int i = 0; i < height; ++i) {
-    for (unsigned int j = 0; j < width; ++j) {
-      if (data_in[i*width+j] != data_out[j*height+i]) correct = 0;
+  for (size_t i = 0; i < height; ++i) {
+    for (size_t j = 0; j < width; ++j) {
+      for (int k = 0; k < components; ++k)
+        if (data_in[(i*width+j)*components+k] != data_out[(j*height+i)*components+k]) correct = 0;
     }
   }
 
-  if (!correct)
+  if (ok && !correct)
     fprintf(stderr, "Compare failed\n");
 
 
   free(data_in);
   free(data_out);
-  teardown(0);
+  teardown(ok ? 0 : -1);
 }
 
 
@@ -1,4 +1,19 @@
-kernel void comp(global float *in, global float *out) {
+// Element type: float, float2 or float4
+#ifndef ELEM
+#define ELEM float
+#endif
+
+// Tile size and rows of a work group of comp_tiled, the work group is TILE x ROWS
+#ifndef TILE
+#define TILE 32
+#endif
+#ifndef ROWS
+#define ROWS 8
+#endif
+
+// Reads are coalesced, writes have a stride of height. The global size has to
+// be the size of the matrix.
+kernel void comp(global ELEM *in, global ELEM *out) {
     size_t x = get_global_id(0);
     size_t y = get_global_id(1);
 
@@ -7,3 +22,94 @@ kernel void comp(global float *in, global float *out) {
 
     out[x*height+y] = in[y*width+x];
 }
+
+// Transpose through a tile in local memory, so that reads and writes are
+// coalesced. The extra column shifts the rows of the tile to different banks,
+// so that reading a column of the tile is free of bank conflicts.
+// Work groups are TILE x ROWS, each work item copies TILE/ROWS elements. The
+// global size is the number of tiles times the work-group size.
+kernel void comp_tiled(global const ELEM *in, global ELEM *out, int width, int height) {
+    local ELEM tile[TILE][TILE+1];
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+
+    // read the tile at (x0, y0) of in
+    int x0 = get_group_id(0) * TILE;
+    int y0 = get_group_id(1) * TILE;
+
+    int x = x0 + lx;
+    for (int j = ly; j < TILE; j += ROWS) {
+        int y = y0 + j;
+        if (x < width && y < height)
+            tile[j][lx] = in[(size_t) y*width + x];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // write it to (y0, x0) of out, which is height wide
+    x = y0 + lx;
+    for (int j = ly; j < TILE; j += ROWS) {
+        int y = x0 + j;
+        if (x < height && y < width)
+            out[(size_t) y*height + x] = tile[lx][j];
+    }
+}
+
+// In-place transpose of a square n x n matrix: the work group of tile
+// (x, y) above the diagonal swaps it with tile (y, x), transposing both in
+// local memory. Groups below the diagonal have nothing to do. The global
+// size is the same as for comp_tiled.
+kernel void comp_square(global ELEM *data, int n) {
+    local ELEM a[TILE][TILE+1];
+    local ELEM b[TILE][TILE+1];
+
+    if (get_group_id(0) < get_group_id(1))
+        return;
+
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+
+    int x0 = get_group_id(0) * TILE;
+    int y0 = get_group_id(1) * TILE;
+
+    // a is the tile at (x0, y0), b the one at (y0, x0)
+    for (int j = ly; j < TILE; j += ROWS) {
+        if (x0 + lx < n && y0 + j < n)
+            a[j][lx] = data[(size_t) (y0 + j)*n + x0 + lx];
+        if (y0 + lx < n && x0 + j < n)
+            b[j][lx] = data[(size_t) (x0 + j)*n + y0 + lx];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // On the diagonal both tiles are the same and both writes store the same values
+    for (int j = ly; j < TILE; j += ROWS) {
+        if (y0 + lx < n && x0 + j < n)
+            data[(size_t) (x0 + j)*n + y0 + lx] = a[lx][j];
+        if (x0 + lx < n && y0 + j < n)
+            data[(size_t) (y0 + j)*n + x0 + lx] = b[lx][j];
+    }
+}
+
+// In-place transpose of a rectangular matrix of height rows by following the
+// cycles of the permutation: the element at index k moves to
+// k * height mod (size - 1), where size is the number of elements. Each work
+// item moves the elements of one cycle, starting at its leader.
+kernel void comp_cycles(global ELEM *data, global const ulong *leaders, ulong cycles,
+        ulong height, ulong size) {
+    size_t c = get_global_id(0);
+    if (c >= cycles)
+        return;
+
+    const ulong start = leaders[c];
+    ulong k = start;
+    ELEM carry = data[k];
+
+    do {
+        k = k * height % (size - 1);
+        ELEM tmp = data[k];
+        data[k] = carry;
+        carry = tmp;
+    } while (k != start);
+}